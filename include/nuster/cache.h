@@ -34,44 +34,105 @@
 #include <common/memory.h>
 
 #include <nuster/common.h>
+#include <nuster/dict.h>
+#include <nuster/epoch.h>
+#include <nuster/evict.h>
 #include <nuster/persist.h>
 
 #define NST_CACHE_DEFAULT_LOAD_FACTOR         0.75
 #define NST_CACHE_DEFAULT_GROWTH_FACTOR       2
+#define NST_CACHE_DICT_SHARD_BITS             4
+#define NST_CACHE_DICT_SHARDS                (1 << NST_CACHE_DICT_SHARD_BITS)
+#define NST_CACHE_DICT_MIN_SIZE               4
+#define NST_CACHE_DICT_REHASH_STEP            8
 #define NST_CACHE_DEFAULT_KEY                "method.scheme.host.uri"
 #define NST_CACHE_DEFAULT_CODE               "200"
 #define NST_CACHE_DEFAULT_KEY_SIZE            128
 #define NST_CACHE_DEFAULT_CHUNK_SIZE          32
+#define NST_CACHE_DEFAULT_EXTENT_SIZE         4096
+#define NST_CACHE_EXTENT_MAX_SIZE            (1 << 30)
+#define NST_CACHE_SPLICE_IOV                  16
 #define NST_CACHE_DEFAULT_PURGE_METHOD       "PURGE"
 #define NST_CACHE_DEFAULT_PURGE_METHOD_SIZE   16
 
+/*
+ * An extent holds a contiguous part of the response, its bytes follow the
+ * header in the same allocation. Extents are filled up before a new one is
+ * allocated, sized for the rest of the response if its length is known,
+ * twice the previous one otherwise, up to the memory block size.
+ */
 struct nst_cache_element {
-    struct nst_str            msg;
-
     struct nst_cache_element *next;
+    int                       len;       /* bytes stored */
+    int                       size;      /* bytes available */
+    char                      data[0];
 };
 
 /*
  * A nst_cache_data contains a complete http response data,
  * and is pointed by nst_cache_entry->data.
- * All nst_cache_data are stored in a circular singly linked list
+ * The validators and the first extent are allocated together with it, so
+ * a small response takes a single allocation.
+ * Requests of the same process can stream it while it is being created,
+ * their applets are in waiters and woken up each time it is appended.
+ * All nst_cache_data are stored in a circular doubly linked list
  */
+#define NST_CACHE_DATA_EVICTING    2     /* invalid, freed by the evictor */
+#define NST_CACHE_COMPACT_IDLE     10    /* seconds after a useless pass */
+
+enum {
+    NST_CACHE_DATA_STATE_CREATING = 0,
+    NST_CACHE_DATA_STATE_DONE,
+    NST_CACHE_DATA_STATE_ABORTED,
+};
+
 struct nst_cache_data {
     int                       clients;
     int                       invalid;
+    int                       state;
+    int                       proc;      /* relative_pid of the creator */
+    struct list               waiters;   /* appctx being fed, see proc */
     struct nst_cache_element *element;
 
+    /* compressed once with gzip, chunked, see nst_cache_gzip_init */
+    int                       gzip;
+    int                       header_len;
+
+    /* of the body decompressed, 0: unknown yet, see _nst_cache_engine_gunzip */
+    uint64_t                  gunzip_len;
+
+    /* the header is made of HTX blocks, see nst_cache_update_header */
+    int                       htx;
+
+    /* validators served with this data, entry->etag and last_modified
+     * point to them */
+    struct nst_str            etag;
+    struct nst_str            last_modified;
+
     struct nst_cache_data    *next;
+    struct nst_cache_data    *prev;
 };
 
 /*
- * A nst_cache_entry is an entry in nst_cache_dict hash table
+ * A nst_cache_entry is an entry in the cache dict
  */
 enum {
     NST_CACHE_ENTRY_STATE_CREATING = 0,
     NST_CACHE_ENTRY_STATE_VALID,
     NST_CACHE_ENTRY_STATE_INVALID,
     NST_CACHE_ENTRY_STATE_EXPIRED,
+    NST_CACHE_ENTRY_STATE_REFRESH,     /* stale, being refreshed, still valid */
+};
+
+/*
+ * The request headers the responses of a key vary on, recorded by the entry
+ * of the key, a vary root. Its variants are cached under the key extended
+ * with the id and the values of these headers.
+ */
+struct nst_cache_vary {
+    uint64_t                id;
+    int                     len;
+    char                    names[0];    /* lowercase, comma separated */
 };
 
 struct nst_cache_entry {
@@ -80,7 +141,11 @@ struct nst_cache_entry {
     uint64_t                hash;
     struct nst_cache_data  *data;
     uint64_t                expire;
-    uint64_t                atime;
+    uint32_t                stale;       /* served seconds after expire */
+    uint32_t                stale_error; /* same, once the server failed */
+    uint64_t                failed;      /* last failed refresh, seconds */
+    struct nst_cache_vary  *vary;        /* vary root, no data */
+    struct nst_evict_info   access;
     struct nst_str          host;
     struct nst_str          path;
     struct nst_rule        *rule;        /* rule */
@@ -89,14 +154,34 @@ struct nst_cache_entry {
     int                     header_len;
     struct nst_str          etag;
     struct nst_str          last_modified;
-
-    struct nst_cache_entry *next;
 };
 
-struct nst_cache_dict {
-    struct nst_cache_entry **entry;
-    uint64_t                 size;      /* number of entries */
-    uint64_t                 used;      /* number of used entries */
+/*
+ * The dict is split into NST_CACHE_DICT_SHARDS shards selected by the
+ * high bits of the hash, each one is locked and maintained independently
+ */
+struct nst_cache_dict_shard {
+    /* 0: using, 1: rehashing */
+    struct nst_dict          dict[2];
+
+    /* >=0: rehashing, group index, -1: not rehashing */
+    int                      rehash_idx;
+
+    /* cache dict cleanup group index */
+    int                      cleanup_idx;
+
+    /* persist async group index */
+    int                      persist_idx;
+
+    /* eviction hand, group index */
+    unsigned int             evict_idx;
+
+    /* increased every time dict[1] replaces dict[0] */
+    unsigned int             generation;
+
+    /* odd while dict[0] or dict[1] is being replaced */
+    unsigned int             seq;
+
 #if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
     pthread_mutex_t          mutex;
 #else
@@ -133,6 +218,9 @@ struct nst_cache_ctx {
     struct nst_cache_data    *data;
     struct nst_cache_element *element;
 
+    /* stale entry this request was elected to refresh */
+    struct nst_cache_entry   *refresh;
+
     struct {
         int                   scheme;
         struct nst_str        host;
@@ -141,6 +229,7 @@ struct nst_cache_ctx {
         int                   delimiter;
         struct nst_str        query;
         struct nst_str        cookie;
+        char                 *buf;              /* see nst_cache_keep_req */
     } req;
 
     struct {
@@ -152,12 +241,43 @@ struct nst_cache_ctx {
     int                       full;             /* memory full */
     int                       header_len;
     uint64_t                  cache_len;
+    uint64_t                  expect_len;       /* header and body, 0: unknown */
+    uint32_t                  ttl;              /* of the response cached */
+
+    /* hash of the Vary names and length of the key before it was extended
+     * for them, see nst_cache_vary_key */
+    uint64_t                  vary;
+    int                       vary_len;
+
+    /* index plus one of the slice requested, see nst_cache_slice_index */
+    uint64_t                  slice;
+
+    /* the range requested out of the slice fetched on a miss, only its
+     * bytes are sent, see nst_cache_slice_range */
+    struct {
+        uint64_t              first;
+        uint64_t              last;             /* UINT64_MAX: to the end */
+        uint64_t              size;             /* of the object, 0: unknown */
+        uint64_t              skip;             /* slice bytes before it */
+        uint64_t              keep;             /* its bytes, 0: all */
+        uint64_t              pos;              /* slice bytes forwarded */
+    } range;
+
+    struct nst_cache_gzip    *gzip;             /* compressing the body */
+
+    int                       htx;              /* HTX stream */
 
     struct persist            disk;
 };
 
-struct nst_cache_stats {
+/*
+ * The counters of a thread of a process, in a cache line of their own, they
+ * are summed up by nst_cache_stats_get when read
+ */
+struct nst_cache_stats_slot {
     uint64_t        used_mem;
+    uint64_t        evicted;
+    uint64_t        compacted;
 
     struct {
         uint64_t    total;
@@ -166,16 +286,19 @@ struct nst_cache_stats {
         uint64_t    abort;
     } req;
 
-#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
-    pthread_mutex_t mutex;
-#else
-    unsigned int    waiters;
-#endif
+    struct {
+        uint64_t    admitted;
+        uint64_t    rejected;
+    } admit;
+} __attribute__((aligned(NST_STATS_SLOT_SIZE)));
+
+struct nst_cache_stats {
+    int                          slots;
+    struct nst_cache_stats_slot *slot;
 };
 
 struct nst_cache {
-    /* 0: using, 1: rehashing */
-    struct nst_cache_dict  dict[2];
+    struct nst_cache_dict_shard shard[NST_CACHE_DICT_SHARDS];
 
     /*
      * point to the circular linked list, tail->next ===  head,
@@ -190,14 +313,31 @@ struct nst_cache {
     unsigned int           waiters;
 #endif
 
-    /* >=0: rehashing, index, -1: not rehashing */
-    int                    rehash_idx;
+    /* lock free readers, see nst_cache_exists */
+    struct nst_epoch       epoch;
+
+    /* request frequencies, for tinylfu */
+    struct nst_sketch      sketch;
 
-    /* cache dict cleanup index */
-    int                    cleanup_idx;
+    /* shard to be checked next by rehash, cleanup and persist async */
+    int                    rehash_shard;
+    int                    cleanup_shard;
+    int                    persist_shard;
 
-    /* persist async index */
-    int                    persist_idx;
+    /* shard and group the compactor checks next, see nst_cache_dict_compact,
+     * whether blocks are being drained, data moved during this pass, and
+     * when to drain again after a pass which moved nothing */
+    int                    compact_shard;
+    uint64_t               compact_idx;
+    int                    compacting;
+    int                    compact_moved;
+    uint64_t               compact_next;
+
+    /* shard to evict from next, shared by all evictors */
+    unsigned int           evict_shard;
+
+    /* last id given to a vary root */
+    uint64_t               vary_id;
 
     /* for disk_loader and disk_cleaner */
     struct {
@@ -223,6 +363,14 @@ enum {
     NST_CACHE_PURGE_REGEX_HOST,
 };
 
+/* appctx->st0 of the cache applet of an HTX stream */
+enum {
+    NST_CACHE_HTX_HEADER = 0,
+    NST_CACHE_HTX_DATA,
+    NST_CACHE_HTX_EOM,
+    NST_CACHE_HTX_DONE,
+};
+
 enum {
     NST_CACHE_STATS_HEAD,
     NST_CACHE_STATS_DATA,
@@ -233,9 +381,16 @@ enum {
 /* dict */
 int nst_cache_dict_init();
 struct nst_cache_entry *nst_cache_dict_get(struct buffer *key, uint64_t hash);
+struct nst_cache_entry *nst_cache_dict_lookup(struct buffer *key,
+        uint64_t hash);
 struct nst_cache_entry *nst_cache_dict_set(struct nst_cache_ctx *ctx);
+int nst_cache_dict_set_vary(struct nst_cache_ctx *ctx, char *names, int len,
+        struct nst_cache_vary **old);
+void nst_cache_dict_vary_free(struct nst_cache_vary *vary);
 void nst_cache_dict_rehash();
 void nst_cache_dict_cleanup();
+int nst_cache_dict_compact();
+int nst_cache_dict_evict(struct nst_cache_data **data, int n);
 int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
         struct nst_str *host, struct nst_str *path);
 
@@ -245,6 +400,7 @@ void nst_cache_housekeeping();
 int nst_cache_prebuild_key(struct nst_cache_ctx *ctx, struct stream *s,
         struct http_msg *msg);
 
+int nst_cache_keep_req(struct nst_cache_ctx *ctx);
 int nst_cache_build_key(struct nst_cache_ctx *ctx,
         struct nst_rule_key **pck, struct stream *s, struct http_msg *msg);
 
@@ -252,15 +408,26 @@ struct buffer *nst_cache_build_purge_key(struct stream *s,
         struct http_msg *msg);
 
 uint64_t nst_cache_hash_key(const char *key);
+int nst_cache_admit(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg);
+
 void nst_cache_create(struct nst_cache_ctx *ctx);
 
 int nst_cache_update(struct nst_cache_ctx *ctx, struct http_msg *msg,
         long msg_len);
 
+int nst_cache_htx_header_len(struct http_msg *msg);
+int nst_cache_update_header(struct nst_cache_ctx *ctx, struct http_msg *msg);
+int nst_cache_update_htx(struct nst_cache_ctx *ctx, struct http_msg *msg,
+        unsigned int offset, unsigned int len);
+
 void nst_cache_finish(struct nst_cache_ctx *ctx);
 void nst_cache_abort(struct nst_cache_ctx *ctx);
-int nst_cache_exists(struct nst_cache_ctx *ctx, int mode);
-struct nst_cache_data *nst_cache_data_new();
+void nst_cache_refresh_abort(struct nst_cache_ctx *ctx, int failed);
+int nst_cache_exists(struct nst_cache_ctx *ctx, int mode, int down);
+struct nst_cache_data *nst_cache_data_new(struct nst_cache_ctx *ctx);
+int nst_cache_data_draining(struct nst_cache_data *data);
+struct nst_cache_data *nst_cache_data_copy(struct nst_cache_data *data);
 void nst_cache_hit(struct stream *s, struct stream_interface *si,
         struct channel *req, struct channel *res, struct nst_cache_data *data);
 
@@ -280,32 +447,110 @@ void nst_cache_build_etag(struct nst_cache_ctx *ctx, struct stream *s,
 void nst_cache_build_last_modified(struct nst_cache_ctx *ctx, struct stream *s,
         struct http_msg *msg);
 
+int nst_cache_build_ttl(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg);
+
+int nst_cache_vary_key(struct nst_cache_ctx *ctx, struct nst_rule *rule,
+        struct stream *s, struct http_msg *msg);
+
+int nst_cache_vary(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg);
+
+int nst_cache_slice_index(struct nst_cache_ctx *ctx, struct nst_rule *rule,
+        struct stream *s, struct http_msg *msg);
+
+int nst_cache_slice_request(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg);
+
+int nst_cache_slice(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg);
+
+int nst_cache_slice_range(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg);
+
+void nst_cache_gzip_init(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg);
+int nst_cache_gzip_finish(struct nst_cache_ctx *ctx);
+void nst_cache_gzip_free(struct nst_cache_gzip *gzip);
+
 int nst_cache_handle_conditional_req(struct nst_cache_ctx *ctx,
         struct nst_rule *rule, struct stream *s, struct http_msg *msg);
 
 
 /* manager */
 int nst_cache_purge(struct stream *s, struct channel *req, struct proxy *px);
+int nst_cache_purge_htx(struct stream *s, struct channel *req,
+        struct proxy *px);
 int nst_cache_manager(struct stream *s, struct channel *req, struct proxy *px);
 int nst_cache_manager_init();
 
 /* stats */
 void nst_cache_stats_update_used_mem(int i);
+void nst_cache_stats_update_evicted(int i);
+void nst_cache_stats_update_compacted(int i);
+void nst_cache_stats_update_admit(int admitted);
 int nst_cache_stats_init();
+void nst_cache_stats_get(struct nst_cache_stats_slot *sum);
 int nst_cache_stats_full();
 int nst_cache_stats(struct stream *s, struct channel *req, struct proxy *px);
 void nst_cache_stats_update_req(int state);
 
+/*
+ * data->clients is shared by all processes, so it is always updated with
+ * atomic operations, even without threads
+ */
+static inline void nst_cache_data_release(struct nst_cache_data *data) {
+    __atomic_sub_fetch(&data->clients, 1, __ATOMIC_SEQ_CST);
+}
+
 static inline int nst_cache_entry_expired(struct nst_cache_entry *entry) {
 
     if(entry->expire == 0) {
         return 0;
     } else {
-        return entry->expire <= get_current_timestamp() / 1000;
+        return entry->expire <= nst_time_now();
     }
 
 }
 
+/*
+ * Expired, but kept within its stale-while-revalidate or stale-if-error
+ * window
+ */
+static inline int nst_cache_entry_stale(struct nst_cache_entry *entry) {
+    uint32_t window = entry->stale;
+
+    if(entry->stale_error > window) {
+        window = entry->stale_error;
+    }
+
+    if(!window || !nst_cache_entry_expired(entry)) {
+        return 0;
+    }
+
+    return entry->expire + window > nst_time_now();
+}
+
+/*
+ * Stale and can be served: within stale-while-revalidate, or within
+ * stale-if-error if the server failed or there is none to send it to
+ */
+static inline int nst_cache_entry_servable(struct nst_cache_entry *entry,
+        int down) {
+
+    uint64_t now = nst_time_now();
+
+    if(!nst_cache_entry_expired(entry)) {
+        return 0;
+    }
+
+    if(entry->expire + entry->stale > now) {
+        return 1;
+    }
+
+    return (down || entry->failed) && entry->expire + entry->stale_error > now;
+}
+
 static inline int nst_cache_entry_invalid(struct nst_cache_entry *entry) {
 
     /* check state */
@@ -313,17 +558,46 @@ static inline int nst_cache_entry_invalid(struct nst_cache_entry *entry) {
         return 1;
     } else if(entry->state == NST_CACHE_ENTRY_STATE_EXPIRED) {
         return 1;
+    } else if(entry->state == NST_CACHE_ENTRY_STATE_REFRESH) {
+        /* owned by the request refreshing it */
+        return 0;
     }
 
     /* check expire */
-    return nst_cache_entry_expired(entry);
+    return nst_cache_entry_expired(entry) && !nst_cache_entry_stale(entry);
+}
+
+/*
+ * Leave the data of entry to the data cleanup, with the validators, which
+ * the data holds. The caller must hold the lock of
+ * nst_cache_dict_shard(entry->hash)
+ */
+static inline void nst_cache_entry_drop_data(struct nst_cache_entry *entry) {
+
+    if(!entry->data) {
+        return;
+    }
+
+    __atomic_store_n(&entry->data->invalid, 1, __ATOMIC_SEQ_CST);
+
+    entry->data               = NULL;
+    entry->etag.data          = NULL;
+    entry->etag.len           = 0;
+    entry->last_modified.data = NULL;
+    entry->last_modified.len  = 0;
 }
 
-#define nst_cache_key_init() nst_key_init(global.nuster.cache.memory)
-#define nst_cache_key_advance(key, step)                                      \
-    nst_key_advance(global.nuster.cache.memory, key, step)
+#define nst_cache_dict_shard(hash)                                            \
+    (&nuster.cache->shard[(hash) >> (64 - NST_CACHE_DICT_SHARD_BITS)])
+#define nst_cache_key_init() nst_key_scratch_init()
+#define nst_cache_key_advance(key, step) nst_key_scratch_advance(key, step)
 #define nst_cache_key_append(key, str, len)                                   \
-    nst_key_append(global.nuster.cache.memory, key, str, len)
+    nst_key_scratch_append(key, str, len)
+#define nst_cache_key_hash(key) nst_key_scratch_hash(key)
+#define nst_cache_key_mark(key) nst_key_scratch_mark(key)
+#define nst_cache_key_rewind(key) nst_key_scratch_rewind(key)
+#define nst_cache_key_store(key)                                              \
+    nst_key_store(global.nuster.cache.memory, key)
 #define nst_cache_memory_alloc(size)                                          \
     nst_memory_alloc(global.nuster.cache.memory, size)
 #define nst_cache_memory_free(p) nst_memory_free(global.nuster.cache.memory, p);
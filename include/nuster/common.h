@@ -50,9 +50,16 @@
 #define NST_DEFAULT_DATA_SIZE           NST_DEFAULT_SIZE
 #define NST_DEFAULT_DICT_CLEANER        100
 #define NST_DEFAULT_DATA_CLEANER        100
+#define NST_DEFAULT_DATA_COMPACTOR      100
 #define NST_DEFAULT_DISK_CLEANER        100
 #define NST_DEFAULT_DISK_LOADER         100
 #define NST_DEFAULT_DISK_SAVER          100
+#define NST_DEFAULT_EVICT               NST_EVICT_SLRU
+#define NST_DEFAULT_HEADROOM            0
+#define NST_DEFAULT_ADMIT               0
+
+/* a cache line, the counters of each thread do not share theirs */
+#define NST_STATS_SLOT_SIZE             64
 
 enum {
     NST_STATUS_UNDEFINED = -1,
@@ -110,6 +117,7 @@ enum nst_rule_key_type {
 struct nst_rule_key {
     enum nst_rule_key_type  type;
     char                   *data;
+    int                     len;            /* of data */
 };
 
 struct nst_rule_code {
@@ -136,6 +144,20 @@ enum {
     NST_DISK_ASYNC,
 };
 
+enum {
+    /* refuse new entries when the memory is full */
+    NST_EVICT_OFF   = 0,
+
+    /* segmented LRU, entries hit at least once are evicted last */
+    NST_EVICT_SLRU,
+
+    /* CLOCK, second chance to entries hit since the hand last passed */
+    NST_EVICT_CLOCK,
+
+    /* W-TinyLFU, new entries compete with old ones on their frequency */
+    NST_EVICT_TINYLFU,
+};
+
 struct nst_rule {
     struct list              list;          /* list linked to from the proxy */
     struct acl_cond         *cond;          /* acl condition to meet */
@@ -149,6 +171,15 @@ struct nst_rule {
     int                      disk;          /* NST_DISK_* */
     int                      etag;          /* etag on|off */
     int                      last_modified; /* last_modified on|off */
+    unsigned int             max_size;      /* max bytes to store, 0: no limit */
+    uint32_t                 stale;         /* stale-while-revalidate: seconds */
+    uint32_t                 stale_error;   /* stale-if-error: seconds */
+    int                      origin_ttl;    /* origin-ttl on|off */
+    uint32_t                 min_ttl;       /* origin-ttl floor: seconds */
+    uint32_t                 max_ttl;       /* origin-ttl ceiling, 0: none */
+    int                      vary;          /* vary on|off */
+    int                      compress;      /* compress gzip(on)|off */
+    unsigned int             slice;         /* slice size: bytes, 0: off */
 };
 
 struct nst_rule_stash {
@@ -156,6 +187,9 @@ struct nst_rule_stash {
     struct nst_rule       *rule;
     struct buffer         *key;
     uint64_t               hash;
+    uint64_t               vary;          /* see nst_cache_vary_key */
+    int                    vary_len;
+    uint64_t               slice;         /* see nst_cache_slice_index */
 };
 
 struct nst_flt_conf {
@@ -170,6 +204,17 @@ static inline uint64_t get_current_timestamp() {
     return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+/* see common/time.h */
+extern THREAD_LOCAL struct timeval date;
+
+/*
+ * The date in seconds of the poll loop of the calling thread, as updated by
+ * tv_update_date, without a system call
+ */
+static inline uint64_t nst_time_now() {
+    return date.tv_sec;
+}
+
 void nst_debug(const char *fmt, ...);
 void nst_debug_key(struct buffer *key);
 
@@ -0,0 +1,219 @@
+/*
+ * include/nuster/dict.h
+ * This file defines the open addressing hash table used by nuster dicts.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NUSTER_DICT_H
+#define _NUSTER_DICT_H
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include <nuster/common.h>
+
+#define NST_DICT_GROUP_SLOTS       15
+#define NST_DICT_GROUP_MASK        0x7FFF
+
+/* ctrl bytes: 0x00-0x7F is the tag of a used slot */
+#define NST_DICT_CTRL_EMPTY        0x80
+#define NST_DICT_CTRL_DELETED      0xFE
+#define NST_DICT_CTRL_SENTINEL     0xFF
+
+/*
+ * A group is a 16 bytes control word followed by 15 slots, 256 bytes in
+ * total. ctrl[i] holds 7 bits of the hash of slot i, or EMPTY/DELETED,
+ * ctrl[15] is a sentinel which never matches anything.
+ * The full hash is stored inline so that the key is only compared when
+ * both the tag and the hash match.
+ */
+struct nst_dict_slot {
+    uint64_t               hash;
+    void                  *ptr;
+};
+
+struct nst_dict_group {
+    uint8_t                ctrl[16];
+    struct nst_dict_slot   slot[NST_DICT_GROUP_SLOTS];
+};
+
+/*
+ * Groups are allocated in segments of 1 << shift groups,
+ * size is the number of groups and always a power of 2
+ */
+struct nst_dict {
+    struct nst_dict_group **segment;
+    uint64_t                size;
+    uint64_t                used;      /* number of used slots */
+    uint64_t                deleted;   /* number of deleted slots */
+    int                     shift;
+};
+
+struct nst_dict_probe {
+    struct nst_dict_group  *group;
+    uint64_t                idx;       /* group index */
+    uint64_t                step;
+    uint32_t                match;     /* candidates left in this group */
+    int                     slot;      /* slot of the last candidate */
+    uint8_t                 tag;
+};
+
+struct nst_memory;
+
+int nst_dict_alloc(struct nst_memory *memory, struct nst_dict *dict,
+        uint64_t size);
+
+void nst_dict_free(struct nst_memory *memory, struct nst_dict *dict);
+uint64_t nst_dict_max_size(struct nst_memory *memory);
+int nst_dict_insert(struct nst_dict *dict, uint64_t hash, void *ptr);
+int nst_dict_move_group(struct nst_dict *from, uint64_t idx,
+        struct nst_dict *to);
+
+static inline struct nst_dict_group *
+nst_dict_group(struct nst_dict *dict, uint64_t idx) {
+    return &dict->segment[idx >> dict->shift][idx & ((1ULL << dict->shift) - 1)];
+}
+
+static inline uint8_t nst_dict_tag(uint64_t hash) {
+    /* low bits select the group and high bits the shard */
+    return (hash >> 40) & 0x7F;
+}
+
+static inline uint64_t nst_dict_capacity(struct nst_dict *dict) {
+    return dict->size * NST_DICT_GROUP_SLOTS;
+}
+
+/*
+ * Bitmask of the slots whose ctrl byte equals c
+ */
+static inline uint32_t nst_dict_match(struct nst_dict_group *group, uint8_t c) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group->ctrl);
+
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(c)))
+        & NST_DICT_GROUP_MASK;
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for(i = 0; i < NST_DICT_GROUP_SLOTS; i++) {
+        mask |= (uint32_t)(group->ctrl[i] == c) << i;
+    }
+
+    return mask;
+#endif
+}
+
+/*
+ * Bitmask of the used slots, ie, those whose ctrl byte is a tag
+ */
+static inline uint32_t nst_dict_match_used(struct nst_dict_group *group) {
+#ifdef __SSE2__
+    __m128i ctrl = _mm_loadu_si128((const __m128i *)group->ctrl);
+
+    return ~_mm_movemask_epi8(ctrl) & NST_DICT_GROUP_MASK;
+#else
+    uint32_t mask = 0;
+    int i;
+
+    for(i = 0; i < NST_DICT_GROUP_SLOTS; i++) {
+        mask |= (uint32_t)!(group->ctrl[i] & 0x80) << i;
+    }
+
+    return mask;
+#endif
+}
+
+/*
+ * Bitmask of the empty or deleted slots
+ */
+static inline uint32_t nst_dict_match_free(struct nst_dict_group *group) {
+    return ~nst_dict_match_used(group) & NST_DICT_GROUP_MASK;
+}
+
+static inline void nst_dict_probe_init(struct nst_dict *dict, uint64_t hash,
+        struct nst_dict_probe *probe) {
+
+    probe->idx   = hash & (dict->size - 1);
+    probe->step  = 0;
+    probe->tag   = nst_dict_tag(hash);
+    probe->group = nst_dict_group(dict, probe->idx);
+
+
+    probe->match = nst_dict_match(probe->group, probe->tag);
+    probe->slot  = -1;
+}
+
+/*
+ * Return the next slot whose tag and hash match, NULL if there is none.
+ * Groups are probed in triangular steps and the probe stops at the first
+ * group which has an empty slot.
+ */
+static inline void *nst_dict_probe_next(struct nst_dict *dict, uint64_t hash,
+        struct nst_dict_probe *probe) {
+
+    while(1) {
+
+        /* read the slots after the ctrl word, see nst_dict_insert */
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        while(probe->match) {
+            int i = __builtin_ctz(probe->match);
+
+            probe->match &= probe->match - 1;
+
+            if(probe->group->slot[i].hash == hash) {
+                probe->slot = i;
+
+                return probe->group->slot[i].ptr;
+            }
+        }
+
+        if(nst_dict_match(probe->group, NST_DICT_CTRL_EMPTY)) {
+            return NULL;
+        }
+
+        if(++probe->step >= dict->size) {
+            return NULL;
+        }
+
+        probe->idx   = (probe->idx + probe->step) & (dict->size - 1);
+        probe->group = nst_dict_group(dict, probe->idx);
+        probe->match = nst_dict_match(probe->group, probe->tag);
+    }
+}
+
+/*
+ * Remove a used slot. It can be marked as empty if the group still has an
+ * empty slot, since no probe sequence ever went past this group then.
+ */
+static inline void nst_dict_remove(struct nst_dict *dict,
+        struct nst_dict_group *group, int slot) {
+
+    if(nst_dict_match(group, NST_DICT_CTRL_EMPTY)) {
+        group->ctrl[slot] = NST_DICT_CTRL_EMPTY;
+    } else {
+        group->ctrl[slot] = NST_DICT_CTRL_DELETED;
+        dict->deleted++;
+    }
+
+    dict->used--;
+}
+
+#endif /* _NUSTER_DICT_H */
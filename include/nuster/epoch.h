@@ -0,0 +1,96 @@
+/*
+ * include/nuster/epoch.h
+ * This file defines the epoch based reclamation used by lock free readers.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NUSTER_EPOCH_H
+#define _NUSTER_EPOCH_H
+
+#include <common/hathreads.h>
+#include <types/global.h>
+
+#include <nuster/common.h>
+
+#define NST_EPOCH_IDLE             0
+#define NST_EPOCH_SLOT_SIZE        64
+
+/*
+ * Readers of every thread of every process publish the epoch they entered
+ * in their own slot, in the shared memory. Only the master process retires
+ * objects, so the retired lists live in its own heap, other processes wait
+ * for the readers with nst_epoch_synchronize before freeing.
+ */
+struct nst_epoch_slot {
+    unsigned int                epoch;
+    char                        pad[NST_EPOCH_SLOT_SIZE - sizeof(unsigned int)];
+};
+
+struct nst_epoch_retired {
+    struct nst_epoch_retired   *next;
+    void                       *p;
+    void                      (*release)(void *p);
+};
+
+struct nst_epoch {
+    unsigned int                epoch;
+    int                         slots;
+    struct nst_epoch_slot      *slot;
+
+    /* objects retired in epoch n wait in retired[n % 3] */
+    struct nst_epoch_retired   *retired[3];
+};
+
+struct nst_memory;
+
+int nst_epoch_init(struct nst_memory *memory, struct nst_epoch *epoch);
+void nst_epoch_retire(struct nst_epoch *epoch, void *p,
+        void (*release)(void *p));
+void nst_epoch_reclaim(struct nst_epoch *epoch);
+void nst_epoch_synchronize(struct nst_epoch *epoch);
+
+/*
+ * Pin the current epoch, return NST_ERR if lock free reads are disabled
+ */
+static inline int nst_epoch_enter(struct nst_epoch *epoch) {
+    struct nst_epoch_slot *slot;
+
+    if(!epoch->slot) {
+        return NST_ERR;
+    }
+
+    slot = &epoch->slot[(relative_pid - 1) * global.nbthread + tid];
+
+    __atomic_store_n(&slot->epoch,
+            __atomic_load_n(&epoch->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+
+    /* the slot must be visible before anything is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    return NST_OK;
+}
+
+static inline void nst_epoch_leave(struct nst_epoch *epoch) {
+    struct nst_epoch_slot *slot;
+
+    slot = &epoch->slot[(relative_pid - 1) * global.nbthread + tid];
+
+    __atomic_store_n(&slot->epoch, NST_EPOCH_IDLE, __ATOMIC_RELEASE);
+}
+
+#endif /* _NUSTER_EPOCH_H */
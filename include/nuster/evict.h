@@ -0,0 +1,101 @@
+/*
+ * include/nuster/evict.h
+ * This file defines the eviction policies of nuster.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NUSTER_EVICT_H
+#define _NUSTER_EVICT_H
+
+#include <common/time.h>
+
+#include <nuster/common.h>
+#include <nuster/sketch.h>
+
+/* candidates compared to choose one victim */
+#define NST_EVICT_SAMPLES          16
+
+/* groups of the dict visited at most to collect the candidates */
+#define NST_EVICT_GROUPS           8
+
+/* entries evicted at most per round of reclaim */
+#define NST_EVICT_BATCH            8
+
+/* rounds at most per housekeeping to keep the headroom */
+#define NST_EVICT_HEADROOM_ROUNDS  32
+
+#define NST_EVICT_HITS_MAX         0xFFFF
+
+/*
+ * Access history of an entry, updated on hits without any lock, the
+ * policies only need an approximate view
+ */
+struct nst_evict_info {
+    uint64_t                    atime;     /* last access, in ms */
+    unsigned int                hits;      /* hits since inserted */
+    unsigned int                ref;       /* CLOCK reference bit */
+};
+
+struct nst_evict_cand {
+    void                       *entry;
+    uint64_t                    hash;
+    uint64_t                    atime;
+    unsigned int                hits;
+    unsigned int               *ref;
+};
+
+int nst_evict_choose(int policy, struct nst_sketch *sketch,
+        struct nst_evict_cand *cand, int n);
+
+const char *nst_evict_name(int policy);
+
+static inline uint64_t nst_evict_now() {
+    return (uint64_t)date.tv_sec * 1000 + date.tv_usec / 1000;
+}
+
+static inline void nst_evict_init(struct nst_evict_info *info) {
+    info->atime = nst_evict_now();
+    info->hits  = 0;
+    info->ref   = 0;
+}
+
+static inline void nst_evict_touch(struct nst_evict_info *info) {
+    unsigned int hits = __atomic_load_n(&info->hits, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&info->atime, nst_evict_now(), __ATOMIC_RELAXED);
+
+    if(hits < NST_EVICT_HITS_MAX) {
+        __atomic_store_n(&info->hits, hits + 1, __ATOMIC_RELAXED);
+    }
+
+    if(!__atomic_load_n(&info->ref, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&info->ref, 1, __ATOMIC_RELAXED);
+    }
+}
+
+static inline void nst_evict_cand_set(struct nst_evict_cand *cand,
+        void *entry, uint64_t hash, struct nst_evict_info *info) {
+
+    cand->entry = entry;
+    cand->hash  = hash;
+    cand->atime = __atomic_load_n(&info->atime, __ATOMIC_RELAXED);
+    cand->hits  = __atomic_load_n(&info->hits, __ATOMIC_RELAXED);
+    cand->ref   = &info->ref;
+}
+
+#endif /* _NUSTER_EVICT_H */
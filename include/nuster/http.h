@@ -26,8 +26,13 @@
 #include <inttypes.h>
 #include <common/chunk.h>
 
+#include <common/htx.h>
+
+#include <types/http_htx.h>
+
 #include <proto/stream_interface.h>
 #include <proto/proto_http.h>
+#include <proto/http_htx.h>
 
 #include <nuster/common.h>
 #include <nuster/nuster.h>
@@ -42,6 +47,8 @@ enum {
     NST_HTTP_SIZE,
 };
 
+#define NST_HTTP_STATUS_MAX    600
+
 struct nst_headers {
     struct nst_str server;
     struct nst_str date;
@@ -52,11 +59,53 @@ struct nst_headers {
     struct nst_str expires;
     struct nst_str cache_control;
     struct nst_str etag;
+    struct nst_str content_range;
+};
+
+/*
+ * A header of the message of a legacy or an HTX stream, its values or its
+ * lines are iterated by nst_http_find_header once reset by nst_http_hdr_init
+ */
+struct nst_http_hdr {
+    struct hdr_ctx      legacy;
+    struct http_hdr_ctx htx;
+    char               *value;
+    int                 len;
 };
 
 extern const char *nst_http_msgs[NST_HTTP_SIZE];
 extern struct buffer nst_http_msg_chunks[NST_HTTP_SIZE];
 extern struct nst_headers nst_headers;
+extern struct nst_str nst_http_status_lines[NST_HTTP_STATUS_MAX];
+extern struct nst_str nst_http_412_tail;
+
+void nst_http_init();
+struct nst_str *nst_http_date_line();
+
+/*
+ * The status line of status serialized by nst_http_init, NULL if there is
+ * none
+ */
+static inline struct nst_str *nst_http_status_line(int status) {
+
+    if(status < 0 || status >= NST_HTTP_STATUS_MAX
+            || !nst_http_status_lines[status].data) {
+
+        return NULL;
+    }
+
+    return &nst_http_status_lines[status];
+}
+
+/*
+ * The date of the poll loop as an IMF-fixdate, see nst_http_date_line
+ */
+static inline struct ist nst_http_date() {
+    struct nst_str *line = nst_http_date_line();
+
+    /* "Date: " and CRLF */
+    return ist2(line->data + 6, line->len - 8);
+}
 
 /*
  * simply response and close
@@ -71,46 +120,56 @@ static inline void nst_response(struct stream *s, struct buffer *msg) {
 
 
 static inline void nst_res_begin(struct buffer *header, int status) {
-    chunk_printf(header, "HTTP/1.1 %d %s\r\n", status, http_get_reason(status));
+    struct nst_str *line = nst_http_status_line(status);
+
+    if(line) {
+        chunk_memcpy(header, line->data, line->len);
+    } else {
+        chunk_printf(header, "HTTP/1.1 %d %s\r\n", status,
+                http_get_reason(status));
+    }
 }
 
 static inline void nst_res_header_server(struct buffer *header) {
-    chunk_appendf(header, "%.*s: nuster\r\n", nst_headers.server.len,
-            nst_headers.server.data);
+    chunk_memcat(header, "Server: nuster\r\n", 16);
 }
 
 static inline void nst_res_header_date(struct buffer *header) {
-    const char mon[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul",
-        "Aug", "Sep", "Oct", "Nov", "Dec" };
-
-    const char day[7][4]  = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    struct nst_str *line = nst_http_date_line();
 
-    struct tm *tm;
-    time_t now;
-    time(&now);
-    tm = gmtime(&now);
-    chunk_appendf(header, "%.*s: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
-            nst_headers.date.len, nst_headers.date.data, day[tm->tm_wday],
-            tm->tm_mday, mon[tm->tm_mon], 1900 + tm->tm_year,
-            tm->tm_hour, tm->tm_min, tm->tm_sec);
+    chunk_memcat(header, line->data, line->len);
 }
 
 static inline void
-nst_res_header_content_length(struct buffer *header, uint64_t len) {
+nst_res_header(struct buffer *header, struct nst_str *k, struct nst_str *v) {
 
-    chunk_appendf(header, "%.*s: %" PRIu64 "\r\n",
-            nst_headers.content_length.len,
-            nst_headers.content_length.data, len);
+    if(header->data + k->len + v->len + 4 > header->size) {
+        return;
+    }
+
+    memcpy(header->area + header->data, k->data, k->len);
+    header->data += k->len;
+    header->area[header->data++] = ':';
+    header->area[header->data++] = ' ';
+    memcpy(header->area + header->data, v->data, v->len);
+    header->data += v->len;
+    header->area[header->data++] = '\r';
+    header->area[header->data++] = '\n';
 }
 
 static inline void
-nst_res_header(struct buffer *header, struct nst_str *k, struct nst_str *v) {
+nst_res_header_content_length(struct buffer *header, uint64_t len) {
+    char buf[24];
+    struct nst_str v;
 
-    chunk_appendf(header, "%.*s: %.*s\r\n", k->len, k->data, v->len, v->data);
+    v.data = buf;
+    v.len  = ulltoa(len, buf, sizeof(buf)) - buf;
+
+    nst_res_header(header, &nst_headers.content_length, &v);
 }
 
 static inline void nst_res_header_end(struct buffer *header) {
-    chunk_appendf(header, "\r\n");
+    chunk_memcat(header, "\r\n", 2);
 }
 
 static inline void nst_res_end(struct stream_interface *si) {
@@ -135,7 +194,7 @@ static inline void nst_res_simple(struct stream_interface *si, int status,
     nst_res_header_end(res);
 
     if(content) {
-        chunk_appendf(res, "%.*s", len, content);
+        chunk_memcat(res, content, len);
     }
 
     nst_res_send(si_ic(si), res->area, res->data);
@@ -170,13 +229,24 @@ static inline struct buffer *nst_res_header_create(int status, int chunked,
     return header;
 }
 
+void nst_res_htx_304(struct stream_interface *si,
+        struct nst_str *last_modified, struct nst_str *etag);
+void nst_res_htx_412(struct stream_interface *si);
+
 /*
  * TODO
  */
 static inline void nst_res_304(struct stream_interface *si,
         struct nst_str *last_modified, struct nst_str *etag) {
 
-    struct buffer *buf = get_trash_chunk();
+    struct buffer *buf;
+
+    if(IS_HTX_STRM(si_strm(si))) {
+        nst_res_htx_304(si, last_modified, etag);
+        return;
+    }
+
+    buf = get_trash_chunk();
 
     nst_res_begin(buf, 304);
     nst_res_header_server(buf);
@@ -192,16 +262,20 @@ static inline void nst_res_304(struct stream_interface *si,
 
 static inline void nst_res_412(struct stream_interface *si) {
 
-    struct buffer *buf = get_trash_chunk();
+    struct buffer *buf;
+
+    if(IS_HTX_STRM(si_strm(si))) {
+        nst_res_htx_412(si);
+        return;
+    }
+
+    buf = get_trash_chunk();
 
     nst_res_begin(buf, 412);
     nst_res_header_server(buf);
     nst_res_header_date(buf);
-    nst_res_header_content_length(buf, strlen(http_get_reason(412)));
+    chunk_memcat(buf, nst_http_412_tail.data, nst_http_412_tail.len);
 
-    nst_res_header_end(buf);
-
-    chunk_appendf(buf, "%s", http_get_reason(412));
     nst_res_send(si_ic(si), buf->area, buf->data);
     nst_res_end(si);
 }
@@ -209,4 +283,19 @@ static inline void nst_res_412(struct stream_interface *si) {
 int nst_req_find_param(char *query_beg, char *query_end,
         char *name, char **value, int *value_len);
 
+static inline void nst_http_hdr_init(struct nst_http_hdr *hdr) {
+    hdr->legacy.idx = 0;
+    hdr->htx.blk    = NULL;
+}
+
+int nst_http_find_header(struct stream *s, struct http_msg *msg,
+        const char *name, int len, struct nst_http_hdr *hdr, int full);
+int nst_http_remove_header(struct stream *s, struct http_msg *msg,
+        struct nst_http_hdr *hdr);
+int nst_http_add_header(struct stream *s, struct http_msg *msg,
+        const char *name, int name_len, const char *value, int value_len);
+int nst_http_body_len(struct stream *s, struct http_msg *msg, uint64_t *len);
+struct ist nst_http_path(struct stream *s, struct http_msg *msg);
+struct ist nst_http_body(struct stream *s, struct http_msg *msg);
+
 #endif /* _NUSTER_HTTP_H */
@@ -31,6 +31,31 @@
 #define NST_MEMORY_BLOCK_MAX_SIZE      1024 * 1024 * 2
 #define NST_MEMORY_BLOCK_MAX_SHIFT     21
 #define NST_MEMORY_INFO_BITMAP_BITS    32
+#define NST_MEMORY_RECLAIM_ROUNDS      8
+#define NST_MEMORY_MAGAZINE_ROUNDS     32
+#define NST_MEMORY_MAGAZINE_BYTES      16384
+#define NST_MEMORY_PREFAULT_MAX        64
+#define NST_MEMORY_DRAIN_SCAN          64
+#define NST_MEMORY_DRAIN_BLOCKS        16
+#define NST_MEMORY_RUN_LISTS           32
+#define NST_MEMORY_LARGE               0xFF
+
+enum {
+    NST_MEMORY_NUMA_OFF = 0,
+    NST_MEMORY_NUMA_BIND,
+    NST_MEMORY_NUMA_INTERLEAVE,
+};
+
+/*
+ * How the memory is mapped, all zero for system pages wherever the kernel
+ * places them on first touch
+ */
+struct nst_memory_conf {
+    int                      pages;       /* shift of huge pages, 0: none */
+    int                      numa;        /* NST_MEMORY_NUMA_* */
+    unsigned long            nodes;       /* a bit per node, 0: all */
+    int                      prefault;    /* threads touching it at start */
+};
 
 
 /* start                                 alignment                   stop
@@ -44,18 +69,46 @@
 
 /*
  * info:
- * | bitmap: 32 | reserved: 16 | 5 | full: 1 | bitmap: 1 | inited: 1 | type: 8 |
+ * | bitmap: 32 | reserved: 16 | 3 | free: 1 | drain: 1 | full: 1 | bitmap: 1 | inited: 1 | type: 8 |
  * bitmap: points to bitmap area, doesn't change once set
  * chunk size[n]: 1<<(NST_MEMORY_CHUNK_MIN_SHIFT + n)
+ * type NST_MEMORY_LARGE: first and last block of a run of blocks allocated
+ * at once
+ *
+ * The bitmap area has two levels: a bit per chunk, then a bit per 64-bit
+ * word of the first level, set when the word is full.
+ *
+ * Empty blocks are kept in runs of contiguous blocks, merged with the runs
+ * next to them when freed. The first and the last block of a free run are
+ * marked free and keep its length in used.
  */
 struct nst_memory_ctrl {
     uint64_t                info;
     uint8_t                *bitmap;
+    uint32_t                used;         /* chunks in use, or blocks */
 
     struct nst_memory_ctrl *prev;
     struct nst_memory_ctrl *next;
 };
 
+/*
+ * Free chunks of one size kept by a thread, taken from and given back to
+ * the memory by halves so that most allocations do not take the lock
+ */
+struct nst_memory_magazine {
+    int                      rounds;
+    int                      max;
+    void                    *chunk[NST_MEMORY_MAGAZINE_ROUNDS];
+};
+
+/*
+ * Blocks and chunks in use of one chunk size, read without the lock
+ */
+struct nst_memory_usage {
+    uint64_t                 blocks;
+    uint64_t                 chunks;
+};
+
 struct nst_memory {
     uint8_t                 *start;
     uint8_t                 *stop;
@@ -75,16 +128,34 @@ struct nst_memory {
 
     int                      chunks;
     int                      blocks;
+    int                      bitmap_words; /* first level of a block */
+    uint64_t                 used;        /* bytes of the chunks in use */
     struct nst_memory_ctrl **chunk;
+    struct nst_memory_usage *usage;       /* per chunk size */
     struct nst_memory_ctrl  *block;
-    struct nst_memory_ctrl  *empty;
     struct nst_memory_ctrl  *full;
 
+    /* free runs of blocks, by the log2 of their length */
+    struct nst_memory_ctrl  *run[NST_MEMORY_RUN_LISTS];
+    uint64_t                 large;       /* blocks of large allocations */
+
+    /* sparse blocks nothing is allocated from, see nst_memory_drain */
+    struct nst_memory_ctrl  *drain;
+    int                      draining;
+    int                      drain_idx;   /* chunk size to start from */
+
     struct {
         uint8_t             *begin;
         uint8_t             *free;
         uint8_t             *end;
     } data;
+
+    /* called when an allocation failed, returns NST_OK if it freed some */
+    int                    (*reclaim)(int size);
+
+    /* per thread, the table is allocated before fork so each process has
+     * its own copy, it stays empty until nst_memory_magazine_start */
+    struct nst_memory_magazine **magazine;
 };
 
 #define bit_set(bit, i) (bit |= 1 << i)
@@ -121,10 +192,83 @@ static inline void _nst_memory_block_clear_full(struct nst_memory_ctrl *block) {
     bit_clear(block->info, 11);
 }
 
+static inline void _nst_memory_block_set_drain(struct nst_memory_ctrl *block) {
+    bit_set(block->info, 12);
+}
+
+static inline int _nst_memory_block_is_drain(struct nst_memory_ctrl *block) {
+    return bit_used(block->info, 12);
+}
+
+static inline void _nst_memory_block_clear_drain(struct nst_memory_ctrl *block) {
+    bit_clear(block->info, 12);
+}
+
+static inline void _nst_memory_block_set_free(struct nst_memory_ctrl *block) {
+    bit_set(block->info, 13);
+}
+
+static inline int _nst_memory_block_is_free(struct nst_memory_ctrl *block) {
+    return bit_used(block->info, 13);
+}
+
 struct nst_memory *nst_memory_create(char *name, uint64_t size,
-        uint32_t block_size, uint32_t chunk_size);
+        uint32_t block_size, uint32_t chunk_size,
+        struct nst_memory_conf *conf);
 
 void *nst_memory_alloc(struct nst_memory *memory, int size);
 void nst_memory_free(struct nst_memory *memory, void *p);
+void *nst_memory_alloc_locked(struct nst_memory *memory, int size);
+void nst_memory_free_locked(struct nst_memory *memory, void *p);
+void nst_memory_magazine_start();
+int nst_memory_drain(struct nst_memory *memory, int size);
+void nst_memory_drain_end(struct nst_memory *memory);
+
+/*
+ * Whether p is in a block being drained, read without the lock
+ */
+static inline int nst_memory_draining(struct nst_memory *memory, void *p) {
+    struct nst_memory_ctrl *block;
+
+    if((uint8_t *)p < memory->data.begin
+            || (uint8_t *)p >= memory->data.end + memory->block_size) {
+
+        return 0;
+    }
+
+    block = &memory->block[((uint8_t *)p - memory->data.begin)
+        / memory->block_size];
+
+    return (__atomic_load_n(&block->info, __ATOMIC_RELAXED) >> 12) & 1;
+}
+
+/*
+ * Percentage of the memory not used by any chunk, read without the lock
+ */
+static inline int nst_memory_headroom(struct nst_memory *memory) {
+    uint64_t size = (uint64_t)memory->blocks * memory->block_size;
+
+    return (int)(100 - 100 * __atomic_load_n(&memory->used, __ATOMIC_RELAXED)
+            / size);
+}
+
+/*
+ * Bytes actually taken by an allocation of size, chunks are powers of two
+ * up to the block size, larger ones take whole blocks
+ */
+static inline int nst_memory_fit(struct nst_memory *memory, int size) {
+    int fit = memory->chunk_size;
+
+    if(size >= memory->block_size) {
+        return (size + memory->block_size - 1) / memory->block_size
+            * memory->block_size;
+    }
+
+    while(fit < size) {
+        fit <<= 1;
+    }
+
+    return fit;
+}
 
 #endif /* _NUSTER_MEMORY_H */
@@ -23,10 +23,16 @@
 #define _NUSTER_NOSQL_H
 
 #include <nuster/common.h>
+#include <nuster/dict.h>
+#include <nuster/evict.h>
 
 #define NST_NOSQL_DEFAULT_CHUNK_SIZE            32
 #define NST_NOSQL_DEFAULT_LOAD_FACTOR           0.75
 #define NST_NOSQL_DEFAULT_GROWTH_FACTOR         2
+#define NST_NOSQL_DICT_SHARD_BITS               4
+#define NST_NOSQL_DICT_SHARDS                  (1 << NST_NOSQL_DICT_SHARD_BITS)
+#define NST_NOSQL_DICT_MIN_SIZE                 4
+#define NST_NOSQL_DICT_REHASH_STEP              8
 #define NST_NOSQL_DEFAULT_KEY_SIZE              128
 
 
@@ -54,15 +60,17 @@ struct nst_nosql_element {
 /*
  * A nst_nosql_data contains a complete http response data,
  * and is pointed by nst_nosql_entry->data.
- * All nst_nosql_data are stored in a circular singly linked list
+ * All nst_nosql_data are stored in a circular doubly linked list
  */
 #define NST_NOSQL_DATA_FLAG_CHUNKED    0x00000001
+#define NST_NOSQL_DATA_EVICTING        2     /* invalid, freed by the evictor */
 
 struct nst_nosql_data {
     int                       clients;
     int                       invalid;
     struct nst_nosql_element *element;
     struct nst_nosql_data    *next;
+    struct nst_nosql_data    *prev;
 
     struct {
         struct nst_str        content_type;
@@ -73,7 +81,7 @@ struct nst_nosql_data {
 };
 
 /*
- * A nst_nosql_entry is an entry in nst_nosql_dict hash table
+ * A nst_nosql_entry is an entry in the nosql dict
  */
 enum {
     NST_NOSQL_ENTRY_STATE_CREATING = 0,
@@ -88,27 +96,42 @@ struct nst_nosql_entry {
     uint64_t                hash;
     struct nst_nosql_data  *data;
     uint64_t                expire;
-    uint64_t                atime;
+    struct nst_evict_info   access;
     struct nst_str          host;
     struct nst_str          path;
-    struct nst_nosql_entry *next;
     struct nst_rule        *rule;        /* rule */
     int                     pid;         /* proxy uuid */
     char                   *file;
     int                     header_len;
 };
 
-struct nst_nosql_dict {
-    struct nst_nosql_entry **entry;
-    uint64_t                 size;      /* number of entries */
-    uint64_t                 used;      /* number of used entries */
+/*
+ * The dict is split into NST_NOSQL_DICT_SHARDS shards selected by the
+ * high bits of the hash, each one is locked and maintained independently
+ */
+struct nst_nosql_dict_shard {
+    /* 0: using, 1: rehashing */
+    struct nst_dict          dict[2];
+
+    /* >=0: rehashing, group index, -1: not rehashing */
+    int                      rehash_idx;
+
+    /* nosql dict cleanup group index */
+    int                      cleanup_idx;
+
+    int                      persist_idx;
+
+    /* eviction hand, group index */
+    unsigned int             evict_idx;
+
+    /* increased every time dict[1] replaces dict[0] */
+    unsigned int             generation;
 
 #if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
     pthread_mutex_t          mutex;
 #else
     unsigned int             waiters;
 #endif
-
 };
 
 enum {
@@ -156,20 +179,18 @@ struct nst_nosql_ctx {
     struct persist            disk;
 };
 
-struct nst_nosql_stats {
+/* see nst_cache_stats_slot */
+struct nst_nosql_stats_slot {
     uint64_t        used_mem;
+} __attribute__((aligned(NST_STATS_SLOT_SIZE)));
 
-#if defined NUSTER_USE_PTHREAD || defined USE_PTHREAD_PSHARED
-    pthread_mutex_t mutex;
-#else
-    unsigned int    waiters;
-#endif
-
+struct nst_nosql_stats {
+    int                          slots;
+    struct nst_nosql_stats_slot *slot;
 };
 
 struct nst_nosql {
-    /* 0: using, 1: rehashing */
-    struct nst_nosql_dict  dict[2];
+    struct nst_nosql_dict_shard shard[NST_NOSQL_DICT_SHARDS];
 
     /* point to the circular linked list, tail->next ===  head */
     struct nst_nosql_data *data_head;
@@ -183,13 +204,16 @@ struct nst_nosql {
     unsigned int           waiters;
 #endif
 
-    /* >=0: rehashing, index, -1: not rehashing */
-    int                    rehash_idx;
+    /* request frequencies, for tinylfu */
+    struct nst_sketch      sketch;
 
-    /* cache dict cleanup index */
-    int                    cleanup_idx;
+    /* shard to be checked next by rehash, cleanup and persist async */
+    int                    rehash_shard;
+    int                    cleanup_shard;
+    int                    persist_shard;
 
-    int                    persist_idx;
+    /* shard to evict from next, shared by all evictors */
+    unsigned int           evict_shard;
 
     /* for disk_loader and disk_cleaner */
     struct {
@@ -241,6 +265,7 @@ struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx);
 int nst_nosql_dict_set_from_disk(char *file, char *meta, struct buffer *key);
 void nst_nosql_dict_rehash();
 void nst_nosql_dict_cleanup();
+int nst_nosql_dict_evict(struct nst_nosql_data **data, int n);
 
 /* stats */
 void nst_nosql_stats_update_used_mem(int i);
@@ -252,7 +277,7 @@ static inline int nst_nosql_dict_entry_expired(struct nst_nosql_entry *entry) {
     if(entry->expire == 0) {
         return 0;
     } else {
-        return entry->expire <= get_current_timestamp() / 1000;
+        return entry->expire <= nst_time_now();
     }
 
 }
@@ -270,6 +295,8 @@ static inline int nst_nosql_entry_invalid(struct nst_nosql_entry *entry) {
     return nst_nosql_dict_entry_expired(entry);
 }
 
+#define nst_nosql_dict_shard(hash)                                            \
+    (&nuster.nosql->shard[(hash) >> (64 - NST_NOSQL_DICT_SHARD_BITS)])
 #define nst_nosql_key_init() nst_key_init(global.nuster.nosql.memory)
 #define nst_nosql_key_advance(key, step)                                      \
     nst_key_advance(global.nuster.nosql.memory, key, step)
@@ -27,6 +27,8 @@
     "2017-present, Jiang Wenyuan, <koubunen AT gmail DOT com >"
 
 #include <common/chunk.h>
+#include <common/hathreads.h>
+#include <types/global.h>
 #include <types/applet.h>
 #include <import/xxhash.h>
 
@@ -70,8 +72,23 @@ static inline int nuster_check_applet (struct stream *s, struct channel *req,
             nst_cache_stats(s, req, px));
 }
 
+/* only the purge of a url is available with HTX, see nst_cache_purge_htx */
+static inline int nuster_check_applet_htx(struct stream *s,
+        struct channel *req, struct proxy *px) {
+
+    return nst_cache_purge_htx(s, req, px);
+}
+
 int nst_test_rule(struct nst_rule *rule, struct stream *s, int res);
 
+/*
+ * The slot of the calling thread among those of every worker process, out
+ * of slots, see nst_epoch_enter
+ */
+static inline int nst_stats_slot(int slots) {
+    return ((relative_pid - 1) * global.nbthread + tid) % slots;
+}
+
 static inline uint64_t nst_hash(const char *buf, size_t len) {
     return XXH64(buf, len, 0);
 }
@@ -80,6 +97,14 @@ struct buffer *nst_key_init(struct nst_memory *memory);
 int nst_key_advance(struct nst_memory *memory, struct buffer *key, int step);
 int nst_key_append(struct nst_memory *memory, struct buffer *key, char *str,
         int len);
+struct buffer *nst_key_scratch_init();
+int nst_key_scratch_advance(struct buffer *key, int step);
+int nst_key_scratch_append(struct buffer *key, char *str, int len);
+uint64_t nst_key_scratch_hash(struct buffer *key);
+void nst_key_scratch_mark(struct buffer *key);
+void nst_key_scratch_rewind(struct buffer *key);
+struct buffer *nst_key_dup(struct buffer *key);
+struct buffer *nst_key_store(struct nst_memory *memory, struct buffer *key);
 
 int nst_ci_send(struct channel *chn, int len);
 
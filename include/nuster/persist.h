@@ -30,12 +30,13 @@
 
 #include <nuster/common.h>
 
-#define NST_PERSIST_VERSION  3
+#define NST_PERSIST_VERSION  4
 
 /*
    Offset              Length(bytes)           Content
    0                   6                       NUSTER
    6                   1                       Mode: NUSTER_DISK_*, 1, 2, 3
+                                               | NST_PERSIST_MODE_HTX
    7                   1                       Version: 1
    8 * 1               8                       hash
    8 * 2               8                       expire time
@@ -46,11 +47,12 @@
    8 * 7               8                       path length
    8 * 8               8                       etag length
    8 * 9               8                       last-modified length
-   8 * 10              key_len                 key
-   8 * 11              host_len                host
-   8 * 12              path_len                path
-   8 * 13              etag_len                etag
-   8 * 14              last_modified_len       last_modified
+   8 * 10              8                       stale-if-error
+   8 * 11              key_len                 key
+   8 * 12              host_len                host
+   8 * 13              path_len                path
+   8 * 14              etag_len                etag
+   8 * 15              last_modified_len       last_modified
    meta_size
    + key_len
    + host_len
@@ -68,9 +70,13 @@
 #define NST_PERSIST_META_POS_PATH_LEN           8 * 7
 #define NST_PERSIST_META_POS_ETAG_LEN           8 * 8
 #define NST_PERSIST_META_POS_LAST_MODIFIED_LEN  8 * 9
+#define NST_PERSIST_META_POS_STALE              8 * 10
 
 
-#define NST_PERSIST_META_SIZE                8 * 10
+#define NST_PERSIST_META_SIZE                8 * 11
+
+/* the header is made of HTX blocks, see nst_cache_update_header */
+#define NST_PERSIST_MODE_HTX                 0x40
 #define NST_PERSIST_POS_KEY                  NST_PERSIST_META_SIZE
 
 enum {
@@ -136,13 +142,51 @@ static inline int nst_persist_meta_check_expire(char *p) {
         return NST_OK;
     }
 
-    if(expire * 1000 > get_current_timestamp()) {
+    if(expire > nst_time_now()) {
         return NST_OK;
     } else {
         return NST_ERR;
     }
 }
 
+static inline void nst_persist_meta_set_stale(char *p, uint64_t v) {
+    *(uint64_t *)(p + NST_PERSIST_META_POS_STALE) = v;
+}
+
+static inline uint64_t nst_persist_meta_get_stale(char *p) {
+    return *(uint64_t *)(p + NST_PERSIST_META_POS_STALE);
+}
+
+/* not expired, or still kept to be served if the server fails */
+static inline int nst_persist_meta_check_stale(char *p) {
+    uint64_t expire = *(uint64_t *)(p + NST_PERSIST_META_POS_EXPIRE);
+
+    if(expire == 0) {
+        return NST_OK;
+    }
+
+    expire += nst_persist_meta_get_stale(p);
+
+    if(expire > nst_time_now()) {
+        return NST_OK;
+    } else {
+        return NST_ERR;
+    }
+}
+
+static inline int nst_persist_meta_get_htx(char *p) {
+    return (p[6] & NST_PERSIST_MODE_HTX) != 0;
+}
+
+static inline int nst_persist_meta_check_magic(char *p) {
+
+    if(memcmp(p, "NUSTER", 6) != 0 || p[7] != (char)NST_PERSIST_VERSION) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
 static inline void nst_persist_meta_set_cache_len(char *p, uint64_t v) {
     *(uint64_t *)(p + NST_PERSIST_META_POS_CACHE_LEN) = v;
 }
@@ -226,10 +270,11 @@ nst_persist_meta_init(char *p, char mode, uint64_t hash, uint64_t expire,
     nst_persist_meta_set_path_len(p, path_len);
     nst_persist_meta_set_etag_len(p, etag_len);
     nst_persist_meta_set_last_modified_len(p, last_modified_len);
+    nst_persist_meta_set_stale(p, 0);
 }
 
 int nst_persist_exists(char *root, struct persist *disk, struct buffer *key,
-        uint64_t hash);
+        uint64_t hash, int stale);
 
 static inline int nst_persist_write(struct persist *disk, char *buf, int len) {
     ssize_t ret = pwrite(disk->fd, buf, len, disk->offset);
@@ -309,7 +354,8 @@ int nst_persist_get_last_modified(int fd, char *meta,
 DIR *nst_persist_opendir_by_idx(char *root, char *path, int idx);
 void nst_persist_cleanup(char *root, char *path, struct dirent *de);
 struct dirent *nst_persist_dir_next(DIR *dir);
-int nst_persist_valid(struct persist *disk, struct buffer *key, uint64_t hash);
+int nst_persist_valid(struct persist *disk, struct buffer *key, uint64_t hash,
+        int stale);
 int nst_persist_purge_by_key(char *root, struct persist *disk,
         struct buffer *key, uint64_t hash);
 int nst_persist_purge_by_path(char *path);
@@ -49,6 +49,8 @@ static inline int _nst_shctx_init(pthread_mutex_t *mutex) {
 #define nst_shctx_init(shctx)   _nst_shctx_init(&(shctx)->mutex)
 #define nst_shctx_lock(shctx)   pthread_mutex_lock(&(shctx)->mutex)
 #define nst_shctx_unlock(shctx) pthread_mutex_unlock(&(shctx)->mutex)
+#define nst_shctx_trylock(shctx)                                             \
+    (pthread_mutex_trylock(&(shctx)->mutex) ? NST_ERR : NST_OK)
 
 #else
 
@@ -176,6 +178,10 @@ static inline void _shctx_unlock(unsigned int *waiters) {
 
 }
 
+static inline int _shctx_trylock(unsigned int *waiters) {
+    return cmpxchg(waiters, 0, 1) ? NST_ERR : NST_OK;
+}
+
 static inline int _nst_shctx_init(unsigned int *waiters) {
     *waiters = 0;
 
@@ -184,6 +190,7 @@ static inline int _nst_shctx_init(unsigned int *waiters) {
 #define nst_shctx_init(shctx)   _nst_shctx_init(&(shctx)->waiters)
 #define nst_shctx_lock(shctx)   _shctx_lock(&(shctx)->waiters)
 #define nst_shctx_unlock(shctx) _shctx_unlock(&(shctx)->waiters)
+#define nst_shctx_trylock(shctx) _shctx_trylock(&(shctx)->waiters)
 
 #endif
 
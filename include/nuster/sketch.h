@@ -0,0 +1,57 @@
+/*
+ * include/nuster/sketch.h
+ * This file defines the frequency sketch used by nuster eviction.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, version 2.1
+ * exclusively.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301 USA
+ */
+
+#ifndef _NUSTER_SKETCH_H
+#define _NUSTER_SKETCH_H
+
+#include <nuster/common.h>
+
+#define NST_SKETCH_DEPTH           4
+#define NST_SKETCH_MIN_SIZE        64
+#define NST_SKETCH_SAMPLE_FACTOR   10
+#define NST_SKETCH_COUNTER_MAX     15
+
+/*
+ * Count-min sketch of 4 bits counters, 16 per word, in the shared memory.
+ * Each key is counted in NST_SKETCH_DEPTH counters of different words.
+ * Once sample counters have been increased, all of them are halved so that
+ * old popularity fades away.
+ * Words are allocated in segments of 1 << shift words, size is the number
+ * of words and always a power of 2.
+ */
+struct nst_sketch {
+    uint64_t              **segment;
+    uint64_t                size;
+    int                     shift;
+    unsigned int            additions;
+    unsigned int            sample;
+};
+
+struct nst_memory;
+
+int nst_sketch_init(struct nst_memory *memory, struct nst_sketch *sketch,
+        uint64_t entries);
+
+void nst_sketch_increment(struct nst_sketch *sketch, uint64_t hash);
+int nst_sketch_frequency(struct nst_sketch *sketch, uint64_t hash);
+void nst_sketch_age(struct nst_sketch *sketch);
+
+#endif /* _NUSTER_SKETCH_H */
@@ -80,11 +80,17 @@ struct appctx {
 				struct nst_cache_entry   *entry;
 				struct nst_cache_data    *data;
 				struct nst_cache_element *element;
+				int                       offset;
+				struct list               waiter;
+				struct nst_cache_gzip    *gunzip;
+				struct nst_cache_range   *range;
 			} cache_engine;
 			struct {
 				struct nst_str   host;
 				struct nst_str   path;
 				struct my_regex *regex;
+				int              shard;
+				unsigned int     generation;
 			} cache_manager;
 			struct {
 				struct nst_nosql_entry   *entry;
@@ -98,6 +104,7 @@ struct appctx {
 				int fd;
 				int header_len;
 				uint64_t offset;
+				struct nst_cache_range *range;
 			} cache_disk_engine;
 		} nuster;
 		struct {
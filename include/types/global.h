@@ -34,6 +34,8 @@
 #include <types/task.h>
 #include <types/vars.h>
 
+#include <nuster/memory.h>
+
 #ifndef UNIX_MAX_PATH
 #define UNIX_MAX_PATH 108
 #endif
@@ -189,9 +191,14 @@ struct global {
 			char     *uri;                         /* the uri used for stats and manager */
 			int	  dict_cleaner;                /* the number of entries checked once */
 			int	  data_cleaner;                /* the number of data checked once */
+			int	  data_compactor;              /* the number of dict groups checked once for data to move */
 			int	  disk_cleaner;                /* the number of files checked once */
 			int	  disk_loader;                 /* the number of files load once */
 			int	  disk_saver;                  /* the number of entries checked once for persist_async */
+			int       evict;                       /* eviction policy */
+			int       headroom;                    /* percentage of memory kept free */
+			int       admit;                       /* min request frequency to store a response */
+			struct nst_memory_conf shm;            /* pages, NUMA and prefault of the memory */
 
 			struct {
 				struct pool_head *stash;
@@ -215,6 +222,9 @@ struct global {
 			int	  disk_cleaner;                /* the number of files checked once */
 			int	  disk_loader;                 /* the number of files load once */
 			int	  disk_saver;                  /* the number of entries checked once for persist_async */
+			int       evict;                       /* eviction policy */
+			int       headroom;                    /* percentage of memory kept free */
+			struct nst_memory_conf shm;            /* pages, NUMA and prefault of the memory */
 
 			struct {
 				struct pool_head *stash;
@@ -465,6 +465,7 @@ struct proxy {
 	struct list filter_configs;		/* list of the filters that are declared on this proxy */
 	struct {
 		int mode;
+		int splice;                     /* splice cache hits, see nuster cache */
 		struct list rules;              /* nuster rules */
 	} nuster;
 	__decl_hathreads(HA_SPINLOCK_T lock);   /* may be taken under the server's lock */
@@ -186,9 +186,13 @@ struct global global = {
 			.dict_size    = NST_DEFAULT_DICT_SIZE,
 			.dict_cleaner = NST_DEFAULT_DICT_CLEANER,
 			.data_cleaner = NST_DEFAULT_DATA_CLEANER,
+			.data_compactor = NST_DEFAULT_DATA_COMPACTOR,
 			.disk_cleaner = NST_DEFAULT_DISK_CLEANER,
 			.disk_loader  = NST_DEFAULT_DISK_LOADER,
 			.disk_saver   = NST_DEFAULT_DISK_SAVER,
+			.evict        = NST_DEFAULT_EVICT,
+			.headroom     = NST_DEFAULT_HEADROOM,
+			.admit        = NST_DEFAULT_ADMIT,
 			.share        = NST_STATUS_ON,
 			.purge_method = NULL,
 			.root	      = NULL,
@@ -203,6 +207,8 @@ struct global global = {
 			.disk_cleaner = NST_DEFAULT_DISK_CLEANER,
 			.disk_loader  = NST_DEFAULT_DISK_LOADER,
 			.disk_saver   = NST_DEFAULT_DISK_SAVER,
+			.evict        = NST_DEFAULT_EVICT,
+			.headroom     = NST_DEFAULT_HEADROOM,
 		},
 	},
 	/* others NULL OK */
@@ -18,217 +18,544 @@
 #include <nuster/persist.h>
 
 
-static int _nst_cache_dict_resize(uint64_t size) {
-    struct nst_cache_dict dict;
+int nst_cache_dict_init() {
+    struct nst_memory *memory = global.nuster.cache.memory;
 
-    dict.size  = size;
-    dict.used  = 0;
-    dict.entry = malloc(sizeof(struct nst_cache_entry*) * size);
+    uint64_t size = global.nuster.cache.dict_size
+        / sizeof(struct nst_dict_group) / NST_CACHE_DICT_SHARDS;
 
-    if(dict.entry) {
-        int i;
+    uint64_t n;
+    int i;
 
-        for(i = 0; i < size; i++) {
-            dict.entry[i] = NULL;
-        }
+    /* round down to power of 2 so that groups fill whole segments */
+    for(n = NST_CACHE_DICT_MIN_SIZE; n * 2 <= size; n *= 2) { }
 
-        if(!nuster.cache->dict[0].entry) {
-            nuster.cache->dict[0] = dict;
+    if(n > nst_dict_max_size(memory)) {
+        n = nst_dict_max_size(memory);
+    }
 
-            return NST_OK;
-        } else {
-            nuster.cache->dict[1] = dict;
-            nuster.cache->rehash_idx = 0;
+    for(i = 0; i < NST_CACHE_DICT_SHARDS; i++) {
+        struct nst_cache_dict_shard *shard = &nuster.cache->shard[i];
 
-            return NST_OK;
+        shard->rehash_idx = -1;
+
+        if(nst_dict_alloc(memory, &shard->dict[0], n) != NST_OK) {
+            return NST_ERR;
         }
 
+        if(nst_shctx_init(shard) != NST_OK) {
+            return NST_ERR;
+        }
     }
 
-    return NST_ERR;
+    return NST_OK;
 }
 
-static int _nst_cache_dict_alloc(uint64_t size) {
-    int i;
-    int entry_size = sizeof(struct nst_cache_entry*);
-    int block_size = global.nuster.cache.memory->block_size;
+static int _nst_cache_dict_rehashing(struct nst_cache_dict_shard *shard) {
+    return shard->rehash_idx != -1;
+}
 
-    nuster.cache->dict[0].size  = size / entry_size;
-    nuster.cache->dict[0].used  = 0;
-    nuster.cache->dict[0].entry = nst_cache_memory_alloc(block_size);
+/*
+ * dict[0] and dict[1] are only replaced by the master process with the
+ * shard lock held, seq is odd meanwhile so that lock free readers retry
+ */
+static void _nst_cache_dict_write_begin(struct nst_cache_dict_shard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    if(!nuster.cache->dict[0].entry) {
-        return NST_ERR;
+static void _nst_cache_dict_write_end(struct nst_cache_dict_shard *shard) {
+    __atomic_store_n(&shard->seq, shard->seq + 1, __ATOMIC_RELEASE);
+}
+
+static void _nst_cache_memory_free(void *p) {
+    nst_cache_memory_free(p);
+}
+
+static void _nst_cache_entry_free(void *p) {
+    struct nst_cache_entry *entry = p;
+
+    nst_cache_memory_free(entry->key->area);
+    nst_cache_memory_free(entry->key);
+    nst_cache_memory_free(entry->host.data);
+    nst_cache_memory_free(entry->path.data);
+
+    if(!entry->data) {
+        nst_cache_memory_free(entry->etag.data);
+        nst_cache_memory_free(entry->last_modified.data);
     }
 
-    for(i = 1; i < size / block_size; i++) {
+    nst_cache_memory_free(entry->vary);
+    nst_cache_memory_free(entry);
+}
 
-        if(!nst_cache_memory_alloc(block_size)) {
-            return NST_ERR;
+/*
+ * Move the slots of at most n groups from dict[0] to dict[1]
+ */
+static void _nst_cache_dict_rehash_step(struct nst_cache_dict_shard *shard,
+        int n) {
+
+    while(n-- && shard->rehash_idx < shard->dict[0].size) {
+
+        /* dict[1] is full, retry later when cleanup freed some slots */
+        if(nst_dict_move_group(&shard->dict[0], shard->rehash_idx,
+                    &shard->dict[1]) != NST_OK) {
+
+            return;
         }
+
+        shard->rehash_idx++;
     }
+}
+
+/*
+ * Switch to dict[1] once dict[0] has been emptied, the groups of dict[0]
+ * are freed when no lock free reader can be walking them anymore
+ */
+static void _nst_cache_dict_rehash_done(struct nst_cache_dict_shard *shard) {
+    struct nst_dict *dict = &shard->dict[0];
+    uint64_t i;
 
-    for(i = 0; i < nuster.cache->dict[0].size; i++) {
-        nuster.cache->dict[0].entry[i] = NULL;
+    for(i = 0; i < dict->size >> dict->shift; i++) {
+        nst_epoch_retire(&nuster.cache->epoch, dict->segment[i],
+                _nst_cache_memory_free);
     }
 
-    return nst_shctx_init((&nuster.cache->dict[0]));
+    nst_epoch_retire(&nuster.cache->epoch, dict->segment,
+            _nst_cache_memory_free);
+
+    _nst_cache_dict_write_begin(shard);
+
+    shard->dict[0]         = shard->dict[1];
+    shard->rehash_idx      = -1;
+    shard->dict[1].segment = NULL;
+    shard->dict[1].size    = 0;
+    shard->dict[1].used    = 0;
+    shard->dict[1].deleted = 0;
+
+    _nst_cache_dict_write_end(shard);
+
+    shard->cleanup_idx     = 0;
+    shard->persist_idx     = 0;
+    shard->generation++;
 }
 
-int nst_cache_dict_init() {
+/*
+ * Rehash one shard, shards are visited in turn.
+ * Start rehashing when used and deleted slots take most of dict[0], into
+ * a dict twice as large, or of the same size when most of them are just
+ * deleted ones. The groups of dict[1] are allocated without holding the
+ * shard lock.
+ */
+void nst_cache_dict_rehash() {
+    struct nst_cache_dict_shard *shard =
+        &nuster.cache->shard[nuster.cache->rehash_shard];
 
-    if(global.nuster.cache.share) {
-        int block_size = global.nuster.cache.memory->block_size;
-        int dict_size = global.nuster.cache.dict_size;
-        int size = (block_size + dict_size - 1) / block_size * block_size;
+    struct nst_memory *memory = global.nuster.cache.memory;
+    struct nst_dict dict;
+    uint64_t size = 0;
 
-        return _nst_cache_dict_alloc(size);
-    } else {
-        return _nst_cache_dict_resize(NST_DEFAULT_DICT_SIZE);
+    nuster.cache->rehash_shard =
+        (nuster.cache->rehash_shard + 1) % NST_CACHE_DICT_SHARDS;
+
+    nst_shctx_lock(shard);
+
+    if(_nst_cache_dict_rehashing(shard)) {
+        _nst_cache_dict_rehash_step(shard, NST_CACHE_DICT_REHASH_STEP);
+
+        /* have we rehashed the whole dict? */
+        if(shard->rehash_idx == shard->dict[0].size) {
+            _nst_cache_dict_rehash_done(shard);
+        }
+
+    } else if(shard->dict[0].used + shard->dict[0].deleted
+            >= nst_dict_capacity(&shard->dict[0])
+            * NST_CACHE_DEFAULT_LOAD_FACTOR) {
+
+        size = shard->dict[0].size;
+
+        if(shard->dict[0].used >= nst_dict_capacity(&shard->dict[0])
+                * NST_CACHE_DEFAULT_LOAD_FACTOR / 2) {
+
+            size *= NST_CACHE_DEFAULT_GROWTH_FACTOR;
+        }
     }
 
+    nst_shctx_unlock(shard);
+
+    if(!size || size > nst_dict_max_size(memory)) {
+        return;
+    }
+
+    if(nst_dict_alloc(memory, &dict, size) != NST_OK) {
+        return;
+    }
+
+    /* only the master process starts rehashing, nobody can race us */
+    nst_shctx_lock(shard);
+
+    _nst_cache_dict_write_begin(shard);
+
+    shard->dict[1]    = dict;
+    shard->rehash_idx = 0;
+
+    _nst_cache_dict_write_end(shard);
+
+    nst_shctx_unlock(shard);
 }
 
-static int _nst_cache_dict_rehashing() {
-    return 0;
-    //return nuster.cache->rehash_idx != -1;
+static void _nst_cache_dict_cleanup(struct nst_cache_dict_shard *shard) {
+    struct nst_dict_group *group;
+    uint32_t mask;
+
+    if(!shard->dict[0].used) {
+        return;
+    }
+
+    group = nst_dict_group(&shard->dict[0], shard->cleanup_idx);
+    mask  = nst_dict_match_used(group);
+
+    while(mask) {
+        struct nst_cache_entry *entry;
+        int i = __builtin_ctz(mask);
+
+        mask &= mask - 1;
+        entry = group->slot[i].ptr;
+
+        if(nst_cache_entry_invalid(entry)) {
+
+            if(entry->data) {
+                entry->data->invalid = 1;
+            }
+
+            nst_dict_remove(&shard->dict[0], group, i);
+            nst_epoch_retire(&nuster.cache->epoch, entry,
+                    _nst_cache_entry_free);
+        }
+
+    }
+
+    shard->cleanup_idx++;
+
+    /* if we have checked the whole dict */
+    if(shard->cleanup_idx == shard->dict[0].size) {
+        shard->cleanup_idx = 0;
+    }
+
 }
 
 /*
- * Rehash dict if cache->dict[0] is almost full
+ * Check entry validity, free the entry if its invalid,
+ * If its invalid set entry->data->invalid to true,
+ * entry->data is freed by _cache_data_cleanup.
+ * One group of one shard is checked per call, shards are visited in turn
  */
-void nst_cache_dict_rehash() {
+void nst_cache_dict_cleanup() {
+    struct nst_cache_dict_shard *shard =
+        &nuster.cache->shard[nuster.cache->cleanup_shard];
 
-    if(_nst_cache_dict_rehashing()) {
-        int max_empty = 10;
-        struct nst_cache_entry *entry = NULL;
+    nuster.cache->cleanup_shard =
+        (nuster.cache->cleanup_shard + 1) % NST_CACHE_DICT_SHARDS;
 
-        /* check max_empty entryies */
-        while(!nuster.cache->dict[0].entry[nuster.cache->rehash_idx]) {
-            nuster.cache->rehash_idx++;
-            max_empty--;
+    nst_shctx_lock(shard);
+    _nst_cache_dict_cleanup(shard);
+    nst_shctx_unlock(shard);
+}
+
+/*
+ * Move the data of the entries of one group of one shard out of the blocks
+ * being drained. The data are copied without holding the shard lock and
+ * pinned meanwhile, the copy replaces entry->data only if the entry still
+ * uses the old one, which is then freed by _nst_cache_data_cleanup once
+ * nobody reads it. Shards are visited in turn, return NST_ERR once all of
+ * them have been checked.
+ */
+int nst_cache_dict_compact() {
+    struct nst_cache_dict_shard *shard =
+        &nuster.cache->shard[nuster.cache->compact_shard];
+
+    struct nst_cache_entry *entry[NST_DICT_GROUP_SLOTS];
+    struct nst_cache_data  *data[NST_DICT_GROUP_SLOTS];
+    struct nst_cache_data  *copy;
+    struct nst_dict_group  *group = NULL;
+    int slot[NST_DICT_GROUP_SLOTS];
+    int n = 0;
+    int i;
 
-            if(nuster.cache->rehash_idx >= nuster.cache->dict[0].size) {
-                return;
+    nst_shctx_lock(shard);
+
+    if(nuster.cache->compact_idx < shard->dict[0].size) {
+        uint32_t mask;
+
+        group = nst_dict_group(&shard->dict[0], nuster.cache->compact_idx);
+        mask  = nst_dict_match_used(group);
+
+        while(mask) {
+            struct nst_cache_entry *e;
+
+            i     = __builtin_ctz(mask);
+            mask &= mask - 1;
+            e     = group->slot[i].ptr;
+
+            if(e->state != NST_CACHE_ENTRY_STATE_VALID || !e->data
+                    || e->data->state != NST_CACHE_DATA_STATE_DONE
+                    || e->data->invalid
+                    || !nst_cache_data_draining(e->data)) {
+
+                continue;
             }
 
-            if(!max_empty) {
-                return;
+            __atomic_add_fetch(&e->data->clients, 1, __ATOMIC_SEQ_CST);
+
+            slot[n]  = i;
+            entry[n] = e;
+            data[n]  = e->data;
+            n++;
+        }
+    }
+
+    nst_shctx_unlock(shard);
+
+    for(i = 0; i < n; i++) {
+        copy = nst_cache_data_copy(data[i]);
+
+        nst_shctx_lock(shard);
+
+        if(copy) {
+
+            /* evicted, deleted or refreshed meanwhile */
+            if(group->slot[slot[i]].ptr == entry[i]
+                    && entry[i]->data == data[i]
+                    && entry[i]->state == NST_CACHE_ENTRY_STATE_VALID
+                    && !__atomic_load_n(&data[i]->invalid, __ATOMIC_SEQ_CST)) {
+
+                entry[i]->etag          = copy->etag;
+                entry[i]->last_modified = copy->last_modified;
+
+                __atomic_store_n(&entry[i]->data, copy, __ATOMIC_RELEASE);
+                __atomic_store_n(&data[i]->invalid, 1, __ATOMIC_SEQ_CST);
+
+                nst_cache_stats_update_compacted(1);
+                nuster.cache->compact_moved++;
+            } else {
+                __atomic_store_n(&copy->invalid, 1, __ATOMIC_SEQ_CST);
             }
 
         }
 
-        /* move all entries in this bucket to dict[1] */
-        entry = nuster.cache->dict[0].entry[nuster.cache->rehash_idx];
+        nst_shctx_unlock(shard);
+
+        nst_cache_data_release(data[i]);
+    }
+
+    if(++nuster.cache->compact_idx < shard->dict[0].size) {
+        return NST_OK;
+    }
+
+    nuster.cache->compact_idx   = 0;
+    nuster.cache->compact_shard =
+        (nuster.cache->compact_shard + 1) % NST_CACHE_DICT_SHARDS;
+
+    return nuster.cache->compact_shard ? NST_OK : NST_ERR;
+}
+
+/*
+ * Choose a victim among the entries following the eviction hand of the
+ * shard, unlink it and mark its data evicting. Invalid entries go first.
+ */
+static struct nst_cache_entry *
+_nst_cache_dict_evict(struct nst_cache_dict_shard *shard) {
+    struct nst_evict_cand   cand[NST_EVICT_SAMPLES];
+    struct nst_dict        *dict   = &shard->dict[0];
+    struct nst_cache_entry *entry  = NULL;
+    struct nst_cache_entry *e;
+    struct nst_dict_probe   probe;
+    int n = 0;
+    int i;
+
+    /* most entries are already in dict[1] late in rehashing */
+    if(shard->dict[1].used > dict->used) {
+        dict = &shard->dict[1];
+    }
+
+    if(!dict->used) {
+        return NULL;
+    }
+
+    for(i = 0; i < NST_EVICT_GROUPS && n < NST_EVICT_SAMPLES && !entry; i++) {
+        struct nst_dict_group *group;
+        uint32_t mask;
+
+        group = nst_dict_group(dict, shard->evict_idx++ & (dict->size - 1));
+        mask  = nst_dict_match_used(group);
+
+        while(mask && n < NST_EVICT_SAMPLES) {
+            e     = group->slot[__builtin_ctz(mask)].ptr;
+            mask &= mask - 1;
+
+            /* being filled or refreshed by a request */
+            if(e->state == NST_CACHE_ENTRY_STATE_CREATING
+                    || e->state == NST_CACHE_ENTRY_STATE_REFRESH) {
+
+                continue;
+            }
+
+            /* the disk copy is only found through the entry */
+            if(nst_cache_entry_invalid(e) && !e->file) {
+                entry = e;
+                break;
+            }
+
+            nst_evict_cand_set(&cand[n++], e, e->hash, &e->access);
+        }
+    }
 
-        while(entry) {
-            int idx = entry->hash % nuster.cache->dict[1].size;
-            struct nst_cache_entry *entry_next = entry->next;
+    if(!entry) {
+        i = nst_evict_choose(global.nuster.cache.evict, &nuster.cache->sketch,
+                cand, n);
 
-            entry->next = nuster.cache->dict[1].entry[idx];
-            nuster.cache->dict[1].entry[idx] = entry;
-            nuster.cache->dict[1].used++;
-            nuster.cache->dict[0].used--;
-            entry = entry_next;
+        if(i == -1) {
+            return NULL;
         }
 
-        nuster.cache->dict[0].entry[nuster.cache->rehash_idx] = NULL;
-        nuster.cache->rehash_idx++;
+        entry = cand[i].entry;
+    }
 
-        /* have we rehashed the whole dict? */
-        if(nuster.cache->dict[0].used == 0) {
-            free(nuster.cache->dict[0].entry);
-            nuster.cache->dict[0]       = nuster.cache->dict[1];
-            nuster.cache->rehash_idx    = -1;
-            nuster.cache->cleanup_idx   = 0;
-            nuster.cache->dict[1].entry = NULL;
-            nuster.cache->dict[1].size  = 0;
-            nuster.cache->dict[1].used  = 0;
+    nst_dict_probe_init(dict, entry->hash, &probe);
+
+    while((e = nst_dict_probe_next(dict, entry->hash, &probe)) != entry) {
+
+        if(!e) {
+            return NULL;
         }
+    }
 
-    } else {
+    nst_dict_remove(dict, probe.group, probe.slot);
 
-        /* should we rehash? */
-        if(global.nuster.cache.share) {
-            return;
+    __atomic_store_n(&entry->state, NST_CACHE_ENTRY_STATE_INVALID,
+            __ATOMIC_RELEASE);
+
+    if(entry->data) {
+        __atomic_store_n(&entry->data->invalid, NST_CACHE_DATA_EVICTING,
+                __ATOMIC_SEQ_CST);
+    }
+
+    return entry;
+}
+
+/*
+ * Evict at most n entries, one per shard visited, shards locked by others
+ * are skipped. The entries are freed once no lock free reader can see
+ * them, their data are returned for the caller to free.
+ */
+int nst_cache_dict_evict(struct nst_cache_data **data, int n) {
+    struct nst_cache_entry *entry[NST_EVICT_BATCH];
+    int evicted = 0;
+    int i;
+
+    if(n > NST_EVICT_BATCH) {
+        n = NST_EVICT_BATCH;
+    }
+
+    for(i = 0; i < 2 * NST_CACHE_DICT_SHARDS && evicted < n; i++) {
+        struct nst_cache_dict_shard *shard = &nuster.cache->shard[
+            __atomic_fetch_add(&nuster.cache->evict_shard, 1, __ATOMIC_RELAXED)
+                % NST_CACHE_DICT_SHARDS];
+
+        if(nst_shctx_trylock(shard) != NST_OK) {
+            continue;
         }
 
-        if(nuster.cache->dict[0].used
-                >= nuster.cache->dict[0].size * NST_CACHE_DEFAULT_LOAD_FACTOR) {
+        entry[evicted] = _nst_cache_dict_evict(shard);
+
+        nst_shctx_unlock(shard);
 
-            _nst_cache_dict_resize(nuster.cache->dict[0].size
-                    * NST_CACHE_DEFAULT_GROWTH_FACTOR);
+        if(entry[evicted]) {
+            data[evicted] = entry[evicted]->data;
+            evicted++;
         }
+    }
+
+    if(!evicted) {
+        return 0;
+    }
+
+    nst_epoch_synchronize(&nuster.cache->epoch);
 
+    for(i = 0; i < evicted; i++) {
+        _nst_cache_entry_free(entry[i]);
     }
+
+    return evicted;
 }
 
 /*
- * Check entry validity, free the entry if its invalid,
- * If its invalid set entry->data->invalid to true,
- * entry->data is freed by _cache_data_cleanup
+ * Copy the key, the host and the path of the request of ctx to entry
  */
-void nst_cache_dict_cleanup() {
-    struct nst_cache_entry *entry =
-        nuster.cache->dict[0].entry[nuster.cache->cleanup_idx];
+static int
+_nst_cache_entry_req(struct nst_cache_entry *entry, struct nst_cache_ctx *ctx) {
 
-    struct nst_cache_entry *prev  = entry;
+    entry->key       = NULL;
+    entry->host.data = NULL;
+    entry->host.len  = ctx->req.host.len;
+    entry->path.data = NULL;
+    entry->path.len  = ctx->req.path.len;
 
-    if(!nuster.cache->dict[0].used) {
-        return;
+    entry->key = nst_cache_key_store(ctx->key);
+
+    if(!entry->key) {
+        goto err;
     }
 
-    while(entry) {
+    if(ctx->req.host.data) {
+        entry->host.data = nst_cache_memory_alloc(entry->host.len);
 
-        if(nst_cache_entry_invalid(entry)) {
-            struct nst_cache_entry *tmp = entry;
+        if(!entry->host.data) {
+            goto err;
+        }
 
-            if(entry->data) {
-                entry->data->invalid = 1;
-            }
+        memcpy(entry->host.data, ctx->req.host.data, entry->host.len);
+    }
 
-            if(prev == entry) {
-                nuster.cache->dict[0].entry[nuster.cache->cleanup_idx] =
-                    entry->next;
-                prev = entry->next;
-            } else {
-                prev->next = entry->next;
-            }
+    if(ctx->req.path.data) {
+        /* extra 1 char as required by regex_exec_match2 */
+        entry->path.data = nst_cache_memory_alloc(entry->path.len + 1);
 
-            entry = entry->next;
-            nst_cache_memory_free(tmp->key->area);
-            nst_cache_memory_free(tmp->key);
-            nst_cache_memory_free(tmp->host.data);
-            nst_cache_memory_free(tmp->path.data);
-            nst_cache_memory_free(tmp);
-            nuster.cache->dict[0].used--;
-        } else {
-            prev  = entry;
-            entry = entry->next;
+        if(!entry->path.data) {
+            goto err;
         }
 
+        memcpy(entry->path.data, ctx->req.path.data, entry->path.len);
     }
 
-    nuster.cache->cleanup_idx++;
+    return NST_OK;
 
-    /* if we have checked the whole dict */
-    if(nuster.cache->cleanup_idx == nuster.cache->dict[0].size) {
-        nuster.cache->cleanup_idx = 0;
+err:
+    if(entry->key) {
+        nst_cache_memory_free(entry->key->area);
+        nst_cache_memory_free(entry->key);
     }
 
+    nst_cache_memory_free(entry->host.data);
+
+    return NST_ERR;
 }
 
 /*
  * Add a new nst_cache_entry to cache_dict
  */
 struct nst_cache_entry *nst_cache_dict_set(struct nst_cache_ctx *ctx) {
-    struct nst_cache_dict  *dict  = NULL;
-    struct nst_cache_data  *data  = NULL;
-    struct nst_cache_entry *entry = NULL;
-    int idx;
+    struct nst_cache_dict_shard *shard = nst_cache_dict_shard(ctx->hash);
+    struct nst_dict             *dict  = NULL;
+    struct nst_cache_data       *data  = NULL;
+    struct nst_cache_entry      *entry = NULL;
 
-    dict = _nst_cache_dict_rehashing()
-        ? &nuster.cache->dict[1] : &nuster.cache->dict[0];
+    dict = _nst_cache_dict_rehashing(shard) ? &shard->dict[1] : &shard->dict[0];
+
+    /* no free slot left, wait for the housekeeping to grow the dict */
+    if(dict->used == nst_dict_capacity(dict)) {
+        return NULL;
+    }
 
     entry = nst_cache_memory_alloc(sizeof(*entry));
 
@@ -236,113 +563,270 @@ struct nst_cache_entry *nst_cache_dict_set(struct nst_cache_ctx *ctx) {
         return NULL;
     }
 
+    /* the request is copied to the shared memory only now */
+    if(_nst_cache_entry_req(entry, ctx) != NST_OK) {
+        nst_cache_memory_free(entry);
+        return NULL;
+    }
+
     if(ctx->rule->disk != NST_DISK_ONLY) {
-        data = nst_cache_data_new();
+        data = nst_cache_data_new(ctx);
 
         if(!data) {
+            nst_cache_memory_free(entry->key->area);
+            nst_cache_memory_free(entry->key);
+            nst_cache_memory_free(entry->host.data);
+            nst_cache_memory_free(entry->path.data);
             nst_cache_memory_free(entry);
             return NULL;
         }
     }
 
-    idx = ctx->hash % dict->size;
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
-
     /* init entry */
     entry->data   = data;
     entry->state  = NST_CACHE_ENTRY_STATE_CREATING;
-    entry->key    = ctx->key;
-    ctx->key      = NULL;
     entry->hash   = ctx->hash;
     entry->expire = 0;
+    entry->stale  = 0;
+    entry->failed = 0;
     entry->rule   = ctx->rule;
     entry->pid    = ctx->pid;
     entry->file   = NULL;
+    entry->vary   = NULL;
 
-    entry->header_len = ctx->header_len;
+    nst_evict_init(&entry->access);
 
-    entry->host.data   = ctx->req.host.data;
-    entry->host.len    = ctx->req.host.len;
-    ctx->req.host.data = NULL;
+    entry->header_len  = ctx->header_len;
+    entry->stale_error = 0;
 
-    entry->path.data   = ctx->req.path.data;
-    entry->path.len    = ctx->req.path.len;
-    ctx->req.path.data = NULL;
+    /* the data holds a copy of the validators, the entry owns them only
+     * if there is none */
+    if(data) {
+        entry->etag          = data->etag;
+        entry->last_modified = data->last_modified;
+    } else {
+        entry->etag                 = ctx->res.etag;
+        entry->last_modified        = ctx->res.last_modified;
+        ctx->res.etag.data          = NULL;
+        ctx->res.last_modified.data = NULL;
+    }
 
-    entry->etag.data   = ctx->res.etag.data;
-    entry->etag.len    = ctx->res.etag.len;
-    ctx->res.etag.data = NULL;
+    /* publish it once initialized, lock free readers can see it */
+    nst_dict_insert(dict, ctx->hash, entry);
 
-    entry->last_modified.data   = ctx->res.last_modified.data;
-    entry->last_modified.len    = ctx->res.last_modified.len;
-    ctx->res.last_modified.data = NULL;
+    /* inserts help the housekeeping to finish rehashing */
+    if(_nst_cache_dict_rehashing(shard)) {
+        _nst_cache_dict_rehash_step(shard, 1);
+    }
 
     return entry;
 }
 
 /*
- * Get entry
+ * Get entry, the caller must hold the lock of nst_cache_dict_shard(hash)
  */
 struct nst_cache_entry *nst_cache_dict_get(struct buffer *key, uint64_t hash) {
-    int i, idx;
-    struct nst_cache_entry *entry = NULL;
+    struct nst_cache_dict_shard *shard = nst_cache_dict_shard(hash);
+    struct nst_cache_entry      *entry = NULL;
+    struct nst_cache_entry      *stale = NULL;
+    int i;
 
-    if(nuster.cache->dict[0].used + nuster.cache->dict[1].used == 0) {
+    if(shard->dict[0].used + shard->dict[1].used == 0) {
         return NULL;
     }
 
     for(i = 0; i <= 1; i++) {
-        idx   = hash % nuster.cache->dict[i].size;
-        entry = nuster.cache->dict[i].entry[idx];
+        struct nst_dict_probe probe;
 
-        while(entry) {
+        nst_dict_probe_init(&shard->dict[i], hash, &probe);
 
-            if(entry->hash == hash
-                    && entry->key->data == key->data
-                    && !memcmp(entry->key->area, key->area, key->data)) {
+        while((entry = nst_dict_probe_next(&shard->dict[i], hash, &probe))) {
 
-                /* check expire
-                 * change state only, leave the free stuff to cleanup
-                 * */
-                if(entry->state == NST_CACHE_ENTRY_STATE_VALID
-                        && nst_cache_entry_expired(entry)) {
+            if(entry->key->data != key->data
+                    || memcmp(entry->key->area, key->area, key->data)) {
 
-                    entry->state         = NST_CACHE_ENTRY_STATE_EXPIRED;
-                    entry->data->invalid = 1;
-                    entry->data          = NULL;
-                    entry->expire        = 0;
+                continue;
+            }
 
-                    return NULL;
-                }
+            /* an invalid entry may be followed by the one replacing it */
+            if(entry->state == NST_CACHE_ENTRY_STATE_INVALID
+                    || entry->state == NST_CACHE_ENTRY_STATE_EXPIRED) {
 
-                return entry;
+                stale = entry;
+                continue;
+            }
+
+            /* check expire
+             * change state only, leave the free stuff to cleanup
+             * a stale entry is kept to be served while refreshed
+             * */
+            if(entry->state == NST_CACHE_ENTRY_STATE_VALID
+                    && nst_cache_entry_expired(entry)
+                    && !nst_cache_entry_stale(entry)) {
+
+                entry->state  = NST_CACHE_ENTRY_STATE_EXPIRED;
+                entry->expire = 0;
+
+                nst_cache_entry_drop_data(entry);
+
+                return NULL;
             }
 
-            entry = entry->next;
+            return entry;
         }
 
-        if(!_nst_cache_dict_rehashing()) {
-            return NULL;
+        if(!_nst_cache_dict_rehashing(shard)) {
+            break;
         }
 
     }
 
+    return stale;
+}
+
+/*
+ * Lock free lookup, the caller must have entered nuster.cache->epoch, which
+ * keeps the groups and the entry from being freed until it leaves.
+ * Entries being moved by rehashing or concurrently replaced can be missed,
+ * the caller falls back to nst_cache_dict_get then.
+ */
+struct nst_cache_entry *nst_cache_dict_lookup(struct buffer *key,
+        uint64_t hash) {
+
+    struct nst_cache_dict_shard *shard = nst_cache_dict_shard(hash);
+    struct nst_cache_entry      *entry = NULL;
+    struct nst_dict              dict[2];
+    unsigned int seq;
+    int i;
+
+    seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+
+    if(seq & 1) {
+        return NULL;
+    }
+
+    dict[0] = shard->dict[0];
+    dict[1] = shard->dict[1];
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if(seq != __atomic_load_n(&shard->seq, __ATOMIC_RELAXED)) {
+        return NULL;
+    }
+
+    for(i = 0; i <= 1 && dict[i].segment; i++) {
+        struct nst_dict_probe probe;
+
+        nst_dict_probe_init(&dict[i], hash, &probe);
+
+        while((entry = nst_dict_probe_next(&dict[i], hash, &probe))) {
+
+            if(entry->key->data == key->data
+                    && !memcmp(entry->key->area, key->area, key->data)) {
+
+                return entry;
+            }
+        }
+    }
+
     return NULL;
 }
 
+/*
+ * Make the entry of ctx->key a vary root recording names, either a new one
+ * or the one cached before the responses started to vary, whose data is
+ * dropped. A new id is given each time, the variants of the previous one
+ * are no longer found and expire. The names it recorded before are set to
+ * old, to be freed by nst_cache_dict_vary_free.
+ * The caller must hold the lock of nst_cache_dict_shard(ctx->hash)
+ */
+int nst_cache_dict_set_vary(struct nst_cache_ctx *ctx, char *names, int len,
+        struct nst_cache_vary **old) {
+
+    struct nst_cache_entry *entry = nst_cache_dict_get(ctx->key, ctx->hash);
+    struct nst_cache_vary  *vary  = NULL;
+
+    if(entry) {
+
+        /* being created, the next responses record it */
+        if(entry->state == NST_CACHE_ENTRY_STATE_CREATING
+                || entry->state == NST_CACHE_ENTRY_STATE_REFRESH) {
+
+            return NST_ERR;
+        }
+
+        /* recorded meanwhile */
+        if(entry->state == NST_CACHE_ENTRY_STATE_VALID && entry->vary
+                && entry->vary->len == len
+                && !memcmp(entry->vary->names, names, len)) {
+
+            return NST_OK;
+        }
+    }
+
+    vary = nst_cache_memory_alloc(sizeof(*vary) + len);
+
+    if(!vary) {
+        return NST_ERR;
+    }
+
+    if(!entry) {
+        entry = nst_cache_dict_set(ctx);
+
+        if(!entry) {
+            nst_cache_memory_free(vary);
+            return NST_ERR;
+        }
+    }
+
+    vary->id  = __atomic_add_fetch(&nuster.cache->vary_id, 1, __ATOMIC_RELAXED);
+    vary->len = len;
+    memcpy(vary->names, names, len);
+
+    /* the old data is left to the data cleanup */
+    nst_cache_entry_drop_data(entry);
+
+    *old = entry->vary;
+
+    entry->expire      = 0;
+    entry->stale       = 0;
+    entry->stale_error = 0;
+    entry->failed      = 0;
+
+    __atomic_store_n(&entry->vary, vary, __ATOMIC_RELEASE);
+    __atomic_store_n(&entry->state, NST_CACHE_ENTRY_STATE_VALID,
+            __ATOMIC_RELEASE);
+
+    return NST_OK;
+}
+
+/*
+ * Free the names a vary root no longer links to once no lock free reader
+ * copies them, without any lock held
+ */
+void nst_cache_dict_vary_free(struct nst_cache_vary *vary) {
+
+    if(vary) {
+        nst_epoch_synchronize(&nuster.cache->epoch);
+        nst_cache_memory_free(vary);
+    }
+}
+
 int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
         struct nst_str *host, struct nst_str *path) {
 
-    struct nst_cache_dict  *dict  = NULL;
-    struct nst_cache_entry *entry = NULL;
-    int idx;
+    struct nst_cache_dict_shard *shard;
+    struct nst_dict             *dict  = NULL;
+    struct nst_cache_entry      *entry = NULL;
     uint64_t hash = nst_persist_meta_get_hash(meta);
 
-    dict = _nst_cache_dict_rehashing()
-        ? &nuster.cache->dict[1] : &nuster.cache->dict[0];
+    shard = nst_cache_dict_shard(hash);
+    dict  = _nst_cache_dict_rehashing(shard) ? &shard->dict[1] : &shard->dict[0];
+
+    /* no free slot left, wait for the housekeeping to grow the dict */
+    if(dict->used == nst_dict_capacity(dict)) {
+        return NST_ERR;
+    }
 
     entry = nst_cache_memory_alloc(sizeof(*entry));
 
@@ -358,12 +842,6 @@ int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
         return NST_ERR;
     }
 
-    idx = hash % dict->size;
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
-
     /* init entry */
     entry->state  = NST_CACHE_ENTRY_STATE_INVALID;
     entry->key    = key;
@@ -371,6 +849,8 @@ int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
     entry->expire = nst_persist_meta_get_expire(meta);
     memcpy(entry->file, file, strlen(file));
 
+    nst_evict_init(&entry->access);
+
     entry->header_len = nst_persist_meta_get_header_len(meta);
 
     entry->host.data  = host->data;
@@ -379,6 +859,8 @@ int nst_cache_dict_set_from_disk(char *file, char *meta, struct buffer *key,
     entry->path.data  = path->data;
     entry->path.len   = path->len;
 
+    nst_dict_insert(dict, hash, entry);
+
     return NST_OK;
 }
 
@@ -10,7 +10,11 @@
  *
  */
 
+#include <sys/uio.h>
+
+#include <proto/applet.h>
 #include <proto/log.h>
+#include <proto/pipe.h>
 #include <proto/proto_http.h>
 #include <proto/raw_sock.h>
 #include <proto/stream_interface.h>
@@ -22,6 +26,10 @@
 #include <types/ssl_sock.h>
 #endif
 
+#if defined(USE_ZLIB)
+#include <zlib.h>
+#endif
+
 #include <nuster/memory.h>
 #include <nuster/shctx.h>
 #include <nuster/nuster.h>
@@ -29,1103 +37,4061 @@
 #include <nuster/persist.h>
 
 /*
- * The cache applet acts like the backend to send cached http data
+ * The extents of a data being created are appended by another request,
+ * the bytes are written before len and an extent before it is linked
  */
-static void nst_cache_engine_handler(struct appctx *appctx) {
-    struct nst_cache_element *element = NULL;
-    struct stream_interface *si       = appctx->owner;
-    struct channel *res               = si_ic(si);
-    /* struct stream *s                  = si_strm(si); */
-    int ret;
-
-    if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
-        appctx->ctx.nuster.cache_engine.data->clients--;
-        return;
-    }
+static inline int _nst_cache_element_len(struct nst_cache_element *element) {
+    return __atomic_load_n(&element->len, __ATOMIC_ACQUIRE);
+}
 
-    /* Check if the input buffer is avalaible. */
-    if(res->buf.size == 0) {
-        si_rx_room_blk(si);
-        return;
-    }
+static inline struct nst_cache_element *_nst_cache_element_next(
+        struct nst_cache_element *element) {
 
-    /* check that the output is not closed */
-    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
-        appctx->ctx.nuster.cache_engine.element = NULL;
-    }
+    return __atomic_load_n(&element->next, __ATOMIC_ACQUIRE);
+}
 
-    if(appctx->ctx.nuster.cache_engine.element) {
-        /*
-        if(appctx->ctx.nuster.cache_engine.element
-        == appctx->ctx.nuster.cache_engine.data->element) {
-            s->res.analysers = 0;
-            s->res.analysers |= (AN_RES_WAIT_HTTP | AN_RES_HTTP_PROCESS_BE
-            | AN_RES_HTTP_XFER_BODY);
-        }
-        */
-        element = appctx->ctx.nuster.cache_engine.element;
+#if defined(USE_ZLIB)
+/*
+ * With compress gzip the body is compressed once as it is cached and stored
+ * chunked, with chunk sizes of NST_CACHE_GZIP_FRAME bytes, so that it is
+ * sent as is to the clients accepting gzip. It is decompressed for the
+ * others by the applet, which parses these chunks.
+ */
+#define NST_CACHE_GZIP_FRAME    10      /* "%08x\r\n" */
+#define NST_CACHE_GZIP_ROOM     32      /* output chunk size and CRLF */
+
+enum {
+    /* compressing the chunked or identity response */
+    NST_CACHE_GZIP_HEADER = 0,
+    NST_CACHE_GZIP_SIZE,
+    NST_CACHE_GZIP_EXT,
+    NST_CACHE_GZIP_DATA,
+    NST_CACHE_GZIP_CRLF,
+    NST_CACHE_GZIP_TRAILERS,
+    NST_CACHE_GZIP_IDENTITY,
+
+    /* decompressing the cached body */
+    NST_CACHE_GZIP_FRAMED,
+    NST_CACHE_GZIP_TAIL,
+    NST_CACHE_GZIP_END,
+};
+
+struct nst_cache_gzip {
+    z_stream    z;
+    int         inflate;
+    int         state;
+    uint64_t    left;       /* bytes of the chunk */
+    int         chunked;    /* decompressed output */
+};
+#endif
 
-        ret = ci_putblk(res, element->msg.data, element->msg.len);
+/*
+ * A Range request served from a complete cached 200 response. The parts are
+ * sent in turn after a 206 header built from the cached one, as a
+ * multipart/byteranges body if there are several.
+ */
+#define NST_CACHE_RANGE_MAX       16
+#define NST_CACHE_RANGE_TYPE      128
+#define NST_CACHE_RANGE_PART_SIZE 256    /* delimiter and headers of a part */
+
+enum {
+    NST_CACHE_RANGE_HEADER = 0,
+    NST_CACHE_RANGE_PART,
+    NST_CACHE_RANGE_DATA,
+    NST_CACHE_RANGE_DONE,
+};
+
+struct nst_cache_range {
+    int         state;
+    int         count;
+    int         idx;        /* part being sent */
+    uint64_t    body;       /* offset of the body in the stored object */
+    uint64_t    start;      /* first byte of the stored body, 206 slice */
+    uint64_t    end;        /* last one */
+    uint64_t    size;       /* complete length */
+    uint64_t    pos;        /* next byte to send, in the stored object */
+    uint64_t    left;       /* bytes of the part */
+
+    struct {
+        uint64_t    first;
+        uint64_t    last;
+    } part[NST_CACHE_RANGE_MAX];
+
+    char        boundary[17];
+    char        type[NST_CACHE_RANGE_TYPE];
+    int         type_len;
+
+    int         header_len;
+    char        header[0];  /* 206 header block */
+};
 
-        if(ret >= 0) {
-            appctx->ctx.nuster.cache_engine.element = element->next;
-        } else if(ret == -2) {
-            appctx->ctx.nuster.cache_engine.data->clients--;
-            si_shutr(si);
-            res->flags |= CF_READ_NULL;
-        }
+/*
+ * Copy the header block src to dst without the headers named in drop, a
+ * NULL terminated list, adding the lines of add at the end
+ */
+static int _nst_cache_header_rewrite(char *src, int len, struct buffer *dst,
+        const char **drop, const char *add) {
 
-    } else {
-        co_skip(si_oc(si), co_data(si_oc(si)));
-        si_shutr(si);
-        res->flags |= CF_READ_NULL;
-        appctx->ctx.nuster.cache_engine.data->clients--;
-    }
+    char *end = src + len;
+    char *p   = src;
+    int skip  = 0;
+    int n;
 
-}
+    dst->data = 0;
 
-/*
- * The cache disk applet acts like the backend to send cached http data
- */
-static void nst_cache_disk_engine_handler(struct appctx *appctx) {
-    struct stream_interface *si = appctx->owner;
-    struct channel *res         = si_ic(si);
+    while(p < end) {
+        char *line = p;
+        const char **name;
 
-    int ret;
-    int max = b_room(&res->buf) - global.tune.maxrewrite;
+        while(p < end && *p++ != '\n') {}
 
-    int fd = appctx->ctx.nuster.cache_disk_engine.fd;
-    int header_len = appctx->ctx.nuster.cache_disk_engine.header_len;
-    uint64_t offset = appctx->ctx.nuster.cache_disk_engine.offset;
+        n = p - line;
 
-    if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
-        return;
-    }
+        /* the empty line closing the block */
+        if(line != src && (*line == '\r' || *line == '\n')) {
+            int add_len = strlen(add);
 
-    /* Check if the input buffer is avalaible. */
-    if(res->buf.size == 0) {
-        si_rx_room_blk(si);
-        return;
-    }
+            if(dst->data + add_len + n > dst->size) {
+                return NST_ERR;
+            }
 
-    if(b_data(&res->buf) != 0) {
-        return;
-    }
+            memcpy(dst->area + dst->data, add, add_len);
+            dst->data += add_len;
+            memcpy(dst->area + dst->data, line, n);
+            dst->data += n;
 
-    /* check that the output is not closed */
-    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
-        appctx->st0 = NST_PERSIST_APPLET_DONE;
-    }
+            return NST_OK;
+        }
 
-    switch(appctx->st0) {
-        case NST_PERSIST_APPLET_HEADER:
-            ret = pread(fd, res->buf.area, header_len, offset);
+        /* continuation of a dropped header */
+        if(skip && (*line == ' ' || *line == '\t')) {
+            continue;
+        }
 
-            if(ret != header_len) {
-                appctx->st0 = NST_PERSIST_APPLET_ERROR;
-                break;
-            }
+        skip = 0;
 
-            ret = nst_ci_send(res, ret);
+        for(name = drop; line != src && *name; name++) {
+            int name_len = strlen(*name);
 
-            if(ret >= 0) {
-                appctx->st0 = NST_PERSIST_APPLET_PAYLOAD;
-                appctx->ctx.nuster.cache_disk_engine.offset += ret;
-            } else if(ret == -2) {
-                appctx->st0 = NST_PERSIST_APPLET_ERROR;
-                si_shutr(si);
-                res->flags |= CF_READ_NULL;
-            }
-            break;
-        case NST_PERSIST_APPLET_PAYLOAD:
-            ret = pread(fd, res->buf.area, max, offset);
+            if(n > name_len && line[name_len] == ':'
+                    && !strncasecmp(line, *name, name_len)) {
 
-            if(ret == -1) {
-                appctx->st0 = NST_PERSIST_APPLET_ERROR;
+                skip = 1;
                 break;
             }
+        }
 
-            if(ret > 0) {
-                ret = nst_ci_send(res, ret);
+        if(skip) {
+            continue;
+        }
 
-                if(ret >= 0) {
-                    appctx->st0 = NST_PERSIST_APPLET_PAYLOAD;
-                    appctx->ctx.nuster.cache_disk_engine.offset += ret;
-                } else if(ret == -2) {
-                    appctx->st0 = NST_PERSIST_APPLET_ERROR;
-                    si_shutr(si);
-                    res->flags |= CF_READ_NULL;
-                }
-                break;
-            }
+        if(dst->data + n > dst->size) {
+            return NST_ERR;
+        }
 
-            close(fd);
-            appctx->st0 = NST_PERSIST_APPLET_DONE;
-        case NST_PERSIST_APPLET_DONE:
-            co_skip(si_oc(si), co_data(si_oc(si)));
-            si_shutr(si);
-            res->flags |= CF_READ_NULL;
-            break;
-        case NST_PERSIST_APPLET_ERROR:
-            si_shutr(si);
-            res->flags |= CF_READ_NULL;
-            close(fd);
-            break;
+        memcpy(dst->area + dst->data, line, n);
+        dst->data += n;
     }
 
+    return NST_ERR;
 }
 
 /*
- * Cache the keys which calculated in request for response use
+ * The value of the first header named name in the header block src, NULL if
+ * there is none
  */
-struct nst_rule_stash *nst_cache_stash_rule(struct nst_cache_ctx *ctx,
-        struct nst_rule *rule) {
+static char *_nst_cache_header_value(char *src, int len, const char *name,
+        int *vlen) {
 
-    struct nst_rule_stash *stash = pool_alloc(global.nuster.cache.pool.stash);
+    char *end    = src + len;
+    char *p      = src;
+    int name_len = strlen(name);
 
-    if(stash) {
-        stash->rule = rule;
-        stash->key  = ctx->key;
-        stash->hash = ctx->hash;
+    /* skip the status line */
+    while(p < end && *p++ != '\n') {}
 
-        if(ctx->stash) {
-            stash->next = ctx->stash;
-        } else {
-            stash->next = NULL;
+    while(p < end) {
+        char *line = p;
+        char *v, *e;
+
+        while(p < end && *p++ != '\n') {}
+
+        if(p - line <= name_len || line[name_len] != ':'
+                || strncasecmp(line, name, name_len)) {
+
+            continue;
         }
 
-        ctx->stash = stash;
-    }
+        v = line + name_len + 1;
+        e = p;
 
-    return stash;
-}
+        while(v < e && (*v == ' ' || *v == '\t')) {
+            v++;
+        }
 
-int nst_cache_check_uri(struct http_msg *msg) {
-    const char *uri = ci_head(msg->chn) + msg->sl.rq.u;
+        while(e > v && (e[-1] == '\r' || e[-1] == '\n' || e[-1] == ' '
+                    || e[-1] == '\t')) {
 
-    if(!global.nuster.cache.uri) {
-        return NST_ERR;
-    }
+            e--;
+        }
 
-    if(strlen(global.nuster.cache.uri) != msg->sl.rq.u_l) {
-        return NST_ERR;
-    }
+        *vlen = e - v;
 
-    if(memcmp(uri, global.nuster.cache.uri, msg->sl.rq.u_l) != 0) {
-        return NST_ERR;
+        return v;
     }
 
-    return NST_OK;
+    return NULL;
 }
 
-/*
- * create a new nst_cache_data and insert it to cache->data list
- */
-struct nst_cache_data *nst_cache_data_new() {
-
-    struct nst_cache_data *data = nst_cache_memory_alloc(sizeof(*data));
+static int _nst_cache_range_number(char **p, char *end, uint64_t *n) {
+    char *start = *p;
 
-    nst_shctx_lock(nuster.cache);
+    *n = 0;
 
-    if(data) {
-        data->clients  = 0;
-        data->invalid  = 0;
-        data->element  = NULL;
-
-        if(nuster.cache->data_head == NULL) {
-            nuster.cache->data_head = data;
-            nuster.cache->data_tail = data;
-            data->next              = data;
-        } else {
+    while(*p < end && isdigit((unsigned char)**p)) {
 
-            if(nuster.cache->data_head == nuster.cache->data_tail) {
-                nuster.cache->data_head->next = data;
-                data->next                    = nuster.cache->data_head;
-                nuster.cache->data_tail       = data;
-            } else {
-                data->next                    = nuster.cache->data_head;
-                nuster.cache->data_tail->next = data;
-                nuster.cache->data_tail       = data;
-            }
+        if(*n > (UINT64_MAX - 9) / 10) {
+            return NST_ERR;
         }
-    }
 
-    nst_shctx_unlock(nuster.cache);
+        *n = *n * 10 + (**p - '0');
+        (*p)++;
+    }
 
-    return data;
+    return *p == start ? NST_ERR : NST_OK;
 }
 
 /*
- * Append partial http response data
+ * Parse the byte ranges of a Range header for a body of range->size bytes.
+ * Return the number of satisfiable ones, -1 if the header is to be ignored:
+ * another unit, a syntax error or too many ranges.
  */
-static struct nst_cache_element *_nst_cache_data_append(struct http_msg *msg,
-        long msg_len) {
-
-    struct nst_cache_element *element =
-        nst_cache_memory_alloc(sizeof(*element));
+static int _nst_cache_range_parse(struct nst_cache_range *range, char *p,
+        int len) {
 
-    if(element) {
-        char *data = b_orig(&msg->chn->buf);
-        char *p    = ci_head(msg->chn);
-        int size   = msg->chn->buf.size;
+    char *end = p + len;
+    uint64_t first, last;
 
-        char *msg_data = nst_cache_memory_alloc(msg_len);
+    range->count = 0;
 
-        if(!msg_data) {
-            nst_cache_memory_free(element);
-            return NULL;
-        }
+    if(len < 6 || strncasecmp(p, "bytes", 5)) {
+        return -1;
+    }
 
-        if(p - data + msg_len > size) {
-            int right = data + size - p;
-            int left  = msg_len - right;
-            memcpy(msg_data, p, right);
-            memcpy(msg_data + right, data, left);
-        } else {
-            memcpy(msg_data, p, msg_len);
-        }
+    for(p += 5; p < end && (*p == ' ' || *p == '\t'); p++) {}
 
-        element->msg.data = msg_data;
-        element->msg.len  = msg_len;
-        element->next     = NULL;
-        nst_cache_stats_update_used_mem(msg_len);
+    if(p == end || *p++ != '=') {
+        return -1;
     }
 
-    return element;
-}
+    while(p < end) {
+        int suffix = 0;
 
+        while(p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+            p++;
+        }
 
-static int _nst_cache_data_invalid(struct nst_cache_data *data) {
+        if(p == end) {
+            break;
+        }
 
-    if(data->invalid) {
+        if(*p == '-') {
+            suffix = 1;
+        } else if(_nst_cache_range_number(&p, end, &first) != NST_OK) {
+            return -1;
+        }
 
-        if(!data->clients) {
-            return 1;
+        if(p == end || *p++ != '-') {
+            return -1;
         }
-    }
 
-    return 0;
-}
+        if(p < end && isdigit((unsigned char)*p)) {
 
-/*
- * free invalid nst_cache_data
- */
-static void _nst_cache_data_cleanup() {
-    struct nst_cache_data *data = NULL;
+            if(_nst_cache_range_number(&p, end, &last) != NST_OK) {
+                return -1;
+            }
 
-    if(nuster.cache->data_head) {
+            if(suffix) {
+
+                /* the last bytes */
+                if(last > range->size) {
+                    last = range->size;
+                }
 
-        if(nuster.cache->data_head == nuster.cache->data_tail) {
+                first = range->size - last;
+                last  = range->size - 1;
 
-            if(_nst_cache_data_invalid(nuster.cache->data_head)) {
-                data                    = nuster.cache->data_head;
-                nuster.cache->data_head = NULL;
-                nuster.cache->data_tail = NULL;
+                if(first > last) {
+                    continue;
+                }
+            } else if(last < first) {
+                return -1;
             }
 
+        } else if(suffix) {
+            return -1;
         } else {
+            last = UINT64_MAX;
+        }
 
-            if(_nst_cache_data_invalid(nuster.cache->data_head)) {
-                data                          = nuster.cache->data_head;
-                nuster.cache->data_tail->next = nuster.cache->data_head->next;
-                nuster.cache->data_head       = nuster.cache->data_head->next;
-            } else {
-                nuster.cache->data_tail = nuster.cache->data_head;
-                nuster.cache->data_head = nuster.cache->data_head->next;
-            }
+        while(p < end && (*p == ' ' || *p == '\t')) {
+            p++;
+        }
+
+        if(p < end && *p != ',') {
+            return -1;
+        }
+
+        /* unsatisfiable */
+        if(first >= range->size) {
+            continue;
+        }
 
+        if(range->count == NST_CACHE_RANGE_MAX) {
+            return -1;
         }
 
+        range->part[range->count].first = first;
+        range->part[range->count].last  = last >= range->size
+            ? range->size - 1 : last;
+
+        range->count++;
     }
 
-    if(data) {
-        struct nst_cache_element *element = data->element;
+    return range->count;
+}
 
-        while(element) {
-            struct nst_cache_element *tmp = element;
-            element                       = element->next;
+/*
+ * The delimiter and headers of part i of a multipart/byteranges body, or
+ * its closing delimiter if i is the number of parts
+ */
+static int _nst_cache_range_part(struct nst_cache_range *range, int i,
+        char *dst) {
 
-            if(tmp->msg.data) {
-                nst_cache_stats_update_used_mem(-tmp->msg.len);
-                nst_cache_memory_free(tmp->msg.data);
-            }
+    int n;
 
-            nst_cache_memory_free(tmp);
-        }
+    if(i == range->count) {
+        return sprintf(dst, "\r\n--%s--\r\n", range->boundary);
+    }
 
-        nst_cache_memory_free(data);
+    n = sprintf(dst, "\r\n--%s\r\n", range->boundary);
+
+    if(range->type_len) {
+        n += sprintf(dst + n, "Content-Type: %.*s\r\n", range->type_len,
+                range->type);
     }
-}
 
-void nst_cache_housekeeping() {
+    n += sprintf(dst + n, "Content-Range: bytes %"PRIu64"-%"PRIu64"/%"PRIu64
+            "\r\n\r\n", range->part[i].first, range->part[i].last,
+            range->size);
 
-    if(global.nuster.cache.status == NST_STATUS_ON && master == 1) {
+    return n;
+}
 
-        int dict_cleaner = global.nuster.cache.dict_cleaner;
-        int data_cleaner = global.nuster.cache.data_cleaner;
-        int disk_cleaner = global.nuster.cache.disk_cleaner;
-        int disk_loader  = global.nuster.cache.disk_loader;
-        int disk_saver   = global.nuster.cache.disk_saver;
+/*
+ * Whether If-Range, if any, matches the validators of the cached header
+ * block: a strong ETag or the Last-Modified date
+ */
+static int _nst_cache_range_if(struct stream *s, char *src, int len) {
+    struct nst_http_hdr hdr;
+    char *v;
+    int vlen;
 
-        while(dict_cleaner--) {
-            nst_cache_dict_rehash();
-            nst_shctx_lock(&nuster.cache->dict[0]);
-            nst_cache_dict_cleanup();
-            nst_shctx_unlock(&nuster.cache->dict[0]);
-        }
+    nst_http_hdr_init(&hdr);
 
-        while(data_cleaner--) {
-            nst_shctx_lock(nuster.cache);
-            _nst_cache_data_cleanup();
-            nst_shctx_unlock(nuster.cache);
-        }
+    if(!nst_http_find_header(s, &s->txn->req, "If-Range", 8, &hdr, 1)) {
+        return 1;
+    }
 
-        while(disk_cleaner--) {
-            nst_cache_persist_cleanup();
-        }
+    if(hdr.len > 0 && (hdr.value[0] == '"' || hdr.value[0] == 'W')) {
 
-        while(disk_loader--) {
-            nst_cache_persist_load();
-        }
+        v = _nst_cache_header_value(src, len, "ETag", &vlen);
 
-        while(disk_saver--) {
-            nst_shctx_lock(&nuster.cache->dict[0]);
-            nst_cache_persist_async();
-            nst_shctx_unlock(&nuster.cache->dict[0]);
+        /* weak validators cannot be used */
+        if(!v || *v != '"') {
+            return 0;
         }
-
+    } else {
+        v = _nst_cache_header_value(src, len, "Last-Modified", &vlen);
     }
+
+    return v && vlen == hdr.len && !memcmp(v, hdr.value, vlen);
 }
 
-void nst_cache_init() {
+/*
+ * Parse the "bytes first-last/size" of a Content-Range
+ */
+static int _nst_cache_content_range(char *p, int len, uint64_t *first,
+        uint64_t *last, uint64_t *size) {
 
-    nuster.applet.cache_engine.fct = nst_cache_engine_handler;
-    nuster.applet.cache_disk_engine.fct = nst_cache_disk_engine_handler;
+    char *end = p + len;
 
-    if(global.nuster.cache.status == NST_STATUS_ON) {
+    if(len < 6 || strncasecmp(p, "bytes ", 6)) {
+        return NST_ERR;
+    }
 
-        if(global.nuster.cache.share == NST_STATUS_UNDEFINED) {
+    p += 6;
 
-            if(global.nbproc == 1) {
-                global.nuster.cache.share = NST_STATUS_OFF;
-            } else {
-                global.nuster.cache.share = NST_STATUS_ON;
-            }
-        }
+    if(_nst_cache_range_number(&p, end, first) != NST_OK
+            || p == end || *p++ != '-'
+            || _nst_cache_range_number(&p, end, last) != NST_OK
+            || p == end || *p++ != '/'
+            || _nst_cache_range_number(&p, end, size) != NST_OK
+            || p != end || *first > *last || *last >= *size) {
 
-        if(global.nuster.cache.root) {
+        return NST_ERR;
+    }
 
-            if(nst_persist_mkdir(global.nuster.cache.root) == NST_ERR) {
+    return NST_OK;
+}
 
-                ha_alert("Create `%s` failed\n", global.nuster.cache.root);
-                exit(1);
-            }
-        }
+/*
+ * Whether the request is a GET with a Range header, found in hdr
+ */
+static int _nst_cache_range_find(struct stream *s, struct nst_http_hdr *hdr) {
 
-        global.nuster.cache.pool.stash = create_pool("cp.stash",
-                sizeof(struct nst_rule_stash), MEM_F_SHARED);
+    if(s->txn->meth != HTTP_METH_GET) {
+        return 0;
+    }
 
-        global.nuster.cache.pool.ctx   = create_pool("cp.ctx",
-                sizeof(struct nst_cache_ctx), MEM_F_SHARED);
+    nst_http_hdr_init(hdr);
 
-        if(global.nuster.cache.share) {
-            global.nuster.cache.memory = nst_memory_create("cache.shm",
-                    global.nuster.cache.dict_size
-                    + global.nuster.cache.data_size, global.tune.bufsize,
-                    NST_CACHE_DEFAULT_CHUNK_SIZE);
+    return nst_http_find_header(s, &s->txn->req, "Range", 5, hdr, 1);
+}
 
-            if(!global.nuster.cache.memory) {
-                goto shm_err;
-            }
+/*
+ * Check the Range header hdr of the request against the cached header block
+ * src of a complete response of total bytes. Return the parts to send after
+ * a 206 header, no part after a 416 one if none is satisfiable, or NULL to
+ * send the whole response. Only identity 200 responses, and 206 ones of a
+ * single range like slices, whose Content-Length matches what is stored are
+ * served partially. The ranges must then start within the stored one.
+ */
+static struct nst_cache_range *_nst_cache_range_new(struct stream *s,
+        struct nst_http_hdr *hdr, char *src, int len, uint64_t total) {
 
-            if(nst_shctx_init(global.nuster.cache.memory) != NST_OK) {
-                goto shm_err;
-            }
+    static const char *drop[] = { "Content-Length", "Content-Range", NULL };
+    static const char *drop_multi[] = { "Content-Length", "Content-Range",
+        "Content-Type", NULL };
 
-            nuster.cache = nst_cache_memory_alloc(sizeof(struct nst_cache));
+    struct nst_cache_range tmp, *range;
+    struct buffer *out;
+    char part[NST_CACHE_RANGE_PART_SIZE];
+    char add[NST_CACHE_RANGE_PART_SIZE];
+    uint64_t length = 0;
+    char *v, *eol;
+    int vlen, i, n;
 
-        } else {
-            global.nuster.cache.memory = nst_memory_create("cache.shm",
-                    NST_DEFAULT_DATA_SIZE, 0, 0);
+    if(len < 13 || total <= len || (memcmp(src + 8, " 200", 4)
+                && memcmp(src + 8, " 206", 4))) {
 
-            if(!global.nuster.cache.memory) {
-                goto shm_err;
-            }
+        return NULL;
+    }
 
-            if(nst_shctx_init(global.nuster.cache.memory) != NST_OK) {
-                goto shm_err;
-            }
+    tmp.start = 0;
+    tmp.end   = total - len - 1;
+    tmp.size  = total - len;
 
-            global.nuster.cache.pool.data    = create_pool("cp.data",
-                    sizeof(struct nst_cache_data), MEM_F_SHARED);
+    if(src[11] == '6') {
+        v = _nst_cache_header_value(src, len, "Content-Range", &vlen);
 
-            global.nuster.cache.pool.element = create_pool("cp.element",
-                    sizeof(struct nst_cache_element), MEM_F_SHARED);
+        if(!v || _nst_cache_content_range(v, vlen, &tmp.start, &tmp.end,
+                    &tmp.size) != NST_OK
+                || tmp.end - tmp.start != total - len - 1) {
 
-            global.nuster.cache.pool.chunk   = create_pool("cp.chunk",
-                    global.tune.bufsize, MEM_F_SHARED);
+            return NULL;
+        }
+    }
 
-            global.nuster.cache.pool.entry   = create_pool("cp.entry",
-                    sizeof(struct nst_cache_entry), MEM_F_SHARED);
+    v = _nst_cache_header_value(src, len, "Content-Length", &vlen);
 
-            nuster.cache = malloc(sizeof(struct nst_cache));
-        }
+    /* chunked, or not stored till the end */
+    if(!v || strtoull(v, NULL, 10) != total - len
+            || _nst_cache_header_value(src, len, "Transfer-Encoding", &vlen)) {
 
-        if(!nuster.cache) {
-            goto err;
-        }
+        return NULL;
+    }
 
-        memset(nuster.cache, 0, sizeof(*nuster.cache));
+    if(!_nst_cache_range_if(s, src, len)) {
+        return NULL;
+    }
 
-        if(global.nuster.cache.root) {
-            nuster.cache->disk.file = nst_cache_memory_alloc(
-                    nst_persist_path_file_len(global.nuster.cache.root) + 1);
+    n = _nst_cache_range_parse(&tmp, hdr->value, hdr->len);
 
-            if(!nuster.cache->disk.file) {
-                goto err;
-            }
-        }
+    if(n < 0) {
+        return NULL;
+    }
 
-        if(nst_shctx_init(nuster.cache) != NST_OK) {
-            goto shm_err;
-        }
+    out = get_trash_chunk();
 
-        if(nst_cache_dict_init() != NST_OK) {
-            goto err;
+    if(n == 0) {
+        nst_res_begin(out, 416);
+        chunk_appendf(out, "%.*s: bytes */%"PRIu64"\r\n",
+                nst_headers.content_range.len,
+                nst_headers.content_range.data, tmp.size);
+
+        nst_res_header_content_length(out, 0);
+        nst_res_header_end(out);
+
+        goto out;
+    }
+
+    for(i = 0; i < n; i++) {
+
+        if(tmp.part[i].first < tmp.start || tmp.part[i].first > tmp.end) {
+            return NULL;
         }
 
-        if(nst_cache_stats_init() !=NST_OK) {
-            goto err;
+        if(tmp.part[i].last > tmp.end) {
+            tmp.part[i].last = tmp.end;
         }
+    }
 
-        if(!nst_cache_manager_init()) {
-            goto err;
+    tmp.type_len = 0;
+    v = _nst_cache_header_value(src, len, "Content-Type", &vlen);
+
+    if(v && vlen <= NST_CACHE_RANGE_TYPE) {
+        memcpy(tmp.type, v, vlen);
+        tmp.type_len = vlen;
+    } else if(v && n > 1) {
+        return NULL;
+    }
+
+    snprintf(tmp.boundary, sizeof(tmp.boundary), "%08x%08x",
+            (unsigned int)random(), (unsigned int)random());
+
+    for(i = 0; i < n; i++) {
+        length += tmp.part[i].last - tmp.part[i].first + 1;
+    }
+
+    if(n == 1) {
+        snprintf(add, sizeof(add), "%.*s: bytes %"PRIu64"-%"PRIu64"/%"PRIu64
+                "\r\n%.*s: %"PRIu64"\r\n", nst_headers.content_range.len,
+                nst_headers.content_range.data, tmp.part[0].first,
+                tmp.part[0].last, tmp.size, nst_headers.content_length.len,
+                nst_headers.content_length.data, length);
+    } else {
+
+        for(i = 0; i <= n; i++) {
+            length += _nst_cache_range_part(&tmp, i, part);
         }
 
-        nst_debug("[nuster][cache] on, data_size=%llu\n",
-                global.nuster.cache.data_size);
+        snprintf(add, sizeof(add), "%.*s: multipart/byteranges; boundary=%s"
+                "\r\n%.*s: %"PRIu64"\r\n", nst_headers.content_type.len,
+                nst_headers.content_type.data, tmp.boundary,
+                nst_headers.content_length.len,
+                nst_headers.content_length.data, length);
     }
 
-    return;
+    if(_nst_cache_header_rewrite(src, len, out, n > 1 ? drop_multi : drop,
+                add) != NST_OK) {
 
-err:
-    ha_alert("Out of memory when initializing cache.\n");
-    exit(1);
+        return NULL;
+    }
 
-shm_err:
-    ha_alert("Error when initializing cache.\n");
-    exit(1);
+    /* the status line, keeping the version */
+    eol = memchr(out->area, '\n', out->data);
+    i   = eol - out->area + 1;
+    n   = 8 + strlen(" 206 Partial Content\r\n");
+
+    if(out->data - i + n > out->size) {
+        return NULL;
+    }
+
+    memmove(out->area + n, out->area + i, out->data - i);
+    memcpy(out->area + 8, " 206 Partial Content\r\n", n - 8);
+    out->data += n - i;
+
+out:
+    range = calloc(1, sizeof(*range) + out->data);
+
+    if(!range) {
+        return NULL;
+    }
+
+    memcpy(range, &tmp, sizeof(tmp));
+    memcpy(range->header, out->area, out->data);
+
+    range->state      = NST_CACHE_RANGE_HEADER;
+    range->idx        = 0;
+    range->body       = len;
+    range->header_len = out->data;
+
+    return range;
 }
 
-int nst_cache_prebuild_key(struct nst_cache_ctx *ctx, struct stream *s,
-        struct http_msg *msg) {
+/*
+ * Whether the applet has sent all the bytes appended so far
+ */
+static int _nst_cache_engine_at_end(struct appctx *appctx) {
+    struct nst_cache_element *element = appctx->ctx.nuster.cache_engine.element;
 
-    struct http_txn *txn = s->txn;
+    return !element
+        || (appctx->ctx.nuster.cache_engine.offset
+                == _nst_cache_element_len(element)
+            && !_nst_cache_element_next(element));
+}
 
-    char *uri_begin, *uri_end;
-    struct hdr_ctx hdr;
+/*
+ * The rest of the body can be passed through a pipe spliced to the client
+ * if the backend asked for it with splice on, the analysers let it be
+ * forwarded as is, splicing is enabled for the response and supported by
+ * the client connection
+ */
+static int _nst_cache_engine_can_splice(struct stream *s,
+        struct channel *res) {
 
-    ctx->req.scheme = SCH_HTTP;
+    struct connection *conn = cs_conn(objt_cs(s->si[0].end));
 
-#ifdef USE_OPENSSL
-    if(s->sess->listener->bind_conf->is_ssl) {
-        ctx->req.scheme = SCH_HTTPS;
+    if(!s->be->nuster.splice || !(global.tune.options & GTUNE_USE_SPLICE)) {
+        return 0;
     }
-#endif
 
-    ctx->req.host.data = NULL;
-    ctx->req.host.len  = 0;
+    if(!((strm_fe(s)->options2 | s->be->options2)
+                & (PR_O2_SPLIC_RTR | PR_O2_SPLIC_AUT))) {
 
-    hdr.idx = 0;
+        return 0;
+    }
 
-    if(http_find_header2("Host", 4, ci_head(msg->chn), &txn->hdr_idx, &hdr)) {
-        ctx->req.host.data = nst_cache_memory_alloc(hdr.vlen);
+    if(res->to_forward < MIN_SPLICE_FORWARD) {
+        return 0;
+    }
 
-        if(!ctx->req.host.data) {
-            return NST_ERR;
+    return conn && conn->xprt && conn->xprt->snd_pipe
+        && conn->mux && conn->mux->snd_pipe;
+}
+
+/*
+ * Copy the extents into the pipe of res until it is full, the pipe is then
+ * spliced to the client without another copy. Return the bytes written, -1
+ * if the pipe cannot be used.
+ */
+static int _nst_cache_engine_splice(struct appctx *appctx,
+        struct channel *res) {
+
+    struct nst_cache_element *element;
+    struct iovec iov[NST_CACHE_SPLICE_IOV];
+    int offset, total = 0;
+
+    if(!res->pipe) {
+        res->pipe = get_pipe();
+
+        if(!res->pipe) {
+            return -1;
         }
 
-        ctx->req.host.len  = hdr.vlen;
-        memcpy(ctx->req.host.data, hdr.line + hdr.val, hdr.vlen);
+        /* never block when the pipe is full */
+        fcntl(res->pipe->prod, F_SETFL, O_NONBLOCK);
     }
 
-    uri_begin = http_txn_get_path(txn);
-    uri_end   = NULL;
+    while(!_nst_cache_engine_at_end(appctx) && res->to_forward) {
+        unsigned int max = res->to_forward;
+        ssize_t ret;
+        int n = 0;
 
-    ctx->req.path.data = NULL;
-    ctx->req.path.len  = 0;
-    ctx->req.uri.data  = NULL;
-    ctx->req.uri.len   = 0;
+        element = appctx->ctx.nuster.cache_engine.element;
+        offset  = appctx->ctx.nuster.cache_engine.offset;
 
-    if(uri_begin) {
-        char *ptr = uri_begin;
-        uri_end   = ci_head(msg->chn) + msg->sl.rq.u + msg->sl.rq.u_l;
+        while(element && n < NST_CACHE_SPLICE_IOV && max) {
+            iov[n].iov_base = element->data + offset;
+            iov[n].iov_len  = _nst_cache_element_len(element) - offset;
 
-        while(ptr < uri_end && *ptr != '?') {
-            ptr++;
+            if(iov[n].iov_len > max) {
+                iov[n].iov_len = max;
+            }
+
+            max    -= iov[n].iov_len;
+            element = _nst_cache_element_next(element);
+            offset  = 0;
+            n++;
         }
 
-        ctx->req.path.len = ptr - uri_begin;
-        ctx->req.uri.data = uri_begin;
-        ctx->req.uri.len  = uri_end - uri_begin;
+        ret = writev(res->pipe->prod, iov, n);
 
-        /* extra 1 char as required by regex_exec_match2 */
-        ctx->req.path.data = nst_cache_memory_alloc(ctx->req.path.len + 1);
+        if(ret <= 0) {
 
-        if(!ctx->req.path.data) {
-            return NST_ERR;
-        }
+            if(ret < 0 && errno != EAGAIN && !total) {
 
-        memcpy(ctx->req.path.data, uri_begin, ctx->req.path.len);
-    }
+                if(!res->pipe->data) {
+                    put_pipe(res->pipe);
+                    res->pipe = NULL;
+                }
 
-    ctx->req.query.data = NULL;
-    ctx->req.query.len  = 0;
-    ctx->req.delimiter  = 0;
+                return -1;
+            }
 
-    if(ctx->req.uri.data) {
-        ctx->req.query.data = memchr(ctx->req.uri.data, '?',
-                uri_end - ctx->req.uri.data);
+            break;
+        }
 
-        if(ctx->req.query.data) {
-            ctx->req.query.data++;
-            ctx->req.query.len = uri_end - ctx->req.query.data;
+        res->pipe->data += ret;
+        res->total      += ret;
+        res->flags      |= CF_READ_PARTIAL;
+        total           += ret;
 
-            if(ctx->req.query.len) {
-                ctx->req.delimiter = 1;
-            }
+        if(res->to_forward != CHN_INFINITE_FORWARD) {
+            res->to_forward -= ret;
         }
-    }
 
-    ctx->req.cookie.data = NULL;
-    ctx->req.cookie.len  = 0;
+        /* advance the position by the bytes written, it stays at the end
+         * of the last extent until the next one is appended */
+        element = appctx->ctx.nuster.cache_engine.element;
+        offset  = appctx->ctx.nuster.cache_engine.offset + ret;
 
-    hdr.idx = 0;
+        while(offset >= _nst_cache_element_len(element)
+                && _nst_cache_element_next(element)) {
+
+            offset -= _nst_cache_element_len(element);
+            element = _nst_cache_element_next(element);
+        }
 
-    if(http_find_header2("Cookie", 6, ci_head(msg->chn), &txn->hdr_idx, &hdr)) {
-        ctx->req.cookie.data = hdr.line + hdr.val;
-        ctx->req.cookie.len  = hdr.vlen;
+        appctx->ctx.nuster.cache_engine.element = element;
+        appctx->ctx.nuster.cache_engine.offset  = offset;
     }
 
-    return NST_OK;
+    return total;
 }
 
-int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
-        struct stream *s, struct http_msg *msg) {
-
-    struct http_txn *txn = s->txn;
-    struct hdr_ctx hdr;
-    struct nst_rule_key *ck = NULL;
+/*
+ * The bytes at the position of the applet in the extents, contiguous
+ */
+static char *_nst_cache_engine_contig(struct appctx *appctx, int *len) {
+    struct nst_cache_element *element = appctx->ctx.nuster.cache_engine.element;
+    int offset = appctx->ctx.nuster.cache_engine.offset;
 
-    ctx->key = nst_cache_key_init();
+    while(offset == _nst_cache_element_len(element)
+            && _nst_cache_element_next(element)) {
 
-    if(!ctx->key) {
-        return NST_ERR;
+        element = _nst_cache_element_next(element);
+        offset  = 0;
     }
 
-    nst_debug("[nuster][cache] Calculate key: ");
+    appctx->ctx.nuster.cache_engine.element = element;
+    appctx->ctx.nuster.cache_engine.offset  = offset;
 
-    while((ck = *pck++)) {
-        int ret = NST_OK;
+    *len = _nst_cache_element_len(element) - offset;
 
-        switch(ck->type) {
-            case NST_RULE_KEY_METHOD:
-                nst_debug("method.");
-                ret = nst_cache_key_append(ctx->key,
-                        http_known_methods[txn->meth].ptr,
-                        http_known_methods[txn->meth].len);
+    return element->data + offset;
+}
 
-                break;
-            case NST_RULE_KEY_SCHEME:
-                nst_debug("scheme.");
-                ret = nst_cache_key_append(ctx->key,
-                        ctx->req.scheme == SCH_HTTPS ? "HTTPS" : "HTTP",
-                        ctx->req.scheme == SCH_HTTPS ? 5 : 4);
+/*
+ * Copy len bytes at the position of the applet without moving it, return
+ * the bytes appended so far if fewer
+ */
+static int _nst_cache_engine_peek(struct appctx *appctx, char *p, int len) {
+    struct nst_cache_element *element = appctx->ctx.nuster.cache_engine.element;
+    int offset = appctx->ctx.nuster.cache_engine.offset;
+    int n      = 0;
 
-                break;
-            case NST_RULE_KEY_HOST:
-                nst_debug("host.");
+    while(n < len) {
+        int l = _nst_cache_element_len(element) - offset;
 
-                if(ctx->req.host.data) {
-                    ret = nst_cache_key_append(ctx->key, ctx->req.host.data,
-                            ctx->req.host.len);
-                } else {
-                    ret = nst_cache_key_advance(ctx->key, 2);
-                }
+        if(l == 0) {
 
+            if(!_nst_cache_element_next(element)) {
                 break;
-            case NST_RULE_KEY_URI:
-                nst_debug("uri.");
+            }
 
-                if(ctx->req.uri.data) {
-                    ret = nst_cache_key_append(ctx->key, ctx->req.uri.data,
-                            ctx->req.uri.len);
+            element = _nst_cache_element_next(element);
+            offset  = 0;
+            continue;
+        }
 
-                } else {
-                    ret = nst_cache_key_advance(ctx->key, 2);
-                }
+        if(l > len - n) {
+            l = len - n;
+        }
 
-                break;
-            case NST_RULE_KEY_PATH:
-                nst_debug("path.");
+        memcpy(p + n, element->data + offset, l);
+        n      += l;
+        offset += l;
+    }
 
-                if(ctx->req.path.data) {
-                    ret = nst_cache_key_append(ctx->key, ctx->req.path.data,
-                            ctx->req.path.len);
+    return n;
+}
 
-                } else {
-                    ret = nst_cache_key_advance(ctx->key, 2);
-                }
+static void _nst_cache_engine_skip(struct appctx *appctx, int len) {
+    struct nst_cache_element *element = appctx->ctx.nuster.cache_engine.element;
+    int offset = appctx->ctx.nuster.cache_engine.offset + len;
 
-                break;
-            case NST_RULE_KEY_DELIMITER:
-                nst_debug("delimiter.");
+    while(offset >= _nst_cache_element_len(element)
+            && _nst_cache_element_next(element)) {
 
-                if(ctx->req.delimiter) {
-                    ret = nst_cache_key_append(ctx->key, "?", 1);
-                } else {
-                    ret = nst_cache_key_advance(ctx->key, 2);
-                }
+        offset -= _nst_cache_element_len(element);
+        element = _nst_cache_element_next(element);
+    }
+
+    appctx->ctx.nuster.cache_engine.element = element;
+    appctx->ctx.nuster.cache_engine.offset  = offset;
+}
+
+/*
+ * Place the applet at pos in the extents of a complete data
+ */
+static void _nst_cache_engine_seek(struct appctx *appctx, uint64_t pos) {
+    struct nst_cache_element *element =
+        appctx->ctx.nuster.cache_engine.data->element;
+
+    while(pos >= _nst_cache_element_len(element)
+            && _nst_cache_element_next(element)) {
+
+        pos    -= _nst_cache_element_len(element);
+        element = _nst_cache_element_next(element);
+    }
+
+    appctx->ctx.nuster.cache_engine.element = element;
+    appctx->ctx.nuster.cache_engine.offset  = pos;
+}
+
+/*
+ * Send the response prepared by _nst_cache_range_new, the parts are taken
+ * from the extents of the cache applet, or read from fd by the disk one.
+ * Return 1 once the applet is done.
+ */
+static int _nst_cache_range_send(struct appctx *appctx,
+        struct nst_cache_range *range, int fd) {
+
+    struct stream_interface *si = appctx->owner;
+    struct channel *res         = si_ic(si);
+    char part[NST_CACHE_RANGE_PART_SIZE];
+    struct buffer *buf;
+    int max, len, ret;
+    char *p;
+
+    while(range->state != NST_CACHE_RANGE_DONE) {
+
+        switch(range->state) {
+            case NST_CACHE_RANGE_HEADER:
+                ret = ci_putblk(res, range->header, range->header_len);
+
+                if(ret < 0) {
+                    goto put;
+                }
+
+                range->state = NST_CACHE_RANGE_PART;
 
                 break;
-            case NST_RULE_KEY_QUERY:
-                nst_debug("query.");
+            case NST_CACHE_RANGE_PART:
 
-                if(ctx->req.query.data && ctx->req.query.len) {
-                    ret = nst_cache_key_append(ctx->key, ctx->req.query.data,
-                            ctx->req.query.len);
+                if(range->count > 1) {
+                    len = _nst_cache_range_part(range, range->idx, part);
+                    ret = ci_putblk(res, part, len);
 
-                } else {
-                    ret = nst_cache_key_advance(ctx->key, 2);
+                    if(ret < 0) {
+                        goto put;
+                    }
+                }
+
+                if(range->idx == range->count) {
+                    range->state = NST_CACHE_RANGE_DONE;
+                    break;
+                }
+
+                range->pos  = range->body + range->part[range->idx].first
+                    - range->start;
+                range->left = range->part[range->idx].last
+                    - range->part[range->idx].first + 1;
+
+                if(fd < 0) {
+                    _nst_cache_engine_seek(appctx, range->pos);
                 }
 
+                range->state = NST_CACHE_RANGE_DATA;
+
                 break;
-            case NST_RULE_KEY_PARAM:
-                nst_debug("param_%s.", ck->data);
+            case NST_CACHE_RANGE_DATA:
+                max = channel_recv_max(res);
 
-                if(ctx->req.query.data && ctx->req.query.len) {
-                    char *v = NULL;
-                    int v_l = 0;
+                if(max <= 0) {
+                    si_rx_room_blk(si);
+                    return 0;
+                }
 
-                    if(nst_req_find_param(ctx->req.query.data,
-                                ctx->req.query.data + ctx->req.query.len,
-                                ck->data, &v, &v_l) == NST_OK) {
+                if(fd < 0) {
+                    p = _nst_cache_engine_contig(appctx, &len);
+                } else {
+                    buf = get_trash_chunk();
+                    p   = buf->area;
+                    len = buf->size;
+                }
 
-                        ret = nst_cache_key_append(ctx->key, v, v_l);
-                        break;
-                    }
+                if(len > max) {
+                    len = max;
+                }
 
+                if(len > range->left) {
+                    len = range->left;
+                }
+
+                if(fd >= 0) {
+                    len = pread(fd, p, len, range->pos);
+                }
+
+                /* truncated */
+                if(len <= 0) {
+                    goto error;
+                }
+
+                ret = ci_putblk(res, p, len);
+
+                if(ret < 0) {
+                    goto put;
+                }
+
+                if(fd < 0) {
+                    _nst_cache_engine_skip(appctx, len);
+                }
+
+                range->pos  += len;
+                range->left -= len;
+
+                if(!range->left) {
+                    range->idx++;
+                    range->state = NST_CACHE_RANGE_PART;
                 }
 
-                ret = nst_cache_key_advance(ctx->key, 2);
                 break;
-            case NST_RULE_KEY_HEADER:
-                hdr.idx = 0;
-                nst_debug("header_%s.", ck->data);
+        }
+    }
+
+    co_skip(si_oc(si), co_data(si_oc(si)));
+    si_shutr(si);
+    res->flags |= CF_READ_NULL;
+
+    return 1;
+
+put:
+
+    if(ret == -1) {
+        si_rx_room_blk(si);
+
+        return 0;
+    }
+
+error:
+    /* like a server closing in the middle of the response */
+    si_shutr(si);
+    res->flags |= CF_READ_ERROR;
+
+    return 1;
+}
+
+#if defined(USE_ZLIB)
+static int _nst_cache_engine_put(struct channel *res, int chunked, char *p,
+        int len) {
+
+    char size[16];
+
+    if(chunked && ci_putblk(res, size,
+                snprintf(size, sizeof(size), "%x\r\n", len)) < 0) {
+
+        return NST_ERR;
+    }
+
+    if(ci_putblk(res, p, len) < 0) {
+        return NST_ERR;
+    }
+
+    if(chunked && ci_putblk(res, "\r\n", 2) < 0) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Send a body cached with compress gzip to a client which does not accept
+ * it, decompressed. Its Content-Length is given if it is known, otherwise it
+ * is chunked if the client speaks HTTP/1.1.
+ */
+static void _nst_cache_engine_gunzip(struct appctx *appctx) {
+    static const char *drop[] = { "Content-Encoding", NULL };
+    static const char *drop_te[] = { "Content-Encoding",
+        "Transfer-Encoding", NULL };
 
-                while(http_find_header2(ck->data, strlen(ck->data),
-                            ci_head(msg->chn), &txn->hdr_idx, &hdr)) {
+    struct nst_cache_gzip *gzip = appctx->ctx.nuster.cache_engine.gunzip;
+    struct nst_cache_data *data = appctx->ctx.nuster.cache_engine.data;
+    struct stream_interface *si = appctx->owner;
+    struct channel *res         = si_ic(si);
+    struct buffer *in, *out;
+    char frame[NST_CACHE_GZIP_FRAME + 1];
+    char length[48];
+    int state, max, len, ret;
+    uint64_t gunzip_len;
+    char *p;
+
+    /* everything is appended once done, read it before the extents */
+    state = __atomic_load_n(&data->state, __ATOMIC_ACQUIRE);
+
+    while(gzip->state != NST_CACHE_GZIP_END) {
+        max = channel_recv_max(res) - NST_CACHE_GZIP_ROOM;
 
-                    ret = nst_cache_key_append(ctx->key, hdr.line + hdr.val,
-                            hdr.vlen);
+        if(max <= 0) {
+            si_rx_room_blk(si);
+            return;
+        }
 
+        switch(gzip->state) {
+            case NST_CACHE_GZIP_HEADER:
+                len = __atomic_load_n(&data->header_len, __ATOMIC_ACQUIRE);
+                in  = get_trash_chunk();
+                out = get_trash_chunk();
+
+                if(!len || _nst_cache_engine_peek(appctx, in->area, len) < len) {
+                    goto wait;
                 }
 
-                ret = ret == NST_OK && nst_cache_key_advance(ctx->key,
-                        hdr.idx == 0 ? 2 : 1);
+                /* set with the header, or when the body is stored */
+                gunzip_len = __atomic_load_n(&data->gunzip_len,
+                        __ATOMIC_ACQUIRE);
+
+                length[0] = '\0';
+
+                if(gunzip_len) {
+                    snprintf(length, sizeof(length), "%.*s: %"PRIu64"\r\n",
+                            nst_headers.content_length.len,
+                            nst_headers.content_length.data, gunzip_len);
+
+                    gzip->chunked = 0;
+                }
+
+                if(_nst_cache_header_rewrite(in->area, len, out,
+                            gzip->chunked ? drop : drop_te, length)
+                        != NST_OK) {
+
+                    goto error;
+                }
+
+                if(out->data > max) {
+                    si_rx_room_blk(si);
+                    return;
+                }
+
+                if(ci_putblk(res, out->area, out->data) < 0) {
+                    goto error;
+                }
+
+                _nst_cache_engine_skip(appctx, len);
+                gzip->state = NST_CACHE_GZIP_FRAMED;
 
                 break;
-            case NST_RULE_KEY_COOKIE:
-                nst_debug("cookie_%s.", ck->data);
+            case NST_CACHE_GZIP_FRAMED:
 
-                if(ctx->req.cookie.data) {
-                    char *v = NULL;
-                    size_t v_l = 0;
+                if(_nst_cache_engine_peek(appctx, frame, NST_CACHE_GZIP_FRAME)
+                        < NST_CACHE_GZIP_FRAME) {
 
-                    if(http_extract_cookie_value(ctx->req.cookie.data,
-                                ctx->req.cookie.data + ctx->req.cookie.len,
-                                ck->data, strlen(ck->data), 1, &v, &v_l)) {
+                    goto wait;
+                }
 
-                        ret = nst_cache_key_append(ctx->key, v, v_l);
-                        break;
-                    }
+                frame[NST_CACHE_GZIP_FRAME] = '\0';
+                gzip->left = strtoull(frame, NULL, 16);
 
+                _nst_cache_engine_skip(appctx, NST_CACHE_GZIP_FRAME);
+
+                if(gzip->left) {
+                    gzip->state = NST_CACHE_GZIP_DATA;
+                    break;
                 }
 
-                ret = nst_cache_key_advance(ctx->key, 2);
+                if(gzip->chunked && ci_putblk(res, "0\r\n\r\n", 5) < 0) {
+                    goto error;
+                }
+
+                gzip->state = NST_CACHE_GZIP_END;
+
                 break;
-            case NST_RULE_KEY_BODY:
-                nst_debug("body.");
+            case NST_CACHE_GZIP_DATA:
+                p   = _nst_cache_engine_contig(appctx, &len);
+                out = get_trash_chunk();
 
-                if(txn->meth == HTTP_METH_POST || txn->meth == HTTP_METH_PUT) {
+                if(!len) {
+                    goto wait;
+                }
 
-                    if((s->be->options & PR_O_WREQ_BODY)
-                            && ci_data(msg->chn) - msg->sov > 0) {
+                if(len > gzip->left) {
+                    len = gzip->left;
+                }
 
-                        ret = nst_cache_key_append(ctx->key,
-                                ci_head(msg->chn) + msg->sov,
-                                ci_data(msg->chn) - msg->sov);
+                if(max > out->size) {
+                    max = out->size;
+                }
 
-                    } else {
-                        ret = nst_cache_key_advance(ctx->key, 2);
-                    }
+                gzip->z.next_in   = (Bytef *)p;
+                gzip->z.avail_in  = len;
+                gzip->z.next_out  = (Bytef *)out->area;
+                gzip->z.avail_out = max;
+
+                ret = inflate(&gzip->z, Z_NO_FLUSH);
+
+                if(ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+                    goto error;
                 }
+
+                len -= gzip->z.avail_in;
+                max -= gzip->z.avail_out;
+
+                /* nothing more can be decompressed */
+                if(!len && !max) {
+                    goto error;
+                }
+
+                _nst_cache_engine_skip(appctx, len);
+                gzip->left -= len;
+
+                if(max && _nst_cache_engine_put(res, gzip->chunked, out->area,
+                            max) != NST_OK) {
+
+                    goto error;
+                }
+
+                if(!gzip->left) {
+                    gzip->state = NST_CACHE_GZIP_TAIL;
+                }
+
                 break;
-            default:
-                ret = NST_ERR;
+            case NST_CACHE_GZIP_TAIL:
+
+                if(_nst_cache_engine_peek(appctx, frame, 2) < 2) {
+                    goto wait;
+                }
+
+                _nst_cache_engine_skip(appctx, 2);
+                gzip->state = NST_CACHE_GZIP_FRAMED;
+
                 break;
         }
+    }
 
-        if(ret != NST_OK) {
-            return NST_ERR;
-        }
+    co_skip(si_oc(si), co_data(si_oc(si)));
+    si_shutr(si);
+    res->flags |= CF_READ_NULL;
+
+    return;
+
+wait:
+
+    /* woken up by _nst_cache_data_wakeup */
+    if(state == NST_CACHE_DATA_STATE_CREATING) {
+        return;
     }
 
-    nst_debug("\n");
-    return NST_OK;
+error:
+    /* like a server closing in the middle of the response */
+    si_shutr(si);
+    res->flags |= CF_READ_ERROR;
 }
+#endif
 
-struct buffer *nst_cache_build_purge_key(struct stream *s,
-        struct http_msg *msg) {
+/*
+ * Rebuild the header blocks stored by nst_cache_update_header, each one is
+ * its info followed by its payload
+ */
+static int _nst_cache_htx_header(struct htx *htx, char *p, int len) {
+    char *end = p + len;
 
-    struct http_txn *txn = s->txn;
-    int https;
-    char *path_beg, *url_end;
-    struct hdr_ctx ctx;
-    int ret;
-    struct buffer *key;
+    while(p + 4 <= end) {
+        struct htx_blk *blk;
+        enum htx_blk_type type;
+        uint32_t info, sz;
 
-    /* method.scheme.host.uri */
-    key = nst_cache_key_init();
+        memcpy(&info, p, 4);
+        type = info >> 28;
+        sz   = type == HTX_BLK_HDR
+            ? (info & 0xff) + ((info >> 8) & 0xfffff)
+            : info & 0xfffffff;
 
-    if(!key) {
-        return NULL;
-    }
+        if(p + 4 + sz > end) {
+            return NST_ERR;
+        }
 
-    ret = nst_cache_key_append(key, "GET", 3);
-    if(ret != NST_OK) {
-        return NULL;
-    }
+        blk = htx_add_blk(htx, type, sz);
 
-    https = 0;
-#ifdef USE_OPENSSL
-    if(s->sess->listener->bind_conf->is_ssl) {
-        https = 1;
-    }
-#endif
+        if(!blk) {
+            return NST_ERR;
+        }
 
-    ret = nst_cache_key_append(key, https ? "HTTPS": "HTTP",
-            strlen(https ? "HTTPS": "HTTP"));
-    if(ret != NST_OK) {
-        return NULL;
+        if(type == HTX_BLK_RES_SL) {
+            htx->sl_off = blk->addr;
+        }
+
+        blk->info = info;
+        memcpy(htx_get_blk_ptr(htx, blk), p + 4, sz);
+
+        p += 4 + sz;
     }
 
-    ctx.idx  = 0;
-    if(http_find_header2("Host", 4, ci_head(msg->chn), &txn->hdr_idx, &ctx)) {
-        ret = nst_cache_key_append(key, ctx.line + ctx.val, ctx.vlen);
-        if(ret != NST_OK) {
-            return NULL;
-        }
+    return p == end ? NST_OK : NST_ERR;
+}
+
+/*
+ * The bytes of body which can be added to the HTX message of the response
+ */
+static int _nst_cache_htx_room(struct channel *res, struct htx *htx) {
+    int max = channel_htx_recv_max(res, htx);
+
+    if(max > htx_free_data_space(htx)) {
+        max = htx_free_data_space(htx);
     }
 
-    path_beg = http_txn_get_path(txn);
-    url_end  = NULL;
-    if(path_beg) {
-        url_end = ci_head(msg->chn) + msg->sl.rq.u + msg->sl.rq.u_l;
-        ret     = nst_cache_key_append(key, path_beg, url_end - path_beg);
-        if(ret != NST_OK) {
-            return NULL;
-        }
+    return max;
+}
+
+/*
+ * Add what was consumed to the response and eat the whole request
+ */
+static void _nst_cache_htx_out(struct channel *req, struct channel *res,
+        struct htx *htx, uint32_t data) {
+
+    struct htx *req_htx;
+
+    if(htx->data > data) {
+        channel_add_input(res, htx->data - data);
     }
 
-    return key;
+    htx_to_buf(htx, &res->buf);
+
+    if(co_data(req)) {
+        req_htx = htx_from_buf(&req->buf);
+        co_htx_skip(req, req_htx, co_data(req));
+        htx_to_buf(req_htx, &req->buf);
+    }
 }
 
 /*
- * Check if valid cache exists
+ * The cache applet of an HTX stream: the header blocks are rebuilt, then
+ * the body is added as DATA blocks until the data is done
  */
-int nst_cache_exists(struct nst_cache_ctx *ctx, int mode) {
-    struct nst_cache_entry *entry = NULL;
-    int ret = NST_CACHE_CTX_STATE_INIT;
+static void _nst_cache_engine_htx(struct appctx *appctx) {
+    struct nst_cache_data *data = appctx->ctx.nuster.cache_engine.data;
+    struct stream_interface *si = appctx->owner;
+    struct channel *req         = si_oc(si);
+    struct channel *res         = si_ic(si);
+    struct htx *htx             = htxbuf(&res->buf);
+    uint32_t before             = htx->data;
+    struct buffer *buf;
+    char *p;
+    int len, max, state;
 
-    if(!ctx->key) {
-        return ret;
+    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
+        appctx->st0 = NST_CACHE_HTX_DONE;
     }
 
-    nst_shctx_lock(&nuster.cache->dict[0]);
-    entry = nst_cache_dict_get(ctx->key, ctx->hash);
+    /* everything is appended once done, read it before the extents */
+    state = __atomic_load_n(&data->state, __ATOMIC_ACQUIRE);
 
-    if(entry) {
+    if(appctx->st0 == NST_CACHE_HTX_HEADER) {
+        buf = get_trash_chunk();
 
-        /*
-         * before disk, entry is set to valid after response is cached to memory
-         * now we can save cache to both memory and disk, and we can also save
-         * cache to disk only.
-         * To keep from big changes, we still use valid to indicate the cache is
-         * in memory, and use another *file to indicate the disk persistence.
-         * So if valid, return memory cache
-         * if invalid and file is set, return disk cache
-         * if entry is null, check disk and return cache if exists
-         * Since valid only indicates whether or not cached is in memory, the
-         * state is set to invalid even if the cache is successfully saved to
-         * disk in disk_only mode
-         */
-        if(entry->state == NST_CACHE_ENTRY_STATE_VALID) {
-            ctx->data = entry->data;
-            ctx->data->clients++;
+        if(data->header_len > buf->size) {
+            goto error;
+        }
 
-            ctx->res.etag.len  = entry->etag.len;
-            ctx->res.etag.data = entry->etag.data;
+        len = _nst_cache_engine_peek(appctx, buf->area, data->header_len);
 
-            ctx->res.last_modified.len  = entry->last_modified.len;
-            ctx->res.last_modified.data = entry->last_modified.data;
+        if(len < data->header_len) {
 
-            ret = NST_CACHE_CTX_STATE_HIT;
+            /* woken up as the header is appended */
+            if(state == NST_CACHE_DATA_STATE_CREATING) {
+                goto out;
+            }
+
+            goto error;
         }
 
-        if(entry->state == NST_CACHE_ENTRY_STATE_INVALID && entry->file) {
-            ctx->disk.file = entry->file;
+        if(_nst_cache_htx_header(htx, buf->area, len) != NST_OK) {
+            goto error;
+        }
+
+        _nst_cache_engine_skip(appctx, len);
+        appctx->st0 = NST_CACHE_HTX_DATA;
+    }
+
+    if(appctx->st0 == NST_CACHE_HTX_DATA) {
+
+        while((max = _nst_cache_htx_room(res, htx)) > 0) {
+            p = _nst_cache_engine_contig(appctx, &len);
+
+            if(len == 0) {
+                break;
+            }
+
+            if(len > max) {
+                len = max;
+            }
+
+            if(!htx_add_data(htx, ist2(p, len))) {
+                break;
+            }
+
+            _nst_cache_engine_skip(appctx, len);
+        }
+
+        if(_nst_cache_engine_at_end(appctx)) {
+
+            if(state == NST_CACHE_DATA_STATE_DONE) {
+                appctx->st0 = NST_CACHE_HTX_EOM;
+            } else if(state == NST_CACHE_DATA_STATE_ABORTED) {
+                goto error;
+            }
+        } else {
+            si_rx_room_blk(si);
+        }
+    }
+
+    if(appctx->st0 == NST_CACHE_HTX_EOM) {
+
+        if(!htx_add_endof(htx, HTX_BLK_EOM)) {
+            si_rx_room_blk(si);
+            goto out;
+        }
+
+        appctx->st0 = NST_CACHE_HTX_DONE;
+    }
+
+    if(appctx->st0 == NST_CACHE_HTX_DONE && !(res->flags & CF_SHUTR)) {
+        si_shutr(si);
+        res->flags |= CF_READ_NULL;
+    }
+
+out:
+    _nst_cache_htx_out(req, res, htx, before);
+
+    return;
+
+error:
+    /* like a server closing in the middle of the response */
+    appctx->st0 = NST_CACHE_HTX_DONE;
+    si_shutr(si);
+    res->flags |= CF_READ_ERROR;
+
+    _nst_cache_htx_out(req, res, htx, before);
+}
+
+/*
+ * The cache applet acts like the backend to send cached http data, the
+ * data may still be being created, it then waits to be woken up by
+ * _nst_cache_data_wakeup at the end of what has been appended
+ */
+static void nst_cache_engine_handler(struct appctx *appctx) {
+    struct nst_cache_data *data       = appctx->ctx.nuster.cache_engine.data;
+    struct nst_cache_element *element = NULL;
+    struct stream_interface *si       = appctx->owner;
+    struct channel *res               = si_ic(si);
+    int offset, len, max, ret, state;
+
+    if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
+        return;
+    }
+
+    /* Check if the input buffer is avalaible. */
+    if(res->buf.size == 0) {
+        si_rx_room_blk(si);
+        return;
+    }
+
+    if(IS_HTX_STRM(si_strm(si))) {
+        _nst_cache_engine_htx(appctx);
+
+        return;
+    }
+
+    /* check that the output is not closed */
+    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
+        appctx->ctx.nuster.cache_engine.element = NULL;
+    }
+
+    if(appctx->ctx.nuster.cache_engine.range) {
+
+        if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
+            appctx->ctx.nuster.cache_engine.range->state =
+                NST_CACHE_RANGE_DONE;
+        }
+
+        _nst_cache_range_send(appctx, appctx->ctx.nuster.cache_engine.range,
+                -1);
+
+        return;
+    }
+
+#if defined(USE_ZLIB)
+    if(appctx->ctx.nuster.cache_engine.gunzip
+            && appctx->ctx.nuster.cache_engine.element) {
+
+        _nst_cache_engine_gunzip(appctx);
+
+        return;
+    }
+#endif
+
+    /* everything is appended once done, read it before the extents */
+    state = __atomic_load_n(&data->state, __ATOMIC_ACQUIRE);
+
+    if(!_nst_cache_engine_at_end(appctx)
+            && _nst_cache_engine_can_splice(si_strm(si), res)) {
+
+        /* the pipe is sent before the buffer, wait for it to be empty */
+        if(c_data(res)) {
+            si_rx_room_blk(si);
+            return;
+        }
+
+        if(_nst_cache_engine_splice(appctx, res) >= 0
+                && !_nst_cache_engine_at_end(appctx)
+                && res->to_forward >= MIN_SPLICE_FORWARD) {
+
+            /* the pipe is full */
+            si_rx_room_blk(si);
+            return;
+        }
+    }
+
+    element = appctx->ctx.nuster.cache_engine.element;
+    offset  = appctx->ctx.nuster.cache_engine.offset;
+
+    /* copy as much of the extents as the buffer can take */
+    while(element) {
+        len = _nst_cache_element_len(element) - offset;
+
+        if(len == 0) {
+
+            if(!_nst_cache_element_next(element)) {
+                break;
+            }
+
+            element = _nst_cache_element_next(element);
+            offset  = 0;
+            continue;
+        }
+
+        max = channel_recv_max(res);
+
+        if(len > max) {
+            len = max;
+        }
+
+        if(len == 0) {
+            si_rx_room_blk(si);
+            break;
+        }
+
+        ret = ci_putblk(res, element->data + offset, len);
+
+        if(ret < 0) {
+
+            if(ret == -2) {
+                si_shutr(si);
+                res->flags |= CF_READ_NULL;
+            } else {
+                si_rx_room_blk(si);
+            }
+
+            break;
+        }
+
+        offset += ret;
+    }
+
+    appctx->ctx.nuster.cache_engine.element = element;
+    appctx->ctx.nuster.cache_engine.offset  = offset;
+
+    if(!element || (state == NST_CACHE_DATA_STATE_DONE
+                && _nst_cache_engine_at_end(appctx))) {
+
+        co_skip(si_oc(si), co_data(si_oc(si)));
+        si_shutr(si);
+        res->flags |= CF_READ_NULL;
+    } else if(state == NST_CACHE_DATA_STATE_ABORTED
+            && _nst_cache_engine_at_end(appctx)) {
+
+        /* like a server closing in the middle of the response */
+        si_shutr(si);
+        res->flags |= CF_READ_ERROR;
+    }
+
+}
+
+/*
+ * Drop the reference taken by nst_cache_exists, whichever way the applet
+ * ends
+ */
+static void nst_cache_engine_release_handler(struct appctx *appctx) {
+
+    if(!LIST_ISEMPTY(&appctx->ctx.nuster.cache_engine.waiter)) {
+        nst_shctx_lock(nuster.cache);
+        LIST_DEL(&appctx->ctx.nuster.cache_engine.waiter);
+        LIST_INIT(&appctx->ctx.nuster.cache_engine.waiter);
+        nst_shctx_unlock(nuster.cache);
+    }
+
+    if(appctx->ctx.nuster.cache_engine.data) {
+        nst_cache_data_release(appctx->ctx.nuster.cache_engine.data);
+        appctx->ctx.nuster.cache_engine.data = NULL;
+    }
+
+    nst_cache_gzip_free(appctx->ctx.nuster.cache_engine.gunzip);
+    appctx->ctx.nuster.cache_engine.gunzip = NULL;
+
+    free(appctx->ctx.nuster.cache_engine.range);
+    appctx->ctx.nuster.cache_engine.range = NULL;
+}
+
+/*
+ * The cache disk applet of an HTX stream, like _nst_cache_engine_htx
+ */
+static void _nst_cache_disk_engine_htx(struct appctx *appctx) {
+    struct stream_interface *si = appctx->owner;
+    struct channel *req         = si_oc(si);
+    struct channel *res         = si_ic(si);
+    struct htx *htx             = htxbuf(&res->buf);
+    struct buffer *buf          = get_trash_chunk();
+    uint32_t before             = htx->data;
+
+    int fd         = appctx->ctx.nuster.cache_disk_engine.fd;
+    int header_len = appctx->ctx.nuster.cache_disk_engine.header_len;
+    int ret, max;
+
+    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)
+            && appctx->st0 != NST_CACHE_HTX_DONE) {
+
+        close(fd);
+        appctx->st0 = NST_CACHE_HTX_DONE;
+    }
+
+    if(appctx->st0 == NST_CACHE_HTX_HEADER) {
+
+        if(header_len > buf->size) {
+            goto error;
+        }
+
+        ret = pread(fd, buf->area, header_len,
+                appctx->ctx.nuster.cache_disk_engine.offset);
+
+        if(ret != header_len
+                || _nst_cache_htx_header(htx, buf->area, ret) != NST_OK) {
+
+            goto error;
+        }
+
+        appctx->ctx.nuster.cache_disk_engine.offset += ret;
+        appctx->st0 = NST_CACHE_HTX_DATA;
+    }
+
+    while(appctx->st0 == NST_CACHE_HTX_DATA) {
+        max = _nst_cache_htx_room(res, htx);
+
+        if(max > buf->size) {
+            max = buf->size;
+        }
+
+        if(max == 0) {
+            si_rx_room_blk(si);
+            goto out;
+        }
+
+        ret = pread(fd, buf->area, max,
+                appctx->ctx.nuster.cache_disk_engine.offset);
+
+        if(ret == -1) {
+            goto error;
+        }
+
+        if(ret == 0) {
+            appctx->st0 = NST_CACHE_HTX_EOM;
+            break;
+        }
+
+        if(!htx_add_data(htx, ist2(buf->area, ret))) {
+            si_rx_room_blk(si);
+            goto out;
+        }
+
+        appctx->ctx.nuster.cache_disk_engine.offset += ret;
+    }
+
+    if(appctx->st0 == NST_CACHE_HTX_EOM) {
+
+        if(!htx_add_endof(htx, HTX_BLK_EOM)) {
+            si_rx_room_blk(si);
+            goto out;
+        }
+
+        close(fd);
+        appctx->st0 = NST_CACHE_HTX_DONE;
+    }
+
+    if(appctx->st0 == NST_CACHE_HTX_DONE && !(res->flags & CF_SHUTR)) {
+        si_shutr(si);
+        res->flags |= CF_READ_NULL;
+    }
+
+out:
+    _nst_cache_htx_out(req, res, htx, before);
+
+    return;
+
+error:
+    close(fd);
+    appctx->st0 = NST_CACHE_HTX_DONE;
+    si_shutr(si);
+    res->flags |= CF_READ_ERROR;
+
+    _nst_cache_htx_out(req, res, htx, before);
+}
+
+/*
+ * The cache disk applet acts like the backend to send cached http data
+ */
+static void nst_cache_disk_engine_handler(struct appctx *appctx) {
+    struct stream_interface *si = appctx->owner;
+    struct channel *res         = si_ic(si);
+
+    int ret;
+    int max = b_room(&res->buf) - global.tune.maxrewrite;
+
+    int fd = appctx->ctx.nuster.cache_disk_engine.fd;
+    int header_len = appctx->ctx.nuster.cache_disk_engine.header_len;
+    uint64_t offset = appctx->ctx.nuster.cache_disk_engine.offset;
+
+    struct nst_cache_range *range = appctx->ctx.nuster.cache_disk_engine.range;
+
+    if(unlikely(si->state == SI_ST_DIS || si->state == SI_ST_CLO)) {
+        return;
+    }
+
+    /* Check if the input buffer is avalaible. */
+    if(res->buf.size == 0) {
+        si_rx_room_blk(si);
+        return;
+    }
+
+    if(IS_HTX_STRM(si_strm(si))) {
+        _nst_cache_disk_engine_htx(appctx);
+
+        return;
+    }
+
+    if(b_data(&res->buf) != 0) {
+        return;
+    }
+
+    /* check that the output is not closed */
+    if(res->flags & (CF_SHUTW|CF_SHUTW_NOW)) {
+
+        if(range) {
+            range->state = NST_CACHE_RANGE_DONE;
+        } else {
+            appctx->st0 = NST_PERSIST_APPLET_DONE;
+        }
+    }
+
+    if(range) {
+
+        if(appctx->st0 != NST_PERSIST_APPLET_DONE
+                && _nst_cache_range_send(appctx, range, fd)) {
+
+            close(fd);
+            appctx->st0 = NST_PERSIST_APPLET_DONE;
+        }
+
+        return;
+    }
+
+    switch(appctx->st0) {
+        case NST_PERSIST_APPLET_HEADER:
+            ret = pread(fd, res->buf.area, header_len, offset);
+
+            if(ret != header_len) {
+                appctx->st0 = NST_PERSIST_APPLET_ERROR;
+                break;
+            }
+
+            ret = nst_ci_send(res, ret);
+
+            if(ret >= 0) {
+                appctx->st0 = NST_PERSIST_APPLET_PAYLOAD;
+                appctx->ctx.nuster.cache_disk_engine.offset += ret;
+            } else if(ret == -2) {
+                appctx->st0 = NST_PERSIST_APPLET_ERROR;
+                si_shutr(si);
+                res->flags |= CF_READ_NULL;
+            }
+            break;
+        case NST_PERSIST_APPLET_PAYLOAD:
+            ret = pread(fd, res->buf.area, max, offset);
+
+            if(ret == -1) {
+                appctx->st0 = NST_PERSIST_APPLET_ERROR;
+                break;
+            }
+
+            if(ret > 0) {
+                ret = nst_ci_send(res, ret);
+
+                if(ret >= 0) {
+                    appctx->st0 = NST_PERSIST_APPLET_PAYLOAD;
+                    appctx->ctx.nuster.cache_disk_engine.offset += ret;
+                } else if(ret == -2) {
+                    appctx->st0 = NST_PERSIST_APPLET_ERROR;
+                    si_shutr(si);
+                    res->flags |= CF_READ_NULL;
+                }
+                break;
+            }
+
+            close(fd);
+            appctx->st0 = NST_PERSIST_APPLET_DONE;
+        case NST_PERSIST_APPLET_DONE:
+            co_skip(si_oc(si), co_data(si_oc(si)));
+            si_shutr(si);
+            res->flags |= CF_READ_NULL;
+            break;
+        case NST_PERSIST_APPLET_ERROR:
+            si_shutr(si);
+            res->flags |= CF_READ_NULL;
+            close(fd);
+            break;
+    }
+
+}
+
+static void nst_cache_disk_engine_release_handler(struct appctx *appctx) {
+    free(appctx->ctx.nuster.cache_disk_engine.range);
+    appctx->ctx.nuster.cache_disk_engine.range = NULL;
+}
+
+/*
+ * Cache the keys which calculated in request for response use, they are
+ * copied out of the space they are built in
+ */
+struct nst_rule_stash *nst_cache_stash_rule(struct nst_cache_ctx *ctx,
+        struct nst_rule *rule) {
+
+    struct nst_rule_stash *stash = pool_alloc(global.nuster.cache.pool.stash);
+
+    if(stash) {
+        stash->key = nst_key_dup(ctx->key);
+
+        if(!stash->key) {
+            pool_free(global.nuster.cache.pool.stash, stash);
+            return NULL;
+        }
+
+        stash->rule = rule;
+        stash->hash = ctx->hash;
+
+        stash->vary     = ctx->vary;
+        stash->vary_len = ctx->vary_len;
+
+        stash->slice = ctx->slice;
+
+        if(ctx->stash) {
+            stash->next = ctx->stash;
+        } else {
+            stash->next = NULL;
+        }
+
+        ctx->stash = stash;
+    }
+
+    return stash;
+}
+
+int nst_cache_check_uri(struct http_msg *msg) {
+    const char *uri = ci_head(msg->chn) + msg->sl.rq.u;
+
+    if(!global.nuster.cache.uri) {
+        return NST_ERR;
+    }
+
+    if(strlen(global.nuster.cache.uri) != msg->sl.rq.u_l) {
+        return NST_ERR;
+    }
+
+    if(memcmp(uri, global.nuster.cache.uri, msg->sl.rq.u_l) != 0) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Size of a nst_cache_data followed by its validators
+ */
+static inline int _nst_cache_data_head(int validators) {
+    int head = sizeof(struct nst_cache_data) + validators;
+
+    return (head + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+/*
+ * Where the first extent is if it was allocated with data
+ */
+static inline struct nst_cache_element *_nst_cache_data_extent(
+        struct nst_cache_data *data) {
+
+    return (struct nst_cache_element *)((char *)data + _nst_cache_data_head(
+                data->etag.len + data->last_modified.len));
+}
+
+/*
+ * Allocate without evicting anything, for what can also be done with less
+ * memory or not at all
+ */
+static void *_nst_cache_memory_try_alloc(int size) {
+    struct nst_memory *memory = global.nuster.cache.memory;
+    void *p;
+
+    nst_shctx_lock(memory);
+    p = nst_memory_alloc_locked(memory, size);
+    nst_shctx_unlock(memory);
+
+    return p;
+}
+
+/*
+ * create a new nst_cache_data and insert it to cache->data list.
+ * The validators of ctx are copied after it, followed by the first extent
+ * which takes the rest of the allocation: the whole body if a run of blocks
+ * is free for it, otherwise at most a block.
+ */
+struct nst_cache_data *nst_cache_data_new(struct nst_cache_ctx *ctx) {
+    struct nst_memory *memory = global.nuster.cache.memory;
+    struct nst_cache_data *data = NULL;
+    uint64_t want;
+    char *p;
+    int head, size;
+
+    head = _nst_cache_data_head(ctx->res.etag.len + ctx->res.last_modified.len);
+
+    want = head + sizeof(struct nst_cache_element) + (ctx->expect_len
+            ? ctx->expect_len : NST_CACHE_DEFAULT_EXTENT_SIZE);
+
+    if(want > memory->block_size && want <= NST_CACHE_EXTENT_MAX_SIZE) {
+        size = nst_memory_fit(memory, want);
+        data = _nst_cache_memory_try_alloc(size);
+    }
+
+    if(!data) {
+        size = nst_memory_fit(memory, want > memory->block_size
+                ? memory->block_size : want);
+
+        if(size < head + sizeof(struct nst_cache_element)) {
+            return NULL;
+        }
+
+        data = nst_cache_memory_alloc(size);
+    }
+
+    if(!data) {
+        return NULL;
+    }
+
+    data->clients  = 0;
+    data->invalid  = 0;
+    data->state    = NST_CACHE_DATA_STATE_CREATING;
+    data->proc     = relative_pid;
+
+    /* the gzip one is known once rewritten, see _nst_cache_gzip_update */
+    data->gzip       = ctx->gzip != NULL;
+    data->header_len = ctx->gzip ? 0 : ctx->header_len;
+    data->gunzip_len = 0;
+    data->htx        = ctx->htx;
+
+    LIST_INIT(&data->waiters);
+
+    p = (char *)(data + 1);
+
+    data->etag.data = p;
+    data->etag.len  = ctx->res.etag.len;
+
+    if(data->etag.len) {
+        memcpy(p, ctx->res.etag.data, data->etag.len);
+        p += data->etag.len;
+    }
+
+    data->last_modified.data = p;
+    data->last_modified.len  = ctx->res.last_modified.len;
+
+    if(data->last_modified.len) {
+        memcpy(p, ctx->res.last_modified.data, data->last_modified.len);
+    }
+
+    data->element       = _nst_cache_data_extent(data);
+    data->element->next = NULL;
+    data->element->len  = 0;
+    data->element->size = size - head - sizeof(struct nst_cache_element);
+
+    nst_shctx_lock(nuster.cache);
+
+    if(nuster.cache->data_head == NULL) {
+        nuster.cache->data_head = data;
+        nuster.cache->data_tail = data;
+        data->next              = data;
+        data->prev              = data;
+    } else {
+        data->next                    = nuster.cache->data_head;
+        data->prev                    = nuster.cache->data_tail;
+        nuster.cache->data_tail->next = data;
+        nuster.cache->data_head->prev = data;
+        nuster.cache->data_tail       = data;
+    }
+
+    nst_shctx_unlock(nuster.cache);
+
+    return data;
+}
+
+/*
+ * Wake up the applets streaming data, they are all in this process as
+ * nst_cache_exists only lets requests of the creator follow it
+ */
+static void _nst_cache_data_wakeup(struct nst_cache_data *data) {
+    struct appctx *appctx;
+
+    /* pairs with the one in nst_cache_hit, either the waiter is seen here
+     * or it sees what was appended */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if(LIST_ISEMPTY(&data->waiters)) {
+        return;
+    }
+
+    nst_shctx_lock(nuster.cache);
+
+    list_for_each_entry(appctx, &data->waiters, ctx.nuster.cache_engine.waiter) {
+        appctx_wakeup(appctx);
+    }
+
+    nst_shctx_unlock(nuster.cache);
+}
+
+/*
+ * Allocate the next extent for len bytes of the response at least
+ */
+static struct nst_cache_element *_nst_cache_element_new(
+        struct nst_cache_ctx *ctx, long len) {
+
+    struct nst_memory *memory         = global.nuster.cache.memory;
+    struct nst_cache_element *element = NULL;
+    uint64_t want = len;
+    int known     = 0;
+    int size;
+
+    if(ctx->expect_len > ctx->cache_len + len) {
+        want  = ctx->expect_len - ctx->cache_len;
+        known = 1;
+    } else if(ctx->element && want < 2 * (uint64_t)ctx->element->size) {
+        want = 2 * (uint64_t)ctx->element->size;
+    }
+
+    /* the rest of the body in a run of blocks if one is free */
+    if(known && want + sizeof(*element) > memory->block_size
+            && want <= NST_CACHE_EXTENT_MAX_SIZE) {
+
+        size    = nst_memory_fit(memory, want + sizeof(*element));
+        element = _nst_cache_memory_try_alloc(size);
+    }
+
+    if(!element) {
+        size    = nst_memory_fit(memory, want > memory->block_size
+                ? memory->block_size : want + sizeof(*element));
+
+        element = nst_cache_memory_alloc(size);
+    }
+
+    /* the memory may be too fragmented for a large extent */
+    if(!element && size > len + sizeof(*element)) {
+        size    = nst_memory_fit(memory, len + sizeof(*element));
+        element = nst_cache_memory_alloc(size);
+    }
+
+    if(element) {
+        element->next = NULL;
+        element->len  = 0;
+        element->size = size - sizeof(*element);
+    }
+
+    return element;
+}
+
+/*
+ * Copy len bytes to the extents of ctx
+ */
+static int _nst_cache_data_write(struct nst_cache_ctx *ctx, char *p,
+        long len) {
+
+    struct nst_cache_element *element = ctx->element;
+
+    while(len) {
+        int n;
+
+        if(!element || element->len == element->size) {
+            element = _nst_cache_element_new(ctx, len);
+
+            if(!element) {
+                return NST_ERR;
+            }
+
+            if(ctx->element) {
+                __atomic_store_n(&ctx->element->next, element,
+                        __ATOMIC_RELEASE);
+            } else {
+                ctx->data->element = element;
+            }
+
+            ctx->element = element;
+        }
+
+        n = element->size - element->len;
+
+        if(n > len) {
+            n = len;
+        }
+
+        memcpy(element->data + element->len, p, n);
+
+        if(ctx->rule->disk == NST_DISK_SYNC) {
+            nst_persist_write(&ctx->disk, element->data + element->len, n);
+        }
+
+        __atomic_store_n(&element->len, element->len + n, __ATOMIC_RELEASE);
+
+        ctx->cache_len += n;
+        p              += n;
+        len            -= n;
+
+        nst_cache_stats_update_used_mem(n);
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Append partial http response data to the extents of ctx
+ */
+static int _nst_cache_data_append(struct nst_cache_ctx *ctx,
+        struct http_msg *msg, long msg_len) {
+
+    struct buffer *buf = &msg->chn->buf;
+    size_t offset      = co_data(msg->chn);
+
+    while(msg_len) {
+        long len = b_contig_data(buf, offset);
+
+        if(len > msg_len) {
+            len = msg_len;
+        }
+
+        if(_nst_cache_data_write(ctx, b_peek(buf, offset), len) != NST_OK) {
+            return NST_ERR;
+        }
+
+        offset  += len;
+        msg_len -= len;
+    }
+
+    _nst_cache_data_wakeup(ctx->data);
+
+    return NST_OK;
+}
+
+/*
+ * Take a reference on the data of a valid entry found by the lock free
+ * lookup, return NULL if there is none.
+ * A reader either sees invalid set here or its reference is seen by
+ * _nst_cache_data_invalid, which checks them in the reverse order.
+ */
+static struct nst_cache_data *_nst_cache_data_get(
+        struct nst_cache_entry *entry) {
+
+    struct nst_cache_data *data;
+    int state, retry = 1;
+
+again:
+    state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+    if(state != NST_CACHE_ENTRY_STATE_VALID
+            && state != NST_CACHE_ENTRY_STATE_REFRESH) {
+
+        return NULL;
+    }
+
+    data  = __atomic_load_n(&entry->data, __ATOMIC_ACQUIRE);
+    state = __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE);
+
+    /* the entry may have been recreated meanwhile */
+    if(!data || (state != NST_CACHE_ENTRY_STATE_VALID
+                && state != NST_CACHE_ENTRY_STATE_REFRESH)) {
+
+        return NULL;
+    }
+
+    /* a stale one is served once a request refreshes it, which is elected
+     * by nst_cache_exists under the lock */
+    if(nst_cache_entry_expired(entry)
+            && (state != NST_CACHE_ENTRY_STATE_REFRESH
+                || !nst_cache_entry_servable(entry, 0))) {
+
+        return NULL;
+    }
+
+    __atomic_add_fetch(&data->clients, 1, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&data->invalid, __ATOMIC_SEQ_CST)) {
+        nst_cache_data_release(data);
+
+        /* moved by the compactor, see nst_cache_dict_compact */
+        if(retry && __atomic_load_n(&entry->data, __ATOMIC_ACQUIRE) != data) {
+            retry = 0;
+
+            goto again;
+        }
+
+        return NULL;
+    }
+
+    return data;
+}
+
+static int _nst_cache_data_invalid(struct nst_cache_data *data) {
+
+    /* the evictor frees it, see _nst_cache_reclaim */
+    if(__atomic_load_n(&data->invalid, __ATOMIC_SEQ_CST)
+            == NST_CACHE_DATA_EVICTING) {
+
+        return 0;
+    }
+
+    if(__atomic_load_n(&data->invalid, __ATOMIC_SEQ_CST)) {
+
+        if(!__atomic_load_n(&data->clients, __ATOMIC_SEQ_CST)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static void _nst_cache_data_free(void *p) {
+    struct nst_cache_data *data       = p;
+    struct nst_cache_element *element = data->element;
+
+    while(element) {
+        struct nst_cache_element *tmp = element;
+        element                       = element->next;
+
+        nst_cache_stats_update_used_mem(-tmp->len);
+
+        /* the first extent may be part of the data */
+        if(tmp != _nst_cache_data_extent(data)) {
+            nst_cache_memory_free(tmp);
+        }
+    }
+
+    nst_cache_memory_free(data);
+}
+
+/*
+ * Remove data from the circular list, the caller must hold the lock
+ */
+static void _nst_cache_data_unlink(struct nst_cache_data *data) {
+
+    if(data->next == data) {
+        nuster.cache->data_head = NULL;
+        nuster.cache->data_tail = NULL;
+    } else {
+        data->prev->next = data->next;
+        data->next->prev = data->prev;
+
+        if(nuster.cache->data_head == data) {
+            nuster.cache->data_head = data->next;
+        }
+
+        if(nuster.cache->data_tail == data) {
+            nuster.cache->data_tail = data->prev;
+        }
+    }
+}
+
+/*
+ * Unlink invalid nst_cache_data and free it once no reader can see it
+ */
+static void _nst_cache_data_cleanup() {
+    struct nst_cache_data *data = NULL;
+
+    if(nuster.cache->data_head) {
+
+        if(_nst_cache_data_invalid(nuster.cache->data_head)) {
+            data = nuster.cache->data_head;
+            _nst_cache_data_unlink(data);
+        } else {
+            nuster.cache->data_tail = nuster.cache->data_head;
+            nuster.cache->data_head = nuster.cache->data_head->next;
+        }
+
+    }
+
+    /* lock free readers may still be looking at it */
+    if(data) {
+        nst_epoch_retire(&nuster.cache->epoch, data, _nst_cache_data_free);
+    }
+}
+
+/*
+ * Whether data or one of its extents is in a block being drained
+ */
+int nst_cache_data_draining(struct nst_cache_data *data) {
+    struct nst_memory *memory = global.nuster.cache.memory;
+    struct nst_cache_element *element;
+
+    if(nst_memory_draining(memory, data)) {
+        return 1;
+    }
+
+    for(element = data->element; element; element = element->next) {
+
+        if(nst_memory_draining(memory, element)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Copy done data out of the blocks being drained and insert the copy to
+ * cache->data list. The first extent stays with the data, and each extent
+ * is sized to what it holds.
+ */
+struct nst_cache_data *nst_cache_data_copy(struct nst_cache_data *data) {
+    struct nst_memory *memory = global.nuster.cache.memory;
+    struct nst_cache_element *from = data->element;
+    struct nst_cache_element *to;
+    struct nst_cache_data *copy;
+    int head, size;
+
+    head = _nst_cache_data_head(data->etag.len + data->last_modified.len);
+    size = nst_memory_fit(memory, head + sizeof(*from) + from->len);
+    copy = _nst_cache_memory_try_alloc(size);
+
+    if(!copy) {
+        return NULL;
+    }
+
+    memcpy(copy, data, head);
+
+    copy->clients            = 0;
+    copy->invalid            = 0;
+    copy->etag.data          = (char *)(copy + 1);
+    copy->last_modified.data = copy->etag.data + copy->etag.len;
+
+    LIST_INIT(&copy->waiters);
+
+    to           = _nst_cache_data_extent(copy);
+    to->next     = NULL;
+    to->len      = from->len;
+    to->size     = size - head - sizeof(*to);
+    copy->element = to;
+
+    memcpy(to->data, from->data, from->len);
+    nst_cache_stats_update_used_mem(to->len);
+
+    while((from = from->next)) {
+        size     = nst_memory_fit(memory, sizeof(*from) + from->len);
+        to->next = _nst_cache_memory_try_alloc(size);
+
+        if(!to->next) {
+            _nst_cache_data_free(copy);
+
+            return NULL;
+        }
+
+        to       = to->next;
+        to->next = NULL;
+        to->len  = from->len;
+        to->size = size - sizeof(*to);
+
+        memcpy(to->data, from->data, from->len);
+        nst_cache_stats_update_used_mem(to->len);
+    }
+
+    nst_shctx_lock(nuster.cache);
+
+    if(nuster.cache->data_head == NULL) {
+        nuster.cache->data_head = copy;
+        nuster.cache->data_tail = copy;
+        copy->next              = copy;
+        copy->prev              = copy;
+    } else {
+        copy->next                    = nuster.cache->data_head;
+        copy->prev                    = nuster.cache->data_tail;
+        nuster.cache->data_tail->next = copy;
+        nuster.cache->data_head->prev = copy;
+        nuster.cache->data_tail       = copy;
+    }
+
+    nst_shctx_unlock(nuster.cache);
+
+    return copy;
+}
+
+/*
+ * Drain the sparse blocks of the memory and move the data in them, the
+ * entries of all shards are checked once, then the blocks which could not
+ * be emptied, because of keys or entries, are used again. After a pass
+ * which moved nothing, the blocks are left alone for a while.
+ */
+static void _nst_cache_data_compact() {
+    struct nst_memory *memory = global.nuster.cache.memory;
+    int compactor             = global.nuster.cache.data_compactor;
+
+    if(!compactor) {
+        return;
+    }
+
+    if(!nuster.cache->compacting) {
+
+        /* smaller chunks only hold keys and entries */
+        if(nst_time_now() < nuster.cache->compact_next
+                || !nst_memory_drain(memory, _nst_cache_data_head(0)
+                    + sizeof(struct nst_cache_element))) {
+
+            return;
+        }
+
+        nuster.cache->compacting    = 1;
+        nuster.cache->compact_moved = 0;
+    }
+
+    while(compactor--) {
+
+        if(nst_cache_dict_compact() != NST_OK
+                || !__atomic_load_n(&memory->draining, __ATOMIC_RELAXED)) {
+
+            nst_memory_drain_end(memory);
+            nuster.cache->compacting    = 0;
+            nuster.cache->compact_shard = 0;
+            nuster.cache->compact_idx   = 0;
+
+            if(!nuster.cache->compact_moved) {
+                nuster.cache->compact_next = nst_time_now()
+                    + NST_CACHE_COMPACT_IDLE;
+            }
+
+            break;
+        }
+    }
+}
+
+/*
+ * Called when the cache memory is full, and to keep the headroom. Evict a
+ * few entries and free their data right away unless they are being served,
+ * the data cleanup frees those later.
+ */
+static int _nst_cache_reclaim(int size) {
+    struct nst_cache_data *data[NST_EVICT_BATCH];
+    int n, i;
+
+    if(global.nuster.cache.evict == NST_EVICT_OFF) {
+        return NST_ERR;
+    }
+
+    n = nst_cache_dict_evict(data, NST_EVICT_BATCH);
+
+    if(!n) {
+        return NST_ERR;
+    }
+
+    nst_shctx_lock(nuster.cache);
+
+    for(i = 0; i < n; i++) {
+
+        if(!data[i]) {
+            continue;
+        }
+
+        if(__atomic_load_n(&data[i]->clients, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&data[i]->invalid, 1, __ATOMIC_SEQ_CST);
+            data[i] = NULL;
+        } else {
+            _nst_cache_data_unlink(data[i]);
+        }
+    }
+
+    nst_shctx_unlock(nuster.cache);
+
+    for(i = 0; i < n; i++) {
+
+        if(data[i]) {
+            _nst_cache_data_free(data[i]);
+        }
+    }
+
+    nst_cache_stats_update_evicted(n);
+
+    return NST_OK;
+}
+
+void nst_cache_housekeeping() {
+
+    if(global.nuster.cache.status == NST_STATUS_ON && master == 1) {
+
+        int dict_cleaner = global.nuster.cache.dict_cleaner;
+        int data_cleaner = global.nuster.cache.data_cleaner;
+        int disk_cleaner = global.nuster.cache.disk_cleaner;
+        int disk_loader  = global.nuster.cache.disk_loader;
+        int disk_saver   = global.nuster.cache.disk_saver;
+        int evictor      = NST_EVICT_HEADROOM_ROUNDS;
+
+        while(dict_cleaner--) {
+            nst_cache_dict_rehash();
+            nst_cache_dict_cleanup();
+        }
+
+        while(evictor-- && nst_memory_headroom(global.nuster.cache.memory)
+                < global.nuster.cache.headroom) {
+
+            if(_nst_cache_reclaim(0) != NST_OK) {
+                break;
+            }
+        }
+
+        nst_sketch_age(&nuster.cache->sketch);
+
+        _nst_cache_data_compact();
+
+        while(data_cleaner--) {
+            nst_shctx_lock(nuster.cache);
+            _nst_cache_data_cleanup();
+            nst_shctx_unlock(nuster.cache);
+        }
+
+        nst_epoch_reclaim(&nuster.cache->epoch);
+
+        while(disk_cleaner--) {
+            nst_cache_persist_cleanup();
+        }
+
+        while(disk_loader--) {
+            nst_cache_persist_load();
+        }
+
+        while(disk_saver--) {
+            nst_cache_persist_async();
+        }
+
+    }
+}
+
+void nst_cache_init() {
+
+    nuster.applet.cache_engine.fct = nst_cache_engine_handler;
+    nuster.applet.cache_engine.release = nst_cache_engine_release_handler;
+    nuster.applet.cache_disk_engine.fct = nst_cache_disk_engine_handler;
+    nuster.applet.cache_disk_engine.release =
+        nst_cache_disk_engine_release_handler;
+
+    if(global.nuster.cache.status == NST_STATUS_ON) {
+
+        if(global.nuster.cache.share == NST_STATUS_UNDEFINED) {
+
+            if(global.nbproc == 1) {
+                global.nuster.cache.share = NST_STATUS_OFF;
+            } else {
+                global.nuster.cache.share = NST_STATUS_ON;
+            }
+        }
+
+        if(global.nuster.cache.root) {
+
+            if(nst_persist_mkdir(global.nuster.cache.root) == NST_ERR) {
+
+                ha_alert("Create `%s` failed\n", global.nuster.cache.root);
+                exit(1);
+            }
+        }
+
+        global.nuster.cache.pool.stash = create_pool("cp.stash",
+                sizeof(struct nst_rule_stash), MEM_F_SHARED);
+
+        global.nuster.cache.pool.ctx   = create_pool("cp.ctx",
+                sizeof(struct nst_cache_ctx), MEM_F_SHARED);
+
+        if(global.nuster.cache.share) {
+            global.nuster.cache.memory = nst_memory_create("cache.shm",
+                    global.nuster.cache.dict_size
+                    + global.nuster.cache.data_size, global.tune.bufsize,
+                    NST_CACHE_DEFAULT_CHUNK_SIZE, &global.nuster.cache.shm);
+
+            if(!global.nuster.cache.memory) {
+                goto shm_err;
+            }
+
+            if(nst_shctx_init(global.nuster.cache.memory) != NST_OK) {
+                goto shm_err;
+            }
+
+            nuster.cache = nst_cache_memory_alloc(sizeof(struct nst_cache));
+
+        } else {
+            global.nuster.cache.memory = nst_memory_create("cache.shm",
+                    NST_DEFAULT_DATA_SIZE, 0, 0, NULL);
+
+            if(!global.nuster.cache.memory) {
+                goto shm_err;
+            }
+
+            if(nst_shctx_init(global.nuster.cache.memory) != NST_OK) {
+                goto shm_err;
+            }
+
+            global.nuster.cache.pool.data    = create_pool("cp.data",
+                    sizeof(struct nst_cache_data), MEM_F_SHARED);
+
+            global.nuster.cache.pool.element = create_pool("cp.element",
+                    sizeof(struct nst_cache_element), MEM_F_SHARED);
+
+            global.nuster.cache.pool.chunk   = create_pool("cp.chunk",
+                    global.tune.bufsize, MEM_F_SHARED);
+
+            global.nuster.cache.pool.entry   = create_pool("cp.entry",
+                    sizeof(struct nst_cache_entry), MEM_F_SHARED);
+
+            nuster.cache = malloc(sizeof(struct nst_cache));
+        }
+
+        if(!nuster.cache) {
+            goto err;
+        }
+
+        memset(nuster.cache, 0, sizeof(*nuster.cache));
+
+        /* vary roots are not persisted, ids are not reused across restarts */
+        nuster.cache->vary_id = get_current_timestamp();
+
+        if(global.nuster.cache.root) {
+            nuster.cache->disk.file = nst_cache_memory_alloc(
+                    nst_persist_path_file_len(global.nuster.cache.root) + 1);
+
+            if(!nuster.cache->disk.file) {
+                goto err;
+            }
+        }
+
+        if(nst_shctx_init(nuster.cache) != NST_OK) {
+            goto shm_err;
+        }
+
+        if(nst_epoch_init(global.nuster.cache.memory, &nuster.cache->epoch)
+                != NST_OK) {
+
+            goto err;
+        }
+
+        if(nst_cache_dict_init() != NST_OK) {
+            goto err;
+        }
+
+        if((global.nuster.cache.evict == NST_EVICT_TINYLFU
+                    || global.nuster.cache.admit)
+                && nst_sketch_init(global.nuster.cache.memory,
+                    &nuster.cache->sketch, global.nuster.cache.dict_size
+                    / sizeof(struct nst_dict_group) * NST_DICT_GROUP_SLOTS)
+                != NST_OK) {
+
+            goto err;
+        }
+
+        if(nst_cache_stats_init() !=NST_OK) {
+            goto err;
+        }
+
+        if(!nst_cache_manager_init()) {
+            goto err;
+        }
+
+        global.nuster.cache.memory->reclaim = _nst_cache_reclaim;
+
+        nst_debug("[nuster][cache] on, data_size=%llu\n",
+                global.nuster.cache.data_size);
+    }
+
+    return;
+
+err:
+    ha_alert("Out of memory when initializing cache.\n");
+    exit(1);
+
+shm_err:
+    ha_alert("Error when initializing cache.\n");
+    exit(1);
+}
+
+int nst_cache_prebuild_key(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
+
+    char *uri_begin, *uri_end;
+    struct nst_http_hdr hdr;
+    struct ist path;
+
+    ctx->req.scheme = SCH_HTTP;
+
+#ifdef USE_OPENSSL
+    if(s->sess->listener->bind_conf->is_ssl) {
+        ctx->req.scheme = SCH_HTTPS;
+    }
+#endif
+
+    ctx->req.host.data = NULL;
+    ctx->req.host.len  = 0;
+
+    nst_http_hdr_init(&hdr);
+
+    /* in the request, see nst_cache_keep_req */
+    if(nst_http_find_header(s, msg, "Host", 4, &hdr, 0)) {
+        ctx->req.host.data = hdr.value;
+        ctx->req.host.len  = hdr.len;
+    }
+
+    path      = nst_http_path(s, msg);
+    uri_begin = path.ptr;
+    uri_end   = NULL;
+
+    ctx->req.path.data = NULL;
+    ctx->req.path.len  = 0;
+    ctx->req.uri.data  = NULL;
+    ctx->req.uri.len   = 0;
+
+    if(uri_begin) {
+        char *ptr = uri_begin;
+        uri_end   = path.ptr + path.len;
+
+        while(ptr < uri_end && *ptr != '?') {
+            ptr++;
+        }
+
+        ctx->req.path.data = uri_begin;
+        ctx->req.path.len  = ptr - uri_begin;
+        ctx->req.uri.data  = uri_begin;
+        ctx->req.uri.len   = uri_end - uri_begin;
+    }
+
+    ctx->req.query.data = NULL;
+    ctx->req.query.len  = 0;
+    ctx->req.delimiter  = 0;
+
+    if(ctx->req.uri.data) {
+        ctx->req.query.data = memchr(ctx->req.uri.data, '?',
+                uri_end - ctx->req.uri.data);
+
+        if(ctx->req.query.data) {
+            ctx->req.query.data++;
+            ctx->req.query.len = uri_end - ctx->req.query.data;
+
+            if(ctx->req.query.len) {
+                ctx->req.delimiter = 1;
+            }
+        }
+    }
+
+    ctx->req.cookie.data = NULL;
+    ctx->req.cookie.len  = 0;
+
+    nst_http_hdr_init(&hdr);
+
+    if(nst_http_find_header(s, msg, "Cookie", 6, &hdr, 0)) {
+        ctx->req.cookie.data = hdr.value;
+        ctx->req.cookie.len  = hdr.len;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Copy the host and the path of the request, which the entry is created
+ * with once the response is received
+ */
+int nst_cache_keep_req(struct nst_cache_ctx *ctx) {
+    char *buf = malloc(ctx->req.host.len + ctx->req.path.len + 1);
+
+    if(!buf) {
+        return NST_ERR;
+    }
+
+    if(ctx->req.host.data) {
+        memcpy(buf, ctx->req.host.data, ctx->req.host.len);
+        ctx->req.host.data = buf;
+    }
+
+    if(ctx->req.path.data) {
+        memcpy(buf + ctx->req.host.len, ctx->req.path.data,
+                ctx->req.path.len);
+
+        ctx->req.path.data = buf + ctx->req.host.len;
+    }
+
+    ctx->req.buf = buf;
+
+    return NST_OK;
+}
+
+int nst_cache_build_key(struct nst_cache_ctx *ctx, struct nst_rule_key **pck,
+        struct stream *s, struct http_msg *msg) {
+
+    struct http_txn *txn = s->txn;
+    struct nst_http_hdr hdr;
+    struct nst_rule_key *ck = NULL;
+
+    ctx->key = nst_cache_key_init();
+
+    if(!ctx->key) {
+        return NST_ERR;
+    }
+
+    nst_debug("[nuster][cache] Calculate key: ");
+
+    while((ck = *pck++)) {
+        int ret = NST_OK;
+
+        switch(ck->type) {
+            case NST_RULE_KEY_METHOD:
+                nst_debug("method.");
+                ret = nst_cache_key_append(ctx->key,
+                        http_known_methods[txn->meth].ptr,
+                        http_known_methods[txn->meth].len);
+
+                break;
+            case NST_RULE_KEY_SCHEME:
+                nst_debug("scheme.");
+                ret = nst_cache_key_append(ctx->key,
+                        ctx->req.scheme == SCH_HTTPS ? "HTTPS" : "HTTP",
+                        ctx->req.scheme == SCH_HTTPS ? 5 : 4);
+
+                break;
+            case NST_RULE_KEY_HOST:
+                nst_debug("host.");
+
+                if(ctx->req.host.data) {
+                    ret = nst_cache_key_append(ctx->key, ctx->req.host.data,
+                            ctx->req.host.len);
+                } else {
+                    ret = nst_cache_key_advance(ctx->key, 2);
+                }
+
+                break;
+            case NST_RULE_KEY_URI:
+                nst_debug("uri.");
+
+                if(ctx->req.uri.data) {
+                    ret = nst_cache_key_append(ctx->key, ctx->req.uri.data,
+                            ctx->req.uri.len);
+
+                } else {
+                    ret = nst_cache_key_advance(ctx->key, 2);
+                }
+
+                break;
+            case NST_RULE_KEY_PATH:
+                nst_debug("path.");
+
+                if(ctx->req.path.data) {
+                    ret = nst_cache_key_append(ctx->key, ctx->req.path.data,
+                            ctx->req.path.len);
+
+                } else {
+                    ret = nst_cache_key_advance(ctx->key, 2);
+                }
+
+                break;
+            case NST_RULE_KEY_DELIMITER:
+                nst_debug("delimiter.");
+
+                if(ctx->req.delimiter) {
+                    ret = nst_cache_key_append(ctx->key, "?", 1);
+                } else {
+                    ret = nst_cache_key_advance(ctx->key, 2);
+                }
+
+                break;
+            case NST_RULE_KEY_QUERY:
+                nst_debug("query.");
+
+                if(ctx->req.query.data && ctx->req.query.len) {
+                    ret = nst_cache_key_append(ctx->key, ctx->req.query.data,
+                            ctx->req.query.len);
+
+                } else {
+                    ret = nst_cache_key_advance(ctx->key, 2);
+                }
+
+                break;
+            case NST_RULE_KEY_PARAM:
+                nst_debug("param_%s.", ck->data);
+
+                if(ctx->req.query.data && ctx->req.query.len) {
+                    char *v = NULL;
+                    int v_l = 0;
+
+                    if(nst_req_find_param(ctx->req.query.data,
+                                ctx->req.query.data + ctx->req.query.len,
+                                ck->data, &v, &v_l) == NST_OK) {
+
+                        ret = nst_cache_key_append(ctx->key, v, v_l);
+                        break;
+                    }
+
+                }
+
+                ret = nst_cache_key_advance(ctx->key, 2);
+                break;
+            case NST_RULE_KEY_HEADER: {
+                int values = 0;
+
+                nst_http_hdr_init(&hdr);
+                nst_debug("header_%s.", ck->data);
+
+                while(nst_http_find_header(s, msg, ck->data, ck->len,
+                            &hdr, 0)) {
+
+                    ret = nst_cache_key_append(ctx->key, hdr.value, hdr.len);
+                    values++;
+                }
+
+                ret = ret == NST_OK && nst_cache_key_advance(ctx->key,
+                        values ? 1 : 2);
+
+                break;
+            }
+            case NST_RULE_KEY_COOKIE:
+                nst_debug("cookie_%s.", ck->data);
+
+                if(ctx->req.cookie.data) {
+                    char *v = NULL;
+                    size_t v_l = 0;
+
+                    if(http_extract_cookie_value(ctx->req.cookie.data,
+                                ctx->req.cookie.data + ctx->req.cookie.len,
+                                ck->data, ck->len, 1, &v, &v_l)) {
+
+                        ret = nst_cache_key_append(ctx->key, v, v_l);
+                        break;
+                    }
+
+                }
+
+                ret = nst_cache_key_advance(ctx->key, 2);
+                break;
+            case NST_RULE_KEY_BODY:
+                nst_debug("body.");
+
+                if(txn->meth == HTTP_METH_POST || txn->meth == HTTP_METH_PUT) {
+                    struct ist body = ist2(NULL, 0);
+
+                    if(s->be->options & PR_O_WREQ_BODY) {
+                        body = nst_http_body(s, msg);
+                    }
+
+                    if(body.len) {
+                        ret = nst_cache_key_append(ctx->key, body.ptr,
+                                body.len);
+
+                    } else {
+                        ret = nst_cache_key_advance(ctx->key, 2);
+                    }
+                }
+                break;
+            default:
+                ret = NST_ERR;
+                break;
+        }
+
+        if(ret != NST_OK) {
+            return NST_ERR;
+        }
+    }
+
+    /* the slice of the object, see nst_cache_slice_index */
+    if(ctx->slice) {
+        char buf[24];
+        int n = snprintf(buf, sizeof(buf), "%"PRIu64, ctx->slice - 1);
+
+        nst_debug("slice.");
+
+        if(nst_cache_key_append(ctx->key, buf, n) != NST_OK) {
+            return NST_ERR;
+        }
+    }
+
+    nst_debug("\n");
+    return NST_OK;
+}
+
+struct buffer *nst_cache_build_purge_key(struct stream *s,
+        struct http_msg *msg) {
+
+    int https;
+    struct nst_http_hdr hdr;
+    struct ist path;
+    int ret;
+    struct buffer *key;
+
+    /* method.scheme.host.uri */
+    key = nst_cache_key_init();
+
+    if(!key) {
+        return NULL;
+    }
+
+    ret = nst_cache_key_append(key, "GET", 3);
+    if(ret != NST_OK) {
+        return NULL;
+    }
+
+    https = 0;
+#ifdef USE_OPENSSL
+    if(s->sess->listener->bind_conf->is_ssl) {
+        https = 1;
+    }
+#endif
+
+    ret = nst_cache_key_append(key, https ? "HTTPS": "HTTP",
+            strlen(https ? "HTTPS": "HTTP"));
+    if(ret != NST_OK) {
+        return NULL;
+    }
+
+    nst_http_hdr_init(&hdr);
+    if(nst_http_find_header(s, msg, "Host", 4, &hdr, 0)) {
+        ret = nst_cache_key_append(key, hdr.value, hdr.len);
+        if(ret != NST_OK) {
+            return NULL;
+        }
+    }
+
+    path = nst_http_path(s, msg);
+    if(path.ptr) {
+        ret = nst_cache_key_append(key, path.ptr, path.len);
+        if(ret != NST_OK) {
+            return NULL;
+        }
+    }
+
+    return key;
+}
+
+/*
+ * Check if valid cache exists
+ */
+int nst_cache_exists(struct nst_cache_ctx *ctx, int mode, int down) {
+    struct nst_cache_entry *entry = NULL;
+    int ret = NST_CACHE_CTX_STATE_INIT;
+
+    if(!ctx->key) {
+        return ret;
+    }
+
+    /* no-op if neither tinylfu nor admit needs the sketch */
+    nst_sketch_increment(&nuster.cache->sketch, ctx->hash);
+
+    /* hits are served without taking the shard lock */
+    if(nst_epoch_enter(&nuster.cache->epoch) == NST_OK) {
+        struct nst_cache_data *data = NULL;
+
+        entry = nst_cache_dict_lookup(ctx->key, ctx->hash);
+
+        /* elected for another rule with the same key */
+        if(entry && entry != ctx->refresh) {
+            data = _nst_cache_data_get(entry);
+        }
+
+        if(data) {
+            ctx->data = data;
+            nst_evict_touch(&entry->access);
+
+            /* the hit holds the data, so do its validators */
+            ctx->res.etag          = data->etag;
+            ctx->res.last_modified = data->last_modified;
+        }
+
+        nst_epoch_leave(&nuster.cache->epoch);
+
+        if(data) {
+            return NST_CACHE_CTX_STATE_HIT;
+        }
+    }
+
+    nst_shctx_lock(nst_cache_dict_shard(ctx->hash));
+    entry = nst_cache_dict_get(ctx->key, ctx->hash);
+
+    if(entry) {
+
+        /*
+         * before disk, entry is set to valid after response is cached to memory
+         * now we can save cache to both memory and disk, and we can also save
+         * cache to disk only.
+         * To keep from big changes, we still use valid to indicate the cache is
+         * in memory, and use another *file to indicate the disk persistence.
+         * So if valid, return memory cache
+         * if invalid and file is set, return disk cache
+         * if entry is null, check disk and return cache if exists
+         * Since valid only indicates whether or not cached is in memory, the
+         * state is set to invalid even if the cache is successfully saved to
+         * disk in disk_only mode
+         */
+        /*
+         * the first request to find an entry stale refreshes it from the
+         * server, the others are served the stale data meanwhile if they
+         * can be. Once the server failed, it is retried once per second.
+         */
+        if(entry->state == NST_CACHE_ENTRY_STATE_VALID
+                && nst_cache_entry_stale(entry) && !ctx->refresh && !down
+                && entry->failed < nst_time_now()) {
+
+            entry->state = NST_CACHE_ENTRY_STATE_REFRESH;
+            ctx->refresh = entry;
+        } else if((entry->state == NST_CACHE_ENTRY_STATE_VALID
+                    || entry->state == NST_CACHE_ENTRY_STATE_REFRESH)
+                && entry->data && entry != ctx->refresh
+                && (!nst_cache_entry_expired(entry)
+                    || nst_cache_entry_servable(entry, down))) {
+
+            ctx->data = entry->data;
+            __atomic_add_fetch(&ctx->data->clients, 1, __ATOMIC_SEQ_CST);
+            nst_evict_touch(&entry->access);
+
+            ctx->res.etag          = ctx->data->etag;
+            ctx->res.last_modified = ctx->data->last_modified;
+
+            ret = NST_CACHE_CTX_STATE_HIT;
+        }
+
+        /*
+         * being created by another request of this process, follow it
+         * instead of fetching it again once it has started to be appended
+         */
+        if(entry->state == NST_CACHE_ENTRY_STATE_CREATING && entry->data
+                && entry->data->proc == relative_pid
+                && (_nst_cache_element_len(entry->data->element)
+                    || _nst_cache_element_next(entry->data->element))) {
+
+            ctx->data = entry->data;
+            __atomic_add_fetch(&ctx->data->clients, 1, __ATOMIC_SEQ_CST);
+
+            ctx->res.etag          = ctx->data->etag;
+            ctx->res.last_modified = ctx->data->last_modified;
+
+            ret = NST_CACHE_CTX_STATE_HIT;
+        }
+
+        if(entry->state == NST_CACHE_ENTRY_STATE_INVALID && entry->file) {
+            ctx->disk.file = entry->file;
             ret = NST_CACHE_CTX_STATE_CHECK_PERSIST;
         }
     } else {
-        if(mode != NST_DISK_OFF) {
-            ctx->disk.file = NULL;
+        if(mode != NST_DISK_OFF) {
+            ctx->disk.file = NULL;
+
+            if(nuster.cache->disk.loaded) {
+                ret = NST_CACHE_CTX_STATE_INIT;
+            } else {
+                ret = NST_CACHE_CTX_STATE_CHECK_PERSIST;
+            }
+        }
+    }
+
+    nst_shctx_unlock(nst_cache_dict_shard(ctx->hash));
+
+    if(ret == NST_CACHE_CTX_STATE_CHECK_PERSIST) {
+
+        if(ctx->disk.file) {
+
+            if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash, down)
+                    == NST_OK) {
+
+                ret = NST_CACHE_CTX_STATE_HIT_DISK;
+            } else {
+                ret = NST_CACHE_CTX_STATE_INIT;
+            }
+        } else {
+            ctx->disk.file = nst_cache_memory_alloc(
+                    nst_persist_path_file_len(global.nuster.cache.root) + 1);
+
+            if(!ctx->disk.file) {
+                ret = NST_CACHE_CTX_STATE_INIT;
+            } else {
+
+                if(nst_persist_exists(global.nuster.cache.root, &ctx->disk,
+                            ctx->key, ctx->hash, down) == NST_OK) {
+
+                    ret = NST_CACHE_CTX_STATE_HIT_DISK;
+                } else {
+                    nst_cache_memory_free(ctx->disk.file);
+                    ret = NST_CACHE_CTX_STATE_INIT;
+                }
+            }
+        }
+    }
+
+    return ret;
+}
+
+/*
+ * Check if the response is worth storing: its key must have been requested
+ * at least admit times recently and its known length must not exceed the
+ * max-size of the rule
+ */
+int nst_cache_admit(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
+
+    uint64_t body_len;
+    int admitted = 1;
+
+    if(!global.nuster.cache.admit && !ctx->rule->max_size) {
+        return NST_OK;
+    }
+
+    if(ctx->rule->max_size && nst_http_body_len(s, msg, &body_len) == NST_OK
+            && ctx->header_len + body_len > ctx->rule->max_size) {
+
+        admitted = 0;
+    } else if(nst_sketch_frequency(&nuster.cache->sketch, ctx->hash)
+            < global.nuster.cache.admit) {
+
+        admitted = 0;
+    }
+
+    nst_cache_stats_update_admit(admitted);
+
+    return admitted ? NST_OK : NST_ERR;
+}
+
+/*
+ * Start to create cache,
+ * if cache does not exist, add a new nst_cache_entry
+ * if cache exists but expired, add a new nst_cache_data to the entry
+ * otherwise, set the corresponding state: bypass, wait
+ */
+void nst_cache_create(struct nst_cache_ctx *ctx) {
+    struct nst_cache_entry *entry = NULL;
+    struct nst_cache_vary  *vary  = NULL;
+
+    nst_shctx_lock(nst_cache_dict_shard(ctx->hash));
+    entry = nst_cache_dict_get(ctx->key, ctx->hash);
+
+    if(entry) {
+
+        if(entry->state == NST_CACHE_ENTRY_STATE_CREATING) {
+            ctx->state = NST_CACHE_CTX_STATE_WAIT;
+        } else if(entry->state == NST_CACHE_ENTRY_STATE_REFRESH) {
+
+            /* the new data replaces the stale one once complete */
+            if(entry == ctx->refresh && ctx->rule->disk != NST_DISK_ONLY) {
+                ctx->data = nst_cache_data_new(ctx);
+
+                if(!ctx->data) {
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                    ctx->full  = 1;
+                } else {
+                    ctx->state   = NST_CACHE_CTX_STATE_CREATE;
+                    ctx->entry   = entry;
+                    ctx->element = ctx->data->element;
+
+                    entry->header_len = ctx->header_len;
+                }
+            } else {
+                ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+            }
+
+        } else if(entry->state == NST_CACHE_ENTRY_STATE_VALID) {
+            ctx->state = NST_CACHE_CTX_STATE_HIT;
+        } else if(entry->state == NST_CACHE_ENTRY_STATE_EXPIRED
+                || entry->state == NST_CACHE_ENTRY_STATE_INVALID) {
+
+            entry->state = NST_CACHE_ENTRY_STATE_CREATING;
+            nst_evict_init(&entry->access);
+
+            /* a purged vary root cached without vary */
+            vary = entry->vary;
+            __atomic_store_n(&entry->vary, NULL, __ATOMIC_RELEASE);
+
+            /* the old data is left to the data cleanup */
+            nst_cache_entry_drop_data(entry);
+
+            if(ctx->rule->disk != NST_DISK_ONLY) {
+                entry->data = nst_cache_data_new(ctx);
+
+                if(!entry->data) {
+                    entry->state = NST_CACHE_ENTRY_STATE_INVALID;
+                    ctx->state   = NST_CACHE_CTX_STATE_BYPASS;
+                    ctx->full    = 1;
+                } else {
+                    ctx->state   = NST_CACHE_CTX_STATE_CREATE;
+                    ctx->entry   = entry;
+
+                    entry->etag          = entry->data->etag;
+                    entry->last_modified = entry->data->last_modified;
+
+                    ctx->data    = entry->data;
+                    ctx->element = entry->data->element;
+                }
+            } else {
+                ctx->state = NST_CACHE_CTX_STATE_CREATE;
+                ctx->entry = entry;
+            }
+
+        } else {
+            ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+        }
+    } else {
+        entry = nst_cache_dict_set(ctx);
+
+        if(entry) {
+            ctx->state = NST_CACHE_CTX_STATE_CREATE;
+            ctx->entry = entry;
+            ctx->data  = entry->data;
+
+            if(ctx->data) {
+                ctx->element = entry->data->element;
+            }
+        } else {
+            ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+            ctx->full  = 1;
+        }
+    }
+
+    nst_shctx_unlock(nst_cache_dict_shard(ctx->hash));
+
+    nst_cache_dict_vary_free(vary);
+
+    if(ctx->state == NST_CACHE_CTX_STATE_CREATE
+            && (ctx->rule->disk == NST_DISK_SYNC
+                || ctx->rule->disk == NST_DISK_ONLY)) {
+
+        /* the entry still has the stale ones while refreshed */
+        struct nst_str *etag          = &ctx->entry->etag;
+        struct nst_str *last_modified = &ctx->entry->last_modified;
+
+        if(ctx->data) {
+            etag          = &ctx->data->etag;
+            last_modified = &ctx->data->last_modified;
+        }
+
+        ctx->disk.file = nst_cache_memory_alloc(
+                nst_persist_path_file_len(global.nuster.cache.root) + 1);
+
+        if(!ctx->disk.file) {
+            return;
+        }
+
+        if(nst_persist_init(global.nuster.cache.root, ctx->disk.file,
+                    ctx->hash) != NST_OK) {
+
+            return;
+        }
+
+        ctx->disk.fd = nst_persist_create(ctx->disk.file);
+
+        nst_persist_meta_init(ctx->disk.meta, (char)(ctx->rule->disk
+                    | (ctx->htx ? NST_PERSIST_MODE_HTX : 0)),
+                ctx->hash, 0, 0, ctx->header_len, ctx->entry->key->data,
+                ctx->entry->host.len, ctx->entry->path.len,
+                etag->len, last_modified->len);
+
+        nst_persist_write_key(&ctx->disk, ctx->entry->key);
+        nst_persist_write_host(&ctx->disk, &ctx->entry->host);
+        nst_persist_write_path(&ctx->disk, &ctx->entry->path);
+        nst_persist_write_etag(&ctx->disk, etag);
+        nst_persist_write_last_modified(&ctx->disk, last_modified);
+
+    }
+}
+
+#if defined(USE_ZLIB)
+/*
+ * Compress len bytes of the body and append the output as chunks
+ */
+static int _nst_cache_gzip_deflate(struct nst_cache_ctx *ctx, char *p,
+        int len, int flush) {
+
+    struct nst_cache_gzip *gzip = ctx->gzip;
+    struct buffer *out          = get_trash_chunk();
+    char frame[NST_CACHE_GZIP_FRAME + 1];
+    int max = out->size - NST_CACHE_GZIP_FRAME - 2;
+    int ret;
+
+    gzip->z.next_in  = (Bytef *)p;
+    gzip->z.avail_in = len;
+
+    do {
+        gzip->z.next_out  = (Bytef *)out->area + NST_CACHE_GZIP_FRAME;
+        gzip->z.avail_out = max;
+
+        ret = deflate(&gzip->z, flush);
+
+        if(ret == Z_STREAM_ERROR) {
+            return NST_ERR;
+        }
+
+        len = max - gzip->z.avail_out;
+
+        if(!len) {
+            continue;
+        }
+
+        snprintf(frame, sizeof(frame), "%08x\r\n", len);
+        memcpy(out->area, frame, NST_CACHE_GZIP_FRAME);
+        memcpy(out->area + NST_CACHE_GZIP_FRAME + len, "\r\n", 2);
+
+        if(_nst_cache_data_write(ctx, out->area,
+                    NST_CACHE_GZIP_FRAME + len + 2) != NST_OK) {
+
+            ctx->full = 1;
+
+            return NST_ERR;
+        }
+
+    } while(gzip->z.avail_out == 0
+            || (flush == Z_FINISH && ret != Z_STREAM_END));
+
+    return NST_OK;
+}
+
+/*
+ * Compress the body of the response, decoded if chunked, the headers are
+ * stored first, rewritten for the compressed body
+ */
+static int _nst_cache_gzip_update(struct nst_cache_ctx *ctx,
+        struct http_msg *msg, long msg_len) {
+
+    static const char *drop[] = { "Content-Length", "Transfer-Encoding",
+        NULL };
+
+    struct nst_cache_gzip *gzip = ctx->gzip;
+    struct buffer *buf          = &msg->chn->buf;
+    size_t offset               = co_data(msg->chn);
+
+    if(gzip->state == NST_CACHE_GZIP_HEADER) {
+        struct buffer *in  = get_trash_chunk();
+        struct buffer *out = get_trash_chunk();
+
+        b_getblk(buf, in->area, msg_len, offset);
+
+        if(_nst_cache_header_rewrite(in->area, msg_len, out, drop,
+                    "Content-Encoding: gzip\r\n"
+                    "Transfer-Encoding: chunked\r\n"
+                    "Vary: Accept-Encoding\r\n") != NST_OK) {
+
+            return NST_ERR;
+        }
+
+        /* chunked, whatever the version of the server */
+        if(out->data > 8 && !memcmp(out->area, "HTTP/1.0", 8)) {
+            out->area[7] = '1';
+        }
+
+        if(_nst_cache_data_write(ctx, out->area, out->data) != NST_OK) {
+            ctx->full = 1;
+
+            return NST_ERR;
+        }
+
+        if(msg->flags & HTTP_MSGF_CNT_LEN) {
+            __atomic_store_n(&ctx->data->gunzip_len, msg->body_len,
+                    __ATOMIC_RELAXED);
+        }
+
+        __atomic_store_n(&ctx->data->header_len, out->data, __ATOMIC_RELEASE);
+
+        gzip->state = msg->flags & HTTP_MSGF_TE_CHNK
+            ? NST_CACHE_GZIP_SIZE : NST_CACHE_GZIP_IDENTITY;
+
+        _nst_cache_data_wakeup(ctx->data);
+
+        return NST_OK;
+    }
+
+    while(msg_len) {
+        char *p = b_peek(buf, offset);
+        long len = b_contig_data(buf, offset);
+        long n;
+
+        if(len > msg_len) {
+            len = msg_len;
+        }
+
+        offset  += len;
+        msg_len -= len;
+
+        while(len) {
+
+            switch(gzip->state) {
+                case NST_CACHE_GZIP_SIZE:
+
+                    if(isxdigit((unsigned char)*p)) {
+                        gzip->left = (gzip->left << 4) | hex2i(*p);
+                    } else if(*p == '\n') {
+                        gzip->state = gzip->left
+                            ? NST_CACHE_GZIP_DATA : NST_CACHE_GZIP_TRAILERS;
+                    } else if(*p != '\r') {
+                        gzip->state = NST_CACHE_GZIP_EXT;
+                    }
+
+                    n = 1;
+
+                    break;
+                case NST_CACHE_GZIP_EXT:
+
+                    if(*p == '\n') {
+                        gzip->state = gzip->left
+                            ? NST_CACHE_GZIP_DATA : NST_CACHE_GZIP_TRAILERS;
+                    }
+
+                    n = 1;
+
+                    break;
+                case NST_CACHE_GZIP_DATA:
+                    n = len < gzip->left ? len : gzip->left;
+
+                    if(_nst_cache_gzip_deflate(ctx, p, n, Z_NO_FLUSH)
+                            != NST_OK) {
+
+                        return NST_ERR;
+                    }
+
+                    gzip->left -= n;
+
+                    if(!gzip->left) {
+                        gzip->state = NST_CACHE_GZIP_CRLF;
+                    }
+
+                    break;
+                case NST_CACHE_GZIP_CRLF:
+
+                    if(*p == '\n') {
+                        gzip->state = NST_CACHE_GZIP_SIZE;
+                    }
+
+                    n = 1;
+
+                    break;
+                case NST_CACHE_GZIP_IDENTITY:
+                    n = len;
+
+                    if(_nst_cache_gzip_deflate(ctx, p, n, Z_NO_FLUSH)
+                            != NST_OK) {
+
+                        return NST_ERR;
+                    }
+
+                    break;
+                default:
+                    /* the trailers are not cached */
+                    n = len;
+            }
+
+            p   += n;
+            len -= n;
+        }
+    }
+
+    _nst_cache_data_wakeup(ctx->data);
+
+    return NST_OK;
+}
+#endif
+
+/*
+ * Add partial http data to nst_cache_data
+ */
+int nst_cache_update(struct nst_cache_ctx *ctx, struct http_msg *msg,
+        long msg_len) {
+
+    /* chunked or close delimited, the length was unknown on admission */
+    if(ctx->rule->max_size
+            && ctx->cache_len + msg_len > ctx->rule->max_size) {
+
+        nst_cache_stats_update_admit(0);
+
+        return NST_ERR;
+    }
+
+#if defined(USE_ZLIB)
+    if(ctx->gzip) {
+        return _nst_cache_gzip_update(ctx, msg, msg_len);
+    }
+#endif
+
+    if(ctx->rule->disk == NST_DISK_ONLY)  {
+        char *data = b_orig(&msg->chn->buf);
+        char *p    = ci_head(msg->chn);
+        int size   = msg->chn->buf.size;
+
+        if(p - data + msg_len > size) {
+            int right = data + size - p;
+            int left  = msg_len - right;
+
+            nst_persist_write(&ctx->disk, p, right);
+            nst_persist_write(&ctx->disk, data, left);
+        } else {
+            nst_persist_write(&ctx->disk, p, msg_len);
+        }
+        ctx->cache_len += msg_len;
+    } else if(_nst_cache_data_append(ctx, msg, msg_len) != NST_OK) {
+        ctx->full = 1;
+
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Copy len bytes to the extents of ctx or to its file with disk only
+ */
+static int _nst_cache_write(struct nst_cache_ctx *ctx, char *p, int len) {
+
+    if(ctx->rule->disk == NST_DISK_ONLY) {
+        nst_persist_write(&ctx->disk, p, len);
+        ctx->cache_len += len;
+    } else if(_nst_cache_data_write(ctx, p, len) != NST_OK) {
+        ctx->full = 1;
+
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * The length of the header stored by nst_cache_update_header
+ */
+int nst_cache_htx_header_len(struct http_msg *msg) {
+    struct htx *htx = htxbuf(&msg->chn->buf);
+    int32_t pos;
+    int len = 0;
+
+    for(pos = htx_get_head(htx); pos != -1; pos = htx_get_next(htx, pos)) {
+        struct htx_blk *blk    = htx_get_blk(htx, pos);
+        enum htx_blk_type type = htx_get_blk_type(blk);
+
+        if(type != HTX_BLK_UNUSED) {
+            len += 4 + htx_get_blksz(blk);
+        }
+
+        if(type == HTX_BLK_EOH) {
+            break;
+        }
+    }
+
+    return len;
+}
+
+/*
+ * With HTX, the header of the response is stored as its blocks up to EOH,
+ * each one is its info followed by its payload, see _nst_cache_htx_header
+ */
+int nst_cache_update_header(struct nst_cache_ctx *ctx, struct http_msg *msg) {
+    struct htx *htx = htxbuf(&msg->chn->buf);
+    int32_t pos;
+
+    for(pos = htx_get_head(htx); pos != -1; pos = htx_get_next(htx, pos)) {
+        struct htx_blk *blk    = htx_get_blk(htx, pos);
+        enum htx_blk_type type = htx_get_blk_type(blk);
+
+        if(type == HTX_BLK_UNUSED) {
+            continue;
+        }
+
+        if(_nst_cache_write(ctx, (char *)&blk->info, 4) != NST_OK
+                || _nst_cache_write(ctx, htx_get_blk_ptr(htx, blk),
+                    htx_get_blksz(blk)) != NST_OK) {
+
+            return NST_ERR;
+        }
+
+        if(type == HTX_BLK_EOH) {
+            break;
+        }
+    }
+
+    if(ctx->data) {
+        _nst_cache_data_wakeup(ctx->data);
+    }
+
+    return NST_OK;
+}
+
+/*
+ * With HTX, add the DATA blocks of the len bytes of the response at offset,
+ * the trailers are not kept
+ */
+int nst_cache_update_htx(struct nst_cache_ctx *ctx, struct http_msg *msg,
+        unsigned int offset, unsigned int len) {
+
+    struct htx *htx = htxbuf(&msg->chn->buf);
+    struct htx_ret ret;
+    struct htx_blk *blk;
+
+    ret    = htx_find_blk(htx, offset);
+    blk    = ret.blk;
+    offset = ret.ret;
+
+    while(blk && len) {
+        uint32_t sz = htx_get_blksz(blk) - offset;
+
+        if(sz > len) {
+            sz = len;
+        }
+
+        if(htx_get_blk_type(blk) == HTX_BLK_DATA) {
+            char *p = (char *)htx_get_blk_ptr(htx, blk) + offset;
+
+            /* chunked or close delimited, see nst_cache_update */
+            if(ctx->rule->max_size
+                    && ctx->cache_len + sz > ctx->rule->max_size) {
+
+                nst_cache_stats_update_admit(0);
+
+                return NST_ERR;
+            }
+
+            if(_nst_cache_write(ctx, p, sz) != NST_OK) {
+
+                return NST_ERR;
+            }
+        }
+
+        len   -= sz;
+        offset = 0;
+        blk    = htx_get_next_blk(htx, blk);
+    }
+
+    if(ctx->data) {
+        _nst_cache_data_wakeup(ctx->data);
+    }
+
+    return NST_OK;
+}
+
+/*
+ * Replace the stale data of the entry refreshed by ctx, lock free readers
+ * see either data with the expire which goes with it or the stale one
+ * being invalidated
+ */
+static void _nst_cache_refresh_finish(struct nst_cache_ctx *ctx,
+        uint64_t expire) {
+
+    struct nst_cache_entry *entry = ctx->refresh;
+    struct nst_cache_data *data   = entry->data;
+
+    nst_shctx_lock(nst_cache_dict_shard(entry->hash));
+
+    entry->etag          = ctx->data->etag;
+    entry->last_modified = ctx->data->last_modified;
+    entry->expire        = expire;
+    entry->stale         = ctx->rule->stale;
+    entry->stale_error   = ctx->rule->stale_error;
+    entry->failed        = 0;
+
+    __atomic_store_n(&entry->data, ctx->data, __ATOMIC_RELEASE);
+
+    /* freed by the data cleanup once no longer served, purged if NULL */
+    if(data) {
+        __atomic_store_n(&data->invalid, 1, __ATOMIC_SEQ_CST);
+    }
+
+    __atomic_store_n(&entry->state, NST_CACHE_ENTRY_STATE_VALID,
+            __ATOMIC_RELEASE);
+
+    nst_shctx_unlock(nst_cache_dict_shard(entry->hash));
+
+    ctx->refresh = NULL;
+}
+
+/*
+ * cache done
+ */
+void nst_cache_finish(struct nst_cache_ctx *ctx) {
+    uint64_t expire = 0;
+
+    ctx->state = NST_CACHE_CTX_STATE_DONE;
+
+    if(ctx->ttl != 0) {
+        expire = nst_time_now() + ctx->ttl;
+    }
+
+    if(ctx->rule->disk == NST_DISK_SYNC || ctx->rule->disk == NST_DISK_ONLY) {
+
+        nst_persist_meta_set_expire(ctx->disk.meta, expire);
+
+        nst_persist_meta_set_stale(ctx->disk.meta, ctx->rule->stale_error);
+
+        nst_persist_meta_set_cache_len(ctx->disk.meta, ctx->cache_len);
+
+        nst_persist_write_meta(&ctx->disk);
+
+        ctx->entry->file = ctx->disk.file;
+    }
+
+    /* the followers are done before the entry can be evicted */
+    if(ctx->data) {
+        __atomic_store_n(&ctx->data->state, NST_CACHE_DATA_STATE_DONE,
+                __ATOMIC_RELEASE);
+
+        _nst_cache_data_wakeup(ctx->data);
+    }
+
+    if(ctx->refresh) {
+        _nst_cache_refresh_finish(ctx, expire);
+
+        return;
+    }
+
+    ctx->entry->expire      = expire;
+    ctx->entry->stale       = ctx->rule->stale;
+    ctx->entry->stale_error = ctx->rule->stale_error;
+    ctx->entry->failed      = 0;
+
+    /*
+     * lock free readers must see the whole data and expire once valid,
+     * and the entry can be evicted from then on
+     */
+    if(ctx->rule->disk == NST_DISK_ONLY) {
+        __atomic_store_n(&ctx->entry->state, NST_CACHE_ENTRY_STATE_INVALID,
+                __ATOMIC_RELEASE);
+    } else {
+        __atomic_store_n(&ctx->entry->state, NST_CACHE_ENTRY_STATE_VALID,
+                __ATOMIC_RELEASE);
+    }
+}
+
+void nst_cache_abort(struct nst_cache_ctx *ctx) {
+
+    /* the followers cannot go to the server once the headers are sent */
+    if(ctx->data) {
+        __atomic_store_n(&ctx->data->state, NST_CACHE_DATA_STATE_ABORTED,
+                __ATOMIC_RELEASE);
+
+        _nst_cache_data_wakeup(ctx->data);
+    }
+
+    /*
+     * the stale data is kept, the new one was not linked to the entry,
+     * see nst_cache_refresh_abort
+     */
+    if(ctx->refresh) {
+
+        if(ctx->data) {
+            __atomic_store_n(&ctx->data->invalid, 1, __ATOMIC_SEQ_CST);
+        }
+
+        return;
+    }
+
+    ctx->entry->state = NST_CACHE_ENTRY_STATE_INVALID;
+}
+
+/*
+ * The request elected to refresh a stale entry did not, the response was
+ * not cached for example. Another one can be elected within the window.
+ * If the server failed, the stale data is served within stale-if-error.
+ */
+void nst_cache_refresh_abort(struct nst_cache_ctx *ctx, int failed) {
+    struct nst_cache_entry *entry = ctx->refresh;
+
+    nst_shctx_lock(nst_cache_dict_shard(entry->hash));
+
+    /* purged meanwhile */
+    if(entry->data) {
+        entry->state = NST_CACHE_ENTRY_STATE_VALID;
+
+        if(failed) {
+            entry->failed = nst_time_now();
+        }
+    } else {
+        entry->state = NST_CACHE_ENTRY_STATE_EXPIRED;
+    }
+
+    nst_shctx_unlock(nst_cache_dict_shard(entry->hash));
+
+    ctx->refresh = NULL;
+}
+
+/*
+ * With slice, Range requests are cached by slices of the rule size. The
+ * slice holding the first byte requested is fetched with a Range of its own
+ * and stored under the key extended with its index, see
+ * nst_cache_build_key, the ranges are then served from it. Set ctx->slice
+ * to the index plus one, or 0 for a rule without slice. Return NST_ERR if
+ * the rule does not apply: the request is not a single range from a
+ * position.
+ */
+int nst_cache_slice_index(struct nst_cache_ctx *ctx, struct nst_rule *rule,
+        struct stream *s, struct http_msg *msg) {
+
+    struct nst_http_hdr hdr;
+    uint64_t first, last;
+    char *p, *end;
 
-            if(nuster.cache->disk.loaded) {
-                ret = NST_CACHE_CTX_STATE_INIT;
-            } else {
-                ret = NST_CACHE_CTX_STATE_CHECK_PERSIST;
-            }
-        }
+    ctx->slice = 0;
+
+    if(!rule->slice) {
+        return NST_OK;
     }
 
-    nst_shctx_unlock(&nuster.cache->dict[0]);
+    if(!_nst_cache_range_find(s, &hdr)) {
+        return NST_ERR;
+    }
 
-    if(ret == NST_CACHE_CTX_STATE_CHECK_PERSIST) {
+    p   = hdr.value;
+    end = p + hdr.len;
 
-        if(ctx->disk.file) {
+    if(hdr.len < 6 || strncasecmp(p, "bytes=", 6)) {
+        return NST_ERR;
+    }
 
-            if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash) == NST_OK) {
+    p += 6;
 
-                ret = NST_CACHE_CTX_STATE_HIT_DISK;
-            } else {
-                ret = NST_CACHE_CTX_STATE_INIT;
-            }
-        } else {
-            ctx->disk.file = nst_cache_memory_alloc(
-                    nst_persist_path_file_len(global.nuster.cache.root) + 1);
+    if(_nst_cache_range_number(&p, end, &first) != NST_OK
+            || p == end || *p++ != '-') {
 
-            if(!ctx->disk.file) {
-                ret = NST_CACHE_CTX_STATE_INIT;
-            } else {
+        return NST_ERR;
+    }
 
-                if(nst_persist_exists(global.nuster.cache.root, &ctx->disk,
-                            ctx->key, ctx->hash) == NST_OK) {
+    last = UINT64_MAX;
 
-                    ret = NST_CACHE_CTX_STATE_HIT_DISK;
-                } else {
-                    nst_cache_memory_free(ctx->disk.file);
-                    ret = NST_CACHE_CTX_STATE_INIT;
-                }
-            }
-        }
+    if(p < end && _nst_cache_range_number(&p, end, &last) != NST_OK) {
+        return NST_ERR;
     }
 
-    return ret;
+    if(p != end || last < first) {
+        return NST_ERR;
+    }
+
+    ctx->slice       = first / rule->slice + 1;
+    ctx->range.first = first;
+    ctx->range.last  = last;
+
+    return NST_OK;
 }
 
 /*
- * Start to create cache,
- * if cache does not exist, add a new nst_cache_entry
- * if cache exists but expired, add a new nst_cache_data to the entry
- * otherwise, set the corresponding state: bypass, wait
+ * Ask the server for the whole slice of the request instead of its ranges
  */
-void nst_cache_create(struct nst_cache_ctx *ctx) {
-    struct nst_cache_entry *entry = NULL;
+int nst_cache_slice_request(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
 
-    nst_shctx_lock(&nuster.cache->dict[0]);
-    entry = nst_cache_dict_get(ctx->key, ctx->hash);
+    struct buffer *buf = get_trash_chunk();
+    uint64_t first     = (ctx->slice - 1) * ctx->rule->slice;
+    struct nst_http_hdr hdr;
 
-    if(entry) {
+    nst_http_hdr_init(&hdr);
 
-        if(entry->state == NST_CACHE_ENTRY_STATE_CREATING) {
-            ctx->state = NST_CACHE_CTX_STATE_WAIT;
-        } else if(entry->state == NST_CACHE_ENTRY_STATE_VALID) {
-            ctx->state = NST_CACHE_CTX_STATE_HIT;
-        } else if(entry->state == NST_CACHE_ENTRY_STATE_EXPIRED
-                || entry->state == NST_CACHE_ENTRY_STATE_INVALID) {
+    while(nst_http_find_header(s, msg, "Range", 5, &hdr, 1)) {
+        nst_http_remove_header(s, msg, &hdr);
+    }
 
-            entry->state = NST_CACHE_ENTRY_STATE_CREATING;
+    /* checked against the slice instead */
+    nst_http_hdr_init(&hdr);
 
-            if(ctx->rule->disk != NST_DISK_ONLY) {
-                entry->data = nst_cache_data_new();
+    while(nst_http_find_header(s, msg, "If-Range", 8, &hdr, 1)) {
+        nst_http_remove_header(s, msg, &hdr);
+    }
 
-                if(!entry->data) {
-                    entry->state = NST_CACHE_ENTRY_STATE_INVALID;
-                    ctx->state   = NST_CACHE_CTX_STATE_BYPASS;
-                    ctx->full    = 1;
-                } else {
-                    ctx->state   = NST_CACHE_CTX_STATE_CREATE;
-                    ctx->entry   = entry;
+    chunk_printf(buf, "bytes=%"PRIu64"-%"PRIu64, first,
+            first + ctx->rule->slice - 1);
 
-                    entry->etag.data   = ctx->res.etag.data;
-                    entry->etag.len    = ctx->res.etag.len;
-                    ctx->res.etag.data = NULL;
+    if(nst_http_add_header(s, msg, "Range", 5, buf->area, buf->data)
+            != NST_OK) {
 
-                    entry->last_modified.data   = ctx->res.last_modified.data;
-                    entry->last_modified.len    = ctx->res.last_modified.len;
-                    ctx->res.last_modified.data = NULL;
+        return NST_ERR;
+    }
 
-                    ctx->data    = entry->data;
-                    ctx->element = entry->data->element;
-                }
-            } else {
-                ctx->state = NST_CACHE_CTX_STATE_CREATE;
-                ctx->entry = entry;
-            }
+    return NST_OK;
+}
 
-        } else {
-            ctx->state = NST_CACHE_CTX_STATE_BYPASS;
-        }
-    } else {
-        entry = nst_cache_dict_set(ctx);
+/*
+ * A slice is stored if the response is the 206 of its whole range, the last
+ * slice ending with the object
+ */
+int nst_cache_slice(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
 
-        if(entry) {
-            ctx->state = NST_CACHE_CTX_STATE_CREATE;
-            ctx->entry = entry;
-            ctx->data  = entry->data;
+    uint64_t first, last, size, want, body_len;
+    struct nst_http_hdr hdr;
 
-            if(ctx->data) {
-                ctx->element = entry->data->element;
-            }
-        } else {
-            ctx->state = NST_CACHE_CTX_STATE_BYPASS;
-            ctx->full  = 1;
-        }
+    if(!ctx->slice) {
+        return NST_OK;
     }
 
-    nst_shctx_unlock(&nuster.cache->dict[0]);
+    if(s->txn->status != 206
+            || nst_http_body_len(s, msg, &body_len) != NST_OK) {
 
-    if(ctx->state == NST_CACHE_CTX_STATE_CREATE
-            && (ctx->rule->disk == NST_DISK_SYNC
-                || ctx->rule->disk == NST_DISK_ONLY)) {
+        return NST_ERR;
+    }
 
-        ctx->disk.file = nst_cache_memory_alloc(
-                nst_persist_path_file_len(global.nuster.cache.root) + 1);
+    nst_http_hdr_init(&hdr);
 
-        if(!ctx->disk.file) {
-            return;
-        }
+    if(!nst_http_find_header(s, msg, "Content-Range", 13, &hdr, 1)) {
+        return NST_ERR;
+    }
 
-        if(nst_persist_init(global.nuster.cache.root, ctx->disk.file,
-                    ctx->hash) != NST_OK) {
+    if(_nst_cache_content_range(hdr.value, hdr.len, &first, &last, &size)
+            != NST_OK) {
 
-            return;
-        }
+        return NST_ERR;
+    }
 
-        ctx->disk.fd = nst_persist_create(ctx->disk.file);
+    want = (ctx->slice - 1) * ctx->rule->slice;
 
-        nst_persist_meta_init(ctx->disk.meta, (char)ctx->rule->disk,
-                ctx->hash, 0, 0, ctx->header_len, ctx->entry->key->data,
-                ctx->entry->host.len, ctx->entry->path.len,
-                ctx->entry->etag.len, ctx->entry->last_modified.len);
+    if(first != want || body_len != last - first + 1) {
+        return NST_ERR;
+    }
 
-        nst_persist_write_key(&ctx->disk, ctx->entry->key);
-        nst_persist_write_host(&ctx->disk, &ctx->entry->host);
-        nst_persist_write_path(&ctx->disk, &ctx->entry->path);
-        nst_persist_write_etag(&ctx->disk, &ctx->entry->etag);
-        nst_persist_write_last_modified(&ctx->disk, &ctx->entry->last_modified);
+    want += ctx->rule->slice - 1;
 
+    if(last != (want < size ? want : size - 1)) {
+        return NST_ERR;
     }
+
+    ctx->range.size = size;
+
+    return NST_OK;
 }
 
 /*
- * Add partial http data to nst_cache_data
+ * The slice checked by nst_cache_slice is stored, but the client only gets
+ * the range it asked for: the header is stored as it is received, then its
+ * Content-Range and Content-Length are set to the range, the body is cut by
+ * the filter while it is forwarded.
  */
-int nst_cache_update(struct nst_cache_ctx *ctx, struct http_msg *msg,
-        long msg_len) {
+int nst_cache_slice_range(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
 
-    struct nst_cache_element *element;
+    struct buffer *buf = get_trash_chunk();
+    uint64_t first     = (ctx->slice - 1) * ctx->rule->slice;
+    uint64_t last      = first + ctx->rule->slice - 1;
+    struct nst_http_hdr hdr;
 
-    if(ctx->rule->disk == NST_DISK_ONLY)  {
-        char *data = b_orig(&msg->chn->buf);
-        char *p    = ci_head(msg->chn);
-        int size   = msg->chn->buf.size;
+    /* not a slice, or the HTX body which is not cut */
+    if(!ctx->range.size || ctx->htx) {
+        return NST_OK;
+    }
 
-        if(p - data + msg_len > size) {
-            int right = data + size - p;
-            int left  = msg_len - right;
+    if(last > ctx->range.size - 1) {
+        last = ctx->range.size - 1;
+    }
 
-            nst_persist_write(&ctx->disk, p, right);
-            nst_persist_write(&ctx->disk, data, left);
-        } else {
-            nst_persist_write(&ctx->disk, p, msg_len);
-        }
-        ctx->cache_len += msg_len;
-    } else {
+    /* past the object, sent as it is */
+    if(ctx->range.first > last) {
+        return NST_OK;
+    }
 
-        element = _nst_cache_data_append(msg, msg_len);
+    if(ctx->range.last > last) {
+        ctx->range.last = last;
+    }
 
-        if(element) {
+    if(ctx->range.first == first && ctx->range.last == last) {
+        return NST_OK;
+    }
 
-            if(ctx->element) {
-                ctx->element->next = element;
-            } else {
-                ctx->data->element = element;
-            }
+    if(ctx->state == NST_CACHE_CTX_STATE_CREATE
+            && nst_cache_update(ctx, msg, ctx->header_len) != NST_OK) {
 
-            ctx->element = element;
+        nst_cache_abort(ctx);
+        ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+    }
 
-            if(ctx->rule->disk == NST_DISK_SYNC) {
-                nst_persist_write(&ctx->disk, element->msg.data,
-                        element->msg.len);
+    nst_http_hdr_init(&hdr);
 
-                ctx->cache_len += element->msg.len;
-            }
+    while(nst_http_find_header(s, msg, "Content-Range", 13, &hdr, 1)) {
+        nst_http_remove_header(s, msg, &hdr);
+    }
 
-        } else {
-            ctx->full = 1;
+    nst_http_hdr_init(&hdr);
 
-            return NST_ERR;
-        }
+    while(nst_http_find_header(s, msg, "Content-Length", 14, &hdr, 1)) {
+        nst_http_remove_header(s, msg, &hdr);
+    }
+
+    chunk_printf(buf, "bytes %"PRIu64"-%"PRIu64"/%"PRIu64, ctx->range.first,
+            ctx->range.last, ctx->range.size);
+
+    if(nst_http_add_header(s, msg, "Content-Range", 13, buf->area, buf->data)
+            != NST_OK) {
+
+        return NST_ERR;
     }
 
+    chunk_printf(buf, "%"PRIu64, ctx->range.last - ctx->range.first + 1);
+
+    if(nst_http_add_header(s, msg, "Content-Length", 14, buf->area, buf->data)
+            != NST_OK) {
+
+        return NST_ERR;
+    }
+
+    /* the header stored, only forwarded now */
+    ctx->header_len = msg->sov;
+    ctx->range.skip = ctx->range.first - first;
+    ctx->range.keep = ctx->range.last - ctx->range.first + 1;
+    ctx->range.pos  = 0;
+
     return NST_OK;
 }
 
+#if defined(USE_ZLIB)
 /*
- * cache done
+ * Whether the client takes the gzip body cached as is: HTTP/1.1 for its
+ * chunks, and gzip accepted by Accept-Encoding
  */
-void nst_cache_finish(struct nst_cache_ctx *ctx) {
-    ctx->state = NST_CACHE_CTX_STATE_DONE;
+static int _nst_cache_accept_gzip(struct stream *s, struct http_msg *msg) {
+    struct nst_http_hdr hdr;
 
-    if(ctx->rule->disk == NST_DISK_ONLY) {
-        ctx->entry->state = NST_CACHE_ENTRY_STATE_INVALID;
-    } else {
-        ctx->entry->state = NST_CACHE_ENTRY_STATE_VALID;
+    if(!(msg->flags & HTTP_MSGF_VER_11)) {
+        return 0;
     }
 
-    if(*ctx->rule->ttl == 0) {
-        ctx->entry->expire = 0;
-    } else {
-        ctx->entry->expire = get_current_timestamp() / 1000 + *ctx->rule->ttl;
-    }
+    nst_http_hdr_init(&hdr);
 
-    if(ctx->rule->disk == NST_DISK_SYNC || ctx->rule->disk == NST_DISK_ONLY) {
+    while(nst_http_find_header(s, msg, "Accept-Encoding", 15, &hdr, 0)) {
+        char *p   = hdr.value;
+        char *end = p + hdr.len;
+        char *q   = p;
+        int len;
 
-        nst_persist_meta_set_expire(ctx->disk.meta, ctx->entry->expire);
+        while(q < end && *q != ';' && *q != ' ' && *q != '\t') {
+            q++;
+        }
 
-        nst_persist_meta_set_cache_len(ctx->disk.meta, ctx->cache_len);
+        len = q - p;
 
-        nst_persist_write_meta(&ctx->disk);
+        if(!((len == 4 && !strncasecmp(p, "gzip", 4))
+                    || (len == 6 && !strncasecmp(p, "x-gzip", 6))
+                    || (len == 1 && *p == '*'))) {
 
-        ctx->entry->file = ctx->disk.file;
+            continue;
+        }
+
+        /* q=0 refuses it */
+        while(q < end && *q != '=') {
+            q++;
+        }
+
+        if(q == end) {
+            return 1;
+        }
+
+        for(q++; q < end && (*q == '0' || *q == '.'); q++) {}
+
+        if(q < end && isdigit((unsigned char)*q)) {
+            return 1;
+        }
+
+        return 0;
     }
-}
 
-void nst_cache_abort(struct nst_cache_ctx *ctx) {
-    ctx->entry->state = NST_CACHE_ENTRY_STATE_INVALID;
+    return 0;
 }
+#endif
 
 /*
  * Create cache applet to handle the request
@@ -1133,7 +4099,27 @@ void nst_cache_abort(struct nst_cache_ctx *ctx) {
 void nst_cache_hit(struct stream *s, struct stream_interface *si,
         struct channel *req, struct channel *res, struct nst_cache_data *data) {
 
-    struct appctx *appctx = NULL;
+    struct appctx *appctx       = NULL;
+    struct nst_cache_gzip *gzip = NULL;
+    struct nst_http_hdr hdr;
+
+#if defined(USE_ZLIB)
+    /* decompressed for the clients which do not accept it */
+    if(data->gzip && !_nst_cache_accept_gzip(s, &s->txn->req)) {
+        gzip = calloc(1, sizeof(*gzip));
+
+        if(!gzip || inflateInit2(&gzip->z, MAX_WBITS + 16) != Z_OK) {
+            free(gzip);
+            nst_cache_data_release(data);
+
+            return;
+        }
+
+        gzip->inflate = 1;
+        gzip->state   = NST_CACHE_GZIP_HEADER;
+        gzip->chunked = (s->txn->req.flags & HTTP_MSGF_VER_11) != 0;
+    }
+#endif
 
     /*
      * set backend to nuster.applet.cache_engine
@@ -1142,7 +4128,8 @@ void nst_cache_hit(struct stream *s, struct stream_interface *si,
 
     if(unlikely(!si_register_handler(si, objt_applet(s->target)))) {
         /* return to regular process on error */
-        data->clients--;
+        nst_cache_gzip_free(gzip);
+        nst_cache_data_release(data);
         s->target = NULL;
     } else {
         appctx = si_appctx(si);
@@ -1151,6 +4138,45 @@ void nst_cache_hit(struct stream *s, struct stream_interface *si,
 
         appctx->ctx.nuster.cache_engine.data    = data;
         appctx->ctx.nuster.cache_engine.element = data->element;
+        appctx->ctx.nuster.cache_engine.gunzip  = gzip;
+
+        appctx->st0 = NST_CACHE_HTX_HEADER;
+
+        LIST_INIT(&appctx->ctx.nuster.cache_engine.waiter);
+
+        /* a part of a complete response, otherwise the whole one */
+        if(!gzip && !IS_HTX_STRM(s) && _nst_cache_range_find(s, &hdr)
+                && __atomic_load_n(&data->state, __ATOMIC_ACQUIRE)
+                == NST_CACHE_DATA_STATE_DONE) {
+
+            struct nst_cache_element *element;
+            struct buffer *buf = get_trash_chunk();
+            uint64_t total     = 0;
+
+            for(element = data->element; element; element = element->next) {
+                total += element->len;
+            }
+
+            if(data->header_len && data->header_len <= buf->size
+                    && data->header_len <= total) {
+
+                _nst_cache_engine_peek(appctx, buf->area, data->header_len);
+
+                appctx->ctx.nuster.cache_engine.range = _nst_cache_range_new(
+                        s, &hdr, buf->area, data->header_len, total);
+            }
+        }
+
+        /* woken up as the data is appended, see _nst_cache_data_wakeup */
+        if(__atomic_load_n(&data->state, __ATOMIC_ACQUIRE)
+                == NST_CACHE_DATA_STATE_CREATING) {
+
+            nst_shctx_lock(nuster.cache);
+            LIST_ADDQ(&data->waiters, &appctx->ctx.nuster.cache_engine.waiter);
+            nst_shctx_unlock(nuster.cache);
+
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        }
 
         req->analysers &= ~AN_REQ_FLT_HTTP_HDRS;
         req->analysers &= ~AN_REQ_FLT_XFER_DATA;
@@ -1168,7 +4194,9 @@ void nst_cache_hit(struct stream *s, struct stream_interface *si,
 void nst_cache_hit_disk(struct stream *s, struct stream_interface *si,
         struct channel *req, struct channel *res, struct nst_cache_ctx *ctx) {
 
-    struct appctx *appctx = NULL;
+    struct appctx *appctx         = NULL;
+    struct nst_cache_range *range = NULL;
+    struct nst_http_hdr hdr;
 
     /*
      * set backend to nuster.applet.cache_disk_engine
@@ -1190,7 +4218,28 @@ void nst_cache_hit_disk(struct stream *s, struct stream_interface *si,
         appctx->ctx.nuster.cache_disk_engine.header_len =
             nst_persist_meta_get_header_len(ctx->disk.meta);
 
-        appctx->st0 = NST_PERSIST_APPLET_HEADER;
+        /* a part of the file, read at its offset */
+        if(!IS_HTX_STRM(s) && _nst_cache_range_find(s, &hdr)) {
+            struct buffer *buf = get_trash_chunk();
+            int header_len = appctx->ctx.nuster.cache_disk_engine.header_len;
+
+            if(header_len <= buf->size && pread(ctx->disk.fd, buf->area,
+                        header_len, appctx->ctx.nuster.cache_disk_engine.offset)
+                    == header_len) {
+
+                range = _nst_cache_range_new(s, &hdr, buf->area, header_len,
+                        nst_persist_meta_get_cache_len(ctx->disk.meta));
+            }
+
+            if(range) {
+                range->body += appctx->ctx.nuster.cache_disk_engine.offset;
+            }
+
+            appctx->ctx.nuster.cache_disk_engine.range = range;
+        }
+
+        appctx->st0 = IS_HTX_STRM(s) ? NST_CACHE_HTX_HEADER
+            : NST_PERSIST_APPLET_HEADER;
 
         req->analysers &= ~AN_REQ_FLT_HTTP_HDRS;
         req->analysers &= ~AN_REQ_FLT_XFER_DATA;
@@ -1202,22 +4251,24 @@ void nst_cache_hit_disk(struct stream *s, struct stream_interface *si,
     }
 }
 
-void nst_cache_persist_async() {
-    struct nst_cache_entry *entry;
+static void _nst_cache_persist_async(struct nst_cache_dict_shard *shard) {
+    struct nst_dict_group *group;
+    uint32_t mask;
 
-    if(!global.nuster.cache.root || !nuster.cache->disk.loaded) {
+    if(!shard->dict[0].used) {
         return;
     }
 
-    if(!nuster.cache->dict[0].used) {
-        return;
-    }
+    group = nst_dict_group(&shard->dict[0], shard->persist_idx);
+    mask  = nst_dict_match_used(group);
 
-    entry = nuster.cache->dict[0].entry[nuster.cache->persist_idx];
+    while(mask) {
+        struct nst_cache_entry *entry = group->slot[__builtin_ctz(mask)].ptr;
 
-    while(entry) {
+        mask &= mask - 1;
 
-        if(!nst_cache_entry_invalid(entry)
+        /* a refreshed entry may have been purged of its data */
+        if(!nst_cache_entry_invalid(entry) && entry->data
                 && entry->rule->disk == NST_DISK_ASYNC
                 && entry->file == NULL) {
 
@@ -1239,11 +4290,14 @@ void nst_cache_persist_async() {
 
             disk.fd = nst_persist_create(entry->file);
 
-            nst_persist_meta_init(disk.meta, (char)entry->rule->disk,
+            nst_persist_meta_init(disk.meta, (char)(entry->rule->disk
+                        | (entry->data->htx ? NST_PERSIST_MODE_HTX : 0)),
                     entry->hash, entry->expire, 0, entry->header_len,
                     entry->key->data, entry->host.len, entry->path.len,
                     entry->etag.len, entry->last_modified.len);
 
+            nst_persist_meta_set_stale(disk.meta, entry->stale_error);
+
             nst_persist_write_key(&disk, entry->key);
             nst_persist_write_host(&disk, &entry->host);
             nst_persist_write_path(&disk, &entry->path);
@@ -1251,15 +4305,10 @@ void nst_cache_persist_async() {
             nst_persist_write_last_modified(&disk, &entry->last_modified);
 
             while(element) {
+                nst_persist_write(&disk, element->data, element->len);
 
-                if(element->msg.data) {
-                    nst_persist_write(&disk, element->msg.data,
-                            element->msg.len);
-
-                    cache_len += element->msg.len;
-                }
-
-                element = element->next;
+                cache_len += element->len;
+                element    = element->next;
             }
 
             nst_persist_meta_set_cache_len(disk.meta, cache_len);
@@ -1269,17 +4318,35 @@ void nst_cache_persist_async() {
             close(disk.fd);
         }
 
-        entry = entry->next;
-
     }
 
-    nuster.cache->persist_idx++;
+    shard->persist_idx++;
 
     /* if we have checked the whole dict */
-    if(nuster.cache->persist_idx == nuster.cache->dict[0].size) {
-        nuster.cache->persist_idx = 0;
+    if(shard->persist_idx == shard->dict[0].size) {
+        shard->persist_idx = 0;
+    }
+
+}
+
+/*
+ * Save one group of one shard to disk, shards are visited in turn
+ */
+void nst_cache_persist_async() {
+    struct nst_cache_dict_shard *shard;
+
+    if(!global.nuster.cache.root || !nuster.cache->disk.loaded) {
+        return;
     }
 
+    shard = &nuster.cache->shard[nuster.cache->persist_shard];
+
+    nuster.cache->persist_shard =
+        (nuster.cache->persist_shard + 1) % NST_CACHE_DICT_SHARDS;
+
+    nst_shctx_lock(shard);
+    _nst_cache_persist_async(shard);
+    nst_shctx_unlock(shard);
 }
 
 void nst_cache_persist_load() {
@@ -1384,8 +4451,14 @@ void nst_cache_persist_load() {
                         goto err;
                     }
 
+                    nst_shctx_lock(nst_cache_dict_shard(
+                                nst_persist_meta_get_hash(meta)));
+
                     nst_cache_dict_set_from_disk(file, meta, key, &host, &path);
 
+                    nst_shctx_unlock(nst_cache_dict_shard(
+                                nst_persist_meta_get_hash(meta)));
+
                     close(fd);
                 }
 
@@ -1479,24 +4552,20 @@ void nst_cache_persist_cleanup() {
 void nst_cache_build_etag(struct nst_cache_ctx *ctx, struct stream *s,
         struct http_msg *msg) {
 
-    struct http_txn *txn = s->txn;
-
-    struct hdr_ctx hdr;
+    struct nst_http_hdr hdr;
 
 
     ctx->res.etag.len  = 0;
     ctx->res.etag.data = NULL;
 
-    hdr.idx = 0;
+    nst_http_hdr_init(&hdr);
 
-    if(http_find_full_header2("ETag", 4, ci_head(msg->chn), &txn->hdr_idx,
-                &hdr)) {
-
-        ctx->res.etag.len  = hdr.vlen;
-        ctx->res.etag.data = nst_cache_memory_alloc(hdr.vlen);
+    if(nst_http_find_header(s, msg, "ETag", 4, &hdr, 1)) {
+        ctx->res.etag.len  = hdr.len;
+        ctx->res.etag.data = nst_cache_memory_alloc(hdr.len);
 
         if(ctx->res.etag.data) {
-            memcpy(ctx->res.etag.data, hdr.line + hdr.val, hdr.vlen);
+            memcpy(ctx->res.etag.data, hdr.value, hdr.len);
         }
     } else {
         ctx->res.etag.len  = 10;
@@ -1507,16 +4576,8 @@ void nst_cache_build_etag(struct nst_cache_ctx *ctx, struct stream *s,
             sprintf(ctx->res.etag.data, "\"%08x\"", XXH32(&t, 8, 0));
 
             if(ctx->rule->etag == NST_STATUS_ON) {
-                trash.data = 6;
-                memcpy(trash.area, "ETag: ", trash.data);
-                memcpy(trash.area + trash.data, ctx->res.etag.data,
+                nst_http_add_header(s, msg, "ETag", 4, ctx->res.etag.data,
                         ctx->res.etag.len);
-
-                trash.data += ctx->res.etag.len;
-                trash.area[trash.data] = '\0';
-
-                http_header_add_tail2(msg, &txn->hdr_idx, trash.area,
-                        trash.data);
             }
         }
     }
@@ -1525,9 +4586,7 @@ void nst_cache_build_etag(struct nst_cache_ctx *ctx, struct stream *s,
 void nst_cache_build_last_modified(struct nst_cache_ctx *ctx, struct stream *s,
         struct http_msg *msg) {
 
-    struct http_txn *txn = s->txn;
-
-    struct hdr_ctx hdr;
+    struct nst_http_hdr hdr;
 
 
     int len  = sizeof("Mon, 01 JAN 1970 00:00:00 GMT") - 1;
@@ -1539,46 +4598,520 @@ void nst_cache_build_last_modified(struct nst_cache_ctx *ctx, struct stream *s,
         return;
     }
 
-    hdr.idx = 0;
+    nst_http_hdr_init(&hdr);
 
-    if(http_find_full_header2("Last-Modified", 13, ci_head(msg->chn),
-                &txn->hdr_idx, &hdr)) {
+    if(nst_http_find_header(s, msg, "Last-Modified", 13, &hdr, 1)) {
 
-        if(hdr.vlen == len) {
-            memcpy(ctx->res.last_modified.data, hdr.line + hdr.val, hdr.vlen);
+        if(hdr.len == len) {
+            memcpy(ctx->res.last_modified.data, hdr.value, hdr.len);
         }
     } else {
-        char mon[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul",
-            "Aug", "Sep", "Oct", "Nov", "Dec" };
-
-        char day[7][4]  = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+        struct ist now = nst_http_date();
 
-        struct tm *tm;
-        time_t now;
-        time(&now);
-        tm = gmtime(&now);
-        sprintf(ctx->res.last_modified.data,
-                "%s, %02d %s %04d %02d:%02d:%02d GMT",
-                day[tm->tm_wday], tm->tm_mday, mon[tm->tm_mon],
-                1900 + tm->tm_year, tm->tm_hour, tm->tm_min, tm->tm_sec);
+        memcpy(ctx->res.last_modified.data, now.ptr, len);
 
         if(ctx->rule->last_modified == NST_STATUS_ON) {
-            trash.data = 15;
-            memcpy(trash.area, "Last-Modified: ", trash.data);
-            memcpy(trash.area + trash.data, ctx->res.last_modified.data,
-                    ctx->res.last_modified.len);
-            trash.data += ctx->res.last_modified.len;
-            trash.area[trash.data] = '\0';
-            http_header_add_tail2(msg, &txn->hdr_idx, trash.area, trash.data);
+            nst_http_add_header(s, msg, "Last-Modified", 13,
+                    ctx->res.last_modified.data, ctx->res.last_modified.len);
+        }
+    }
+}
+
+/*
+ * A Cache-Control directive, returns where its value starts, or its end
+ * if it has none, NULL if it is not name
+ */
+static char *_nst_cache_directive(char *p, int len, const char *name,
+        int name_len) {
+
+    if(len < name_len || strncasecmp(p, name, name_len) != 0) {
+        return NULL;
+    }
+
+    if(len == name_len) {
+        return p + len;
+    }
+
+    if(p[name_len] == '=') {
+        return p + name_len + 1;
+    }
+
+    return NULL;
+}
+
+/* delta-seconds, maybe quoted, -1 if there is none */
+static int64_t _nst_cache_seconds(char *p, char *end) {
+    int64_t v = -1;
+
+    if(p < end && *p == '"') {
+        p++;
+    }
+
+    while(p < end && *p >= '0' && *p <= '9') {
+        v = (v == -1 ? 0 : v) * 10 + *p++ - '0';
+
+        if(v > UINT32_MAX) {
+            return UINT32_MAX;
+        }
+    }
+
+    return v;
+}
+
+static int64_t _nst_cache_date(struct stream *s, struct http_msg *msg,
+        const char *name, int len) {
+
+    struct nst_http_hdr hdr;
+    struct tm tm;
+
+    nst_http_hdr_init(&hdr);
+
+    if(!nst_http_find_header(s, msg, name, len, &hdr, 1)) {
+        return -1;
+    }
+
+    if(!parse_http_date(hdr.value, hdr.len, &tm)) {
+        return 0;
+    }
+
+    return my_timegm(&tm);
+}
+
+/*
+ * Set the lifetime of the response, the ttl of the rule, or with origin-ttl
+ * the one given by the server: Cache-Control s-maxage or max-age, or Expires,
+ * less its Age, kept within min-ttl and max-ttl. The ttl of the rule is used
+ * if there is none. Returns NST_ERR if the response must not be stored.
+ */
+int nst_cache_build_ttl(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
+
+    struct nst_rule *rule = ctx->rule;
+    struct nst_http_hdr hdr;
+
+    int64_t smaxage = -1;
+    int64_t maxage  = -1;
+    int64_t ttl     = -1;
+
+    ctx->ttl = *rule->ttl;
+
+    if(rule->origin_ttl != NST_STATUS_ON) {
+        return NST_OK;
+    }
+
+    nst_http_hdr_init(&hdr);
+
+    while(nst_http_find_header(s, msg, "Cache-Control", 13, &hdr, 0)) {
+        char *p   = hdr.value;
+        char *end = p + hdr.len;
+        char *v;
+
+        if(_nst_cache_directive(p, hdr.len, "no-store", 8)
+                || _nst_cache_directive(p, hdr.len, "no-cache", 8)
+                || _nst_cache_directive(p, hdr.len, "private", 7)) {
+
+            return NST_ERR;
+        }
+
+        if((v = _nst_cache_directive(p, hdr.len, "s-maxage", 8))) {
+            smaxage = _nst_cache_seconds(v, end);
+        } else if((v = _nst_cache_directive(p, hdr.len, "max-age", 7))) {
+            maxage = _nst_cache_seconds(v, end);
+        }
+    }
+
+    if(smaxage != -1) {
+        ttl = smaxage;
+    } else if(maxage != -1) {
+        ttl = maxage;
+    } else {
+        int64_t expires = _nst_cache_date(s, msg, "Expires", 7);
+
+        if(expires != -1) {
+            int64_t date = _nst_cache_date(s, msg, "Date", 4);
+
+            if(date <= 0) {
+                date = nst_time_now();
+            }
+
+            /* an invalid date means already expired */
+            ttl = expires > date ? expires - date : 0;
+        }
+    }
+
+    if(ttl == -1) {
+        return NST_OK;
+    }
+
+    nst_http_hdr_init(&hdr);
+
+    if(nst_http_find_header(s, msg, "Age", 3, &hdr, 1)) {
+        int64_t age = _nst_cache_seconds(hdr.value, hdr.value + hdr.len);
+
+        if(age > 0) {
+            ttl = ttl > age ? ttl - age : 0;
+        }
+    }
+
+    if(ttl < rule->min_ttl) {
+        ttl = rule->min_ttl;
+    }
+
+    if(rule->max_ttl && ttl > rule->max_ttl) {
+        ttl = rule->max_ttl;
+    }
+
+    /* a ttl of 0 would never expire */
+    if(ttl == 0) {
+        return NST_ERR;
+    }
+
+    ctx->ttl = ttl > UINT32_MAX ? UINT32_MAX : ttl;
+
+    return NST_OK;
+}
+
+/*
+ * Copy the names of a vary root, returns its id, 0 if it is none
+ */
+static uint64_t _nst_cache_vary_copy(struct nst_cache_entry *entry,
+        struct buffer *names) {
+
+    struct nst_cache_vary *vary = __atomic_load_n(&entry->vary,
+            __ATOMIC_ACQUIRE);
+
+    if(!vary || vary->len > names->size) {
+        return 0;
+    }
+
+    memcpy(names->area, vary->names, vary->len);
+    names->data = vary->len;
+
+    nst_evict_touch(&entry->access);
+
+    return vary->id;
+}
+
+/*
+ * With vary on, if the responses of the key vary on request headers, which
+ * the vary root of the key records, extend the key with the id of the root
+ * and the values of these headers so that each variant is cached apart
+ */
+int nst_cache_vary_key(struct nst_cache_ctx *ctx, struct nst_rule *rule,
+        struct stream *s, struct http_msg *msg) {
+
+    struct nst_cache_entry *entry = NULL;
+    struct buffer *names;
+    struct nst_http_hdr hdr;
+    uint64_t id = 0;
+    int found   = 0;
+    char buf[17];
+    char *p, *end;
+
+    ctx->vary     = 0;
+    ctx->vary_len = 0;
+
+    if(rule->vary != NST_STATUS_ON) {
+        return NST_OK;
+    }
+
+    names = get_trash_chunk();
+
+    if(nst_epoch_enter(&nuster.cache->epoch) == NST_OK) {
+        entry = nst_cache_dict_lookup(ctx->key, ctx->hash);
+
+        /* an invalid entry may hide the root replacing it */
+        if(!entry || __atomic_load_n(&entry->state, __ATOMIC_ACQUIRE)
+                == NST_CACHE_ENTRY_STATE_VALID) {
+
+            id    = entry ? _nst_cache_vary_copy(entry, names) : 0;
+            found = 1;
+        }
+
+        nst_epoch_leave(&nuster.cache->epoch);
+    }
+
+    if(!found) {
+        nst_shctx_lock(nst_cache_dict_shard(ctx->hash));
+        entry = nst_cache_dict_get(ctx->key, ctx->hash);
+
+        if(entry && entry->state == NST_CACHE_ENTRY_STATE_VALID) {
+            id = _nst_cache_vary_copy(entry, names);
+        }
+
+        nst_shctx_unlock(nst_cache_dict_shard(ctx->hash));
+    }
+
+    if(!id) {
+        return NST_OK;
+    }
+
+    ctx->vary     = nst_hash(names->area, names->data);
+    ctx->vary_len = ctx->key->data;
+
+    snprintf(buf, sizeof(buf), "%016"PRIx64, id);
+
+    if(nst_cache_key_append(ctx->key, buf, 16) != NST_OK) {
+        return NST_ERR;
+    }
+
+    p   = names->area;
+    end = p + names->data;
+
+    while(p < end) {
+        char *name = p;
+        int values = 0;
+
+        while(p < end && *p != ',') {
+            p++;
+        }
+
+        nst_http_hdr_init(&hdr);
+
+        while(nst_http_find_header(s, msg, name, p - name, &hdr, 0)) {
+
+            if(nst_cache_key_append(ctx->key, hdr.value, hdr.len)
+                    != NST_OK) {
+
+                return NST_ERR;
+            }
+
+            values++;
+        }
+
+        if(nst_cache_key_advance(ctx->key, values ? 1 : 2) != NST_OK) {
+            return NST_ERR;
+        }
+
+        p++;
+    }
+
+    ctx->hash = nst_cache_key_hash(ctx->key);
+
+    return NST_OK;
+}
+
+/*
+ * With vary on, a response varying on request headers is cached under the
+ * key extended for them by nst_cache_vary_key. If it was not, the headers
+ * are recorded by a vary root for the next requests, and NST_ERR is
+ * returned as the response cannot be cached: the request headers are gone.
+ */
+int nst_cache_vary(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
+
+    struct nst_cache_vary *old = NULL;
+    struct buffer *names;
+    struct nst_http_hdr hdr;
+    int ret, i;
+
+    if(ctx->rule->vary != NST_STATUS_ON) {
+        return NST_OK;
+    }
+
+    names = get_trash_chunk();
+    nst_http_hdr_init(&hdr);
+
+    while(nst_http_find_header(s, msg, "Vary", 4, &hdr, 0)) {
+
+        /* served to any client, see nst_cache_gzip_init */
+        if(hdr.len == 0 || (ctx->gzip && hdr.len == 15
+                    && !strncasecmp(hdr.value, "accept-encoding", 15))) {
+
+            continue;
+        }
+
+        /* varies on more than the request headers */
+        if(hdr.len == 1 && hdr.value[0] == '*') {
+            return NST_ERR;
+        }
+
+        if(names->data + hdr.len + 1 > names->size) {
+            return NST_ERR;
+        }
+
+        if(names->data) {
+            names->area[names->data++] = ',';
+        }
+
+        for(i = 0; i < hdr.len; i++) {
+            names->area[names->data++] = tolower(hdr.value[i]);
+        }
+    }
+
+    if(!names->data) {
+        return NST_OK;
+    }
+
+    if(ctx->vary_len && ctx->vary == nst_hash(names->area, names->data)) {
+        return NST_OK;
+    }
+
+    /* back to the key of the root */
+    if(ctx->vary_len) {
+        memset(ctx->key->area + ctx->vary_len, 0,
+                ctx->key->data - ctx->vary_len);
+
+        ctx->key->data = ctx->vary_len;
+        ctx->hash      = nst_hash(ctx->key->area, ctx->key->data);
+        ctx->vary_len  = 0;
+    }
+
+    nst_shctx_lock(nst_cache_dict_shard(ctx->hash));
+    ret = nst_cache_dict_set_vary(ctx, names->area, names->data, &old);
+    nst_shctx_unlock(nst_cache_dict_shard(ctx->hash));
+
+    nst_cache_dict_vary_free(old);
+
+    nst_debug("[nuster][cache] Vary %.*s: %s\n", (int)names->data,
+            names->area, ret == NST_OK ? "recorded" : "not recorded");
+
+    return NST_ERR;
+}
+
+#if defined(USE_ZLIB)
+/*
+ * Whether the type names an already compressed content
+ */
+static int _nst_cache_compressed_type(char *p, int len) {
+    static const char *types[] = { "image/", "audio/", "video/",
+        "application/zip", "application/gzip", "application/x-gzip", NULL };
+
+    const char **type;
+
+    if(len >= 13 && !strncasecmp(p, "image/svg+xml", 13)) {
+        return 0;
+    }
+
+    for(type = types; *type; type++) {
+        int n = strlen(*type);
+
+        if(len >= n && !strncasecmp(p, *type, n)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+/*
+ * With compress gzip, start to compress the body of the response to cache
+ * unless it is already encoded, has none, or must not be transformed
+ */
+void nst_cache_gzip_init(struct nst_cache_ctx *ctx, struct stream *s,
+        struct http_msg *msg) {
+
+#if defined(USE_ZLIB)
+    struct http_txn *txn = s->txn;
+    struct nst_cache_gzip *gzip;
+    struct nst_http_hdr hdr;
+    uint64_t body_len;
+
+    /* the HTX body is stored as it is received, see nst_cache_update_htx */
+    if(ctx->rule->compress != NST_STATUS_ON || IS_HTX_STRM(s)
+            || txn->meth == HTTP_METH_HEAD
+            || txn->status == 204 || txn->status == 304) {
+
+        return;
+    }
+
+    if(nst_http_body_len(s, msg, &body_len) == NST_OK && body_len == 0) {
+        return;
+    }
+
+    nst_http_hdr_init(&hdr);
+
+    if(nst_http_find_header(s, msg, "Content-Encoding", 16, &hdr, 0)) {
+
+        return;
+    }
+
+    nst_http_hdr_init(&hdr);
+
+    while(nst_http_find_header(s, msg, "Cache-Control", 13, &hdr, 0)) {
+
+        if(hdr.len == 12
+                && !strncasecmp(hdr.value, "no-transform", 12)) {
+
+            return;
+        }
+    }
+
+    nst_http_hdr_init(&hdr);
+
+    if(nst_http_find_header(s, msg, "Content-Type", 12, &hdr, 1)
+            && _nst_cache_compressed_type(hdr.value, hdr.len)) {
+
+        return;
+    }
+
+    gzip = calloc(1, sizeof(*gzip));
+
+    if(!gzip) {
+        return;
+    }
+
+    if(deflateInit2(&gzip->z, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+
+        free(gzip);
+        return;
+    }
+
+    gzip->state = NST_CACHE_GZIP_HEADER;
+    ctx->gzip   = gzip;
+
+    /* the compressed length is unknown */
+    ctx->expect_len = 0;
+#endif
+}
+
+/*
+ * Flush the compressed body and end its chunks
+ */
+int nst_cache_gzip_finish(struct nst_cache_ctx *ctx) {
+
+#if defined(USE_ZLIB)
+    if(_nst_cache_gzip_deflate(ctx, NULL, 0, Z_FINISH) != NST_OK
+            || _nst_cache_data_write(ctx, "00000000\r\n\r\n",
+                NST_CACHE_GZIP_FRAME + 2) != NST_OK) {
+
+        return NST_ERR;
+    }
+
+    /* a chunked response, its length is known now */
+    if(ctx->gzip->z.total_in) {
+        __atomic_store_n(&ctx->data->gunzip_len, ctx->gzip->z.total_in,
+                __ATOMIC_RELEASE);
+    }
+
+    _nst_cache_data_wakeup(ctx->data);
+#endif
+
+    return NST_OK;
+}
+
+void nst_cache_gzip_free(struct nst_cache_gzip *gzip) {
+
+#if defined(USE_ZLIB)
+    if(gzip) {
+
+        if(gzip->inflate) {
+            inflateEnd(&gzip->z);
+        } else {
+            deflateEnd(&gzip->z);
         }
+
+        free(gzip);
     }
+#endif
 }
 
 int nst_cache_handle_conditional_req(struct nst_cache_ctx *ctx,
         struct nst_rule *rule, struct stream *s, struct http_msg *msg) {
 
-    struct http_txn *txn = s->txn;
-    struct hdr_ctx hdr;
+    struct nst_http_hdr hdr;
 
     int if_none_match     = -1;
     int if_match          = -1;
@@ -1590,20 +5123,19 @@ int nst_cache_handle_conditional_req(struct nst_cache_ctx *ctx,
 
     if(rule->etag == NST_STATUS_ON) {
 
-        hdr.idx = 0;
+        nst_http_hdr_init(&hdr);
 
-        while(http_find_header2("If-Match", 8, ci_head(msg->chn),
-                    &txn->hdr_idx, &hdr)) {
+        while(nst_http_find_header(s, msg, "If-Match", 8, &hdr, 0)) {
 
             if_match = 412;
 
-            if(1 == hdr.vlen && *(hdr.line + hdr.val) == '*') {
+            if(1 == hdr.len && hdr.value[0] == '*') {
                 if_match = 200;
                 break;
             }
 
-            if(ctx->res.etag.len == hdr.vlen && memcmp(ctx->res.etag.data,
-                        hdr.line + hdr.val, hdr.vlen) == 0) {
+            if(ctx->res.etag.len == hdr.len && memcmp(ctx->res.etag.data,
+                        hdr.value, hdr.len) == 0) {
 
                 if_match = 200;
                 break;
@@ -1617,14 +5149,13 @@ int nst_cache_handle_conditional_req(struct nst_cache_ctx *ctx,
 
     if(rule->last_modified == NST_STATUS_ON) {
 
-        hdr.idx = 0;
+        nst_http_hdr_init(&hdr);
 
-        if(http_find_full_header2("If-Unmodified-Since", 19, ci_head(msg->chn),
-                    &txn->hdr_idx, &hdr)) {
+        if(nst_http_find_header(s, msg, "If-Unmodified-Since", 19, &hdr, 1)) {
 
-            if(ctx->res.last_modified.len != hdr.vlen
+            if(ctx->res.last_modified.len != hdr.len
                     || memcmp(ctx->res.last_modified.data,
-                        hdr.line + hdr.val, hdr.vlen) != 0) {
+                        hdr.value, hdr.len) != 0) {
 
                 return 412;
             }
@@ -1632,20 +5163,19 @@ int nst_cache_handle_conditional_req(struct nst_cache_ctx *ctx,
     }
 
     if(rule->etag == NST_STATUS_ON) {
-        hdr.idx = 0;
+        nst_http_hdr_init(&hdr);
 
-        while(http_find_header2("If-None-Match", 13, ci_head(msg->chn),
-                    &txn->hdr_idx, &hdr)) {
+        while(nst_http_find_header(s, msg, "If-None-Match", 13, &hdr, 0)) {
 
             if_none_match = 200;
 
-            if(1 == hdr.vlen && *(hdr.line + hdr.val) == '*') {
+            if(1 == hdr.len && hdr.value[0] == '*') {
                 if_none_match = 304;
                 break;
             }
 
-            if(ctx->res.etag.len == hdr.vlen && memcmp(ctx->res.etag.data,
-                        hdr.line + hdr.val, hdr.vlen) == 0) {
+            if(ctx->res.etag.len == hdr.len && memcmp(ctx->res.etag.data,
+                        hdr.value, hdr.len) == 0) {
 
                 if_none_match = 304;
                 break;
@@ -1655,14 +5185,13 @@ int nst_cache_handle_conditional_req(struct nst_cache_ctx *ctx,
 
     if(rule->last_modified == NST_STATUS_ON) {
 
-        hdr.idx = 0;
+        nst_http_hdr_init(&hdr);
 
-        if(http_find_full_header2("If-Modified-Since", 17, ci_head(msg->chn),
-                    &txn->hdr_idx, &hdr)) {
+        if(nst_http_find_header(s, msg, "If-Modified-Since", 17, &hdr, 1)) {
 
-            if(ctx->res.last_modified.len == hdr.vlen
+            if(ctx->res.last_modified.len == hdr.len
                     && memcmp(ctx->res.last_modified.data,
-                        hdr.line + hdr.val, hdr.vlen) == 0) {
+                        hdr.value, hdr.len) == 0) {
 
                 if_modified_since = 304;
             } else {
@@ -15,6 +15,7 @@
 
 #include <types/sample.h>
 
+#include <proto/backend.h>
 #include <proto/sample.h>
 #include <proto/filters.h>
 #include <proto/log.h>
@@ -42,12 +43,35 @@ static void _nst_cache_filter_deinit(struct proxy *px, struct flt_conf *fconf) {
 }
 
 static int _nst_cache_filter_check(struct proxy *px, struct flt_conf *fconf) {
+    struct nst_rule *rule;
+    int err = 0;
 
     if(px->mode != PR_MODE_HTTP) {
         ha_warning("Proxy [%s]: mode should be http to enable cache\n", px->id);
     }
 
-    return 0;
+    if(!(px->options2 & PR_O2_USE_HTX)) {
+        return 0;
+    }
+
+    /* the requests of the uri would be sent to the server */
+    if(global.nuster.cache.uri) {
+        ha_alert("Proxy [%s]: the cache manager and stats uri do not support "
+                "option http-use-htx\n", px->id);
+        err++;
+    }
+
+    /* the whole slice would be sent to the client */
+    list_for_each_entry(rule, &px->nuster.rules, list) {
+
+        if(rule->slice) {
+            ha_alert("Proxy [%s]: rule %s: slice does not support option "
+                    "http-use-htx\n", px->id, rule->name);
+            err++;
+        }
+    }
+
+    return err;
 }
 
 static int _nst_cache_filter_attach(struct stream *s, struct filter *filter) {
@@ -71,6 +95,7 @@ static int _nst_cache_filter_attach(struct stream *s, struct filter *filter) {
 
         ctx->state = NST_CACHE_CTX_STATE_INIT;
         ctx->pid   = -1;
+        ctx->htx   = IS_HTX_STRM(s) != 0;
 
         filter->ctx = ctx;
     }
@@ -97,27 +122,24 @@ static void _nst_cache_filter_detach(struct stream *s, struct filter *filter) {
             nst_cache_abort(ctx);
         }
 
+        /* an error from the server lets the stale data be served */
+        if(ctx->refresh) {
+            nst_cache_refresh_abort(ctx,
+                    (s->flags & SF_ERR_MASK) == SF_ERR_SRVTO
+                    || (s->flags & SF_ERR_MASK) == SF_ERR_SRVCL);
+        }
+
         while(ctx->stash) {
             stash      = ctx->stash;
             ctx->stash = ctx->stash->next;
 
-            if(stash->key) {
-                if(!ctx->entry || ctx->entry->key != stash->key) {
-                    nst_cache_memory_free(stash->key->area);
-                    nst_cache_memory_free(stash->key);
-                }
-            }
-
+            free(stash->key);
             pool_free(global.nuster.cache.pool.stash, stash);
         }
 
-        if(ctx->req.host.data) {
-            nst_cache_memory_free(ctx->req.host.data);
-        }
+        free(ctx->req.buf);
 
-        if(ctx->req.path.data) {
-            nst_cache_memory_free(ctx->req.path.data);
-        }
+        nst_cache_gzip_free(ctx->gzip);
 
         pool_free(global.nuster.cache.pool.ctx, ctx);
     }
@@ -142,6 +164,8 @@ static int _nst_cache_filter_http_headers(struct stream *s,
 
         /* request */
         if(ctx->state == NST_CACHE_CTX_STATE_INIT) {
+            struct nst_rule_key **plan = NULL;
+            uint64_t slice             = 0;
 
             if(nst_cache_prebuild_key(ctx, s, msg) != NST_OK) {
                 ctx->state = NST_CACHE_CTX_STATE_BYPASS;
@@ -156,21 +180,39 @@ static int _nst_cache_filter_http_headers(struct stream *s,
                     continue;
                 }
 
-                /* build key */
-                if(nst_cache_build_key(ctx, rule->key, s, msg) != NST_OK) {
-                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
-                    return 1;
+                /* a slice rule applies to range requests only */
+                if(nst_cache_slice_index(ctx, rule, s, msg) != NST_OK) {
+                    nst_debug("[nuster][cache] Not a slice request\n");
+                    continue;
+                }
+
+                /* the rules sharing a key share that of the request */
+                if(plan == rule->key && slice == ctx->slice) {
+                    nst_cache_key_rewind(ctx->key);
+                } else {
+
+                    /* build key */
+                    if(nst_cache_build_key(ctx, rule->key, s, msg)
+                            != NST_OK) {
+
+                        ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                        return 1;
+                    }
+
+                    plan  = rule->key;
+                    slice = ctx->slice;
+                    nst_cache_key_mark(ctx->key);
                 }
 
                 nst_debug("[nuster][cache] Key: ");
                 nst_debug_key(ctx->key);
 
-                ctx->hash = nst_hash(ctx->key->area, ctx->key->data);
+                ctx->hash = nst_cache_key_hash(ctx->key);
 
                 nst_debug("[nuster][cache] Hash: %"PRIu64"\n", ctx->hash);
 
-                /* stash key */
-                if(!nst_cache_stash_rule(ctx, rule)) {
+                /* a variant of the responses varying on request headers */
+                if(nst_cache_vary_key(ctx, rule, s, msg) != NST_OK) {
                     ctx->state = NST_CACHE_CTX_STATE_BYPASS;
                     return 1;
                 }
@@ -178,7 +220,27 @@ static int _nst_cache_filter_http_headers(struct stream *s,
                 /* check if cache exists  */
                 nst_debug("[nuster][cache] Checking key existence: ");
 
-                ctx->state = nst_cache_exists(ctx, rule->disk);
+                ctx->state = nst_cache_exists(ctx, rule->disk,
+                        !be_usable_srv(px));
+
+                /* stored by a stream of the other mode */
+                if(ctx->state == NST_CACHE_CTX_STATE_HIT
+                        && ctx->data->htx != ctx->htx) {
+
+                    nst_cache_data_release(ctx->data);
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+
+                    return 1;
+                }
+
+                if(ctx->state == NST_CACHE_CTX_STATE_HIT_DISK
+                        && nst_persist_meta_get_htx(ctx->disk.meta)
+                        != ctx->htx) {
+
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+
+                    return 1;
+                }
 
                 if(ctx->state == NST_CACHE_CTX_STATE_HIT) {
                     int ret;
@@ -192,12 +254,16 @@ static int _nst_cache_filter_http_headers(struct stream *s,
                         nst_res_304(si, &ctx->res.last_modified,
                                 &ctx->res.etag);
 
+                        nst_cache_data_release(ctx->data);
+
                         return 1;
                     }
 
                     if(ret == 412) {
                         nst_res_412(si);
 
+                        nst_cache_data_release(ctx->data);
+
                         return 1;
                     }
 
@@ -278,6 +344,12 @@ abort_check:
                 nst_debug("NOT EXIST\n");
                 /* no, there's no cache yet */
 
+                /* stash key, only the requests not hit need it */
+                if(!nst_cache_stash_rule(ctx, rule)) {
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                    return 1;
+                }
+
                 /* test acls to see if we should cache it */
                 nst_debug("[nuster][cache] Checking if rule pass: ");
 
@@ -294,6 +366,24 @@ abort_check:
             }
         }
 
+        /* the stash keeps a copy of the key built in the thread space */
+        ctx->key = NULL;
+
+        /* the request is gone once the response is to be cached */
+        if((ctx->state == NST_CACHE_CTX_STATE_PASS
+                    || ctx->state == NST_CACHE_CTX_STATE_INIT)
+                && ctx->stash && nst_cache_keep_req(ctx) != NST_OK) {
+
+            ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+        }
+
+        /* fetch the whole slice to cache it */
+        if(ctx->state == NST_CACHE_CTX_STATE_PASS && ctx->slice
+                && nst_cache_slice_request(ctx, s, msg) != NST_OK) {
+
+            ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+        }
+
         if(ctx->state == NST_CACHE_CTX_STATE_HIT) {
             nst_cache_hit(s, si, req, res, ctx->data);
         }
@@ -302,6 +392,13 @@ abort_check:
             nst_cache_hit_disk(s, si, req, res, ctx);
         }
 
+        /* nothing to store, let the body be forwarded without the filter */
+        if(ctx->state == NST_CACHE_CTX_STATE_HIT
+                || ctx->state == NST_CACHE_CTX_STATE_HIT_DISK) {
+
+            unregister_data_filter(s, res, filter);
+        }
+
     } else {
         /* response */
 
@@ -327,6 +424,7 @@ abort_check:
         if(ctx->state == NST_CACHE_CTX_STATE_PASS) {
             struct nst_rule_stash *stash = ctx->stash;
             struct nst_rule_code *cc     = ctx->rule->code;
+            uint64_t body_len;
 
             int valid = 0;
 
@@ -335,11 +433,12 @@ abort_check:
             /* check if code is valid */
             nst_debug("[nuster][cache] Checking status code: ");
 
-            if(!cc) {
+            /* slices are checked by nst_cache_slice */
+            if(!cc || ctx->rule->slice) {
                 valid = 1;
             }
 
-            while(cc) {
+            while(cc && !valid) {
 
                 if(cc->code == s->txn->status) {
                     valid = 1;
@@ -351,6 +450,11 @@ abort_check:
 
             if(!valid) {
                 nst_debug("FAIL\n");
+
+                if(ctx->refresh && s->txn->status >= 500) {
+                    nst_cache_refresh_abort(ctx, 1);
+                }
+
                 return 1;
             }
 
@@ -361,6 +465,10 @@ abort_check:
                     ctx->key  = stash->key;
                     ctx->hash = stash->hash;
                     stash->key = NULL;
+
+                    ctx->vary     = stash->vary;
+                    ctx->vary_len = stash->vary_len;
+                    ctx->slice    = stash->slice;
                     break;
                 }
 
@@ -375,11 +483,68 @@ abort_check:
 
             nst_cache_build_last_modified(ctx, s, msg);
 
-            ctx->header_len = msg->sov;
-            nst_debug("PASS\n[nuster][cache] To create\n");
+            if(ctx->htx) {
+                ctx->header_len = nst_cache_htx_header_len(msg);
+            } else {
+                ctx->header_len = msg->sov;
+            }
+
+            ctx->expect_len = 0;
+
+            if(nst_http_body_len(s, msg, &body_len) == NST_OK) {
+                ctx->expect_len = ctx->header_len + body_len;
+            }
+
+            nst_cache_gzip_init(ctx, s, msg);
+
+            if(nst_cache_slice(ctx, s, msg) != NST_OK
+                    || nst_cache_vary(ctx, s, msg) != NST_OK
+                    || nst_cache_build_ttl(ctx, s, msg) != NST_OK) {
 
-            /* start to build cache */
-            nst_cache_create(ctx);
+                nst_debug("NOT STORABLE\n");
+                ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+            } else if(nst_cache_admit(ctx, s, msg) != NST_OK) {
+                nst_debug("REJECT\n");
+                ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+            } else {
+                nst_debug("PASS\n[nuster][cache] To create\n");
+
+                /* start to build cache */
+                nst_cache_create(ctx);
+
+                /* the body is added by _nst_cache_filter_http_payload */
+                if(ctx->htx && ctx->state == NST_CACHE_CTX_STATE_CREATE
+                        && nst_cache_update_header(ctx, msg) != NST_OK) {
+
+                    nst_cache_abort(ctx);
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                }
+            }
+
+            /* the slice fetched on a miss, cut to the range requested */
+            if(ctx->slice && nst_cache_slice_range(ctx, s, msg) != NST_OK) {
+
+                if(ctx->state == NST_CACHE_CTX_STATE_CREATE) {
+                    nst_cache_abort(ctx);
+                    ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+                }
+
+                return -1;
+            }
+
+            /* copied by a new entry */
+            free(ctx->key);
+            ctx->key = NULL;
+
+            if(ctx->res.etag.data) {
+                nst_cache_memory_free(ctx->res.etag.data);
+                ctx->res.etag.data = NULL;
+            }
+
+            if(ctx->res.last_modified.data) {
+                nst_cache_memory_free(ctx->res.last_modified.data);
+                ctx->res.last_modified.data = NULL;
+            }
         }
 
     }
@@ -387,40 +552,115 @@ abort_check:
     return 1;
 }
 
+/*
+ * Drop the len bytes at off of the input of chn, the bytes behind are moved
+ * over them
+ */
+static void _nst_cache_filter_del(struct channel *chn, int off, int len) {
+    struct buffer *buf = &chn->buf;
+    size_t pos         = b_peek_ofs(buf, co_data(chn) + off + len);
+
+    b_move(buf, pos, ci_data(chn) - off - len, -len);
+    b_sub(buf, len);
+}
+
+/*
+ * Forward only the bytes of the range requested out of the len bytes of the
+ * slice, see nst_cache_slice_range. Return the bytes left to forward.
+ */
+static int _nst_cache_filter_slice_send(struct nst_cache_ctx *ctx,
+        struct filter *filter, struct http_msg *msg, int len) {
+
+    uint64_t pos = ctx->range.pos;
+    uint64_t end = ctx->range.skip + ctx->range.keep;
+    int head     = 0;
+    int keep     = 0;
+
+    if(pos < ctx->range.skip) {
+        head = ctx->range.skip - pos < len ? ctx->range.skip - pos : len;
+    }
+
+    if(pos + head < end) {
+        keep = end - pos - head < len - head ? end - pos - head : len - head;
+    }
+
+    ctx->range.pos += len;
+
+    /* the bytes after the range first, deleting those before it would move
+     * them */
+    if(head + keep < len) {
+        _nst_cache_filter_del(msg->chn, head + keep, len - head - keep);
+    }
+
+    if(head) {
+        _nst_cache_filter_del(msg->chn, 0, head);
+    }
+
+    flt_change_forward_size(filter, msg->chn, keep - len);
+    msg->next -= len - keep;
+
+    return keep;
+}
+
 static int _nst_cache_filter_http_forward_data(struct stream *s,
         struct filter *filter, struct http_msg *msg, unsigned int len) {
 
     struct nst_cache_ctx *ctx = filter->ctx;
 
-    int ret = len;
+    int ret    = len;
+    int header = 0;
 
     if(len <= 0) {
         return 0;
     }
 
-    if(ctx->state == NST_CACHE_CTX_STATE_CREATE
-            && (msg->chn->flags & CF_ISRESP)) {
+    if(!(msg->chn->flags & CF_ISRESP)) {
+        return ret;
+    }
 
-        if(ctx->header_len > 0) {
-            ret = ctx->header_len;
+    if(ctx->header_len > 0) {
+        ret    = ctx->header_len;
+        header = 1;
 
-            ctx->header_len = 0;
-        }
+        ctx->header_len = 0;
+    }
 
-        if(nst_cache_update(ctx, msg, ret) != NST_OK) {
-            goto err;
-        }
+    /* the header of a slice cut was stored before it was rewritten */
+    if(ctx->state == NST_CACHE_CTX_STATE_CREATE
+            && !(header && ctx->range.keep)
+            && nst_cache_update(ctx, msg, ret) != NST_OK) {
+
+        /* keep the partial data with the entry, cleanup or eviction frees
+         * it */
+        nst_cache_abort(ctx);
+        ctx->state = NST_CACHE_CTX_STATE_BYPASS;
     }
 
-    return ret;
+    if(!header && ctx->range.keep) {
+        ret = _nst_cache_filter_slice_send(ctx, filter, msg, ret);
+    }
 
-err:
-    ctx->entry->state = NST_CACHE_ENTRY_STATE_INVALID;
-    ctx->entry->data  = NULL;
-    ctx->state        = NST_CACHE_CTX_STATE_BYPASS;
     return ret;
 }
 
+static int _nst_cache_filter_http_payload(struct stream *s,
+        struct filter *filter, struct http_msg *msg, unsigned int offset,
+        unsigned int len) {
+
+    struct nst_cache_ctx *ctx = filter->ctx;
+
+    if(ctx->state == NST_CACHE_CTX_STATE_CREATE
+            && (msg->chn->flags & CF_ISRESP)
+            && nst_cache_update_htx(ctx, msg, offset, len) != NST_OK) {
+
+        /* keep the partial data with the entry, cleanup or eviction frees it */
+        nst_cache_abort(ctx);
+        ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+    }
+
+    return len;
+}
+
 static int _nst_cache_filter_http_end(struct stream *s, struct filter *filter,
         struct http_msg *msg) {
 
@@ -429,7 +669,12 @@ static int _nst_cache_filter_http_end(struct stream *s, struct filter *filter,
     if(ctx->state == NST_CACHE_CTX_STATE_CREATE
             && (msg->chn->flags & CF_ISRESP)) {
 
-        nst_cache_finish(ctx);
+        if(ctx->gzip && nst_cache_gzip_finish(ctx) != NST_OK) {
+            nst_cache_abort(ctx);
+            ctx->state = NST_CACHE_CTX_STATE_BYPASS;
+        } else {
+            nst_cache_finish(ctx);
+        }
     }
 
     return 1;
@@ -447,6 +692,7 @@ struct flt_ops nst_cache_filter_ops = {
     /* Filter HTTP requests and responses */
     .http_headers      = _nst_cache_filter_http_headers,
     .http_forward_data = _nst_cache_filter_http_forward_data,
+    .http_payload      = _nst_cache_filter_http_payload,
     .http_end          = _nst_cache_filter_http_end,
 
 };
@@ -12,6 +12,7 @@
 
 #include <types/global.h>
 
+#include <proto/http_htx.h>
 #include <proto/proto_http.h>
 #include <proto/stream_interface.h>
 #include <proto/proxy.h>
@@ -28,17 +29,24 @@ int _nst_cache_purge_by_key(struct buffer *key, uint64_t hash) {
     struct nst_cache_entry *entry = NULL;
     int ret;
 
-    nst_shctx_lock(&nuster.cache->dict[0]);
+    nst_shctx_lock(nst_cache_dict_shard(hash));
     entry = nst_cache_dict_get(key, hash);
 
     if(entry) {
 
+        /* a vary root has no data, its variants are no longer found */
         if(entry->state == NST_CACHE_ENTRY_STATE_VALID) {
-            entry->state         = NST_CACHE_ENTRY_STATE_EXPIRED;
-            entry->data->invalid = 1;
-            entry->data          = NULL;
-            entry->expire        = 0;
-            ret                  = 200;
+            entry->state  = NST_CACHE_ENTRY_STATE_EXPIRED;
+            entry->expire = 0;
+            ret           = 200;
+
+            nst_cache_entry_drop_data(entry);
+        }
+
+        /* stop serving the stale data, the refresh replaces it */
+        if(entry->state == NST_CACHE_ENTRY_STATE_REFRESH && entry->data) {
+            nst_cache_entry_drop_data(entry);
+            ret = 200;
         }
 
         if(entry->file) {
@@ -48,7 +56,7 @@ int _nst_cache_purge_by_key(struct buffer *key, uint64_t hash) {
         ret = 404;
     }
 
-    nst_shctx_unlock(&nuster.cache->dict[0]);
+    nst_shctx_unlock(nst_cache_dict_shard(hash));
 
     if(!nuster.cache->disk.loaded && global.nuster.cache.root){
         struct persist disk;
@@ -79,7 +87,7 @@ int nst_cache_purge(struct stream *s, struct channel *req, struct proxy *px) {
         txn->status = 500;
         nst_response(s, &nst_http_msg_chunks[NST_HTTP_500]);
     } else {
-        uint64_t hash = nst_hash(key->area, key->data);
+        uint64_t hash = nst_cache_key_hash(key);
         txn->status = _nst_cache_purge_by_key(key, hash);
 
         if(txn->status == 200) {
@@ -92,6 +100,71 @@ int nst_cache_purge(struct stream *s, struct channel *req, struct proxy *px) {
     return 1;
 }
 
+/* the responses of nst_cache_purge_htx, see nst_cache_manager_init */
+static struct buffer _nst_cache_purge_htx_msgs[NST_HTTP_SIZE];
+
+/*
+ * Purge the url of an HTX stream. The cache manager uri is not available
+ * with HTX, see _nst_cache_filter_check.
+ * Return 1 if the request is done, otherwise 0.
+ */
+int nst_cache_purge_htx(struct stream *s, struct channel *req,
+        struct proxy *px) {
+
+    struct http_txn *txn = s->txn;
+    struct htx_sl *sl;
+    struct buffer *key;
+    struct ist meth;
+    int len;
+
+    if(global.nuster.cache.status != NST_STATUS_ON
+            || txn->meth != HTTP_METH_OTHER) {
+
+        return 0;
+    }
+
+    sl = http_find_stline(htxbuf(&req->buf));
+
+    if(!sl) {
+        return 0;
+    }
+
+    /* followed by a space, see nuster_parse_global_cache */
+    meth = htx_sl_req_meth(sl);
+    len  = strlen(global.nuster.cache.purge_method) - 1;
+
+    if(meth.len != len
+            || memcmp(meth.ptr, global.nuster.cache.purge_method, len)) {
+
+        return 0;
+    }
+
+    key = nst_cache_build_purge_key(s, &txn->req);
+
+    if(!key) {
+        txn->status = 500;
+        htx_reply_and_close(s, txn->status,
+                &_nst_cache_purge_htx_msgs[NST_HTTP_500]);
+    } else {
+        uint64_t hash = nst_cache_key_hash(key);
+        txn->status = _nst_cache_purge_by_key(key, hash);
+
+        if(txn->status == 200) {
+            htx_reply_and_close(s, txn->status,
+                    &_nst_cache_purge_htx_msgs[NST_HTTP_200]);
+        } else {
+            htx_reply_and_close(s, txn->status,
+                    &_nst_cache_purge_htx_msgs[NST_HTTP_404]);
+        }
+    }
+
+    if(!(s->flags & SF_ERR_MASK)) {
+        s->flags |= SF_ERR_LOCAL;
+    }
+
+    return 1;
+}
+
 int _nst_cache_manager_state_ttl(struct stream *s, struct channel *req,
         struct proxy *px, int state, int ttl) {
 
@@ -483,35 +556,71 @@ static void nst_cache_manager_handler(struct appctx *appctx) {
     int max                       = 1000;
     uint64_t start                = get_current_timestamp();
 
-    while(1) {
-        nst_shctx_lock(&nuster.cache->dict[0]);
+    while(appctx->ctx.nuster.cache_manager.shard < NST_CACHE_DICT_SHARDS) {
+        struct nst_cache_dict_shard *shard =
+            &nuster.cache->shard[appctx->ctx.nuster.cache_manager.shard];
+
+        nst_shctx_lock(shard);
+
+        /*
+         * dict[1] replaced dict[0] since last time, entries may have been
+         * moved to checked groups, so start over with this shard
+         */
+        if(appctx->ctx.nuster.cache_manager.generation != shard->generation) {
+            appctx->ctx.nuster.cache_manager.generation = shard->generation;
+            appctx->st2 = 0;
+        }
 
-        while(appctx->st2 < nuster.cache->dict[0].size && max--) {
-            entry = nuster.cache->dict[0].entry[appctx->st2];
+        /* dict[0] groups followed by dict[1] groups if rehashing */
+        while(appctx->st2 < shard->dict[0].size + shard->dict[1].size
+                && max--) {
+
+            struct nst_dict *dict = &shard->dict[0];
+            uint64_t idx          = appctx->st2;
+            struct nst_dict_group *group;
+            uint32_t mask;
+
+            if(idx >= dict->size) {
+                idx  -= dict->size;
+                dict  = &shard->dict[1];
+            }
 
-            while(entry) {
+            group = nst_dict_group(dict, idx);
+            mask  = nst_dict_match_used(group);
+
+            while(mask) {
+                entry = group->slot[__builtin_ctz(mask)].ptr;
+                mask &= mask - 1;
 
                 if(_nst_cache_manager_should_purge(entry, appctx)) {
                     if(entry->state == NST_CACHE_ENTRY_STATE_VALID) {
 
-                        entry->state         = NST_CACHE_ENTRY_STATE_INVALID;
-                        entry->data->invalid = 1;
-                        entry->data          = NULL;
-                        entry->expire        = 0;
+                        entry->state  = NST_CACHE_ENTRY_STATE_INVALID;
+                        entry->expire = 0;
+
+                        nst_cache_entry_drop_data(entry);
+                    }
+
+                    if(entry->state == NST_CACHE_ENTRY_STATE_REFRESH) {
+                        nst_cache_entry_drop_data(entry);
                     }
 
                     if(entry->file) {
                         nst_persist_purge_by_path(entry->file);
                     }
                 }
-
-                entry = entry->next;
             }
 
             appctx->st2++;
         }
 
-        nst_shctx_unlock(&nuster.cache->dict[0]);
+        /* move on to the next shard */
+        if(appctx->st2 == shard->dict[0].size + shard->dict[1].size) {
+            appctx->ctx.nuster.cache_manager.shard++;
+            appctx->st2 = 0;
+        }
+
+        nst_shctx_unlock(shard);
 
         if(get_current_timestamp() - start > 1) {
             break;
@@ -522,7 +631,7 @@ static void nst_cache_manager_handler(struct appctx *appctx) {
 
     task_wakeup(s->task, TASK_WOKEN_OTHER);
 
-    if(appctx->st2 == nuster.cache->dict[0].size) {
+    if(appctx->ctx.nuster.cache_manager.shard == NST_CACHE_DICT_SHARDS) {
         ci_putblk(res, nst_http_msgs[NST_HTTP_200],
                 strlen(nst_http_msgs[NST_HTTP_200]));
 
@@ -549,8 +658,19 @@ static void nst_cache_manager_release_handler(struct appctx *appctx) {
 }
 
 int nst_cache_manager_init() {
+    int i;
+
     nuster.applet.cache_manager.fct     = nst_cache_manager_handler;
     nuster.applet.cache_manager.release = nst_cache_manager_release_handler;
 
+    for(i = 0; i < NST_HTTP_SIZE; i++) {
+
+        if(!http_str_to_htx(&_nst_cache_purge_htx_msgs[i],
+                    ist2(nst_http_msgs[i], strlen(nst_http_msgs[i])))) {
+
+            return 0;
+        }
+    }
+
     return 1;
 }
@@ -21,42 +21,98 @@
 #include <nuster/memory.h>
 #include <nuster/shctx.h>
 
+static inline struct nst_cache_stats_slot *_nst_cache_stats_slot() {
+    struct nst_cache_stats *stats = global.nuster.cache.stats;
+
+    return &stats->slot[nst_stats_slot(stats->slots)];
+}
+
+/*
+ * Only the counters of the thread are updated, no lock is taken
+ */
 void nst_cache_stats_update_used_mem(int i) {
-    nst_shctx_lock(global.nuster.cache.stats);
-    global.nuster.cache.stats->used_mem += i;
-    nst_shctx_unlock(global.nuster.cache.stats);
+    __atomic_add_fetch(&_nst_cache_stats_slot()->used_mem, i,
+            __ATOMIC_RELAXED);
+}
+
+void nst_cache_stats_update_evicted(int i) {
+    __atomic_add_fetch(&_nst_cache_stats_slot()->evicted, i,
+            __ATOMIC_RELAXED);
+}
+
+void nst_cache_stats_update_compacted(int i) {
+    __atomic_add_fetch(&_nst_cache_stats_slot()->compacted, i,
+            __ATOMIC_RELAXED);
+}
+
+void nst_cache_stats_update_admit(int admitted) {
+    struct nst_cache_stats_slot *slot = _nst_cache_stats_slot();
+
+    if(admitted) {
+        __atomic_add_fetch(&slot->admit.admitted, 1, __ATOMIC_RELAXED);
+    } else {
+        __atomic_add_fetch(&slot->admit.rejected, 1, __ATOMIC_RELAXED);
+    }
 }
 
 void nst_cache_stats_update_req(int state) {
-    nst_shctx_lock(global.nuster.cache.stats);
-    global.nuster.cache.stats->req.total++;
+    struct nst_cache_stats_slot *slot = _nst_cache_stats_slot();
+
+    __atomic_add_fetch(&slot->req.total, 1, __ATOMIC_RELAXED);
 
     switch(state) {
         case NST_CACHE_CTX_STATE_HIT:
         case NST_CACHE_CTX_STATE_HIT_DISK:
-            global.nuster.cache.stats->req.hit++;
+            __atomic_add_fetch(&slot->req.hit, 1, __ATOMIC_RELAXED);
             break;
         case NST_CACHE_CTX_STATE_CREATE:
-            global.nuster.cache.stats->req.abort++;
+            __atomic_add_fetch(&slot->req.abort, 1, __ATOMIC_RELAXED);
             break;
         case NST_CACHE_CTX_STATE_DONE:
-            global.nuster.cache.stats->req.fetch++;
+            __atomic_add_fetch(&slot->req.fetch, 1, __ATOMIC_RELAXED);
             break;
         default:
             break;
     }
+}
 
-    nst_shctx_unlock(global.nuster.cache.stats);
+/*
+ * Sum up the counters of every thread, each one is read as a whole but
+ * they may be updated meanwhile
+ */
+void nst_cache_stats_get(struct nst_cache_stats_slot *sum) {
+    struct nst_cache_stats *stats = global.nuster.cache.stats;
+    int i;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for(i = 0; i < stats->slots; i++) {
+        struct nst_cache_stats_slot *slot = &stats->slot[i];
+
+        sum->used_mem += __atomic_load_n(&slot->used_mem, __ATOMIC_RELAXED);
+        sum->evicted  += __atomic_load_n(&slot->evicted, __ATOMIC_RELAXED);
+
+        sum->compacted += __atomic_load_n(&slot->compacted, __ATOMIC_RELAXED);
+
+        sum->req.total += __atomic_load_n(&slot->req.total, __ATOMIC_RELAXED);
+        sum->req.fetch += __atomic_load_n(&slot->req.fetch, __ATOMIC_RELAXED);
+        sum->req.hit   += __atomic_load_n(&slot->req.hit, __ATOMIC_RELAXED);
+        sum->req.abort += __atomic_load_n(&slot->req.abort, __ATOMIC_RELAXED);
+
+        sum->admit.admitted += __atomic_load_n(&slot->admit.admitted,
+                __ATOMIC_RELAXED);
+
+        sum->admit.rejected += __atomic_load_n(&slot->admit.rejected,
+                __ATOMIC_RELAXED);
+    }
 }
 
 int nst_cache_stats_full() {
-    int i;
+    struct nst_cache_stats_slot sum;
 
-    nst_shctx_lock(global.nuster.cache.stats);
-    i =  global.nuster.cache.data_size <= global.nuster.cache.stats->used_mem;
-    nst_shctx_unlock(global.nuster.cache.stats);
+    nst_cache_stats_get(&sum);
 
-    return i;
+    return global.nuster.cache.data_size <= sum.used_mem;
 }
 
 /*
@@ -95,9 +151,55 @@ int nst_cache_stats(struct stream *s, struct channel *req, struct proxy *px) {
     return 0;
 }
 
+/*
+ * Blocks and chunks in use of each chunk size, read without the lock.
+ * frag is the share of the blocks of that size not used by chunks.
+ */
+static void _nst_cache_stats_memory(struct nst_memory *memory) {
+    int i;
+
+    chunk_appendf(&trash, "\n**MEMORY**\n");
+
+    chunk_appendf(&trash, "global.nuster.cache.memory.blocks: %"PRIu64
+            " of %d\n", (uint64_t)(__atomic_load_n(&memory->data.free,
+                    __ATOMIC_RELAXED) - memory->data.begin)
+            / memory->block_size, memory->blocks);
+
+    chunk_appendf(&trash, "global.nuster.cache.memory.draining: %d\n",
+            __atomic_load_n(&memory->draining, __ATOMIC_RELAXED));
+
+    chunk_appendf(&trash, "global.nuster.cache.memory.large: %"PRIu64"\n",
+            __atomic_load_n(&memory->large, __ATOMIC_RELAXED));
+
+    for(i = 0; i < memory->chunks; i++) {
+        uint64_t blocks = __atomic_load_n(&memory->usage[i].blocks,
+                __ATOMIC_RELAXED);
+
+        uint64_t chunks = __atomic_load_n(&memory->usage[i].chunks,
+                __ATOMIC_RELAXED);
+
+        uint64_t capacity = blocks
+            * (memory->block_size >> (memory->chunk_shift + i));
+
+        if(!blocks) {
+            continue;
+        }
+
+        chunk_appendf(&trash, "global.nuster.cache.memory.chunk.%u: "
+                "blocks %"PRIu64", chunks %"PRIu64" of %"PRIu64
+                ", frag %"PRIu64"%%\n", 1U << (memory->chunk_shift + i),
+                blocks, chunks, capacity,
+                chunks < capacity ? (capacity - chunks) * 100 / capacity : 0);
+    }
+}
+
 int _nst_cache_stats_head(struct appctx *appctx, struct stream *s,
         struct stream_interface *si, struct channel *res) {
 
+    struct nst_cache_stats_slot sum;
+
+    nst_cache_stats_get(&sum);
+
     chunk_printf(&trash,
             "HTTP/1.1 200 OK\r\n"
             "Cache-Control: no-cache\r\n"
@@ -115,24 +217,47 @@ int _nst_cache_stats_head(struct appctx *appctx, struct stream *s,
     chunk_appendf(&trash, "global.nuster.cache.uri: %s\n",
             global.nuster.cache.uri);
 
+    chunk_appendf(&trash, "global.nuster.cache.evict: %s\n",
+            nst_evict_name(global.nuster.cache.evict));
+
+    chunk_appendf(&trash, "global.nuster.cache.headroom: %d\n",
+            global.nuster.cache.headroom);
+
+    chunk_appendf(&trash, "global.nuster.cache.admit: %d\n",
+            global.nuster.cache.admit);
+
     chunk_appendf(&trash, "global.nuster.cache.purge_method: %.*s\n",
             (int)strlen(global.nuster.cache.purge_method) - 1,
             global.nuster.cache.purge_method);
 
     chunk_appendf(&trash, "global.nuster.cache.stats.used_mem: %"PRIu64"\n",
-            global.nuster.cache.stats->used_mem);
+            sum.used_mem);
 
     chunk_appendf(&trash, "global.nuster.cache.stats.req_total: %"PRIu64"\n",
-            global.nuster.cache.stats->req.total);
+            sum.req.total);
 
     chunk_appendf(&trash, "global.nuster.cache.stats.req_hit: %"PRIu64"\n",
-            global.nuster.cache.stats->req.hit);
+            sum.req.hit);
 
     chunk_appendf(&trash, "global.nuster.cache.stats.req_fetch: %"PRIu64"\n",
-            global.nuster.cache.stats->req.fetch);
+            sum.req.fetch);
 
     chunk_appendf(&trash, "global.nuster.cache.stats.req_abort: %"PRIu64"\n",
-            global.nuster.cache.stats->req.abort);
+            sum.req.abort);
+
+    chunk_appendf(&trash, "global.nuster.cache.stats.evicted: %"PRIu64"\n",
+            sum.evicted);
+
+    chunk_appendf(&trash, "global.nuster.cache.stats.compacted: %"PRIu64"\n",
+            sum.compacted);
+
+    chunk_appendf(&trash, "global.nuster.cache.stats.admitted: %"PRIu64"\n",
+            sum.admit.admitted);
+
+    chunk_appendf(&trash, "global.nuster.cache.stats.rejected: %"PRIu64"\n",
+            sum.admit.rejected);
+
+    _nst_cache_stats_memory(global.nuster.cache.memory);
 
     chunk_appendf(&trash, "\n**PERSISTENCE**\n");
 
@@ -252,25 +377,32 @@ static void nst_cache_stats_handler(struct appctx *appctx) {
 
 }
 
+/*
+ * Allocate one slot per thread of every worker process, or a single one
+ * shared by all if they do not fit in one block
+ */
 int nst_cache_stats_init() {
-    global.nuster.cache.stats =
-        nst_cache_memory_alloc(sizeof(struct nst_cache_stats));
+    struct nst_cache_stats *stats;
+    int slots = global.nbproc * global.nbthread;
+
+    stats = nst_cache_memory_alloc(sizeof(struct nst_cache_stats));
 
-    if(!global.nuster.cache.stats) {
+    if(!stats) {
         return NST_ERR;
     }
 
-    if(nst_shctx_init(global.nuster.cache.stats) != NST_OK) {
+    stats->slot = nst_cache_memory_alloc(
+            slots * sizeof(struct nst_cache_stats_slot));
+
+    if(!stats->slot) {
         return NST_ERR;
     }
 
-    global.nuster.cache.stats->used_mem  = 0;
-    global.nuster.cache.stats->req.total = 0;
-    global.nuster.cache.stats->req.fetch = 0;
-    global.nuster.cache.stats->req.hit   = 0;
-    global.nuster.cache.stats->req.abort = 0;
-    nuster.applet.cache_stats.fct        = nst_cache_stats_handler;
+    memset(stats->slot, 0, slots * sizeof(struct nst_cache_stats_slot));
+    stats->slots = slots;
+
+    global.nuster.cache.stats     = stats;
+    nuster.applet.cache_stats.fct = nst_cache_stats_handler;
 
     return NST_OK;
 }
-
@@ -0,0 +1,167 @@
+/*
+ * nuster dict functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <nuster/memory.h>
+#include <nuster/dict.h>
+
+/*
+ * Allocate size groups from memory, in segments of at most one block each
+ */
+int nst_dict_alloc(struct nst_memory *memory, struct nst_dict *dict,
+        uint64_t size) {
+
+    uint64_t groups = memory->block_size / sizeof(struct nst_dict_group);
+    uint64_t segments;
+    uint64_t i;
+
+    if(size < groups) {
+        groups = size;
+    }
+
+    segments = size / groups;
+
+    dict->segment = nst_memory_alloc(memory,
+            segments * sizeof(struct nst_dict_group *));
+
+    if(!dict->segment) {
+        return NST_ERR;
+    }
+
+    for(i = 0; i < segments; i++) {
+        struct nst_dict_group *segment;
+        uint64_t j;
+
+        segment = nst_memory_alloc(memory,
+                groups * sizeof(struct nst_dict_group));
+
+        if(!segment) {
+
+            while(i--) {
+                nst_memory_free(memory, dict->segment[i]);
+            }
+
+            nst_memory_free(memory, dict->segment);
+            dict->segment = NULL;
+
+            return NST_ERR;
+        }
+
+        for(j = 0; j < groups; j++) {
+            memset(segment[j].ctrl, NST_DICT_CTRL_EMPTY, NST_DICT_GROUP_SLOTS);
+            segment[j].ctrl[NST_DICT_GROUP_SLOTS] = NST_DICT_CTRL_SENTINEL;
+        }
+
+        dict->segment[i] = segment;
+    }
+
+    for(dict->shift = 0; (1ULL << dict->shift) < groups; dict->shift++) { }
+
+    dict->size    = size;
+    dict->used    = 0;
+    dict->deleted = 0;
+
+    return NST_OK;
+}
+
+void nst_dict_free(struct nst_memory *memory, struct nst_dict *dict) {
+    uint64_t i;
+
+    for(i = 0; i < dict->size >> dict->shift; i++) {
+        nst_memory_free(memory, dict->segment[i]);
+    }
+
+    nst_memory_free(memory, dict->segment);
+
+    dict->segment = NULL;
+    dict->size    = 0;
+    dict->used    = 0;
+    dict->deleted = 0;
+}
+
+/*
+ * The largest number of groups whose segment directory fits in one block
+ */
+uint64_t nst_dict_max_size(struct nst_memory *memory) {
+    uint64_t groups   = memory->block_size / sizeof(struct nst_dict_group);
+    uint64_t segments = memory->block_size / sizeof(struct nst_dict_group *);
+
+    return groups * segments;
+}
+
+/*
+ * Put ptr in the first empty or deleted slot along the probe sequence of
+ * hash, the caller has to make sure that it is not in the dict yet
+ */
+int nst_dict_insert(struct nst_dict *dict, uint64_t hash, void *ptr) {
+    uint64_t idx = hash & (dict->size - 1);
+    uint64_t step;
+
+    for(step = 0; step < dict->size; step++) {
+        struct nst_dict_group *group = nst_dict_group(dict, idx);
+        uint32_t mask                = nst_dict_match_free(group);
+
+        if(mask) {
+            int i = __builtin_ctz(mask);
+
+            if(group->ctrl[i] == NST_DICT_CTRL_DELETED) {
+                dict->deleted--;
+            }
+
+            group->slot[i].hash = hash;
+            group->slot[i].ptr  = ptr;
+
+            /* lock free readers must see the slot before its tag */
+            __atomic_store_n(&group->ctrl[i], nst_dict_tag(hash),
+                    __ATOMIC_RELEASE);
+
+            dict->used++;
+
+            return NST_OK;
+        }
+
+        idx = (idx + step + 1) & (dict->size - 1);
+    }
+
+    return NST_ERR;
+}
+
+/*
+ * Move all used slots of group idx to another dict, the moved slots are
+ * marked as deleted so that probes of other slots still go past this group
+ */
+int nst_dict_move_group(struct nst_dict *from, uint64_t idx,
+        struct nst_dict *to) {
+
+    struct nst_dict_group *group = nst_dict_group(from, idx);
+    uint32_t mask                = nst_dict_match_used(group);
+
+    while(mask) {
+        int i = __builtin_ctz(mask);
+
+        mask &= mask - 1;
+
+        if(nst_dict_insert(to, group->slot[i].hash, group->slot[i].ptr)
+                != NST_OK) {
+
+            return NST_ERR;
+        }
+
+        /* and it must be in the new dict before it leaves the old one */
+        __atomic_store_n(&group->ctrl[i], NST_DICT_CTRL_DELETED,
+                __ATOMIC_RELEASE);
+
+        from->deleted++;
+        from->used--;
+    }
+
+    return NST_OK;
+}
@@ -0,0 +1,140 @@
+/*
+ * nuster epoch based reclamation functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <import/atomic-ops.h>
+
+#include <nuster/memory.h>
+#include <nuster/epoch.h>
+
+/*
+ * Allocate one slot per thread of every worker process. Lock free reads
+ * stay disabled if the slots do not fit in one block.
+ */
+int nst_epoch_init(struct nst_memory *memory, struct nst_epoch *epoch) {
+    int slots = global.nbproc * global.nbthread;
+
+    memset(epoch, 0, sizeof(*epoch));
+
+    epoch->epoch = NST_EPOCH_IDLE + 1;
+
+    if(slots * NST_EPOCH_SLOT_SIZE > memory->block_size) {
+        return NST_OK;
+    }
+
+    epoch->slot = nst_memory_alloc(memory, slots * NST_EPOCH_SLOT_SIZE);
+
+    if(!epoch->slot) {
+        return NST_ERR;
+    }
+
+    memset(epoch->slot, 0, slots * NST_EPOCH_SLOT_SIZE);
+    epoch->slots = slots;
+
+    return NST_OK;
+}
+
+/*
+ * Free p once no reader can see it anymore, the caller must have unlinked
+ * it from everything the readers can reach
+ */
+void nst_epoch_retire(struct nst_epoch *epoch, void *p,
+        void (*release)(void *p)) {
+
+    struct nst_epoch_retired *retired;
+
+    if(!epoch->slot) {
+        release(p);
+        return;
+    }
+
+    retired = malloc(sizeof(*retired));
+
+    /* better leak it than free it under a reader */
+    if(!retired) {
+        return;
+    }
+
+    retired->p       = p;
+    retired->release = release;
+    retired->next    = epoch->retired[epoch->epoch % 3];
+
+    epoch->retired[epoch->epoch % 3] = retired;
+}
+
+/*
+ * Advance the epoch if every reader has left the previous one, then free
+ * what was retired two epochs ago
+ */
+void nst_epoch_reclaim(struct nst_epoch *epoch) {
+    struct nst_epoch_retired *retired;
+    unsigned int current = epoch->epoch;
+    int i;
+
+    if(!epoch->slot) {
+        return;
+    }
+
+    /* the unlinks must be visible before the slots are checked */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for(i = 0; i < epoch->slots; i++) {
+        unsigned int e = __atomic_load_n(&epoch->slot[i].epoch,
+                __ATOMIC_ACQUIRE);
+
+        if(e != NST_EPOCH_IDLE && e != current) {
+            return;
+        }
+    }
+
+    if(++current == NST_EPOCH_IDLE) {
+        current++;
+    }
+
+    __atomic_store_n(&epoch->epoch, current, __ATOMIC_RELEASE);
+
+    retired = epoch->retired[(current + 1) % 3];
+    epoch->retired[(current + 1) % 3] = NULL;
+
+    while(retired) {
+        struct nst_epoch_retired *tmp = retired;
+
+        retired = retired->next;
+        tmp->release(tmp->p);
+        free(tmp);
+    }
+}
+
+/*
+ * Wait until every reader inside a read section has left it, so that what
+ * the caller unlinked before can be freed right away, by any process.
+ * Readers never block inside a read section.
+ */
+void nst_epoch_synchronize(struct nst_epoch *epoch) {
+    int i;
+
+    if(!epoch->slot) {
+        return;
+    }
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    for(i = 0; i < epoch->slots; i++) {
+        unsigned int e = __atomic_load_n(&epoch->slot[i].epoch,
+                __ATOMIC_ACQUIRE);
+
+        while(e != NST_EPOCH_IDLE && e == __atomic_load_n(
+                    &epoch->slot[i].epoch, __ATOMIC_ACQUIRE)) {
+
+            pl_cpu_relax();
+        }
+    }
+}
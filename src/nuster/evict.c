@@ -0,0 +1,135 @@
+/*
+ * nuster eviction policy functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <nuster/evict.h>
+
+/*
+ * Is a to be evicted before b, entries with at least protect hits are in
+ * the protected segment and evicted after the probation ones
+ */
+static int _nst_evict_before(struct nst_evict_cand *a,
+        struct nst_evict_cand *b, unsigned int protect) {
+
+    int pa = a->hits >= protect;
+    int pb = b->hits >= protect;
+
+    if(pa != pb) {
+        return pa < pb;
+    }
+
+    return a->atime < b->atime;
+}
+
+/*
+ * Least recently used candidate with at least min hits, probation first
+ */
+static int _nst_evict_slru(struct nst_evict_cand *cand, int n,
+        unsigned int min, unsigned int protect) {
+
+    int victim = -1;
+    int i;
+
+    for(i = 0; i < n; i++) {
+
+        if(cand[i].hits < min) {
+            continue;
+        }
+
+        if(victim == -1 || _nst_evict_before(&cand[i], &cand[victim], protect)) {
+            victim = i;
+        }
+    }
+
+    return victim;
+}
+
+/*
+ * The candidates are in the order of the hand, clear the reference bits
+ * until an unreferenced entry is found. If all of them were referenced the
+ * hand would come back to the first one.
+ */
+static int _nst_evict_clock(struct nst_evict_cand *cand, int n) {
+    int i;
+
+    for(i = 0; i < n; i++) {
+
+        if(!__atomic_exchange_n(cand[i].ref, 0, __ATOMIC_RELAXED)) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Entries never hit since inserted make the window, the least recent one
+ * leaves it only if it has been requested more often than the victim of
+ * the main SLRU, otherwise it is evicted itself
+ */
+static int _nst_evict_tinylfu(struct nst_sketch *sketch,
+        struct nst_evict_cand *cand, int n) {
+
+    int window = _nst_evict_slru(cand, n, 0, 1);
+    int main   = _nst_evict_slru(cand, n, 1, 2);
+
+    if(window == -1 || cand[window].hits > 0) {
+        return main;
+    }
+
+    if(main == -1) {
+        return window;
+    }
+
+    if(nst_sketch_frequency(sketch, cand[window].hash)
+            > nst_sketch_frequency(sketch, cand[main].hash)) {
+
+        return main;
+    }
+
+    return window;
+}
+
+/*
+ * Return the index of the candidate to evict, -1 if there is none
+ */
+int nst_evict_choose(int policy, struct nst_sketch *sketch,
+        struct nst_evict_cand *cand, int n) {
+
+    if(n == 0) {
+        return -1;
+    }
+
+    switch(policy) {
+        case NST_EVICT_CLOCK:
+            return _nst_evict_clock(cand, n);
+        case NST_EVICT_TINYLFU:
+            return _nst_evict_tinylfu(sketch, cand, n);
+        case NST_EVICT_SLRU:
+            return _nst_evict_slru(cand, n, 0, 1);
+        default:
+            return -1;
+    }
+}
+
+const char *nst_evict_name(int policy) {
+
+    switch(policy) {
+        case NST_EVICT_SLRU:
+            return "slru";
+        case NST_EVICT_CLOCK:
+            return "clock";
+        case NST_EVICT_TINYLFU:
+            return "tinylfu";
+        default:
+            return "off";
+    }
+}
@@ -10,6 +10,10 @@
  *
  */
 
+#include <common/standard.h>
+
+#include <proto/channel.h>
+
 #include <nuster/http.h>
 
 /*
@@ -77,9 +81,81 @@ struct nst_headers nst_headers = {
     .expires           = nst_str_set("Expires"),
     .cache_control     = nst_str_set("Cache-Control"),
     .etag              = nst_str_set("ETag"),
+    .content_range     = nst_str_set("Content-Range"),
 };
 
 
+/* "HTTP/1.1 <status> <reason>\r\n", see nst_http_init */
+struct nst_str nst_http_status_lines[NST_HTTP_STATUS_MAX];
+
+/* what follows the Date of a 412 */
+struct nst_str nst_http_412_tail;
+
+/* the Date header of the calling thread, see nst_http_date_line */
+static THREAD_LOCAL struct {
+    time_t         sec;
+    struct nst_str line;
+    char           buf[40];
+} nst_http_date_cache;
+
+/*
+ * Serialize the fixed parts of the responses once
+ */
+void nst_http_init() {
+    char *p;
+    int i;
+
+    for(i = 0; i < NST_HTTP_SIZE; i++) {
+        nst_http_msg_chunks[i].area = (char *)nst_http_msgs[i];
+        nst_http_msg_chunks[i].data = strlen(nst_http_msgs[i]);
+    }
+
+    for(i = 100; i < NST_HTTP_STATUS_MAX; i++) {
+        p = NULL;
+        memprintf(&p, "HTTP/1.1 %d %s\r\n", i, http_get_reason(i));
+
+        nst_http_status_lines[i].data = p;
+        nst_http_status_lines[i].len  = p ? strlen(p) : 0;
+    }
+
+    p = NULL;
+    memprintf(&p, "%.*s: %d\r\n\r\n%s", nst_headers.content_length.len,
+            nst_headers.content_length.data, (int)strlen(http_get_reason(412)),
+            http_get_reason(412));
+
+    nst_http_412_tail.data = p;
+    nst_http_412_tail.len  = p ? strlen(p) : 0;
+}
+
+/*
+ * The Date header line of the date of the poll loop of the calling thread,
+ * formatted once a second
+ */
+struct nst_str *nst_http_date_line() {
+    const char mon[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul",
+        "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+    const char day[7][4]  = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+    if(!nst_http_date_cache.line.len
+            || nst_http_date_cache.sec != date.tv_sec) {
+
+        time_t sec = date.tv_sec;
+        struct tm tm;
+
+        gmtime_r(&sec, &tm);
+
+        nst_http_date_cache.sec       = sec;
+        nst_http_date_cache.line.data = nst_http_date_cache.buf;
+        nst_http_date_cache.line.len  = snprintf(nst_http_date_cache.buf,
+                sizeof(nst_http_date_cache.buf),
+                "Date: %s, %02d %s %04d %02d:%02d:%02d GMT\r\n",
+                day[tm.tm_wday], tm.tm_mday, mon[tm.tm_mon],
+                1900 + tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
+    }
+
+    return &nst_http_date_cache.line;
+}
 
 int nst_req_find_param(char *query_beg, char *query_end,
         char *name, char **value, int *value_len) {
@@ -113,3 +189,301 @@ int nst_req_find_param(char *query_beg, char *query_end,
     return NST_ERR;
 }
 
+/*
+ * Find the next value of the header name in the message of s, or its next
+ * line if full, whether the stream is legacy or HTX
+ */
+int nst_http_find_header(struct stream *s, struct http_msg *msg,
+        const char *name, int len, struct nst_http_hdr *hdr, int full) {
+
+    if(IS_HTX_STRM(s)) {
+        struct htx *htx = htxbuf(&msg->chn->buf);
+
+        if(!http_find_header(htx, ist2(name, len), &hdr->htx, full)) {
+            return 0;
+        }
+
+        hdr->value = hdr->htx.value.ptr;
+        hdr->len   = hdr->htx.value.len;
+    } else {
+        int found;
+
+        if(full) {
+            found = http_find_full_header2(name, len, ci_head(msg->chn),
+                    &s->txn->hdr_idx, &hdr->legacy);
+        } else {
+            found = http_find_header2(name, len, ci_head(msg->chn),
+                    &s->txn->hdr_idx, &hdr->legacy);
+        }
+
+        if(!found) {
+            return 0;
+        }
+
+        hdr->value = hdr->legacy.line + hdr->legacy.val;
+        hdr->len   = hdr->legacy.vlen;
+    }
+
+    return 1;
+}
+
+/*
+ * Remove what nst_http_find_header found, it can go on after it
+ */
+int nst_http_remove_header(struct stream *s, struct http_msg *msg,
+        struct nst_http_hdr *hdr) {
+
+    if(IS_HTX_STRM(s)) {
+        return http_remove_header(htxbuf(&msg->chn->buf), &hdr->htx);
+    }
+
+    return http_remove_header2(msg, &s->txn->hdr_idx, &hdr->legacy);
+}
+
+int nst_http_add_header(struct stream *s, struct http_msg *msg,
+        const char *name, int name_len, const char *value, int value_len) {
+
+    if(IS_HTX_STRM(s)) {
+
+        if(!http_add_header(htxbuf(&msg->chn->buf), ist2(name, name_len),
+                    ist2(value, value_len))) {
+
+            return NST_ERR;
+        }
+
+        return NST_OK;
+    }
+
+    chunk_printf(&trash, "%.*s: %.*s", name_len, name, value_len, value);
+
+    if(http_header_add_tail2(msg, &s->txn->hdr_idx, trash.area,
+                trash.data) < 0) {
+
+        return NST_ERR;
+    }
+
+    return NST_OK;
+}
+
+/*
+ * The length of the body given by Content-Length, NST_ERR if there is none
+ */
+int nst_http_body_len(struct stream *s, struct http_msg *msg, uint64_t *len) {
+    struct nst_http_hdr hdr;
+    long long v;
+
+    if(!(msg->flags & HTTP_MSGF_CNT_LEN)) {
+        return NST_ERR;
+    }
+
+    if(!IS_HTX_STRM(s)) {
+        *len = msg->body_len;
+
+        return NST_OK;
+    }
+
+    /* the HTX analysers do not keep it, it was checked by the mux */
+    nst_http_hdr_init(&hdr);
+
+    if(!nst_http_find_header(s, msg, "Content-Length", 14, &hdr, 1)
+            || strl2llrc(hdr.value, hdr.len, &v) != 0 || v < 0) {
+
+        return NST_ERR;
+    }
+
+    *len = v;
+
+    return NST_OK;
+}
+
+/*
+ * The path of the request and its query
+ */
+struct ist nst_http_path(struct stream *s, struct http_msg *msg) {
+    char *begin, *end;
+
+    if(IS_HTX_STRM(s)) {
+        struct htx_sl *sl = http_find_stline(htxbuf(&msg->chn->buf));
+
+        if(!sl) {
+            return ist2(NULL, 0);
+        }
+
+        return http_get_path(htx_sl_req_uri(sl));
+    }
+
+    begin = http_txn_get_path(s->txn);
+
+    if(!begin) {
+        return ist2(NULL, 0);
+    }
+
+    end = ci_head(msg->chn) + msg->sl.rq.u + msg->sl.rq.u_l;
+
+    return ist2(begin, end - begin);
+}
+
+/*
+ * The body of the request received so far, contiguous
+ */
+struct ist nst_http_body(struct stream *s, struct http_msg *msg) {
+    struct htx *htx;
+    struct buffer *buf;
+    struct ist body = ist2(NULL, 0);
+    int32_t pos;
+    int eoh = 0;
+
+    if(!IS_HTX_STRM(s)) {
+
+        if(ci_data(msg->chn) > msg->sov) {
+            body = ist2(ci_head(msg->chn) + msg->sov,
+                    ci_data(msg->chn) - msg->sov);
+        }
+
+        return body;
+    }
+
+    htx = htxbuf(&msg->chn->buf);
+    buf = NULL;
+
+    /* copied only if split in several blocks */
+    for(pos = htx_get_head(htx); pos != -1; pos = htx_get_next(htx, pos)) {
+        struct htx_blk *blk = htx_get_blk(htx, pos);
+        enum htx_blk_type type = htx_get_blk_type(blk);
+        struct ist v;
+
+        if(type == HTX_BLK_EOH) {
+            eoh = 1;
+            continue;
+        }
+
+        if(!eoh || type != HTX_BLK_DATA) {
+            continue;
+        }
+
+        v = htx_get_blk_value(htx, blk);
+
+        if(!body.ptr) {
+            body = v;
+            continue;
+        }
+
+        if(!buf) {
+            buf = get_trash_chunk();
+            chunk_memcpy(buf, body.ptr, body.len);
+        }
+
+        if(!chunk_memcat(buf, v.ptr, v.len)) {
+            break;
+        }
+
+        body = ist2(buf->area, buf->data);
+    }
+
+    return body;
+}
+
+/*
+ * Add the response of status at once to the channel of an HTX stream, like
+ * the cache applet of src/cache.c, and close it
+ */
+static void _nst_res_htx(struct stream_interface *si, int status,
+        struct nst_str *last_modified, struct nst_str *etag,
+        const char *content) {
+
+    struct channel *req = si_oc(si);
+    struct channel *res = si_ic(si);
+    struct htx *htx     = htx_from_buf(&res->buf);
+    const char *reason  = http_get_reason(status);
+    unsigned int flags  = HTX_SL_F_IS_RESP | HTX_SL_F_VER_11
+        | HTX_SL_F_XFER_LEN;
+
+    struct htx_sl *sl;
+    uint32_t data = htx->data;
+    char code[12], len[24];
+
+    if(!content) {
+        flags |= HTX_SL_F_BODYLESS;
+    } else {
+        flags |= HTX_SL_F_CLEN;
+        ulltoa(strlen(content), len, sizeof(len));
+    }
+
+    sl = htx_add_stline(htx, HTX_BLK_RES_SL, flags, ist("HTTP/1.1"),
+            ist2(code, ulltoa(status, code, sizeof(code)) - code),
+            ist(reason));
+
+    if(!sl) {
+        goto err;
+    }
+
+    sl->info.res.status = status;
+
+    if(!htx_add_header(htx, ist2(nst_headers.server.data,
+                    nst_headers.server.len), ist("nuster"))
+            || !htx_add_header(htx, ist2(nst_headers.date.data,
+                    nst_headers.date.len), nst_http_date())) {
+
+        goto err;
+    }
+
+    if(last_modified && !htx_add_header(htx,
+                ist2(nst_headers.last_modified.data,
+                    nst_headers.last_modified.len),
+                ist2(last_modified->data, last_modified->len))) {
+
+        goto err;
+    }
+
+    if(etag && !htx_add_header(htx, ist2(nst_headers.etag.data,
+                    nst_headers.etag.len), ist2(etag->data, etag->len))) {
+
+        goto err;
+    }
+
+    if(content && !htx_add_header(htx, ist2(nst_headers.content_length.data,
+                    nst_headers.content_length.len), ist(len))) {
+
+        goto err;
+    }
+
+    if(!htx_add_endof(htx, HTX_BLK_EOH)) {
+        goto err;
+    }
+
+    if(content && !htx_add_data(htx, ist(content))) {
+        goto err;
+    }
+
+    if(!htx_add_endof(htx, HTX_BLK_EOM)) {
+        goto err;
+    }
+
+    channel_add_input(res, htx->data - data);
+    goto end;
+
+err:
+    channel_htx_truncate(res, htx);
+
+end:
+    htx_to_buf(htx, &res->buf);
+
+    if(co_data(req)) {
+        htx = htx_from_buf(&req->buf);
+        co_htx_skip(req, htx, co_data(req));
+        htx_to_buf(htx, &req->buf);
+    }
+
+    si_shutr(si);
+    res->flags |= CF_READ_NULL;
+}
+
+void nst_res_htx_304(struct stream_interface *si,
+        struct nst_str *last_modified, struct nst_str *etag) {
+
+    _nst_res_htx(si, 304, last_modified, etag, NULL);
+}
+
+void nst_res_htx_412(struct stream_interface *si) {
+    _nst_res_htx(si, 412, NULL, NULL, http_get_reason(412));
+}
@@ -11,18 +11,141 @@
  */
 
 #include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#ifdef USE_THREAD
+#include <pthread.h>
+#endif
 
 #include <nuster/shctx.h>
 #include <nuster/memory.h>
 
 #include <common/standard.h>
+#include <common/hathreads.h>
+
+#if defined MAP_HUGETLB && !defined MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+/*
+ * Applies the NUMA policy to the memory before any page is touched, the
+ * policy belongs to the shared memory so it holds in every process
+ */
+static int _nst_memory_numa(uint8_t *p, uint64_t size,
+        struct nst_memory_conf *conf) {
+
+#if defined __linux__ && defined SYS_mbind
+    unsigned long nodes = conf->nodes;
+    int mode;
+
+    if(conf->numa == NST_MEMORY_NUMA_OFF) {
+        return NST_OK;
+    }
+
+    if(!nodes && syscall(SYS_get_mempolicy, NULL, &nodes,
+                sizeof(nodes) * 8, NULL, MPOL_F_MEMS_ALLOWED)) {
+
+        return NST_ERR;
+    }
+
+    mode = conf->numa == NST_MEMORY_NUMA_BIND ? MPOL_BIND : MPOL_INTERLEAVE;
+
+    /* the kernel reads one bit less than maxnode */
+    if(syscall(SYS_mbind, p, size, mode, &nodes, sizeof(nodes) * 8 + 1, 0)) {
+        return NST_ERR;
+    }
+
+    return NST_OK;
+#else
+    return conf->numa == NST_MEMORY_NUMA_OFF ? NST_OK : NST_ERR;
+#endif
+}
+
+struct nst_memory_prefault {
+    uint8_t  *begin;
+    uint8_t  *end;
+    uint64_t  page;
+};
+
+static void *_nst_memory_prefault_run(void *arg) {
+    struct nst_memory_prefault *pf = arg;
+    uint8_t *p;
+
+    for(p = pf->begin; p < pf->end; p += pf->page) {
+        *(volatile uint8_t *)p = 0;
+    }
+
+    return NULL;
+}
+
+/*
+ * Touches every page of the fresh memory so that requests do not fault
+ * them in, each thread touches a contiguous share of the pages
+ */
+static void _nst_memory_prefault(uint8_t *p, uint64_t size, uint64_t page,
+        int threads) {
+
+    struct nst_memory_prefault pf[NST_MEMORY_PREFAULT_MAX];
+    uint64_t pages = size / page;
+    int i, n = 1;
+
+#ifdef USE_THREAD
+    pthread_t thread[NST_MEMORY_PREFAULT_MAX];
+#endif
+
+    if(threads <= 0) {
+        return;
+    }
+
+    if(threads > NST_MEMORY_PREFAULT_MAX) {
+        threads = NST_MEMORY_PREFAULT_MAX;
+    }
+
+    for(i = 0; i < threads; i++) {
+        pf[i].begin = p + pages * i / threads * page;
+        pf[i].end   = p + pages * (i + 1) / threads * page;
+        pf[i].page  = page;
+    }
+
+#ifdef USE_THREAD
+    for(n = 1; n < threads; n++) {
+
+        if(pthread_create(&thread[n], NULL, _nst_memory_prefault_run,
+                    &pf[n])) {
+
+            break;
+        }
+    }
+#endif
+
+    /* this thread takes the shares no thread could be started for */
+    _nst_memory_prefault_run(&pf[0]);
+
+    for(i = n; i < threads; i++) {
+        _nst_memory_prefault_run(&pf[i]);
+    }
+
+#ifdef USE_THREAD
+    for(i = 1; i < n; i++) {
+        pthread_join(thread[i], NULL);
+    }
+#endif
+}
 
 struct nst_memory *nst_memory_create(char *name, uint64_t size,
-        uint32_t block_size, uint32_t chunk_size) {
+        uint32_t block_size, uint32_t chunk_size,
+        struct nst_memory_conf *conf) {
 
     uint8_t *p;
     struct nst_memory *memory;
     uint64_t n;
+    uint64_t page  = sysconf(_SC_PAGESIZE);
+    int      flags = MAP_ANON|MAP_SHARED;
     uint8_t *begin, *end;
     uint32_t bitmap_size;
 
@@ -63,17 +186,45 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
         return NULL;
     }
 
+    if(conf && conf->pages) {
+#ifdef MAP_HUGETLB
+        flags |= MAP_HUGETLB | (conf->pages << MAP_HUGE_SHIFT);
+        page   = 1ULL << conf->pages;
+#else
+        fprintf(stderr, "Huge pages are not supported on this system.\n");
+        return NULL;
+#endif
+    }
+
     size = (size + block_size - 1) / block_size * block_size;
+    size = (size + page - 1) / page * page;
 
     /* create shared memory */
-    p = (uint8_t *) mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_ANON|MAP_SHARED,
-            -1, 0);
+    p = (uint8_t *) mmap(NULL, size, PROT_READ|PROT_WRITE, flags, -1, 0);
 
     if(p == MAP_FAILED) {
-        fprintf(stderr, "Out of memory when initialization.\n");
+
+        if(conf && conf->pages) {
+            fprintf(stderr, "Cannot reserve %llu bytes of %lluk huge pages for "
+                    "%s, see vm.nr_hugepages.\n", (unsigned long long)size,
+                    (unsigned long long)page >> 10, name);
+        } else {
+            fprintf(stderr, "Out of memory when initialization.\n");
+        }
+
         return NULL;
     }
 
+    if(conf && _nst_memory_numa(p, size, conf) != NST_OK) {
+        fprintf(stderr, "Cannot apply the NUMA policy to %s.\n", name);
+        munmap(p, size);
+        return NULL;
+    }
+
+    if(conf && conf->prefault) {
+        _nst_memory_prefault(p, size, page, conf->prefault);
+    }
+
     memory = (struct nst_memory *)p;
 
     /* init header */
@@ -101,11 +252,30 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
 
     p += memory->chunks * sizeof(struct nst_memory_ctrl *);
 
-    memory->block = (struct nst_memory_ctrl *)p;
-    memory->empty = NULL;
-    memory->full  = NULL;
+    memory->usage = (struct nst_memory_usage *)p;
+
+    p += memory->chunks * sizeof(struct nst_memory_usage);
+
+    memory->block     = (struct nst_memory_ctrl *)p;
+    memory->full      = NULL;
+    memory->large     = 0;
+    memory->drain     = NULL;
+    memory->draining  = 0;
+    memory->drain_idx = 0;
+
+    for(n = 0; n < NST_MEMORY_RUN_LISTS; n++) {
+        memory->run[n] = NULL;
+    }
+
+    /* a bit per chunk of the smallest size, then a bit per 64 of them */
+    memory->bitmap_words = (block_size >> memory->chunk_shift) / 64;
+
+    if(memory->bitmap_words == 0) {
+        memory->bitmap_words = 1;
+    }
 
-    bitmap_size = block_size / chunk_size / 8;
+    bitmap_size = (memory->bitmap_words + (memory->bitmap_words + 63) / 64)
+        * sizeof(uint64_t);
 
     /* set data begin */
     n = (memory->stop - p)
@@ -128,27 +298,30 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
     }
 
     memory->blocks     = n;
+    memory->used       = 0;
+    memory->reclaim    = NULL;
+    memory->magazine   = calloc(MAX_THREADS, sizeof(*memory->magazine));
     memory->bitmap     = (uint8_t *)(memory->block + n);
     memory->data.begin = begin;
     memory->data.free  = begin;
     memory->data.end   = begin + block_size * (n - 1);
 
-    n = sizeof(struct nst_memory)
-        + sizeof(struct nst_memory_ctrl *) * memory->chunks
-        + sizeof(struct nst_memory_ctrl) * n;
-
-    if(memory->blocks == 0 || memory->data.end + block_size > memory->stop) {
+    if(memory->blocks == 0 || memory->data.end + block_size > memory->stop
+            || !memory->magazine) {
         return NULL;
     }
 
     /* initialize chunk */
     for(n = 0; n < memory->chunks; n++) {
-        memory->chunk[n] = NULL;
+        memory->chunk[n]        = NULL;
+        memory->usage[n].blocks = 0;
+        memory->usage[n].chunks = 0;
     }
 
     /* initialize block */
     for(n = 0; n < memory->blocks; n++) {
         memory->block[n].info   = 0;
+        memory->block[n].used   = 0;
         memory->block[n].bitmap = memory->bitmap + n * bitmap_size;
         memory->block[n].prev   = NULL;
         memory->block[n].next   = NULL;
@@ -157,6 +330,11 @@ struct nst_memory *nst_memory_create(char *name, uint64_t size,
     return memory;
 }
 
+/*
+ * Takes the first free chunk of a block which has one: a chunk per bit of
+ * the info for the large sizes, otherwise a 64-bit word of the bitmap with
+ * a free chunk is found through the second level first
+ */
 void *_nst_memory_block_alloc(struct nst_memory *memory,
         struct nst_memory_ctrl *block, int chunk_idx) {
 
@@ -165,54 +343,37 @@ void *_nst_memory_block_alloc(struct nst_memory *memory,
 
     int bits_need  = memory->block_size / chunk_size;
     int bits_idx   = 0;
-    int i          = 0;
-    int unset      = 1;
-    int full       = 1;
+    int i;
 
-    /* use info, should not use anymore */
+    /* use info */
     if(chunk_size * NST_MEMORY_INFO_BITMAP_BITS >= memory->block_size) {
-        uint32_t mask =  ~0U >> (NST_MEMORY_INFO_BITMAP_BITS - bits_need);
         uint32_t *v   = (uint32_t *)(&block->info) + 1;
-        uint32_t t    = *v;
 
-        /* get bits_idx */
-        bits_idx      = __builtin_ffs(~t) - 1;
-        /* set rightmost 0 to 1 */
-        *v           |= *v + 1;
-        full          = (mask == *v);
+        bits_idx      = __builtin_ctz(~*v);
+        *v           |= 1U << bits_idx;
     }
     /* use bitmap */
     else {
-        uint64_t *begin;
-        begin = (uint64_t *)block->bitmap;
+        uint64_t *word = (uint64_t *)block->bitmap;
+        uint64_t *full = word + memory->bitmap_words;
+        int w;
 
-        i     = 0;
-        unset = 1;
+        for(i = 0; full[i] == ~0ULL; i++) { }
 
-        for(i = 0; i < bits_need / 64; i++) {
-            uint64_t *v = begin + i;
+        w        = i * 64 + __builtin_ctzll(~full[i]);
+        bits_idx = w * 64 + __builtin_ctzll(~word[w]);
 
-            if(*v == ~0ULL && unset) {
-                bits_idx += 64;
-                continue;
-            }
-
-            if(unset) {
-                uint64_t t = *v;
-                bits_idx  += __builtin_ffsll(~t) - 1;
-                *v        |= *v + 1;
-                unset      = 0;
-            }
+        word[w] |= 1ULL << (bits_idx & 63);
 
-            if(*v != ~0ULL) {
-                full = 0;
-                break;
-            }
+        if(word[w] == ~0ULL) {
+            full[i] |= 1ULL << (w & 63);
         }
     }
 
-    /* yes */
-    if(full) {
+    block->used++;
+    memory->usage[chunk_idx].chunks++;
+
+    if(block->used == bits_need) {
         _nst_memory_block_set_full(block);
         /* remove from chunk list */
         memory->chunk[chunk_idx] = block->next;
@@ -233,6 +394,8 @@ void *_nst_memory_block_alloc(struct nst_memory *memory,
         memory->full = block;
     }
 
+    memory->used += chunk_size;
+
     return (void *)(memory->data.begin + 1ULL * memory->block_size * block_idx
             + chunk_size * bits_idx);
 }
@@ -241,12 +404,20 @@ void _nst_memory_block_init(struct nst_memory * memory,
         struct nst_memory_ctrl *block, int chunk_idx) {
 
     struct nst_memory_ctrl *chunk;
+    int words = (memory->block_size >> (memory->chunk_shift + chunk_idx)) / 64;
+
     chunk       = memory->chunk[chunk_idx];
     block->info = 0;
+    block->used = 0;
     _nst_memory_block_set_type(block, chunk_idx);
     _nst_memory_block_set_inited(block);
 
-    memset(block->bitmap, 0, memory->block_size / memory->chunk_size / 8);
+    /* the words of this size and the second level */
+    if(words) {
+        memset(block->bitmap, 0, words * sizeof(uint64_t));
+        memset((uint64_t *)block->bitmap + memory->bitmap_words, 0,
+                (words + 63) / 64 * sizeof(uint64_t));
+    }
 
     block->prev = NULL;
     block->next = NULL;
@@ -258,50 +429,204 @@ void _nst_memory_block_init(struct nst_memory * memory,
     }
 
     memory->chunk[chunk_idx] = block;
+    memory->usage[chunk_idx].blocks++;
 }
 
-void *nst_memory_alloc_locked(struct nst_memory *memory, int size) {
-    int i, chunk_idx = 0;
-    struct nst_memory_ctrl *chunk, *block;
+static inline int _nst_memory_run_list(uint32_t n) {
+    int i = 31 - __builtin_clz(n);
 
-    if(!size || size > memory->block_size) {
-        return NULL;
+    return i < NST_MEMORY_RUN_LISTS ? i : NST_MEMORY_RUN_LISTS - 1;
+}
+
+/*
+ * Mark n blocks from block as a free run and add it to its list
+ */
+static void _nst_memory_run_link(struct nst_memory *memory,
+        struct nst_memory_ctrl *block, uint32_t n) {
+
+    struct nst_memory_ctrl *last = block + n - 1;
+    int i = _nst_memory_run_list(n);
+
+    block->info = 0;
+    block->used = n;
+    last->info  = 0;
+    last->used  = n;
+
+    _nst_memory_block_set_free(block);
+    _nst_memory_block_set_free(last);
+
+    block->prev = NULL;
+    block->next = memory->run[i];
+
+    if(block->next) {
+        block->next->prev = block;
     }
 
-    for(i = (size - 1) >> (memory->chunk_shift - 1); i >>= 1; chunk_idx++) {}
+    memory->run[i] = block;
+}
 
-    chunk = memory->chunk[chunk_idx];
+static void _nst_memory_run_unlink(struct nst_memory *memory,
+        struct nst_memory_ctrl *block) {
 
-    /* check chunk list */
-    if(chunk) {
-        block = chunk;
+    if(block->prev) {
+        block->prev->next = block->next;
+    } else {
+        memory->run[_nst_memory_run_list(block->used)] = block->next;
     }
-    /* check empty list */
-    else if(memory->empty) {
-        /* remove from empty list */
-        block         = memory->empty;
-        memory->empty = block->next;
 
-        if(memory->empty) {
-            memory->empty->prev = NULL;
-        }
+    if(block->next) {
+        block->next->prev = block->prev;
+    }
+}
 
-        _nst_memory_block_init(memory, block, chunk_idx);
+/*
+ * Give back n blocks from block, merged with the free runs around them.
+ * The blocks next to a run in use are the first or the last of theirs.
+ */
+static void _nst_memory_run_put(struct nst_memory *memory,
+        struct nst_memory_ctrl *block, uint32_t n) {
+
+    struct nst_memory_ctrl *next = block + n;
+    int top = (memory->data.free - memory->data.begin) / memory->block_size;
+
+    if(block > memory->block && _nst_memory_block_is_free(block - 1)) {
+        struct nst_memory_ctrl *prev = block - (block - 1)->used;
+
+        _nst_memory_run_unlink(memory, prev);
+        n    += prev->used;
+        block = prev;
     }
-    /* require new block from unused */
-    else if(memory->data.free <= memory->data.end) {
-        int block_idx      = (memory->data.free - memory->data.begin)
-            / memory->block_size;
 
-        memory->data.free += memory->block_size;
-        block              = &memory->block[block_idx];
+    if(next < memory->block + top && _nst_memory_block_is_free(next)) {
+        _nst_memory_run_unlink(memory, next);
+        n += next->used;
+    }
 
-        if(_nst_memory_block_is_inited(block)) {
-            return NULL;
-        } else {
-            _nst_memory_block_init(memory, block, chunk_idx);
+    _nst_memory_run_link(memory, block, n);
+}
+
+/*
+ * Take n contiguous blocks: the first free run long enough, from the list
+ * of runs of about that length up, split if longer, otherwise blocks never
+ * used from the free region
+ */
+static struct nst_memory_ctrl *_nst_memory_run_get(struct nst_memory *memory,
+        uint32_t n) {
+
+    struct nst_memory_ctrl *block;
+    int i;
+
+    for(i = _nst_memory_run_list(n); i < NST_MEMORY_RUN_LISTS; i++) {
+
+        for(block = memory->run[i]; block; block = block->next) {
+
+            if(block->used >= n) {
+                _nst_memory_run_unlink(memory, block);
+
+                if(block->used > n) {
+                    _nst_memory_run_link(memory, block + n, block->used - n);
+                }
+
+                return block;
+            }
         }
     }
+
+    if(memory->data.free + (uint64_t)n * memory->block_size
+            > memory->data.end + memory->block_size) {
+
+        return NULL;
+    }
+
+    block = &memory->block[(memory->data.free - memory->data.begin)
+        / memory->block_size];
+
+    __atomic_store_n(&memory->data.free,
+            memory->data.free + (uint64_t)n * memory->block_size,
+            __ATOMIC_RELAXED);
+
+    return block;
+}
+
+/*
+ * Larger than a block, a run of blocks in use keeps its length in its first
+ * block, and both its first and last blocks are marked large
+ */
+static void *_nst_memory_large_alloc(struct nst_memory *memory,
+        uint64_t size) {
+
+    struct nst_memory_ctrl *block, *last;
+    uint32_t n = (size + memory->block_size - 1) / memory->block_size;
+
+    if(n > (uint32_t)memory->blocks) {
+        return NULL;
+    }
+
+    block = _nst_memory_run_get(memory, n);
+
+    if(!block) {
+        return NULL;
+    }
+
+    last        = block + n - 1;
+    last->info  = 0;
+    last->used  = 0;
+    block->info = 0;
+    block->used = n;
+
+    _nst_memory_block_set_type(last, NST_MEMORY_LARGE);
+    _nst_memory_block_set_inited(last);
+    _nst_memory_block_set_type(block, NST_MEMORY_LARGE);
+    _nst_memory_block_set_inited(block);
+
+    memory->used  += (uint64_t)n * memory->block_size;
+    memory->large += n;
+
+    return (void *)(memory->data.begin
+            + 1ULL * memory->block_size * (block - memory->block));
+}
+
+static void _nst_memory_large_free(struct nst_memory *memory,
+        struct nst_memory_ctrl *block) {
+
+    uint32_t n = block->used;
+
+    memory->used  -= (uint64_t)n * memory->block_size;
+    memory->large -= n;
+
+    _nst_memory_run_put(memory, block, n);
+}
+
+static inline int _nst_memory_chunk_idx(struct nst_memory *memory, int size) {
+    int i, chunk_idx = 0;
+
+    for(i = (size - 1) >> (memory->chunk_shift - 1); i >>= 1; chunk_idx++) {}
+
+    return chunk_idx;
+}
+
+void *nst_memory_alloc_locked(struct nst_memory *memory, int size) {
+    struct nst_memory_ctrl *block;
+    int chunk_idx;
+
+    if(size <= 0) {
+        return NULL;
+    }
+
+    if(size > memory->block_size) {
+        return _nst_memory_large_alloc(memory, size);
+    }
+
+    chunk_idx = _nst_memory_chunk_idx(memory, size);
+
+    /* check chunk list */
+    if(memory->chunk[chunk_idx]) {
+        block = memory->chunk[chunk_idx];
+    }
+    /* a free block, or a new one from unused */
+    else if((block = _nst_memory_run_get(memory, 1))) {
+        _nst_memory_block_init(memory, block, chunk_idx);
+    }
     else {
         return NULL;
     }
@@ -309,16 +634,156 @@ void *nst_memory_alloc_locked(struct nst_memory *memory, int size) {
     return _nst_memory_block_alloc(memory, block, chunk_idx);
 }
 
-void *nst_memory_alloc(struct nst_memory *memory, int size) {
-    void *p;
+/*
+ * Chunks kept by a thread before fork would be inherited, and handed out,
+ * by every process, so magazines are only used by the threads which called
+ * nst_memory_magazine_start, once forked
+ */
+static THREAD_LOCAL int _nst_memory_magazine_on;
+
+void nst_memory_magazine_start() {
+    _nst_memory_magazine_on = 1;
+}
+
+/*
+ * The magazine of the chunk_idx of this thread, NULL if chunks of that size
+ * are too large to be kept, or if this thread does not use magazines
+ */
+static struct nst_memory_magazine *
+_nst_memory_magazine(struct nst_memory *memory, int chunk_idx) {
+    struct nst_memory_magazine *mag;
+    int i;
+
+    if(!_nst_memory_magazine_on || chunk_idx >= memory->chunks) {
+        return NULL;
+    }
+
+    mag = memory->magazine[tid];
+
+    if(!mag) {
+        mag = calloc(memory->chunks, sizeof(*mag));
+
+        if(!mag) {
+            return NULL;
+        }
+
+        for(i = 0; i < memory->chunks; i++) {
+            mag[i].max = NST_MEMORY_MAGAZINE_BYTES
+                >> (memory->chunk_shift + i);
+
+            if(mag[i].max > NST_MEMORY_MAGAZINE_ROUNDS) {
+                mag[i].max = NST_MEMORY_MAGAZINE_ROUNDS;
+            }
+
+            if(mag[i].max < 4) {
+                mag[i].max = 0;
+            }
+        }
+
+        memory->magazine[tid] = mag;
+    }
+
+    return mag[chunk_idx].max ? &mag[chunk_idx] : NULL;
+}
+
+/*
+ * Gives back the chunks of this thread until at most keep are left in each
+ * magazine, returns how many were given back
+ */
+static int _nst_memory_magazine_flush(struct nst_memory *memory, int keep) {
+    struct nst_memory_magazine *mag = memory->magazine[tid];
+    int i, n = 0;
+
+    if(!mag) {
+        return 0;
+    }
+
     nst_shctx_lock(memory);
-    p = nst_memory_alloc_locked(memory, size);
+
+    for(i = 0; i < memory->chunks; i++) {
+
+        while(mag[i].rounds > keep) {
+            nst_memory_free_locked(memory, mag[i].chunk[--mag[i].rounds]);
+            n++;
+        }
+    }
+
     nst_shctx_unlock(memory);
+
+    return n;
+}
+
+/*
+ * Small chunks come from the magazine of this thread, which is refilled by
+ * half under a single lock when empty.
+ * If the memory is full, give back the chunks kept by this thread, then let
+ * the owner of the memory evict something and retry, a few times at most
+ * since freed chunks may not make room for this size
+ */
+void *nst_memory_alloc(struct nst_memory *memory, int size) {
+    struct nst_memory_magazine *mag = NULL;
+    void *p = NULL;
+    int i;
+
+    if(size <= 0) {
+        return NULL;
+    }
+
+    if(size <= memory->block_size) {
+        mag = _nst_memory_magazine(memory,
+                _nst_memory_chunk_idx(memory, size));
+    }
+
+    if(mag) {
+
+        if(!mag->rounds) {
+            nst_shctx_lock(memory);
+
+            while(mag->rounds < mag->max / 2) {
+                p = nst_memory_alloc_locked(memory, size);
+
+                if(!p) {
+                    break;
+                }
+
+                mag->chunk[mag->rounds++] = p;
+            }
+
+            nst_shctx_unlock(memory);
+        }
+
+        p = mag->rounds ? mag->chunk[--mag->rounds] : NULL;
+    } else {
+        nst_shctx_lock(memory);
+        p = nst_memory_alloc_locked(memory, size);
+        nst_shctx_unlock(memory);
+    }
+
+    if(!p && _nst_memory_magazine_flush(memory, 0)) {
+        nst_shctx_lock(memory);
+        p = nst_memory_alloc_locked(memory, size);
+        nst_shctx_unlock(memory);
+    }
+
+    for(i = 0; !p && memory->reclaim && i < NST_MEMORY_RECLAIM_ROUNDS; i++) {
+
+        if(memory->reclaim(size) != NST_OK) {
+            break;
+        }
+
+        /* what was evicted may be kept by this thread */
+        _nst_memory_magazine_flush(memory, 0);
+
+        nst_shctx_lock(memory);
+        p = nst_memory_alloc_locked(memory, size);
+        nst_shctx_unlock(memory);
+    }
+
     return p;
 }
 
 void nst_memory_free_locked(struct nst_memory *memory, void *p) {
-    int block_idx, chunk_size, bits, bits_idx, empty, full;
+    int block_idx, chunk_size, bits_idx, empty, full;
     struct nst_memory_ctrl *chunk, *block;
     uint8_t chunk_idx;
 
@@ -329,60 +794,86 @@ void nst_memory_free_locked(struct nst_memory *memory, void *p) {
     block_idx  = ((uint8_t *)p - memory->data.begin) / memory->block_size;
     block      = &memory->block[block_idx];
     chunk_idx  = block->info & 0xFF;
+
+    if(chunk_idx == NST_MEMORY_LARGE) {
+        _nst_memory_large_free(memory, block);
+
+        return;
+    }
+
     chunk      = memory->chunk[chunk_idx];
     chunk_size = 1<<(memory->chunk_shift + chunk_idx);
-    bits       = memory->block_size / chunk_size;
     bits_idx   = ((uint8_t *)p
             - (memory->data.begin + block_idx * memory->block_size))
         / chunk_size;
 
-    empty      = 0;
     full       = _nst_memory_block_is_full(block);
     _nst_memory_block_clear_full(block);
 
+    memory->used -= chunk_size;
+
     /* info used */
     if(chunk_size * NST_MEMORY_INFO_BITMAP_BITS >= memory->block_size) {
         block->info &= ~(1ULL << (bits_idx + 32));
-
-        if(!(block->info & 0xFFFFFFFF00000000ULL)) {
-            empty = 1;
-        }
     }
     /* bitmap used */
     else {
-        int i;
-        *((uint64_t *)block->bitmap + bits_idx / 64 ) &=
-            ~(1ULL<<(bits_idx % 64));
+        uint64_t *word = (uint64_t *)block->bitmap;
+        uint64_t *wide = word + memory->bitmap_words;
 
-        for(i = 0; i < bits / 64; i++) {
+        word[bits_idx / 64]   &= ~(1ULL << (bits_idx % 64));
+        wide[bits_idx / 4096] &= ~(1ULL << (bits_idx / 64 % 64));
+    }
 
-            if(*((uint64_t *)block->bitmap + i) == 0) {
-                empty += 64;
-            }
+    block->used--;
+    memory->usage[chunk_idx].chunks--;
+
+    empty = block->used == 0;
+
+    if(empty) {
+        memory->usage[chunk_idx].blocks--;
+    }
+
+    /* nothing is allocated from it, it only waits to be empty */
+    if(_nst_memory_block_is_drain(block)) {
+
+        if(!empty) {
+            return;
         }
 
-        if(empty == bits) {
-            empty = 1;
+        _nst_memory_block_clear_drain(block);
+        memory->draining--;
+
+        if(block->prev) {
+            block->prev->next = block->next;
         } else {
-            empty = 0;
+            memory->drain = block->next;
         }
+
+        if(block->next) {
+            block->next->prev = block->prev;
+        }
+
+        _nst_memory_run_put(memory, block, 1);
+
+        return;
     }
 
     /*
      * 1. if the block previously was full
-     *  a. if chunk_id is LAST, move the block from full list to empty list
+     *  a. if chunk_id is LAST, move the block from full list to free runs
      *  b. else move the block from full list to chunk[chunk_idx]
      * 2. else if the block became empty after free
-     *  a. if chunk_id is LAST, move the block from full list to empty list
-     *  b. else move the block from chunk[chunk_idx] to empty list
+     *  a. if chunk_id is LAST, move the block from full list to free runs
+     *  b. else move the block from chunk[chunk_idx] to free runs
      * 3. else do nothing
      *
      * 1. if chunk_id is LAST(full && empty)
-     *  a. move the block from full list to empty list
+     *  a. move the block from full list to free runs
      * 2. else
      *  a. if previously full, move the block from full list to chunk[chunk_idx]
      *  b. else if empty after free, move the block
-     *     from chunk[chunk_idx] to empty list
+     *     from chunk[chunk_idx] to free runs
      *  c. else do nothing
      */
     /* remove from full list and add to chunk list */
@@ -399,14 +890,8 @@ void nst_memory_free_locked(struct nst_memory *memory, void *p) {
             block->next->prev = block->prev;
         }
 
-        /* add to empty list */
-        block->prev   = NULL;
-        block->next   = memory->empty;
-        memory->empty = block;
-
-        if(block->next) {
-            block->next->prev = block;
-        }
+        /* add to free runs */
+        _nst_memory_run_put(memory, block, 1);
     } else {
 
         if(full) {
@@ -443,21 +928,157 @@ void nst_memory_free_locked(struct nst_memory *memory, void *p) {
                 block->next->prev = block->prev;
             }
 
-            /* add to empty list */
-            block->prev   = NULL;
-            block->next   = memory->empty;
-            memory->empty = block;
-
-            if(block->next) {
-                block->next->prev = block;
-            }
+            /* add to free runs */
+            _nst_memory_run_put(memory, block, 1);
         }
     }
 }
 
+/*
+ * Small chunks go to the magazine of this thread, half of which is given
+ * back under a single lock when full.
+ * A chunk in use keeps the type of its block, which can be read unlocked
+ */
 void nst_memory_free(struct nst_memory *memory, void *p) {
+    struct nst_memory_magazine *mag;
+    struct nst_memory_ctrl *block;
+    int chunk_idx;
+
+    if((uint8_t *)p < memory->data.begin
+            || (uint8_t *)p >= __atomic_load_n(&memory->data.free,
+                __ATOMIC_RELAXED)) {
+
+        return;
+    }
+
+    block     = &memory->block[((uint8_t *)p - memory->data.begin)
+        / memory->block_size];
+    chunk_idx = __atomic_load_n((uint8_t *)&block->info, __ATOMIC_RELAXED);
+    mag       = _nst_memory_magazine(memory, chunk_idx);
+
+    if(mag) {
+
+        if(mag->rounds == mag->max) {
+            nst_shctx_lock(memory);
+
+            while(mag->rounds > mag->max / 2) {
+                nst_memory_free_locked(memory, mag->chunk[--mag->rounds]);
+            }
+
+            nst_shctx_unlock(memory);
+        }
+
+        mag->chunk[mag->rounds++] = p;
+
+        return;
+    }
+
     nst_shctx_lock(memory);
     nst_memory_free_locked(memory, p);
     nst_shctx_unlock(memory);
 }
 
+
+/*
+ * Take the sparse blocks of the sizes using less than half of their chunks
+ * out of their chunk list, so that nothing is allocated from them anymore
+ * and they go to the free runs once their chunks are moved or freed.
+ * Only chunks of at least size bytes are considered, one size per call,
+ * taken in turn from one call to the next. Returns the number of blocks
+ * draining.
+ */
+int nst_memory_drain(struct nst_memory *memory, int size) {
+    int i, n, k;
+
+    nst_shctx_lock(memory);
+
+    for(k = 0; k < memory->chunks && !memory->draining; k++) {
+
+        struct nst_memory_ctrl *block;
+        uint64_t bits;
+
+        i     = (memory->drain_idx + k) % memory->chunks;
+        block = memory->chunk[i];
+        bits  = memory->block_size >> (memory->chunk_shift + i);
+
+        if((1 << (memory->chunk_shift + i)) < size || bits < 4
+                || memory->usage[i].chunks * 2
+                > memory->usage[i].blocks * bits) {
+
+            continue;
+        }
+
+        memory->drain_idx = (i + 1) % memory->chunks;
+
+        for(n = 0; block && n < NST_MEMORY_DRAIN_SCAN
+                && memory->draining < NST_MEMORY_DRAIN_BLOCKS; n++) {
+
+            struct nst_memory_ctrl *next = block->next;
+
+            if(block->used * 4 <= bits) {
+
+                /* remove from chunk list */
+                if(block->prev) {
+                    block->prev->next = block->next;
+                } else {
+                    memory->chunk[i] = block->next;
+                }
+
+                if(block->next) {
+                    block->next->prev = block->prev;
+                }
+
+                /* add to drain list */
+                block->prev   = NULL;
+                block->next   = memory->drain;
+                memory->drain = block;
+
+                if(block->next) {
+                    block->next->prev = block;
+                }
+
+                _nst_memory_block_set_drain(block);
+                memory->draining++;
+            }
+
+            block = next;
+        }
+    }
+
+    n = memory->draining;
+
+    nst_shctx_unlock(memory);
+
+    return n;
+}
+
+/*
+ * Give the blocks which are still draining back to their chunk list
+ */
+void nst_memory_drain_end(struct nst_memory *memory) {
+    struct nst_memory_ctrl *block;
+
+    nst_shctx_lock(memory);
+
+    while(memory->drain) {
+        int chunk_idx = memory->drain->info & 0xFF;
+
+        block         = memory->drain;
+        memory->drain = block->next;
+
+        _nst_memory_block_clear_drain(block);
+
+        block->prev = NULL;
+        block->next = memory->chunk[chunk_idx];
+
+        if(block->next) {
+            block->next->prev = block;
+        }
+
+        memory->chunk[chunk_idx] = block;
+    }
+
+    memory->draining = 0;
+
+    nst_shctx_unlock(memory);
+}
@@ -17,185 +17,308 @@
 #include <nuster/nuster.h>
 
 
-static int _nst_nosql_dict_resize(uint64_t size) {
-    struct nst_nosql_dict dict;
+int nst_nosql_dict_init() {
+    struct nst_memory *memory = global.nuster.nosql.memory;
 
-    dict.size  = size;
-    dict.used  = 0;
-    dict.entry = malloc(sizeof(struct nst_nosql_entry*) * size);
+    uint64_t size = global.nuster.nosql.dict_size
+        / sizeof(struct nst_dict_group) / NST_NOSQL_DICT_SHARDS;
 
-    if(dict.entry) {
-        int i;
+    uint64_t n;
+    int i;
 
-        for(i = 0; i < size; i++) {
-            dict.entry[i] = NULL;
-        }
+    /* round down to power of 2 so that groups fill whole segments */
+    for(n = NST_NOSQL_DICT_MIN_SIZE; n * 2 <= size; n *= 2) { }
+
+    if(n > nst_dict_max_size(memory)) {
+        n = nst_dict_max_size(memory);
+    }
 
-        if(!nuster.nosql->dict[0].entry) {
-            nuster.nosql->dict[0] = dict;
-            return 1;
-        } else {
-            nuster.nosql->dict[1] = dict;
-            nuster.nosql->rehash_idx = 0;
-            return 1;
+    for(i = 0; i < NST_NOSQL_DICT_SHARDS; i++) {
+        struct nst_nosql_dict_shard *shard = &nuster.nosql->shard[i];
+
+        shard->rehash_idx = -1;
+
+        if(nst_dict_alloc(memory, &shard->dict[0], n) != NST_OK) {
+            return NST_ERR;
         }
 
+        if(nst_shctx_init(shard) != NST_OK) {
+            return NST_ERR;
+        }
     }
 
-    return 0;
+    return NST_OK;
 }
 
-static int _nst_nosql_dict_alloc(uint64_t size) {
-    int i;
-    int entry_size = sizeof(struct nst_nosql_entry*);
-    int block_size = global.nuster.nosql.memory->block_size;
+static int _nst_nosql_dict_rehashing(struct nst_nosql_dict_shard *shard) {
+    return shard->rehash_idx != -1;
+}
 
-    nuster.nosql->dict[0].size  = size / entry_size;
-    nuster.nosql->dict[0].used  = 0;
-    nuster.nosql->dict[0].entry = nst_nosql_memory_alloc(block_size);
+static void _nst_nosql_entry_free(struct nst_nosql_entry *entry) {
+    nst_nosql_memory_free(entry->key->area);
+    nst_nosql_memory_free(entry->key);
+    nst_nosql_memory_free(entry->host.data);
+    nst_nosql_memory_free(entry->path.data);
+    nst_nosql_memory_free(entry);
+}
 
-    if(!nuster.nosql->dict[0].entry) {
-        return NST_ERR;
+/*
+ * Move the slots of at most n groups from dict[0] to dict[1],
+ * and switch to dict[1] once dict[0] has been emptied
+ */
+static void _nst_nosql_dict_rehash_step(struct nst_nosql_dict_shard *shard,
+        int n) {
+
+    while(n-- && shard->rehash_idx < shard->dict[0].size) {
+
+        /* dict[1] is full, retry later when cleanup freed some slots */
+        if(nst_dict_move_group(&shard->dict[0], shard->rehash_idx,
+                    &shard->dict[1]) != NST_OK) {
+
+            return;
+        }
+
+        shard->rehash_idx++;
     }
 
-    for(i = 1; i < size / block_size; i++) {
-        if(!nst_nosql_memory_alloc(block_size)) {
-            return NST_ERR;
+    /* have we rehashed the whole dict? */
+    if(shard->rehash_idx == shard->dict[0].size) {
+        nst_dict_free(global.nuster.nosql.memory, &shard->dict[0]);
+
+        shard->dict[0]         = shard->dict[1];
+        shard->rehash_idx      = -1;
+        shard->cleanup_idx     = 0;
+        shard->persist_idx     = 0;
+        shard->generation++;
+        shard->dict[1].segment = NULL;
+        shard->dict[1].size    = 0;
+        shard->dict[1].used    = 0;
+        shard->dict[1].deleted = 0;
+    }
+}
+
+/*
+ * Rehash one shard, shards are visited in turn.
+ * Start rehashing when used and deleted slots take most of dict[0], into
+ * a dict twice as large, or of the same size when most of them are just
+ * deleted ones. The groups of dict[1] are allocated without holding the
+ * shard lock.
+ */
+void nst_nosql_dict_rehash() {
+    struct nst_nosql_dict_shard *shard =
+        &nuster.nosql->shard[nuster.nosql->rehash_shard];
+
+    struct nst_memory *memory = global.nuster.nosql.memory;
+    struct nst_dict dict;
+    uint64_t size = 0;
+
+    nuster.nosql->rehash_shard =
+        (nuster.nosql->rehash_shard + 1) % NST_NOSQL_DICT_SHARDS;
+
+    nst_shctx_lock(shard);
+
+    if(_nst_nosql_dict_rehashing(shard)) {
+        _nst_nosql_dict_rehash_step(shard, NST_NOSQL_DICT_REHASH_STEP);
+    } else if(shard->dict[0].used + shard->dict[0].deleted
+            >= nst_dict_capacity(&shard->dict[0])
+            * NST_NOSQL_DEFAULT_LOAD_FACTOR) {
+
+        size = shard->dict[0].size;
+
+        if(shard->dict[0].used >= nst_dict_capacity(&shard->dict[0])
+                * NST_NOSQL_DEFAULT_LOAD_FACTOR / 2) {
+
+            size *= NST_NOSQL_DEFAULT_GROWTH_FACTOR;
         }
     }
 
-    for(i = 0; i < nuster.nosql->dict[0].size; i++) {
-        nuster.nosql->dict[0].entry[i] = NULL;
+    nst_shctx_unlock(shard);
+
+    if(!size || size > nst_dict_max_size(memory)) {
+        return;
     }
 
-    return nst_shctx_init((&nuster.nosql->dict[0]));
-}
+    if(nst_dict_alloc(memory, &dict, size) != NST_OK) {
+        return;
+    }
 
-int nst_nosql_dict_init() {
-    int block_size = global.nuster.nosql.memory->block_size;
-    int dict_size = global.nuster.nosql.dict_size;
-    int size = (block_size + dict_size - 1) / block_size * block_size;
+    /* only the master process starts rehashing, nobody can race us */
+    nst_shctx_lock(shard);
 
-    return _nst_nosql_dict_alloc(size);
-}
+    shard->dict[1]    = dict;
+    shard->rehash_idx = 0;
 
-static int _nst_nosql_dict_rehashing() {
-    return 0;
-    //return nuster.nosql->rehash_idx != -1;
+    nst_shctx_unlock(shard);
 }
 
-/*
- * Rehash dict if nosql->dict[0] is almost full
- */
-void nst_nosql_dict_rehash() {
+static void _nst_nosql_dict_cleanup(struct nst_nosql_dict_shard *shard) {
+    struct nst_dict_group *group;
+    uint32_t mask;
 
-    if(_nst_nosql_dict_rehashing()) {
-        int max_empty = 10;
-        struct nst_nosql_entry *entry = NULL;
+    if(!shard->dict[0].used) {
+        return;
+    }
 
-        /* check max_empty entryies */
-        while(!nuster.nosql->dict[0].entry[nuster.nosql->rehash_idx]) {
-            nuster.nosql->rehash_idx++;
-            max_empty--;
+    group = nst_dict_group(&shard->dict[0], shard->cleanup_idx);
+    mask  = nst_dict_match_used(group);
 
-            if(nuster.nosql->rehash_idx >= nuster.nosql->dict[0].size) {
-                return;
-            }
+    while(mask) {
+        struct nst_nosql_entry *entry;
+        int i = __builtin_ctz(mask);
 
-            if(!max_empty) {
-                return;
+        mask &= mask - 1;
+        entry = group->slot[i].ptr;
+
+        if(nst_nosql_entry_invalid(entry)) {
+
+            if(entry->data) {
+                entry->data->invalid = 1;
             }
-        }
 
-        /* move all entries in this bucket to dict[1] */
-        entry = nuster.nosql->dict[0].entry[nuster.nosql->rehash_idx];
-        while(entry) {
-            int idx = entry->hash % nuster.nosql->dict[1].size;
-            struct nst_nosql_entry *entry_next = entry->next;
-
-            entry->next = nuster.nosql->dict[1].entry[idx];
-            nuster.nosql->dict[1].entry[idx] = entry;
-            nuster.nosql->dict[1].used++;
-            nuster.nosql->dict[0].used--;
-            entry = entry_next;
+            nst_dict_remove(&shard->dict[0], group, i);
+            _nst_nosql_entry_free(entry);
         }
 
-        nuster.nosql->dict[0].entry[nuster.nosql->rehash_idx] = NULL;
-        nuster.nosql->rehash_idx++;
-
-        /* have we rehashed the whole dict? */
-        if(nuster.nosql->dict[0].used == 0) {
-            free(nuster.nosql->dict[0].entry);
-            nuster.nosql->dict[0]       = nuster.nosql->dict[1];
-            nuster.nosql->rehash_idx    = -1;
-            nuster.nosql->cleanup_idx   = 0;
-            nuster.nosql->dict[1].entry = NULL;
-            nuster.nosql->dict[1].size  = 0;
-            nuster.nosql->dict[1].used  = 0;
-        }
-    } else {
+    }
 
-        /* should we rehash? */
-        if(nuster.nosql->dict[0].used >= nuster.nosql->dict[0].size
-                * NST_NOSQL_DEFAULT_LOAD_FACTOR) {
+    shard->cleanup_idx++;
 
-            _nst_nosql_dict_resize(nuster.nosql->dict[0].size
-                    * NST_NOSQL_DEFAULT_GROWTH_FACTOR);
-        }
+    /* if we have checked the whole dict */
+    if(shard->cleanup_idx == shard->dict[0].size) {
+        shard->cleanup_idx = 0;
     }
+
 }
 
 /*
  * Check entry validity, free the entry if its invalid,
  * If its invalid set entry->data->invalid to true,
- * entry->data is freed by _nosql_data_cleanup
+ * entry->data is freed by _nosql_data_cleanup.
+ * One group of one shard is checked per call, shards are visited in turn
  */
 void nst_nosql_dict_cleanup() {
-    struct nst_nosql_entry *entry =
-        nuster.nosql->dict[0].entry[nuster.nosql->cleanup_idx];
+    struct nst_nosql_dict_shard *shard =
+        &nuster.nosql->shard[nuster.nosql->cleanup_shard];
 
-    struct nst_nosql_entry *prev  = entry;
+    nuster.nosql->cleanup_shard =
+        (nuster.nosql->cleanup_shard + 1) % NST_NOSQL_DICT_SHARDS;
 
-    if(!nuster.nosql->dict[0].used) {
-        return;
+    nst_shctx_lock(shard);
+    _nst_nosql_dict_cleanup(shard);
+    nst_shctx_unlock(shard);
+}
+
+/*
+ * Choose a victim among the entries following the eviction hand of the
+ * shard, unlink it and mark its data evicting. Invalid entries go first.
+ */
+static struct nst_nosql_entry *
+_nst_nosql_dict_evict(struct nst_nosql_dict_shard *shard) {
+    struct nst_evict_cand   cand[NST_EVICT_SAMPLES];
+    struct nst_dict        *dict   = &shard->dict[0];
+    struct nst_nosql_entry *entry  = NULL;
+    struct nst_nosql_entry *e;
+    struct nst_dict_probe   probe;
+    int n = 0;
+    int i;
+
+    /* most entries are already in dict[1] late in rehashing */
+    if(shard->dict[1].used > dict->used) {
+        dict = &shard->dict[1];
     }
 
-    while(entry) {
+    if(!dict->used) {
+        return NULL;
+    }
 
-        if(nst_nosql_entry_invalid(entry)) {
-            struct nst_nosql_entry *tmp = entry;
+    for(i = 0; i < NST_EVICT_GROUPS && n < NST_EVICT_SAMPLES && !entry; i++) {
+        struct nst_dict_group *group;
+        uint32_t mask;
 
-            if(entry->data) {
-                entry->data->invalid = 1;
-            }
+        group = nst_dict_group(dict, shard->evict_idx++ & (dict->size - 1));
+        mask  = nst_dict_match_used(group);
 
-            if(prev == entry) {
-                nuster.nosql->dict[0].entry[nuster.nosql->cleanup_idx] =
-                    entry->next;
+        while(mask && n < NST_EVICT_SAMPLES) {
+            e     = group->slot[__builtin_ctz(mask)].ptr;
+            mask &= mask - 1;
 
-                prev = entry->next;
-            } else {
-                prev->next = entry->next;
+            /* being filled by a request */
+            if(e->state == NST_NOSQL_ENTRY_STATE_CREATING) {
+                continue;
             }
 
-            entry = entry->next;
-            nst_nosql_memory_free(tmp->key);
-            nst_nosql_memory_free(tmp->host.data);
-            nst_nosql_memory_free(tmp->path.data);
-            nst_nosql_memory_free(tmp);
-            nuster.nosql->dict[0].used--;
-        } else {
-            prev  = entry;
-            entry = entry->next;
+            /* the disk copy is only found through the entry */
+            if(nst_nosql_entry_invalid(e) && !e->file) {
+                entry = e;
+                break;
+            }
+
+            nst_evict_cand_set(&cand[n++], e, e->hash, &e->access);
         }
     }
 
-    nuster.nosql->cleanup_idx++;
+    if(!entry) {
+        i = nst_evict_choose(global.nuster.nosql.evict, &nuster.nosql->sketch,
+                cand, n);
 
-    /* if we have checked the whole dict */
-    if(nuster.nosql->cleanup_idx == nuster.nosql->dict[0].size) {
-        nuster.nosql->cleanup_idx = 0;
+        if(i == -1) {
+            return NULL;
+        }
+
+        entry = cand[i].entry;
     }
+
+    nst_dict_probe_init(dict, entry->hash, &probe);
+
+    while((e = nst_dict_probe_next(dict, entry->hash, &probe)) != entry) {
+
+        if(!e) {
+            return NULL;
+        }
+    }
+
+    nst_dict_remove(dict, probe.group, probe.slot);
+
+    entry->state = NST_NOSQL_ENTRY_STATE_INVALID;
+
+    if(entry->data) {
+        entry->data->invalid = NST_NOSQL_DATA_EVICTING;
+    }
+
+    return entry;
+}
+
+/*
+ * Evict at most n entries, one per shard visited, shards locked by others
+ * are skipped. The entries are freed, their data are returned for the
+ * caller to free.
+ */
+int nst_nosql_dict_evict(struct nst_nosql_data **data, int n) {
+    int evicted = 0;
+    int i;
+
+    for(i = 0; i < 2 * NST_NOSQL_DICT_SHARDS && evicted < n; i++) {
+        struct nst_nosql_dict_shard *shard = &nuster.nosql->shard[
+            __atomic_fetch_add(&nuster.nosql->evict_shard, 1, __ATOMIC_RELAXED)
+                % NST_NOSQL_DICT_SHARDS];
+
+        struct nst_nosql_entry *entry;
+
+        if(nst_shctx_trylock(shard) != NST_OK) {
+            continue;
+        }
+
+        entry = _nst_nosql_dict_evict(shard);
+
+        nst_shctx_unlock(shard);
+
+        if(entry) {
+            data[evicted++] = entry->data;
+            _nst_nosql_entry_free(entry);
+        }
+    }
+
+    return evicted;
 }
 
 /*
@@ -203,13 +326,17 @@ void nst_nosql_dict_cleanup() {
  */
 struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx) {
 
-    struct nst_nosql_dict  *dict  = NULL;
-    struct nst_nosql_data  *data  = NULL;
-    struct nst_nosql_entry *entry = NULL;
-    int idx;
+    struct nst_nosql_dict_shard *shard = nst_nosql_dict_shard(ctx->hash);
+    struct nst_dict             *dict  = NULL;
+    struct nst_nosql_data       *data  = NULL;
+    struct nst_nosql_entry      *entry = NULL;
+
+    dict = _nst_nosql_dict_rehashing(shard) ? &shard->dict[1] : &shard->dict[0];
 
-    dict = _nst_nosql_dict_rehashing()
-        ? &nuster.nosql->dict[1] : &nuster.nosql->dict[0];
+    /* no free slot left, wait for the housekeeping to grow the dict */
+    if(dict->used == nst_dict_capacity(dict)) {
+        return NULL;
+    }
 
     entry = nst_nosql_memory_alloc(sizeof(*entry));
     if(!entry) {
@@ -223,11 +350,7 @@ struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx) {
         return NULL;
     }
 
-    idx = ctx->hash % dict->size;
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
+    nst_dict_insert(dict, ctx->hash, entry);
 
     /* init entry */
     entry->data   = data;
@@ -239,6 +362,8 @@ struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx) {
     entry->rule   = ctx->rule;
     entry->pid    = ctx->pid;
 
+    nst_evict_init(&entry->access);
+
     entry->header_len = ctx->header_len;
 
     entry->host.data   = ctx->req.host.data;
@@ -249,64 +374,85 @@ struct nst_nosql_entry *nst_nosql_dict_set(struct nst_nosql_ctx *ctx) {
     entry->path.len    = ctx->req.path.len;
     ctx->req.path.data = NULL;
 
+    /* inserts help the housekeeping to finish rehashing */
+    if(_nst_nosql_dict_rehashing(shard)) {
+        _nst_nosql_dict_rehash_step(shard, 1);
+    }
+
     return entry;
 }
 
 /*
- * Get entry
+ * Get entry, the caller must hold the lock of nst_nosql_dict_shard(hash)
  */
 struct nst_nosql_entry *nst_nosql_dict_get(struct buffer *key, uint64_t hash) {
-    int i, idx;
-    struct nst_nosql_entry *entry = NULL;
+    struct nst_nosql_dict_shard *shard = nst_nosql_dict_shard(hash);
+    struct nst_nosql_entry      *entry = NULL;
+    struct nst_nosql_entry      *stale = NULL;
+    int i;
 
-    if(nuster.nosql->dict[0].used + nuster.nosql->dict[1].used == 0) {
+    if(shard->dict[0].used + shard->dict[1].used == 0) {
         return NULL;
     }
 
     for(i = 0; i <= 1; i++) {
-        idx   = hash % nuster.nosql->dict[i].size;
-        entry = nuster.nosql->dict[i].entry[idx];
-
-        while(entry) {
-
-            if(entry->hash == hash
-                    && entry->key->data == key->data
-                    && !memcmp(entry->key->area, key->area, key->data)) {
-                /* check expire
-                 * change state only, leave the free stuff to cleanup
-                 * */
-                if(entry->state == NST_NOSQL_ENTRY_STATE_VALID
-                        && nst_nosql_dict_entry_expired(entry)) {
-
-                    entry->state         = NST_NOSQL_ENTRY_STATE_EXPIRED;
-                    entry->data->invalid = 1;
-                    entry->data          = NULL;
-                    entry->expire        = 0;
-                    return NULL;
-                }
-
-                return entry;
+        struct nst_dict_probe probe;
+
+        nst_dict_probe_init(&shard->dict[i], hash, &probe);
+
+        while((entry = nst_dict_probe_next(&shard->dict[i], hash, &probe))) {
+
+            if(entry->key->data != key->data
+                    || memcmp(entry->key->area, key->area, key->data)) {
+
+                continue;
+            }
+
+            /* an invalid entry may be followed by the one replacing it */
+            if(entry->state == NST_NOSQL_ENTRY_STATE_INVALID
+                    || entry->state == NST_NOSQL_ENTRY_STATE_EXPIRED) {
+
+                stale = entry;
+                continue;
+            }
+
+            /* check expire
+             * change state only, leave the free stuff to cleanup
+             * */
+            if(entry->state == NST_NOSQL_ENTRY_STATE_VALID
+                    && nst_nosql_dict_entry_expired(entry)) {
+
+                entry->state         = NST_NOSQL_ENTRY_STATE_EXPIRED;
+                entry->data->invalid = 1;
+                entry->data          = NULL;
+                entry->expire        = 0;
+                return NULL;
             }
 
-            entry = entry->next;
+            return entry;
         }
 
-        if(!_nst_nosql_dict_rehashing()) {
-            return NULL;
+        if(!_nst_nosql_dict_rehashing(shard)) {
+            break;
         }
     }
 
-    return NULL;
+    return stale;
 }
 
 int nst_nosql_dict_set_from_disk(char *file, char *meta, struct buffer *key) {
-    struct nst_nosql_dict  *dict  = NULL;
-    struct nst_nosql_entry *entry = NULL;
-    int idx;
+    struct nst_nosql_dict_shard *shard;
+    struct nst_dict             *dict  = NULL;
+    struct nst_nosql_entry      *entry = NULL;
     uint64_t hash = nst_persist_meta_get_hash(meta);
 
-    dict = _nst_nosql_dict_rehashing()
-        ? &nuster.nosql->dict[1] : &nuster.nosql->dict[0];
+    shard = nst_nosql_dict_shard(hash);
+    dict  = _nst_nosql_dict_rehashing(shard) ? &shard->dict[1] : &shard->dict[0];
+
+    /* no free slot left, wait for the housekeeping to grow the dict */
+    if(dict->used == nst_dict_capacity(dict)) {
+        return NST_ERR;
+    }
 
     entry = nst_nosql_memory_alloc(sizeof(*entry));
 
@@ -322,11 +468,7 @@ int nst_nosql_dict_set_from_disk(char *file, char *meta, struct buffer *key) {
         return NST_ERR;
     }
 
-    idx = hash % dict->size;
-    /* prepend entry to dict->entry[idx] */
-    entry->next      = dict->entry[idx];
-    dict->entry[idx] = entry;
-    dict->used++;
+    nst_dict_insert(dict, hash, entry);
 
     /* init entry */
     entry->state  = NST_NOSQL_ENTRY_STATE_INVALID;
@@ -335,6 +477,8 @@ int nst_nosql_dict_set_from_disk(char *file, char *meta, struct buffer *key) {
     entry->expire = nst_persist_meta_get_expire(meta);
     memcpy(entry->file, file, strlen(file));
 
+    nst_evict_init(&entry->access);
+
     entry->header_len = nst_persist_meta_get_header_len(meta);
 
     return NST_OK;
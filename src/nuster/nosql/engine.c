@@ -225,17 +225,13 @@ struct nst_nosql_data *nst_nosql_data_new() {
             nuster.nosql->data_head = data;
             nuster.nosql->data_tail = data;
             data->next              = data;
+            data->prev              = data;
         } else {
-
-            if(nuster.nosql->data_head == nuster.nosql->data_tail) {
-                nuster.nosql->data_head->next = data;
-                data->next                    = nuster.nosql->data_head;
-                nuster.nosql->data_tail       = data;
-            } else {
-                data->next                    = nuster.nosql->data_head;
-                nuster.nosql->data_tail->next = data;
-                nuster.nosql->data_tail       = data;
-            }
+            data->next                    = nuster.nosql->data_head;
+            data->prev                    = nuster.nosql->data_tail;
+            nuster.nosql->data_tail->next = data;
+            nuster.nosql->data_head->prev = data;
+            nuster.nosql->data_tail       = data;
         }
     }
 
@@ -246,6 +242,11 @@ struct nst_nosql_data *nst_nosql_data_new() {
 
 static int _nst_nosql_data_invalid(struct nst_nosql_data *data) {
 
+    /* the evictor frees it, see _nst_nosql_reclaim */
+    if(data->invalid == NST_NOSQL_DATA_EVICTING) {
+        return 0;
+    }
+
     if(data->invalid) {
 
         if(!data->clients) {
@@ -255,58 +256,118 @@ static int _nst_nosql_data_invalid(struct nst_nosql_data *data) {
     return 0;
 }
 
-static void _nst_nosql_data_cleanup() {
-    struct nst_nosql_data *data = NULL;
+/*
+ * Remove data from the circular list, the caller must hold the lock
+ */
+static void _nst_nosql_data_unlink(struct nst_nosql_data *data) {
 
-    if(nuster.nosql->data_head) {
+    if(data->next == data) {
+        nuster.nosql->data_head = NULL;
+        nuster.nosql->data_tail = NULL;
+    } else {
+        data->prev->next = data->next;
+        data->next->prev = data->prev;
 
-        if(nuster.nosql->data_head == nuster.nosql->data_tail) {
+        if(nuster.nosql->data_head == data) {
+            nuster.nosql->data_head = data->next;
+        }
 
-            if(_nst_nosql_data_invalid(nuster.nosql->data_head)) {
-                data                    = nuster.nosql->data_head;
-                nuster.nosql->data_head = NULL;
-                nuster.nosql->data_tail = NULL;
-            }
+        if(nuster.nosql->data_tail == data) {
+            nuster.nosql->data_tail = data->prev;
+        }
+    }
+}
 
-        } else {
+static void _nst_nosql_data_free(struct nst_nosql_data *data) {
+    struct nst_nosql_element *element = data->element;
 
-            if(_nst_nosql_data_invalid(nuster.nosql->data_head)) {
-                data                          = nuster.nosql->data_head;
-                nuster.nosql->data_tail->next = nuster.nosql->data_head->next;
-                nuster.nosql->data_head       = nuster.nosql->data_head->next;
-            } else {
-                nuster.nosql->data_tail = nuster.nosql->data_head;
-                nuster.nosql->data_head = nuster.nosql->data_head->next;
-            }
+    while(element) {
+        struct nst_nosql_element *tmp = element;
+        element                       = element->next;
 
+        if(tmp->msg.data) {
+            nst_nosql_stats_update_used_mem(-tmp->msg.len);
+            nst_nosql_memory_free(tmp->msg.data);
         }
+
+        nst_nosql_memory_free(tmp);
     }
 
-    if(data) {
-        struct nst_nosql_element *element = data->element;
+    if(data->info.content_type.data) {
+        nst_nosql_memory_free(data->info.content_type.data);
+    }
 
-        while(element) {
-            struct nst_nosql_element *tmp = element;
-            element                       = element->next;
+    if(data->info.transfer_encoding.data) {
+        nst_nosql_memory_free(data->info.transfer_encoding.data);
+    }
 
-            if(tmp->msg.data) {
-                nst_nosql_stats_update_used_mem(-tmp->msg.len);
-                nst_nosql_memory_free(tmp->msg.data);
-            }
+    nst_nosql_memory_free(data);
+}
+
+static void _nst_nosql_data_cleanup() {
+    struct nst_nosql_data *data = NULL;
+
+    if(nuster.nosql->data_head) {
 
-            nst_nosql_memory_free(tmp);
+        if(_nst_nosql_data_invalid(nuster.nosql->data_head)) {
+            data = nuster.nosql->data_head;
+            _nst_nosql_data_unlink(data);
+        } else {
+            nuster.nosql->data_tail = nuster.nosql->data_head;
+            nuster.nosql->data_head = nuster.nosql->data_head->next;
         }
+    }
+
+    if(data) {
+        _nst_nosql_data_free(data);
+    }
+}
+
+/*
+ * Called when the nosql memory is full, and to keep the headroom. Evict a
+ * few entries and free their data right away unless they are being served,
+ * the data cleanup frees those later.
+ */
+static int _nst_nosql_reclaim(int size) {
+    struct nst_nosql_data *data[NST_EVICT_BATCH];
+    int n, i;
+
+    if(global.nuster.nosql.evict == NST_EVICT_OFF) {
+        return NST_ERR;
+    }
+
+    n = nst_nosql_dict_evict(data, NST_EVICT_BATCH);
+
+    if(!n) {
+        return NST_ERR;
+    }
 
-        if(data->info.content_type.data) {
-            nst_nosql_memory_free(data->info.content_type.data);
+    nst_shctx_lock(nuster.nosql);
+
+    for(i = 0; i < n; i++) {
+
+        if(!data[i]) {
+            continue;
         }
 
-        if(data->info.transfer_encoding.data) {
-            nst_nosql_memory_free(data->info.transfer_encoding.data);
+        if(data[i]->clients) {
+            data[i]->invalid = 1;
+            data[i]          = NULL;
+        } else {
+            _nst_nosql_data_unlink(data[i]);
         }
+    }
+
+    nst_shctx_unlock(nuster.nosql);
+
+    for(i = 0; i < n; i++) {
 
-        nst_nosql_memory_free(data);
+        if(data[i]) {
+            _nst_nosql_data_free(data[i]);
+        }
     }
+
+    return NST_OK;
 }
 
 void nst_nosql_housekeeping() {
@@ -318,13 +379,23 @@ void nst_nosql_housekeeping() {
         int disk_cleaner = global.nuster.nosql.disk_cleaner;
         int disk_loader  = global.nuster.nosql.disk_loader;
         int disk_saver   = global.nuster.nosql.disk_saver;
+        int evictor      = NST_EVICT_HEADROOM_ROUNDS;
 
         while(dict_cleaner--) {
-            nst_shctx_lock(&nuster.nosql->dict[0]);
+            nst_nosql_dict_rehash();
             nst_nosql_dict_cleanup();
-            nst_shctx_unlock(&nuster.nosql->dict[0]);
         }
 
+        while(evictor-- && nst_memory_headroom(global.nuster.nosql.memory)
+                < global.nuster.nosql.headroom) {
+
+            if(_nst_nosql_reclaim(0) != NST_OK) {
+                break;
+            }
+        }
+
+        nst_sketch_age(&nuster.nosql->sketch);
+
         while(data_cleaner--) {
             nst_shctx_lock(nuster.nosql);
             _nst_nosql_data_cleanup();
@@ -340,9 +411,7 @@ void nst_nosql_housekeeping() {
         }
 
         while(disk_saver--) {
-            nst_shctx_lock(&nuster.nosql->dict[0]);
             nst_nosql_persist_async();
-            nst_shctx_unlock(&nuster.nosql->dict[0]);
         }
     }
 }
@@ -365,7 +434,8 @@ void nst_nosql_init() {
 
         global.nuster.nosql.memory = nst_memory_create("nosql.shm",
                 global.nuster.nosql.dict_size + global.nuster.nosql.data_size,
-                global.tune.bufsize, NST_NOSQL_DEFAULT_CHUNK_SIZE);
+                global.tune.bufsize, NST_NOSQL_DEFAULT_CHUNK_SIZE,
+                &global.nuster.nosql.shm);
 
         if(!global.nuster.nosql.memory) {
             goto shm_err;
@@ -400,10 +470,20 @@ void nst_nosql_init() {
             goto err;
         }
 
+        if(global.nuster.nosql.evict == NST_EVICT_TINYLFU
+                && nst_sketch_init(global.nuster.nosql.memory,
+                    &nuster.nosql->sketch, global.nuster.nosql.dict_size
+                    / sizeof(struct nst_dict_group) * NST_DICT_GROUP_SLOTS)
+                != NST_OK) {
+
+            goto err;
+        }
+
         if(nst_nosql_stats_init() != NST_OK) {
             goto err;
         }
 
+        global.nuster.nosql.memory->reclaim = _nst_nosql_reclaim;
     }
 
     return;
@@ -695,7 +775,7 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
                 hdr.idx = 0;
                 nst_debug("header_%s.", ck->data);
 
-                while(http_find_header2(ck->data, strlen(ck->data),
+                while(http_find_header2(ck->data, ck->len,
                             ci_head(msg->chn), &txn->hdr_idx, &hdr)) {
 
                     ret = nst_nosql_key_append(ctx->key, hdr.line + hdr.val,
@@ -716,7 +796,7 @@ int nst_nosql_build_key(struct nst_nosql_ctx *ctx, struct nst_rule_key **pck,
 
                     if(http_extract_cookie_value(ctx->req.cookie.data,
                                 ctx->req.cookie.data + ctx->req.cookie.len,
-                                ck->data, strlen(ck->data), 1, &v, &v_l)) {
+                                ck->data, ck->len, 1, &v, &v_l)) {
 
                         ret = nst_nosql_key_append(ctx->key, v, v_l);
                         break;
@@ -831,14 +911,18 @@ void nst_nosql_create(struct nst_nosql_ctx *ctx, struct stream *s,
     struct nst_nosql_entry *entry = NULL;
 
     struct buffer *header = NULL;
+    int i;
 
-    /* Check if nosql is full */
-    if(nst_nosql_stats_full()) {
-        ctx->state = NST_NOSQL_CTX_STATE_FULL;
-        return;
+    /* Check if nosql is full, make room if it can evict */
+    for(i = 0; nst_nosql_stats_full(); i++) {
+
+        if(i == NST_MEMORY_RECLAIM_ROUNDS || _nst_nosql_reclaim(0) != NST_OK) {
+            ctx->state = NST_NOSQL_CTX_STATE_FULL;
+            return;
+        }
     }
 
-    nst_shctx_lock(&nuster.nosql->dict[0]);
+    nst_shctx_lock(nst_nosql_dict_shard(ctx->hash));
     entry = nst_nosql_dict_get(ctx->key, ctx->hash);
 
     if(entry) {
@@ -860,7 +944,7 @@ void nst_nosql_create(struct nst_nosql_ctx *ctx, struct stream *s,
         entry = nst_nosql_dict_set(ctx);
     }
 
-    nst_shctx_unlock(&nuster.nosql->dict[0]);
+    nst_shctx_unlock(nst_nosql_dict_shard(ctx->hash));
 
     if(!entry || !entry->data) {
         ctx->state   = NST_NOSQL_CTX_STATE_INVALID;
@@ -1001,13 +1085,18 @@ int nst_nosql_exists(struct nst_nosql_ctx *ctx, int mode) {
         return ret;
     }
 
-    nst_shctx_lock(&nuster.nosql->dict[0]);
+    if(global.nuster.nosql.evict == NST_EVICT_TINYLFU) {
+        nst_sketch_increment(&nuster.nosql->sketch, ctx->hash);
+    }
+
+    nst_shctx_lock(nst_nosql_dict_shard(ctx->hash));
     entry = nst_nosql_dict_get(ctx->key, ctx->hash);
 
     if(entry) {
         if(entry->state == NST_NOSQL_ENTRY_STATE_VALID) {
             ctx->data = entry->data;
             ctx->data->clients++;
+            nst_evict_touch(&entry->access);
             ret = NST_NOSQL_CTX_STATE_HIT;
         }
 
@@ -1026,11 +1115,12 @@ int nst_nosql_exists(struct nst_nosql_ctx *ctx, int mode) {
         }
     }
 
-    nst_shctx_unlock(&nuster.nosql->dict[0]);
+    nst_shctx_unlock(nst_nosql_dict_shard(ctx->hash));
 
     if(ret == NST_NOSQL_CTX_STATE_CHECK_PERSIST) {
         if(ctx->disk.file) {
-            if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash) == NST_OK) {
+            if(nst_persist_valid(&ctx->disk, ctx->key, ctx->hash, 0)
+                    == NST_OK) {
 
                 ret = NST_NOSQL_CTX_STATE_HIT_DISK;
             } else {
@@ -1045,7 +1135,7 @@ int nst_nosql_exists(struct nst_nosql_ctx *ctx, int mode) {
             } else {
 
                 if(nst_persist_exists(global.nuster.nosql.root, &ctx->disk,
-                            ctx->key, ctx->hash) == NST_OK) {
+                            ctx->key, ctx->hash, 0) == NST_OK) {
 
                     ret = NST_NOSQL_CTX_STATE_HIT_DISK;
                 } else {
@@ -1067,7 +1157,7 @@ int nst_nosql_delete(struct buffer *key, uint64_t hash) {
         return 0;
     }
 
-    nst_shctx_lock(&nuster.nosql->dict[0]);
+    nst_shctx_lock(nst_nosql_dict_shard(hash));
     entry = nst_nosql_dict_get(key, hash);
 
     if(entry) {
@@ -1075,7 +1165,7 @@ int nst_nosql_delete(struct buffer *key, uint64_t hash) {
         ret = 1;
     }
 
-    nst_shctx_unlock(&nuster.nosql->dict[0]);
+    nst_shctx_unlock(nst_nosql_dict_shard(hash));
 
     return ret;
 }
@@ -1127,7 +1217,7 @@ void nst_nosql_finish(struct nst_nosql_ctx *ctx, struct http_msg *msg) {
         if(*ctx->rule->ttl == 0) {
             ctx->entry->expire = 0;
         } else {
-            ctx->entry->expire = get_current_timestamp() / 1000
+            ctx->entry->expire = nst_time_now()
                 + *ctx->rule->ttl;
         }
 
@@ -1149,20 +1239,21 @@ void nst_nosql_abort(struct nst_nosql_ctx *ctx) {
     ctx->entry->state = NST_NOSQL_ENTRY_STATE_INVALID;
 }
 
-void nst_nosql_persist_async() {
-    struct nst_nosql_entry *entry;
+static void _nst_nosql_persist_async(struct nst_nosql_dict_shard *shard) {
+    struct nst_dict_group *group;
+    uint32_t mask;
 
-    if(!global.nuster.nosql.root || !nuster.nosql->disk.loaded) {
+    if(!shard->dict[0].used) {
         return;
     }
 
-    if(!nuster.nosql->dict[0].used) {
-        return;
-    }
+    group = nst_dict_group(&shard->dict[0], shard->persist_idx);
+    mask  = nst_dict_match_used(group);
 
-    entry = nuster.nosql->dict[0].entry[nuster.nosql->persist_idx];
+    while(mask) {
+        struct nst_nosql_entry *entry = group->slot[__builtin_ctz(mask)].ptr;
 
-    while(entry) {
+        mask &= mask - 1;
 
         if(entry->state == NST_NOSQL_ENTRY_STATE_VALID
                 && entry->rule->disk == NST_DISK_ASYNC
@@ -1224,19 +1315,37 @@ void nst_nosql_persist_async() {
             close(disk.fd);
         }
 
-        entry = entry->next;
-
     }
 
-    nuster.nosql->persist_idx++;
+    shard->persist_idx++;
 
     /* if we have checked the whole dict */
-    if(nuster.nosql->persist_idx == nuster.nosql->dict[0].size) {
-        nuster.nosql->persist_idx = 0;
+    if(shard->persist_idx == shard->dict[0].size) {
+        shard->persist_idx = 0;
     }
 
 }
 
+/*
+ * Save one group of one shard to disk, shards are visited in turn
+ */
+void nst_nosql_persist_async() {
+    struct nst_nosql_dict_shard *shard;
+
+    if(!global.nuster.nosql.root || !nuster.nosql->disk.loaded) {
+        return;
+    }
+
+    shard = &nuster.nosql->shard[nuster.nosql->persist_shard];
+
+    nuster.nosql->persist_shard =
+        (nuster.nosql->persist_shard + 1) % NST_NOSQL_DICT_SHARDS;
+
+    nst_shctx_lock(shard);
+    _nst_nosql_persist_async(shard);
+    nst_shctx_unlock(shard);
+}
+
 void nst_nosql_persist_load() {
 
     if(global.nuster.nosql.root && !nuster.nosql->disk.loaded) {
@@ -1328,8 +1437,14 @@ void nst_nosql_persist_load() {
                         return;
                     }
 
+                    nst_shctx_lock(nst_nosql_dict_shard(
+                                nst_persist_meta_get_hash(meta)));
+
                     nst_nosql_dict_set_from_disk(file, meta, key);
 
+                    nst_shctx_unlock(nst_nosql_dict_shard(
+                                nst_persist_meta_get_hash(meta)));
+
                     close(fd);
                 }
 
@@ -31,6 +31,14 @@ static void _nst_nosql_filter_deinit(struct proxy *px, struct flt_conf *fconf) {
 }
 
 static int _nst_nosql_filter_check(struct proxy *px, struct flt_conf *fconf) {
+
+    if(px->options2 & PR_O2_USE_HTX) {
+        ha_alert("Proxy [%s]: nosql does not support option http-use-htx\n",
+                px->id);
+
+        return 1;
+    }
+
     return 0;
 }
 
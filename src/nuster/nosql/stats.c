@@ -21,36 +21,53 @@
 #include <nuster/memory.h>
 #include <nuster/shctx.h>
 
+/*
+ * Only the counter of the thread is updated, see nst_cache_stats_slot
+ */
 void nst_nosql_stats_update_used_mem(int i) {
-    nst_shctx_lock(global.nuster.nosql.stats);
-    global.nuster.nosql.stats->used_mem += i;
-    nst_shctx_unlock(global.nuster.nosql.stats);
+    struct nst_nosql_stats *stats = global.nuster.nosql.stats;
+
+    __atomic_add_fetch(&stats->slot[nst_stats_slot(stats->slots)].used_mem, i,
+            __ATOMIC_RELAXED);
 }
 
 int nst_nosql_stats_full() {
+    struct nst_nosql_stats *stats = global.nuster.nosql.stats;
+    uint64_t used_mem = 0;
     int i;
 
-    nst_shctx_lock(global.nuster.nosql.stats);
-    i =  global.nuster.nosql.data_size <= global.nuster.nosql.stats->used_mem;
-    nst_shctx_unlock(global.nuster.nosql.stats);
+    for(i = 0; i < stats->slots; i++) {
+        used_mem += __atomic_load_n(&stats->slot[i].used_mem,
+                __ATOMIC_RELAXED);
+    }
 
-    return i;
+    return global.nuster.nosql.data_size <= used_mem;
 }
 
+/*
+ * See nst_cache_stats_init
+ */
 int nst_nosql_stats_init() {
-    global.nuster.nosql.stats =
-        nst_nosql_memory_alloc(sizeof(struct nst_nosql_stats));
+    struct nst_nosql_stats *stats;
+    int slots = global.nbproc * global.nbthread;
+
+    stats = nst_nosql_memory_alloc(sizeof(struct nst_nosql_stats));
 
-    if(!global.nuster.nosql.stats) {
+    if(!stats) {
         return NST_ERR;
     }
 
-    if(nst_shctx_init(global.nuster.nosql.stats) != NST_OK) {
+    stats->slot = nst_nosql_memory_alloc(
+            slots * sizeof(struct nst_nosql_stats_slot));
+
+    if(!stats->slot) {
         return NST_ERR;
     }
 
-    global.nuster.nosql.stats->used_mem = 0;
+    memset(stats->slot, 0, slots * sizeof(struct nst_nosql_stats_slot));
+    stats->slots = slots;
+
+    global.nuster.nosql.stats = stats;
 
     return NST_OK;
 }
-
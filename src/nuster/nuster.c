@@ -72,6 +72,18 @@ void nst_debug_key(struct buffer *key) {
     }
 }
 
+/*
+ * Runs in every thread once the processes are forked, nuster_init runs
+ * before fork and must not leave chunks in a magazine
+ */
+static int _nst_init_per_thread() {
+    nst_memory_magazine_start();
+
+    return 1;
+}
+
+REGISTER_PER_THREAD_INIT(_nst_init_per_thread);
+
 void nuster_init() {
     int i, uuid;
     struct proxy *p;
@@ -82,10 +94,7 @@ void nuster_init() {
         exit(1);
     }
 
-    for(i = 0; i < NST_HTTP_SIZE; i++) {
-        nst_http_msg_chunks[i].area = (char *)nst_http_msgs[i];
-        nst_http_msg_chunks[i].data = strlen(nst_http_msgs[i]);
-    }
+    nst_http_init();
 
     nst_cache_init();
     nst_nosql_init();
@@ -282,6 +291,154 @@ int nst_key_append(struct nst_memory *memory, struct buffer *key, char *str,
     return NST_OK;
 }
 
+/*
+ * The keys of the cache are built in the space of the calling thread while
+ * they are hashed, a key is copied only if it outlives the request, see
+ * nst_key_dup and nst_key_store
+ */
+static THREAD_LOCAL struct {
+    struct buffer  key;
+    XXH64_state_t  state;
+
+    /* see nst_key_scratch_mark */
+    XXH64_state_t  mark;
+    int            mark_len;
+} nst_key_scratch;
+
+static int _nst_key_scratch_expand(struct buffer *key, int need) {
+    int new_size = key->size ? key->size : NST_CACHE_DEFAULT_KEY_SIZE;
+    char *p;
+
+    while(new_size < need + key->data) {
+        new_size *= 2;
+    }
+
+    if(new_size > global.tune.bufsize) {
+        return NST_ERR;
+    }
+
+    p = realloc(key->area, new_size);
+
+    if(!p) {
+        return NST_ERR;
+    }
+
+    key->area = p;
+    key->size = new_size;
+
+    return NST_OK;
+}
+
+/*
+ * Reset the key of the calling thread, which the other nst_key_scratch_*
+ * functions take only
+ */
+struct buffer *nst_key_scratch_init() {
+    struct buffer *key = &nst_key_scratch.key;
+
+    if(!key->area && _nst_key_scratch_expand(key, 0) != NST_OK) {
+        return NULL;
+    }
+
+    key->data = 0;
+    key->head = 0;
+    XXH64_reset(&nst_key_scratch.state, 0);
+
+    return key;
+}
+
+int nst_key_scratch_advance(struct buffer *key, int step) {
+
+    if(b_room(key) < step && _nst_key_scratch_expand(key, step) != NST_OK) {
+        return NST_ERR;
+    }
+
+    memset(key->area + key->data, 0, step);
+    XXH64_update(&nst_key_scratch.state, key->area + key->data, step);
+    key->data += step;
+
+    return NST_OK;
+}
+
+int nst_key_scratch_append(struct buffer *key, char *str, int str_len) {
+
+    if(b_room(key) < str_len + 1
+            && _nst_key_scratch_expand(key, str_len + 1) != NST_OK) {
+
+        return NST_ERR;
+    }
+
+    memcpy(key->area + key->data, str, str_len);
+    key->area[key->data + str_len] = 0;
+    XXH64_update(&nst_key_scratch.state, key->area + key->data, str_len + 1);
+    key->data += str_len + 1;
+
+    return NST_OK;
+}
+
+/*
+ * The hash of the key so far, the same as nst_hash on it
+ */
+uint64_t nst_key_scratch_hash(struct buffer *key) {
+    return XXH64_digest(&nst_key_scratch.state);
+}
+
+/*
+ * Remember the key as it is, nst_key_scratch_rewind brings it back to this
+ * point once it has been extended
+ */
+void nst_key_scratch_mark(struct buffer *key) {
+    nst_key_scratch.mark     = nst_key_scratch.state;
+    nst_key_scratch.mark_len = key->data;
+}
+
+void nst_key_scratch_rewind(struct buffer *key) {
+    nst_key_scratch.state = nst_key_scratch.mark;
+    key->data             = nst_key_scratch.mark_len;
+}
+
+/*
+ * A copy of the key in the heap, released by free()
+ */
+struct buffer *nst_key_dup(struct buffer *key) {
+    struct buffer *dup = malloc(sizeof(*dup) + key->data);
+
+    if(dup) {
+        dup->area = (char *)(dup + 1);
+        dup->size = key->data;
+        dup->data = key->data;
+        dup->head = 0;
+        memcpy(dup->area, key->area, key->data);
+    }
+
+    return dup;
+}
+
+/*
+ * A copy of the key in the shared memory, as nst_key_init allocates it
+ */
+struct buffer *nst_key_store(struct nst_memory *memory, struct buffer *key) {
+    struct buffer *copy = nst_memory_alloc(memory, sizeof(*copy));
+
+    if(!copy) {
+        return NULL;
+    }
+
+    copy->area = nst_memory_alloc(memory, key->data);
+
+    if(!copy->area) {
+        nst_memory_free(memory, copy);
+        return NULL;
+    }
+
+    copy->size = key->data;
+    copy->data = key->data;
+    copy->head = 0;
+    memcpy(copy->area, key->area, key->data);
+
+    return copy;
+}
+
 int nst_ci_send(struct channel *chn, int len) {
     if(unlikely(channel_input_closed(chn))) {
         return -2;
@@ -73,6 +73,10 @@ static struct nst_rule_key *_nst_parse_rule_key_cast(char *str) {
         key->data = NULL;
     }
 
+    if(key) {
+        key->len = key->data ? strlen(key->data) : 0;
+    }
+
     return key;
 }
 
@@ -120,6 +124,53 @@ err:
     return NULL;
 }
 
+static void _nst_parse_rule_key_free(struct nst_rule_key **pk) {
+    int i;
+
+    for(i = 0; pk[i]; i++) {
+        free(pk[i]->data);
+        free(pk[i]);
+    }
+
+    free(pk);
+}
+
+static int _nst_parse_rule_key_equal(struct nst_rule_key **a,
+        struct nst_rule_key **b) {
+
+    for(; *a && *b; a++, b++) {
+
+        if((*a)->type != (*b)->type || (*a)->len != (*b)->len
+                || ((*a)->data && strcmp((*a)->data, (*b)->data))) {
+
+            return 0;
+        }
+    }
+
+    return !*a && !*b;
+}
+
+/*
+ * The key of a rule of the proxy built the same way, so that the rules
+ * sharing it share the key of a request, see _nst_cache_filter_http_headers
+ */
+static struct nst_rule_key **_nst_parse_rule_key_shared(struct proxy *px,
+        struct nst_rule_key **pk) {
+
+    struct nst_rule *rule;
+
+    list_for_each_entry(rule, &px->nuster.rules, list) {
+
+        if(_nst_parse_rule_key_equal(rule->key, pk)) {
+            _nst_parse_rule_key_free(pk);
+
+            return rule->key;
+        }
+    }
+
+    return pk;
+}
+
 static struct nst_rule_code *_nst_parse_rule_code(char *str) {
 
     if(!strcmp(str, "all")) {
@@ -297,10 +348,157 @@ const char *nst_parse_time(const char *text, int len, unsigned *ret) {
     return NULL;
 }
 
+/*
+ * Parse NUMA nodes like 0,2-3, returns NULL on success
+ */
+static const char *_nst_parse_nodes(const char *text, unsigned long *ret) {
+    unsigned long nodes = 0;
+    char *end;
+    long from, to;
+
+    while(1) {
+        from = to = strtol(text, &end, 10);
+
+        if(end == text) {
+            return text;
+        }
+
+        text = end;
+
+        if(*text == '-') {
+            to = strtol(++text, &end, 10);
+
+            if(end == text) {
+                return text;
+            }
+
+            text = end;
+        }
+
+        if(from < 0 || to < from || to >= (long)sizeof(nodes) * 8) {
+            return text;
+        }
+
+        while(from <= to) {
+            nodes |= 1UL << from++;
+        }
+
+        if(*text == '\0') {
+            break;
+        }
+
+        if(*text++ != ',') {
+            return text - 1;
+        }
+    }
+
+    *ret = nodes;
+
+    return NULL;
+}
+
+/*
+ * Parse the options of the memory zone shared by cache and nosql,
+ * returns -1 if args[*cur_arg] is not one of them
+ */
+static int _nst_parse_global_memory(const char *file, int linenum,
+        char **args, int *cur_arg, struct nst_memory_conf *conf) {
+
+    if(!strcmp(args[*cur_arg], "hugepages")) {
+        (*cur_arg)++;
+
+        if(!strcmp(args[*cur_arg], "off")) {
+            conf->pages = 0;
+        } else if(!strcmp(args[*cur_arg], "2m")) {
+            conf->pages = 21;
+        } else if(!strcmp(args[*cur_arg], "1g")) {
+            conf->pages = 30;
+        } else {
+            ha_alert("parsing [%s:%d]: '%s' hugepages expects 'off', '2m' or "
+                    "'1g'.\n", file, linenum, args[0]);
+
+            return ERR_ALERT | ERR_FATAL;
+        }
+
+        (*cur_arg)++;
+        return 0;
+    }
+
+    if(!strcmp(args[*cur_arg], "numa")) {
+        (*cur_arg)++;
+
+        if(!strcmp(args[*cur_arg], "off")) {
+            conf->numa  = NST_MEMORY_NUMA_OFF;
+            conf->nodes = 0;
+            (*cur_arg)++;
+            return 0;
+        }
+
+        if(!strcmp(args[*cur_arg], "bind")) {
+            conf->numa = NST_MEMORY_NUMA_BIND;
+        } else if(!strcmp(args[*cur_arg], "interleave")) {
+            conf->numa = NST_MEMORY_NUMA_INTERLEAVE;
+        } else {
+            ha_alert("parsing [%s:%d]: '%s' numa expects 'off', 'bind' or "
+                    "'interleave'.\n", file, linenum, args[0]);
+
+            return ERR_ALERT | ERR_FATAL;
+        }
+
+        (*cur_arg)++;
+        conf->nodes = 0;
+
+        /* nodes are optional for interleave, all allowed nodes by default */
+        if(conf->numa == NST_MEMORY_NUMA_INTERLEAVE
+                && (*args[*cur_arg] < '0' || *args[*cur_arg] > '9')) {
+
+            return 0;
+        }
+
+        if(_nst_parse_nodes(args[*cur_arg], &conf->nodes)) {
+            ha_alert("parsing [%s:%d]: '%s' numa expects nodes like 0 or "
+                    "0,2-3, up to %d.\n", file, linenum, args[0],
+                    (int)sizeof(conf->nodes) * 8 - 1);
+
+            return ERR_ALERT | ERR_FATAL;
+        }
+
+        (*cur_arg)++;
+        return 0;
+    }
+
+    if(!strcmp(args[*cur_arg], "prefault")) {
+        (*cur_arg)++;
+
+        if(*args[*cur_arg] == 0) {
+            ha_alert("parsing [%s:%d]: '%s' prefault expects a number of "
+                    "threads.\n", file, linenum, args[0]);
+
+            return ERR_ALERT | ERR_FATAL;
+        }
+
+        conf->prefault = atoi(args[*cur_arg]);
+
+        if(conf->prefault < 0 || conf->prefault > NST_MEMORY_PREFAULT_MAX) {
+            ha_alert("parsing [%s:%d]: '%s' prefault expects a number of "
+                    "threads between 0 and %d.\n", file, linenum, args[0],
+                    NST_MEMORY_PREFAULT_MAX);
+
+            return ERR_ALERT | ERR_FATAL;
+        }
+
+        (*cur_arg)++;
+        return 0;
+    }
+
+    return -1;
+}
+
 int nuster_parse_global_cache(const char *file, int linenum, char **args) {
 
     int err_code = 0;
     int cur_arg  = 1;
+    int ret;
 
     if(global.nuster.cache.status != NST_STATUS_UNDEFINED) {
         ha_alert("parsing [%s:%d]: '%s' already specified. Ignore.\n", file,
@@ -506,6 +704,27 @@ int nuster_parse_global_cache(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "data-compactor")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' data-compactor expects a "
+                        "number.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.data_compactor = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.data_compactor < 0) {
+                global.nuster.cache.data_compactor = 0;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         if(!strcmp(args[cur_arg], "disk-cleaner")) {
             cur_arg++;
 
@@ -569,6 +788,97 @@ int nuster_parse_global_cache(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "evict")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.cache.evict = NST_EVICT_OFF;
+            } else if(!strcmp(args[cur_arg], "slru")) {
+                global.nuster.cache.evict = NST_EVICT_SLRU;
+            } else if(!strcmp(args[cur_arg], "clock")) {
+                global.nuster.cache.evict = NST_EVICT_CLOCK;
+            } else if(!strcmp(args[cur_arg], "tinylfu")) {
+                global.nuster.cache.evict = NST_EVICT_TINYLFU;
+            } else {
+                ha_alert("parsing [%s:%d]: '%s' evict expects 'off', 'slru', "
+                        "'clock' or 'tinylfu'.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "headroom")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' headroom expects a percentage."
+                        "\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.headroom = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.headroom < 0
+                    || global.nuster.cache.headroom > 50) {
+
+                ha_alert("parsing [%s:%d]: '%s' headroom expects a percentage "
+                        "between 0 and 50.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "admit")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' admit expects a frequency."
+                        "\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.cache.admit = atoi(args[cur_arg]);
+
+            if(global.nuster.cache.admit < 0
+                    || global.nuster.cache.admit > NST_SKETCH_COUNTER_MAX) {
+
+                ha_alert("parsing [%s:%d]: '%s' admit expects a frequency "
+                        "between 0 and %d.\n", file, linenum, args[0],
+                        NST_SKETCH_COUNTER_MAX);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        ret = _nst_parse_global_memory(file, linenum, args, &cur_arg,
+                &global.nuster.cache.shm);
+
+        if(ret >= 0) {
+            err_code |= ret;
+
+            if(err_code & ERR_FATAL) {
+                goto out;
+            }
+
+            continue;
+        }
+
         ha_alert("parsing [%s:%d]: '%s' Unrecognized .\n", file, linenum,
                 args[cur_arg]);
 
@@ -584,6 +894,7 @@ int nuster_parse_global_nosql(const char *file, int linenum, char **args) {
 
     int err_code = 0;
     int cur_arg  = 1;
+    int ret;
 
     if(global.nuster.nosql.status != NST_STATUS_UNDEFINED) {
         ha_alert("parsing [%s:%d]: '%s' already specified. Ignore.\n", file,
@@ -787,6 +1098,69 @@ int nuster_parse_global_nosql(const char *file, int linenum, char **args) {
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "evict")) {
+            cur_arg++;
+
+            if(!strcmp(args[cur_arg], "off")) {
+                global.nuster.nosql.evict = NST_EVICT_OFF;
+            } else if(!strcmp(args[cur_arg], "slru")) {
+                global.nuster.nosql.evict = NST_EVICT_SLRU;
+            } else if(!strcmp(args[cur_arg], "clock")) {
+                global.nuster.nosql.evict = NST_EVICT_CLOCK;
+            } else if(!strcmp(args[cur_arg], "tinylfu")) {
+                global.nuster.nosql.evict = NST_EVICT_TINYLFU;
+            } else {
+                ha_alert("parsing [%s:%d]: '%s' evict expects 'off', 'slru', "
+                        "'clock' or 'tinylfu'.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "headroom")) {
+            cur_arg++;
+
+            if(*args[cur_arg] == 0) {
+                ha_alert("parsing [%s:%d]: '%s' headroom expects a percentage."
+                        "\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            global.nuster.nosql.headroom = atoi(args[cur_arg]);
+
+            if(global.nuster.nosql.headroom < 0
+                    || global.nuster.nosql.headroom > 50) {
+
+                ha_alert("parsing [%s:%d]: '%s' headroom expects a percentage "
+                        "between 0 and 50.\n", file, linenum, args[0]);
+
+                err_code |= ERR_ALERT | ERR_FATAL;
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        ret = _nst_parse_global_memory(file, linenum, args, &cur_arg,
+                &global.nuster.nosql.shm);
+
+        if(ret >= 0) {
+            err_code |= ret;
+
+            if(err_code & ERR_FATAL) {
+                goto out;
+            }
+
+            continue;
+        }
+
         ha_alert("parsing [%s:%d]: '%s' Unrecognized .\n", file, linenum,
                 args[cur_arg]);
 
@@ -830,7 +1204,7 @@ int nst_parse_proxy_cache(char **args, int section, struct proxy *px,
     conf->status = NST_STATUS_ON;
     cur_arg++;
 
-    if(*args[cur_arg]) {
+    if(*args[cur_arg] && strcmp(args[cur_arg], "splice")) {
 
         if(!strcmp(args[cur_arg], "off")) {
             conf->status = NST_STATUS_OFF;
@@ -844,9 +1218,32 @@ int nst_parse_proxy_cache(char **args, int section, struct proxy *px,
         cur_arg++;
     }
 
-    fconf->id   = nst_cache_flt_id;
-    fconf->conf = conf;
-    fconf->ops  = &nst_cache_filter_ops;
+    px->nuster.splice = 0;
+
+    if(!strcmp(args[cur_arg], "splice")) {
+        cur_arg++;
+
+        if(!strcmp(args[cur_arg], "on")) {
+            px->nuster.splice = 1;
+        } else if(!strcmp(args[cur_arg], "off")) {
+            px->nuster.splice = 0;
+        } else {
+            memprintf(err, "splice: expects [on|off], default off");
+            return -1;
+        }
+
+        cur_arg++;
+    }
+
+    if(*args[cur_arg]) {
+        memprintf(err, "%s: unknown argument", args[cur_arg]);
+        return -1;
+    }
+
+    fconf->id    = nst_cache_flt_id;
+    fconf->conf  = conf;
+    fconf->ops   = &nst_cache_filter_ops;
+    fconf->flags = FLT_CFG_FL_HTX;
 
     LIST_ADDQ(&px->filter_configs, &fconf->list);
 
@@ -891,6 +1288,15 @@ int nst_parse_proxy_rule(char **args, int section, struct proxy *proxy,
     int etag   = -1;
 
     int last_modified = -1;
+    int max_size      = -1;
+    int stale         = -1;
+    int stale_error   = -1;
+    int origin_ttl    = -1;
+    int min_ttl       = -1;
+    int max_ttl       = -1;
+    int vary          = -1;
+    int compress      = -1;
+    int slice         = -1;
 
     int cur_arg = 2;
 
@@ -1086,6 +1492,283 @@ int nst_parse_proxy_rule(char **args, int section, struct proxy *proxy,
             continue;
         }
 
+        if(!strcmp(args[cur_arg], "max-size")) {
+
+            if(max_size != -1) {
+                memprintf(err, "'%s %s': max-size already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects a size[k|m|g].", args[0],
+                        name);
+
+                goto out;
+            }
+
+            if(parse_size_err(args[cur_arg], (unsigned *)&max_size)
+                    || max_size < 0) {
+
+                memprintf(err, "'%s %s': invalid max-size.", args[0], name);
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "stale-while-revalidate")) {
+
+            if(stale != -1) {
+                memprintf(err, "'%s %s': stale-while-revalidate already "
+                        "specified.", args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects a stale-while-revalidate"
+                        "(in seconds).", args[0], name);
+
+                goto out;
+            }
+
+            if(nst_parse_time(args[cur_arg], strlen(args[cur_arg]),
+                        (unsigned *)&stale)) {
+
+                memprintf(err, "'%s %s': invalid stale-while-revalidate.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "stale-if-error")) {
+
+            if(stale_error != -1) {
+                memprintf(err, "'%s %s': stale-if-error already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects a stale-if-error"
+                        "(in seconds).", args[0], name);
+
+                goto out;
+            }
+
+            if(nst_parse_time(args[cur_arg], strlen(args[cur_arg]),
+                        (unsigned *)&stale_error)) {
+
+                memprintf(err, "'%s %s': invalid stale-if-error.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "origin-ttl")) {
+
+            if(origin_ttl != -1) {
+                memprintf(err, "'%s %s': origin-ttl already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects [on|off], default off.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "on")) {
+                origin_ttl = NST_STATUS_ON;
+            } else if(!strcmp(args[cur_arg], "off")) {
+                origin_ttl = NST_STATUS_OFF;
+            } else {
+                memprintf(err, "'%s %s': expects [on|off], default off.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "min-ttl")) {
+
+            if(min_ttl != -1) {
+                memprintf(err, "'%s %s': min-ttl already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects a min-ttl(in seconds).",
+                        args[0], name);
+
+                goto out;
+            }
+
+            if(nst_parse_time(args[cur_arg], strlen(args[cur_arg]),
+                        (unsigned *)&min_ttl)) {
+
+                memprintf(err, "'%s %s': invalid min-ttl.", args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "max-ttl")) {
+
+            if(max_ttl != -1) {
+                memprintf(err, "'%s %s': max-ttl already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects a max-ttl(in seconds).",
+                        args[0], name);
+
+                goto out;
+            }
+
+            if(nst_parse_time(args[cur_arg], strlen(args[cur_arg]),
+                        (unsigned *)&max_ttl)) {
+
+                memprintf(err, "'%s %s': invalid max-ttl.", args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "compress")) {
+
+            if(compress != -1) {
+                memprintf(err, "'%s %s': compress already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects [gzip|off], default off.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "gzip")) {
+#if defined(USE_ZLIB)
+                compress = NST_STATUS_ON;
+#else
+                memprintf(err, "'%s %s': compress gzip needs USE_ZLIB.",
+                        args[0], name);
+
+                goto out;
+#endif
+            } else if(!strcmp(args[cur_arg], "off")) {
+                compress = NST_STATUS_OFF;
+            } else {
+                memprintf(err, "'%s %s': expects [gzip|off], default off.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "slice")) {
+
+            if(slice != -1) {
+                memprintf(err, "'%s %s': slice already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects a size[k|m|g].", args[0],
+                        name);
+
+                goto out;
+            }
+
+            if(parse_size_err(args[cur_arg], (unsigned *)&slice)
+                    || slice <= 0) {
+
+                memprintf(err, "'%s %s': invalid slice.", args[0], name);
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
+        if(!strcmp(args[cur_arg], "vary")) {
+
+            if(vary != -1) {
+                memprintf(err, "'%s %s': vary already specified.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            if(*args[cur_arg] == 0) {
+                memprintf(err, "'%s %s': expects [on|off], default off.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            if(!strcmp(args[cur_arg], "on")) {
+                vary = NST_STATUS_ON;
+            } else if(!strcmp(args[cur_arg], "off")) {
+                vary = NST_STATUS_OFF;
+            } else {
+                memprintf(err, "'%s %s': expects [on|off], default off.",
+                        args[0], name);
+
+                goto out;
+            }
+
+            cur_arg++;
+            continue;
+        }
+
         memprintf(err, "'%s %s': Unrecognized '%s'.", args[0], name,
                 args[cur_arg]);
         goto out;
@@ -1123,12 +1806,31 @@ int nst_parse_proxy_rule(char **args, int section, struct proxy *proxy,
         goto out;
     }
 
+    rule->key  = _nst_parse_rule_key_shared(proxy, rule->key);
+
     rule->code = _nst_parse_rule_code(code == NULL
             ? NST_CACHE_DEFAULT_CODE : code);
 
     rule->ttl  = malloc(sizeof(*rule->ttl));
     *rule->ttl = ttl == -1 ? NST_DEFAULT_TTL : ttl;
 
+    if(max_ttl > 0 && min_ttl > max_ttl) {
+        memprintf(err, "rule %s: min-ttl greater than max-ttl", name);
+        goto out;
+    }
+
+    /* the disk applet sends the file as is */
+    if(compress == NST_STATUS_ON && disk > 0) {
+        memprintf(err, "rule %s: compress needs disk off", name);
+        goto out;
+    }
+
+    /* the stored body must be the bytes of the slice */
+    if(compress == NST_STATUS_ON && slice > 0) {
+        memprintf(err, "rule %s: compress cannot be used with slice", name);
+        goto out;
+    }
+
     if(disk > 0 && !global.nuster.cache.root) {
         memprintf(err, "rule %s: disk enabled but no `dir` defined", name);
         goto out;
@@ -1138,6 +1840,15 @@ int nst_parse_proxy_rule(char **args, int section, struct proxy *proxy,
     rule->etag = etag == -1 ? NST_STATUS_OFF : etag;
 
     rule->last_modified = last_modified == -1 ? NST_STATUS_OFF : last_modified;
+    rule->max_size      = max_size == -1 ? 0 : max_size;
+    rule->stale         = stale == -1 ? 0 : stale;
+    rule->stale_error   = stale_error == -1 ? 0 : stale_error;
+    rule->origin_ttl    = origin_ttl == -1 ? NST_STATUS_OFF : origin_ttl;
+    rule->min_ttl       = min_ttl == -1 ? 0 : min_ttl;
+    rule->max_ttl       = max_ttl == -1 ? 0 : max_ttl;
+    rule->vary          = vary == -1 ? NST_STATUS_OFF : vary;
+    rule->compress      = compress == -1 ? NST_STATUS_OFF : compress;
+    rule->slice         = slice == -1 ? 0 : slice;
 
     rule->id   = -1;
     LIST_INIT(&rule->list);
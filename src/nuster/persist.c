@@ -68,7 +68,8 @@ int nst_persist_init(char *root, char *path, uint64_t hash) {
     return NST_OK;
 }
 
-int nst_persist_valid(struct persist *disk, struct buffer *key, uint64_t hash) {
+int nst_persist_valid(struct persist *disk, struct buffer *key, uint64_t hash,
+        int stale) {
     char *buf;
     int ret;
 
@@ -84,11 +85,13 @@ int nst_persist_valid(struct persist *disk, struct buffer *key, uint64_t hash) {
         goto err;
     }
 
-    if(memcmp(disk->meta, "NUSTER", 6) !=0) {
+    if(nst_persist_meta_check_magic(disk->meta) != NST_OK) {
         goto err;
     }
 
-    if(nst_persist_meta_check_expire(disk->meta) != NST_OK) {
+    if(nst_persist_meta_check_expire(disk->meta) != NST_OK
+            && (!stale || nst_persist_meta_check_stale(disk->meta) != NST_OK)) {
+
         goto err;
     }
 
@@ -123,11 +126,16 @@ err:
 }
 
 
+/*
+ * Find a valid file of the key, an expired one which can still be served
+ * is only returned if stale is set and there is no fresh one
+ */
 int nst_persist_exists(char *root, struct persist *disk, struct buffer *key,
-        uint64_t hash) {
+        uint64_t hash, int stale) {
 
     struct dirent *de;
     DIR *dirp;
+    int i;
 
     sprintf(disk->file, "%s/%"PRIx64"/%02"PRIx64"/%016"PRIx64, root,
             hash >> 60, hash >> 56, hash);
@@ -138,18 +146,23 @@ int nst_persist_exists(char *root, struct persist *disk, struct buffer *key,
         return NST_ERR;
     }
 
-    while((de = readdir(dirp)) != NULL) {
+    for(i = 0; i <= stale; i++) {
 
-        if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
-            memcpy(disk->file + nst_persist_path_hash_len(root), "/", 1);
-            memcpy(disk->file + nst_persist_path_hash_len(root) + 1,
-                    de->d_name, strlen(de->d_name));
+        while((de = readdir(dirp)) != NULL) {
+
+            if(strcmp(de->d_name, ".") != 0 && strcmp(de->d_name, "..") != 0) {
+                memcpy(disk->file + nst_persist_path_hash_len(root), "/", 1);
+                memcpy(disk->file + nst_persist_path_hash_len(root) + 1,
+                        de->d_name, strlen(de->d_name));
 
-            if(nst_persist_valid(disk, key, hash) == NST_OK) {
-                closedir(dirp);
-                return NST_OK;
+                if(nst_persist_valid(disk, key, hash, i) == NST_OK) {
+                    closedir(dirp);
+                    return NST_OK;
+                }
             }
         }
+
+        rewinddir(dirp);
     }
 
     closedir(dirp);
@@ -176,11 +189,11 @@ int nst_persist_get_meta(int fd, char *meta) {
         return NST_ERR;
     }
 
-    if(memcmp(meta, "NUSTER", 6) !=0) {
+    if(nst_persist_meta_check_magic(meta) != NST_OK) {
         return NST_ERR;
     }
 
-    if(nst_persist_meta_check_expire(meta) != NST_OK) {
+    if(nst_persist_meta_check_stale(meta) != NST_OK) {
         return NST_ERR;
     }
 
@@ -299,14 +312,14 @@ void nst_persist_cleanup(char *root, char *path, struct dirent *de1) {
                 continue;
             }
 
-            if(memcmp(meta, "NUSTER", 6) !=0) {
+            if(nst_persist_meta_check_magic(meta) != NST_OK) {
                 unlink(path);
                 close(fd);
                 continue;
             }
 
-            /* persist is complete */
-            if(nst_persist_meta_check_expire(meta) != NST_OK) {
+            /* persist is complete, kept while it may be served stale */
+            if(nst_persist_meta_check_stale(meta) != NST_OK) {
                 unlink(path);
                 close(fd);
                 continue;
@@ -0,0 +1,183 @@
+/*
+ * nuster frequency sketch functions.
+ *
+ * Copyright (C) Jiang Wenyuan, < koubunen AT gmail DOT com >
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License, or (at your option) any later version.
+ *
+ */
+
+#include <string.h>
+
+#include <nuster/memory.h>
+#include <nuster/sketch.h>
+
+static const uint64_t _nst_sketch_seed[NST_SKETCH_DEPTH] = {
+    0xC3A5C85C97CB3127ULL, 0xB492B66FBE98F273ULL,
+    0x9AE16A3B2F90404FULL, 0xCBF29CE484222325ULL,
+};
+
+static inline uint64_t *_nst_sketch_word(struct nst_sketch *sketch,
+        uint64_t hash, int i) {
+
+    uint64_t idx = hash * _nst_sketch_seed[i];
+
+    idx  = (idx ^ (idx >> 32)) & (sketch->size - 1);
+
+    return &sketch->segment[idx >> sketch->shift]
+        [idx & ((1ULL << sketch->shift) - 1)];
+}
+
+/*
+ * Bit offset of the counter i of hash in its word, every counter of a key
+ * is in a different nibble
+ */
+static inline int _nst_sketch_offset(uint64_t hash, int i) {
+    return ((((hash >> 8) & 3) << 2) + i) << 2;
+}
+
+/*
+ * Allocate about one word per 4 entries, in segments of at most one block
+ */
+int nst_sketch_init(struct nst_memory *memory, struct nst_sketch *sketch,
+        uint64_t entries) {
+
+    uint64_t words = memory->block_size / sizeof(uint64_t);
+    uint64_t size, segments, i;
+
+    memset(sketch, 0, sizeof(*sketch));
+
+    for(size = NST_SKETCH_MIN_SIZE; size * 4 < entries; size *= 2) { }
+
+    if(size > words * (memory->block_size / sizeof(uint64_t *))) {
+        size = words * (memory->block_size / sizeof(uint64_t *));
+    }
+
+    if(size < words) {
+        words = size;
+    }
+
+    segments = size / words;
+
+    sketch->segment = nst_memory_alloc(memory, segments * sizeof(uint64_t *));
+
+    if(!sketch->segment) {
+        return NST_ERR;
+    }
+
+    for(i = 0; i < segments; i++) {
+        sketch->segment[i] = nst_memory_alloc(memory,
+                words * sizeof(uint64_t));
+
+        if(!sketch->segment[i]) {
+
+            while(i--) {
+                nst_memory_free(memory, sketch->segment[i]);
+            }
+
+            nst_memory_free(memory, sketch->segment);
+            sketch->segment = NULL;
+
+            return NST_ERR;
+        }
+
+        memset(sketch->segment[i], 0, words * sizeof(uint64_t));
+    }
+
+    for(sketch->shift = 0; (1ULL << sketch->shift) < words; sketch->shift++) { }
+
+    sketch->size   = size;
+    sketch->sample = entries * NST_SKETCH_SAMPLE_FACTOR > ~0U
+        ? ~0U : entries * NST_SKETCH_SAMPLE_FACTOR;
+
+    return NST_OK;
+}
+
+/*
+ * Counters are shared by all processes and updated with CAS, a saturated
+ * counter is left untouched
+ */
+void nst_sketch_increment(struct nst_sketch *sketch, uint64_t hash) {
+    int added = 0;
+    int i;
+
+    if(!sketch->segment) {
+        return;
+    }
+
+    for(i = 0; i < NST_SKETCH_DEPTH; i++) {
+        uint64_t *word = _nst_sketch_word(sketch, hash, i);
+        uint64_t  old  = __atomic_load_n(word, __ATOMIC_RELAXED);
+        int offset     = _nst_sketch_offset(hash, i);
+
+        while(((old >> offset) & 0xF) != 0xF) {
+
+            if(__atomic_compare_exchange_n(word, &old, old + (1ULL << offset),
+                        1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+
+                added = 1;
+                break;
+            }
+        }
+    }
+
+    if(added) {
+        __atomic_add_fetch(&sketch->additions, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * Estimated frequency of hash, from 0 to 15
+ */
+int nst_sketch_frequency(struct nst_sketch *sketch, uint64_t hash) {
+    int freq = 0xF;
+    int i;
+
+    if(!sketch->segment) {
+        return 0;
+    }
+
+    for(i = 0; i < NST_SKETCH_DEPTH; i++) {
+        uint64_t word = __atomic_load_n(_nst_sketch_word(sketch, hash, i),
+                __ATOMIC_RELAXED);
+
+        int count = (word >> _nst_sketch_offset(hash, i)) & 0xF;
+
+        if(count < freq) {
+            freq = count;
+        }
+    }
+
+    return freq;
+}
+
+/*
+ * Halve every counter once sample counters have been increased
+ */
+void nst_sketch_age(struct nst_sketch *sketch) {
+    uint64_t i;
+
+    if(!sketch->segment
+            || __atomic_load_n(&sketch->additions, __ATOMIC_RELAXED)
+            < sketch->sample) {
+
+        return;
+    }
+
+    for(i = 0; i < sketch->size; i++) {
+        uint64_t *word = &sketch->segment[i >> sketch->shift]
+            [i & ((1ULL << sketch->shift) - 1)];
+
+        uint64_t old   = __atomic_load_n(word, __ATOMIC_RELAXED);
+
+        while(!__atomic_compare_exchange_n(word, &old,
+                    (old >> 1) & 0x7777777777777777ULL, 1,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+    }
+
+    __atomic_store_n(&sketch->additions, sketch->additions / 2,
+            __ATOMIC_RELAXED);
+}
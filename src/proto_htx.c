@@ -36,6 +36,8 @@
 #include <proto/stream_interface.h>
 #include <proto/stats.h>
 
+#include <nuster/nuster.h>
+
 extern const char *stat_status_codes[];
 
 static void htx_end_request(struct stream *s);
@@ -639,6 +641,11 @@ int htx_process_req_common(struct stream *s, struct channel *req, int an_bit, st
 		goto done;
 	}
 
+	/* check nuster applets: purge */
+	if (nuster_check_applet_htx(s, req, px)) {
+		goto return_prx_cond;
+	}
+
 	/* POST requests may be accompanied with an "Expect: 100-Continue" header.
 	 * If this happens, then the data will not come immediately, so we must
 	 * send all what we have without waiting. Note that due to the small gain
@@ -0,0 +1,258 @@
+/*
+ * Compare the nuster dict (open addressing, 16 ctrl bytes per group) with
+ * the chained dict it replaced. Both index the same N entries, laid out
+ * like nst_cache_entry with the key in separate buffers, at the same load
+ * factor range, and are probed in random order.
+ *
+ *   gcc -O2 -Iinclude -Iebtree -o test_nst_dict tests/test_nst_dict.c \
+ *       src/nuster/dict.c
+ *   ./test_nst_dict 1000000
+ *   ./test_nst_dict 10000000
+ */
+
+#include <sys/time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <nuster/memory.h>
+#include <nuster/dict.h>
+
+struct key {
+    char         *area;
+    int           data;
+};
+
+struct entry {
+    uint64_t      hash;
+    struct key   *key;
+    uint64_t      pad[9];
+    struct entry *next;
+};
+
+struct chain {
+    struct entry **bucket;
+    uint64_t       size;
+};
+
+/* the dict only needs block_size from the memory, back it with malloc */
+void *nst_memory_alloc(struct nst_memory *memory, int size) {
+    return malloc(size);
+}
+
+void nst_memory_free(struct nst_memory *memory, void *p) {
+    free(p);
+}
+
+static double now() {
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+
+    return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x  = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x  = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+static void shuffle(struct entry **e, uint64_t n, uint64_t seed) {
+    uint64_t i;
+
+    for(i = n - 1; i > 0; i--) {
+        uint64_t j     = mix(seed + i) % (i + 1);
+        struct entry *t = e[i];
+
+        e[i] = e[j];
+        e[j] = t;
+    }
+}
+
+static struct entry *chain_get(struct chain *c, struct entry *k) {
+    struct entry *e = c->bucket[k->hash & (c->size - 1)];
+
+    while(e) {
+
+        if(e->hash == k->hash && e->key->data == k->key->data
+                && !memcmp(e->key->area, k->key->area, k->key->data)) {
+
+            return e;
+        }
+
+        e = e->next;
+    }
+
+    return NULL;
+}
+
+static struct entry *dict_get(struct nst_dict *d, struct entry *k) {
+    struct nst_dict_probe probe;
+    struct entry *e;
+
+    nst_dict_probe_init(d, k->hash, &probe);
+
+    while((e = nst_dict_probe_next(d, k->hash, &probe))) {
+
+        if(e->key->data == k->key->data
+                && !memcmp(e->key->area, k->key->area, k->key->data)) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    struct nst_memory memory;
+    struct nst_dict dict;
+    struct chain chain;
+    struct entry **entries, **miss;
+    struct entry *pool;
+    struct key *keys;
+    uint64_t *perm;
+    char *areas;
+    uint64_t n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1000000;
+    uint64_t i, found;
+    double t;
+
+    /* at most 3/4 full, as both dicts grow past that */
+    for(chain.size = 64; chain.size * 3 / 4 < n; chain.size *= 2) { }
+
+    memset(&memory, 0, sizeof(memory));
+    memory.block_size = 16384;
+
+    for(i = 4; i * NST_DICT_GROUP_SLOTS * 3 / 4 < n; i *= 2) { }
+
+    if(i > nst_dict_max_size(&memory)) {
+        memory.block_size = 1024 * 1024 * 2;
+    }
+
+    if(nst_dict_alloc(&memory, &dict, i) != NST_OK) {
+        return 1;
+    }
+
+    chain.bucket = calloc(chain.size, sizeof(*chain.bucket));
+    pool         = malloc(2 * n * sizeof(*pool));
+    keys         = malloc(2 * n * sizeof(*keys));
+    areas        = malloc(2 * n * 48);
+    perm         = malloc(2 * n * sizeof(*perm));
+    entries      = malloc(n * sizeof(*entries));
+    miss         = malloc(n * sizeof(*miss));
+
+    if(!chain.bucket || !pool || !keys || !areas || !perm || !entries || !miss) {
+        return 1;
+    }
+
+    for(i = 0; i < 2 * n; i++) {
+        perm[i] = i;
+    }
+
+    for(i = 2 * n - 1; i > 0; i--) {
+        uint64_t j = mix(i) % (i + 1);
+        uint64_t t = perm[i];
+
+        perm[i] = perm[j];
+        perm[j] = t;
+    }
+
+    /* entries, keys and key areas are scattered in their own pools */
+    for(i = 0; i < 2 * n; i++) {
+        uint64_t k = perm[i];
+        uint64_t a = perm[2 * n - 1 - i];
+
+        keys[k].area = areas + a * 48;
+        keys[k].data = snprintf(keys[k].area, 48,
+                "GET.http.example.com/%lu", (unsigned long)i);
+
+        pool[i].hash = mix(i);
+        pool[i].key  = &keys[k];
+        pool[i].next = NULL;
+    }
+
+    /* hit and miss keys are interleaved in memory */
+    for(i = 0; i < n; i++) {
+        entries[i] = &pool[2 * i];
+        miss[i]    = &pool[2 * i + 1];
+    }
+
+    shuffle(entries, n, 1);
+
+    printf("entries %lu, chained: %lu buckets, %.1f MB, "
+            "open: %lu groups, %.1f MB\n", (unsigned long)n,
+            (unsigned long)chain.size,
+            (chain.size * sizeof(void *) + n * sizeof(void *)) / 1048576.0,
+            (unsigned long)dict.size,
+            dict.size * sizeof(struct nst_dict_group) / 1048576.0);
+
+    t = now();
+
+    for(i = 0; i < n; i++) {
+        struct entry **b = &chain.bucket[entries[i]->hash & (chain.size - 1)];
+
+        entries[i]->next = *b;
+        *b               = entries[i];
+    }
+
+    printf("chained insert   %8.1f ns/op\n", (now() - t) * 1e9 / n);
+
+    t = now();
+
+    for(i = 0; i < n; i++) {
+        nst_dict_insert(&dict, entries[i]->hash, entries[i]);
+    }
+
+    printf("open    insert   %8.1f ns/op\n", (now() - t) * 1e9 / n);
+
+    shuffle(entries, n, 2);
+
+    t = now();
+
+    for(i = 0, found = 0; i < n; i++) {
+        found += chain_get(&chain, entries[i]) != NULL;
+    }
+
+    printf("chained hit      %8.1f ns/op (%lu)\n", (now() - t) * 1e9 / n,
+            (unsigned long)found);
+
+    t = now();
+
+    for(i = 0, found = 0; i < n; i++) {
+        found += dict_get(&dict, entries[i]) != NULL;
+    }
+
+    printf("open    hit      %8.1f ns/op (%lu)\n", (now() - t) * 1e9 / n,
+            (unsigned long)found);
+
+    t = now();
+
+    for(i = 0, found = 0; i < n; i++) {
+        found += chain_get(&chain, miss[i]) != NULL;
+    }
+
+    printf("chained miss     %8.1f ns/op (%lu)\n", (now() - t) * 1e9 / n,
+            (unsigned long)found);
+
+    t = now();
+
+    for(i = 0, found = 0; i < n; i++) {
+        found += dict_get(&dict, miss[i]) != NULL;
+    }
+
+    printf("open    miss     %8.1f ns/op (%lu)\n", (now() - t) * 1e9 / n,
+            (unsigned long)found);
+
+    nst_dict_free(&memory, &dict);
+    free(chain.bucket);
+    free(entries);
+    free(miss);
+    free(pool);
+    free(keys);
+    free(areas);
+    free(perm);
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Compare the two ways the cache applet delivers a hit to the client: the
+ * extents copied into the channel buffer which is then sent (ci_putblk),
+ * and the extents written into a pipe which is then spliced to the socket.
+ * An object of SIZE bytes laid out in 16kB extents is sent N times over a
+ * loopback TCP connection drained by another thread, the CPU time of the
+ * sending thread is converted to TSC cycles.
+ *
+ *   gcc -O2 -pthread -o test_nst_hit tests/test_nst_hit.c
+ *   ./test_nst_hit 1048576 2000
+ *   ./test_nst_hit 16384 50000
+ */
+
+#define _GNU_SOURCE
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#define EXTENT   16384
+#define BUFSIZE  16384
+#define IOV      16
+
+static char **extent;
+static int    extents;
+static long   size;
+
+static uint64_t now_ns(clockid_t clock) {
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double tsc_per_ns() {
+#if defined(__x86_64__) || defined(__i386__)
+    uint64_t t0 = now_ns(CLOCK_MONOTONIC);
+    uint64_t c0 = __builtin_ia32_rdtsc();
+
+    usleep(200000);
+
+    return (double)(__builtin_ia32_rdtsc() - c0)
+        / (now_ns(CLOCK_MONOTONIC) - t0);
+#else
+    return 1;
+#endif
+}
+
+static void *drain(void *arg) {
+    int fd = (long)arg;
+    char buf[1 << 16];
+
+    while(read(fd, buf, sizeof(buf)) > 0) {}
+
+    return NULL;
+}
+
+static void send_all(int fd, const char *p, long len) {
+
+    while(len > 0) {
+        ssize_t ret = send(fd, p, len, 0);
+
+        if(ret <= 0) {
+            perror("send");
+            exit(1);
+        }
+
+        p   += ret;
+        len -= ret;
+    }
+}
+
+static int extent_len(int i) {
+    return i == extents - 1 ? size - (long)i * EXTENT : EXTENT;
+}
+
+/* copy into a buffer then send it, like ci_putblk and raw_sock */
+static void hit_copy(int fd) {
+    static char buf[BUFSIZE];
+    int i, offset = 0, len = 0;
+
+    for(i = 0; i < extents; ) {
+        int n = extent_len(i);
+        int room = BUFSIZE - len;
+
+        if(n - offset < room) {
+            room = n - offset;
+        }
+
+        memcpy(buf + len, extent[i] + offset, room);
+        len    += room;
+        offset += room;
+
+        if(len == BUFSIZE) {
+            send_all(fd, buf, len);
+            len = 0;
+        }
+
+        if(offset == n) {
+            offset = 0;
+            i++;
+        }
+    }
+
+    send_all(fd, buf, len);
+}
+
+/* write into a pipe then splice it, like the cache applet and raw_sock */
+static void hit_splice(int fd, int *pfd) {
+    int i = 0, offset = 0;
+
+    while(i < extents) {
+        struct iovec iov[IOV];
+        ssize_t ret, left;
+        int n;
+
+        for(n = 0; n < IOV && i + n < extents; n++) {
+            iov[n].iov_base = extent[i + n] + (n ? 0 : offset);
+            iov[n].iov_len  = extent_len(i + n) - (n ? 0 : offset);
+        }
+
+        left = ret = writev(pfd[1], iov, n);
+
+        if(ret <= 0) {
+            perror("writev");
+            exit(1);
+        }
+
+        while(left > 0) {
+            ssize_t s = splice(pfd[0], NULL, fd, NULL, left, SPLICE_F_MOVE);
+
+            if(s <= 0) {
+                perror("splice");
+                exit(1);
+            }
+
+            left -= s;
+        }
+
+        offset += ret;
+
+        while(i < extents && offset >= extent_len(i)) {
+            offset -= extent_len(i);
+            i++;
+        }
+    }
+}
+
+static int connect_pair(pthread_t *th) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int one = 1;
+    int lfd, cfd, afd;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family      = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    bind(lfd, (struct sockaddr *)&sa, sizeof(sa));
+    listen(lfd, 1);
+    getsockname(lfd, (struct sockaddr *)&sa, &len);
+
+    cfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if(connect(cfd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+        perror("connect");
+        exit(1);
+    }
+
+    afd = accept(lfd, NULL, NULL);
+    close(lfd);
+    pthread_create(th, NULL, drain, (void *)(long)afd);
+
+    return cfd;
+}
+
+static void run(const char *name, int mode, int n, double tsc) {
+    pthread_t th;
+    int pfd[2];
+    int fd = connect_pair(&th);
+    uint64_t cpu, wall;
+    double bytes = (double)size * n;
+    int i;
+
+    if(pipe(pfd) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+
+    /* a partial write rather than waiting for room the pipe never gets */
+    fcntl(pfd[1], F_SETFL, O_NONBLOCK);
+
+    wall = now_ns(CLOCK_MONOTONIC);
+    cpu  = now_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    for(i = 0; i < n; i++) {
+
+        if(mode) {
+            hit_splice(fd, pfd);
+        } else {
+            hit_copy(fd);
+        }
+    }
+
+    cpu  = now_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wall = now_ns(CLOCK_MONOTONIC) - wall;
+
+    shutdown(fd, SHUT_WR);
+    pthread_join(th, NULL);
+    close(fd);
+    close(pfd[0]);
+    close(pfd[1]);
+
+    printf("%-8s %8.3f bytes/cycle %8.1f MB/s cpu %6.0f ms wall %6.0f ms\n",
+            name, bytes / (cpu * tsc), bytes / wall * 1000,
+            cpu / 1e6, wall / 1e6);
+}
+
+int main(int argc, char **argv) {
+    int n, i;
+    double tsc;
+
+    if(argc != 3) {
+        fprintf(stderr, "usage: %s SIZE N\n", argv[0]);
+        return 1;
+    }
+
+    size    = atol(argv[1]);
+    n       = atoi(argv[2]);
+    extents = (size + EXTENT - 1) / EXTENT;
+    extent  = malloc(extents * sizeof(*extent));
+
+    for(i = 0; i < extents; i++) {
+        extent[i] = malloc(EXTENT);
+        memset(extent[i], 'a' + i % 26, EXTENT);
+    }
+
+    tsc = tsc_per_ns();
+
+    printf("object %ld bytes in %d extents, %d hits\n", size, extents, n);
+
+    run("putblk", 0, n, tsc);
+    run("splice", 1, n, tsc);
+
+    return 0;
+}
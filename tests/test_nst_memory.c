@@ -0,0 +1,167 @@
+/*
+ * Compare the two ways threads allocate from the nuster memory: every
+ * allocation and free taking the lock of the memory, as nst_memory_alloc
+ * and nst_memory_free did, and the per-thread magazines exchanging chunks
+ * with the memory by halves.
+ * THREADS threads each run N operations on a window of live chunks sized
+ * like keys, entries and headers: a random slot is freed and reallocated.
+ *
+ *   gcc -O2 -pthread -DUSE_THREAD -Iinclude -Iebtree -o test_nst_memory \
+ *       tests/test_nst_memory.c src/nuster/memory.c
+ *   ./test_nst_memory 1 10000000
+ *   ./test_nst_memory 4 10000000
+ */
+
+#include <pthread.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <nuster/shctx.h>
+#include <nuster/memory.h>
+
+#include <common/hathreads.h>
+
+#define WINDOW   1024
+
+THREAD_LOCAL unsigned int tid;
+
+/* the memory only copies its name */
+int strlcpy2(char *dst, const char *src, int size) {
+    snprintf(dst, size, "%s", src);
+
+    return strlen(dst);
+}
+
+static struct nst_memory *memory;
+static long               ops;
+static int                locked;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x  = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x  = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+static void *alloc(int size) {
+    void *p;
+
+    if(!locked) {
+        return nst_memory_alloc(memory, size);
+    }
+
+    nst_shctx_lock(memory);
+    p = nst_memory_alloc_locked(memory, size);
+    nst_shctx_unlock(memory);
+
+    return p;
+}
+
+static void release(void *p) {
+
+    if(!locked) {
+        nst_memory_free(memory, p);
+        return;
+    }
+
+    nst_shctx_lock(memory);
+    nst_memory_free_locked(memory, p);
+    nst_shctx_unlock(memory);
+}
+
+static void *run(void *arg) {
+    static const int size[8] = { 24, 40, 64, 96, 160, 200, 512, 1000 };
+    void *live[WINDOW] = { NULL };
+    uint64_t r;
+    long i;
+
+    tid = (long)arg;
+    r   = tid;
+
+    nst_memory_magazine_start();
+
+    for(i = 0; i < ops; i++) {
+        r = mix(r);
+
+        release(live[r % WINDOW]);
+        live[r % WINDOW] = alloc(size[(r >> 32) & 7]);
+
+        if(!live[r % WINDOW]) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        /* touch it like a caller would */
+        *(uint64_t *)live[r % WINDOW] = r;
+    }
+
+    for(i = 0; i < WINDOW; i++) {
+        release(live[i]);
+    }
+
+    return NULL;
+}
+
+static double bench(int threads) {
+    pthread_t t[MAX_THREADS];
+    uint64_t t0 = now_ns();
+    long i;
+
+    for(i = 0; i < threads; i++) {
+        pthread_create(&t[i], NULL, run, (void *)i);
+    }
+
+    for(i = 0; i < threads; i++) {
+        pthread_join(t[i], NULL);
+    }
+
+    return (double)(now_ns() - t0) / ops;
+}
+
+int main(int argc, char **argv) {
+    int threads = argc > 1 ? atoi(argv[1]) : 4;
+    double old, new;
+
+    ops = argc > 2 ? atol(argv[2]) : 10000000;
+
+    if(threads <= 0 || threads > MAX_THREADS || ops <= 0) {
+        fprintf(stderr, "usage: %s THREADS N\n", argv[0]);
+        return 1;
+    }
+
+    memory = nst_memory_create("test", 256 * 1024 * 1024, 16384, 32, NULL);
+
+    if(!memory || nst_shctx_init(memory) != NST_OK) {
+        fprintf(stderr, "cannot create memory\n");
+        return 1;
+    }
+
+    locked = 1;
+    old    = bench(threads);
+
+    locked = 0;
+    new    = bench(threads);
+
+    printf("%d threads, %ld operations each, window %d\n", threads, ops,
+            WINDOW);
+    printf("  lock per operation:   %8.1f ns per operation per thread\n",
+            old);
+    printf("  per-thread magazines: %8.1f ns per operation per thread\n",
+            new);
+    printf("  speedup:              %8.2fx\n", old / new);
+    printf("  kept in magazines:    %8"PRIu64" bytes\n", memory->used);
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Compare the two ways a large response body is kept in the nuster memory:
+ * split into extents of at most a block, as the cache did since nst_memory
+ * could not allocate more than a block, and a single run of contiguous
+ * blocks.
+ * A window of WINDOW bodies of SIZE bytes is kept, N times a random one is
+ * freed and replaced: allocated, filled, then read back in bufsize steps
+ * like a response being sent.
+ *
+ *   gcc -O2 -pthread -DUSE_THREAD -Iinclude -Iebtree -o test_nst_memory_large \
+ *       tests/test_nst_memory_large.c src/nuster/memory.c
+ *   ./test_nst_memory_large 100000 409600
+ *   ./test_nst_memory_large 100000 65536
+ */
+
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <nuster/shctx.h>
+#include <nuster/memory.h>
+
+#include <common/hathreads.h>
+
+#define WINDOW   256
+#define BUFSIZE  16384
+
+THREAD_LOCAL unsigned int tid;
+
+/* the memory only copies its name */
+int strlcpy2(char *dst, const char *src, int size) {
+    snprintf(dst, size, "%s", src);
+
+    return strlen(dst);
+}
+
+/* like nst_cache_element */
+struct element {
+    struct element *next;
+    int             len;
+    int             size;
+    char            data[0];
+};
+
+static struct nst_memory *memory;
+static char               body[64 * 1024 * 1024];
+static char               out[BUFSIZE];
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint64_t mix(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ULL;
+    x  = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    x  = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+
+    return x ^ (x >> 31);
+}
+
+static struct element *store(long len, int run) {
+    struct element *head = NULL, **next = &head;
+    long done = 0;
+
+    while(done < len) {
+        struct element *e;
+        long size = run ? nst_memory_fit(memory, sizeof(*e) + len)
+            : BUFSIZE;
+
+        nst_shctx_lock(memory);
+        e = nst_memory_alloc_locked(memory, size);
+        nst_shctx_unlock(memory);
+
+        if(!e) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        e->next = NULL;
+        e->size = size - sizeof(*e);
+        e->len  = len - done < e->size ? len - done : e->size;
+
+        memcpy(e->data, body + done, e->len);
+
+        done += e->len;
+        *next = e;
+        next  = &e->next;
+    }
+
+    return head;
+}
+
+static uint64_t emit(struct element *e) {
+    uint64_t sum = 0;
+
+    for(; e; e = e->next) {
+        int off;
+
+        for(off = 0; off < e->len; off += BUFSIZE) {
+            int n = e->len - off < BUFSIZE ? e->len - off : BUFSIZE;
+
+            memcpy(out, e->data + off, n);
+            sum += (unsigned char)out[n - 1];
+        }
+    }
+
+    return sum;
+}
+
+static void release(struct element *e) {
+
+    while(e) {
+        struct element *next = e->next;
+
+        nst_shctx_lock(memory);
+        nst_memory_free_locked(memory, e);
+        nst_shctx_unlock(memory);
+
+        e = next;
+    }
+}
+
+static double bench(long n, long len, int run, uint64_t *sum) {
+    struct element *live[WINDOW] = { NULL };
+    uint64_t t0 = now_ns();
+    uint64_t r  = 1;
+    long i;
+
+    for(i = 0; i < n; i++) {
+        r = mix(r);
+
+        release(live[r % WINDOW]);
+        live[r % WINDOW] = store(len, run);
+        *sum += emit(live[r % WINDOW]);
+    }
+
+    for(i = 0; i < WINDOW; i++) {
+        release(live[i]);
+    }
+
+    return (double)(now_ns() - t0) / n;
+}
+
+int main(int argc, char **argv) {
+    long n       = argc > 1 ? atol(argv[1]) : 100000;
+    long len     = argc > 2 ? atol(argv[2]) : 409600;
+    uint64_t sum = 0;
+    double old, new;
+
+    if(n <= 0 || len <= 0 || len > (long)sizeof(body)) {
+        fprintf(stderr, "usage: %s N SIZE\n", argv[0]);
+        return 1;
+    }
+
+    memory = nst_memory_create("test", (uint64_t)(WINDOW + 16)
+            * (len + BUFSIZE) * 2, BUFSIZE, 32, NULL);
+
+    if(!memory || nst_shctx_init(memory) != NST_OK) {
+        fprintf(stderr, "cannot create memory\n");
+        return 1;
+    }
+
+    memset(body, 'x', len);
+
+    old = bench(n, len, 0, &sum);
+    new = bench(n, len, 1, &sum);
+
+    printf("bodies of %ld bytes, %ld replaced, window %d\n", len, n, WINDOW);
+    printf("  extents of a block:   %8.1f ns per body\n", old);
+    printf("  run of blocks:        %8.1f ns per body\n", new);
+    printf("  speedup:              %8.2fx (%"PRIu64")\n", old / new,
+            sum % 10);
+
+    return 0;
+}
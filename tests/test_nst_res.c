@@ -0,0 +1,302 @@
+/*
+ * Check the 304 built by nst_res_304 and compare its cost with the status
+ * line and the headers formatted with printf for each response, and the
+ * Date formatted with gmtime for each response, as nst_res_304 did before.
+ * The responses must be the same, and the Date line cached by
+ * nst_http_date_line must follow the date of the poll loop across a second.
+ * N responses are built in batches of BATCH, as many as a poll loop would
+ * send, the date of the poll loop is updated once per batch.
+ *
+ * The HTTP parsing functions of src/nuster/http.c are dropped at link time.
+ *
+ *   gcc -O2 -ffunction-sections -Wl,--gc-sections -Iinclude -Iebtree \
+ *       -o test_nst_res tests/test_nst_res.c src/nuster/http.c src/http.c \
+ *       src/htx.c
+ *   ./test_nst_res 10000000 200
+ *   ./test_nst_res 10000000 1
+ */
+
+#define _GNU_SOURCE
+#include <sys/time.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+#include <common/chunk.h>
+
+#include <proto/channel.h>
+#include <proto/stream_interface.h>
+
+#include <nuster/http.h>
+
+#define BUFSIZE  16384
+
+/* 2026-10-16 23:59:59 GMT */
+#define SEC      1792195199
+
+/* the date of the poll loop, see tv_update_date */
+THREAD_LOCAL struct timeval date;
+
+struct global global;
+
+static char            trash_area[BUFSIZE];
+static struct buffer   trash_chunk = { .area = trash_area, .size = BUFSIZE };
+
+/* what nst_res_304 sent */
+static char            out_area[BUFSIZE];
+static struct buffer   out = { .area = out_area, .size = BUFSIZE };
+
+static struct proxy    fe;
+static struct session  sess = { .fe = &fe };
+static struct stream   strm = { .sess = &sess };
+
+static struct nst_str  last_modified = nst_str_set("Fri, 16 Oct 2026 23:03:12 GMT");
+static struct nst_str  etag          = nst_str_set("\"5d8c72a5edda8d6a\"");
+
+struct buffer *get_trash_chunk(void) {
+    trash_chunk.data = 0;
+
+    return &trash_chunk;
+}
+
+int chunk_printf(struct buffer *chk, const char *fmt, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = vsnprintf(chk->area, chk->size, fmt, ap);
+    va_end(ap);
+
+    if(ret < 0 || ret >= chk->size) {
+        return -1;
+    }
+
+    chk->data = ret;
+
+    return chk->data;
+}
+
+const char hextab[16] = "0123456789ABCDEF";
+
+char *ulltoa(unsigned long long n, char *dst, size_t size) {
+    int len = snprintf(dst, size, "%llu", n);
+
+    return len < 0 || len >= size ? NULL : dst + len;
+}
+
+char *memprintf(char **out, const char *format, ...) {
+    va_list ap;
+
+    free(*out);
+
+    va_start(ap, format);
+
+    if(vasprintf(out, format, ap) < 0) {
+        *out = NULL;
+    }
+
+    va_end(ap);
+
+    return *out;
+}
+
+/* the channel only records what is sent */
+int ci_putblk(struct channel *chn, const char *blk, int len) {
+
+    if(out.data + len > out.size) {
+        return -1;
+    }
+
+    memcpy(out.area + out.data, blk, len);
+    out.data += len;
+
+    return len;
+}
+
+static void shutr(struct stream_interface *si) {
+}
+
+static struct si_ops si_ops = { .shutr = shutr };
+
+static uint64_t now_ns() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void appendf(struct buffer *b, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void appendf(struct buffer *b, const char *fmt, ...) {
+    va_list ap;
+    int ret;
+
+    va_start(ap, fmt);
+    ret = vsnprintf(b->area + b->data, b->size - b->data, fmt, ap);
+    va_end(ap);
+
+    if(ret > 0 && ret < b->size - b->data) {
+        b->data += ret;
+    }
+}
+
+static void res_304_printf(struct stream_interface *si,
+        struct nst_str *last_modified, struct nst_str *etag) {
+
+    const char mon[12][4] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul",
+        "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+    const char day[7][4]  = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+
+    struct buffer *buf = get_trash_chunk();
+    time_t sec = date.tv_sec;
+    char now[32];
+    struct tm tm;
+    int len;
+
+    gmtime_r(&sec, &tm);
+
+    len = sprintf(now, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+            day[tm.tm_wday], tm.tm_mday, mon[tm.tm_mon],
+            1900 + tm.tm_year, tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    appendf(buf, "HTTP/1.1 %d %s\r\n", 304, http_get_reason(304));
+    appendf(buf, "%.*s: nuster\r\n", nst_headers.server.len,
+            nst_headers.server.data);
+    appendf(buf, "%.*s: %.*s\r\n", nst_headers.date.len,
+            nst_headers.date.data, len, now);
+    appendf(buf, "%.*s: %.*s\r\n", nst_headers.last_modified.len,
+            nst_headers.last_modified.data, last_modified->len,
+            last_modified->data);
+    appendf(buf, "%.*s: %.*s\r\n", nst_headers.etag.len,
+            nst_headers.etag.data, etag->len, etag->data);
+    appendf(buf, "\r\n");
+
+    nst_res_send(si_ic(si), buf->area, buf->data);
+    nst_res_end(si);
+}
+
+static void res_304(struct stream_interface *si,
+        struct nst_str *last_modified, struct nst_str *etag) {
+
+    nst_res_304(si, last_modified, etag);
+}
+
+/*
+ * Check the response sent by build at the date sec against expect
+ */
+static int check(void (*build)(struct stream_interface *, struct nst_str *,
+            struct nst_str *), const char *name, time_t sec, long usec,
+        const char *expect) {
+
+    date.tv_sec  = sec;
+    date.tv_usec = usec;
+    out.data     = 0;
+
+    build(&strm.si[1], &last_modified, &etag);
+
+    if(out.data != strlen(expect) || memcmp(out.area, expect, out.data)) {
+        fprintf(stderr, "%s at %ld.%06ld sent:\n%.*s\nexpected:\n%s\n",
+                name, (long)sec, usec, (int)out.data, out.area, expect);
+
+        return 1;
+    }
+
+    return 0;
+}
+
+static double run(void (*build)(struct stream_interface *, struct nst_str *,
+            struct nst_str *), long n, long batch, uint64_t *sum) {
+
+    uint64_t t0 = now_ns();
+    long i;
+
+    for(i = 0; i < n; i++) {
+
+        if(i % batch == 0) {
+            gettimeofday(&date, NULL);
+        }
+
+        out.data = 0;
+        build(&strm.si[1], &last_modified, &etag);
+        *sum += out.data + (unsigned char)out.area[out.data / 2];
+    }
+
+    return (double)(now_ns() - t0) / n;
+}
+
+int main(int argc, char **argv) {
+    const char *before =
+        "HTTP/1.1 304 Not Modified\r\n"
+        "Server: nuster\r\n"
+        "Date: Fri, 16 Oct 2026 23:59:59 GMT\r\n"
+        "Last-Modified: Fri, 16 Oct 2026 23:03:12 GMT\r\n"
+        "ETag: \"5d8c72a5edda8d6a\"\r\n"
+        "\r\n";
+    const char *after =
+        "HTTP/1.1 304 Not Modified\r\n"
+        "Server: nuster\r\n"
+        "Date: Sat, 17 Oct 2026 00:00:00 GMT\r\n"
+        "Last-Modified: Fri, 16 Oct 2026 23:03:12 GMT\r\n"
+        "ETag: \"5d8c72a5edda8d6a\"\r\n"
+        "\r\n";
+    struct nst_str *line;
+    uint64_t sum = 0;
+    long n       = argc > 1 ? atol(argv[1]) : 10000000;
+    long batch   = argc > 2 ? atol(argv[2]) : 200;
+    double old, new;
+    int err = 0;
+
+    if(n <= 0 || batch <= 0) {
+        fprintf(stderr, "usage: %s N BATCH\n", argv[0]);
+        return 1;
+    }
+
+    global.tune.maxrewrite = BUFSIZE / 2;
+
+    strm.req.flags = 0;
+    strm.res.flags = CF_ISRESP;
+    strm.si[1].flags = SI_FL_ISBACK;
+    strm.si[1].ops   = &si_ops;
+
+    nst_http_init();
+
+    /* the cached line is formatted on the first call of each second */
+    err |= check(res_304_printf, "printf", SEC, 0, before);
+    err |= check(res_304, "nst_res_304", SEC, 0, before);
+    err |= check(res_304, "nst_res_304", SEC, 999999, before);
+    err |= check(res_304, "nst_res_304", SEC + 1, 0, after);
+    err |= check(res_304_printf, "printf", SEC + 1, 0, after);
+
+    date.tv_sec = SEC;
+    line        = nst_http_date_line();
+
+    if(line->len != 37
+            || memcmp(line->data, "Date: Fri, 16 Oct 2026 23:59:59 GMT\r\n",
+                line->len)) {
+
+        fprintf(stderr, "nst_http_date_line: %.*s\n", line->len, line->data);
+        err = 1;
+    }
+
+    if(err) {
+        return 1;
+    }
+
+    old = run(res_304_printf, n, batch, &sum);
+    new = run(res_304, n, batch, &sum);
+
+    printf("304 of %zu bytes, %ld responses, date updated every %ld\n",
+            out.data, n, batch);
+    printf("  printf and gmtime per response: %8.1f ns\n", old);
+    printf("  nst_res_304:                    %8.1f ns\n", new);
+    printf("  speedup:                        %8.2fx (%"PRIu64")\n",
+            old / new, sum % 10);
+
+    return 0;
+}